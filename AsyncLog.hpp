@@ -0,0 +1,373 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * Created by Darkwire Software.
+ *
+ * This example logging file is available unlicensed; the MIT license of liblacewing/Lacewing Relay
+ * does not apply to this file.
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+enum class logcolor : unsigned char { none, red, green, yellow, white };
+
+/// <summary> Console log that never makes the caller wait on the terminal. Callers fill a slot in a fixed
+/// 		  ring and carry on; a writer thread stamps, colours and writes the records, flushing once per batch.
+/// 		  When the ring is full, records are dropped and counted, or the caller waits, as chosen in start().
+/// 		  Before start() and after stop(), records are written directly on the caller. </summary>
+class asynclog
+{
+public:
+	enum class fullpolicy { drop, block };
+
+private:
+	enum class kind : unsigned char
+	{
+		line,	// "\r12:34:56 | text", padded over the status line, then a newline
+		status,	// as line, but ends with \r, to be overwritten by the next record
+		raw		// text as-is, then back to yellow if coloured
+	};
+
+	struct slot
+	{
+		std::atomic<size_t> sequence = 0;
+		std::chrono::system_clock::time_point when;
+		kind type = kind::raw;
+		logcolor color = logcolor::none;
+		unsigned short length = 0;
+		char text[480];
+	};
+
+	// Producers claim slots at tail; the writer thread alone reads at head
+	std::unique_ptr<slot[]> ring;
+	size_t mask = 0;
+	alignas(64) std::atomic<size_t> tail = 0;
+	alignas(64) std::atomic<size_t> head = 0;
+	std::atomic<size_t> written = 0;
+	std::atomic<size_t> droppedCount = 0;
+	fullpolicy policy = fullpolicy::drop;
+
+	std::thread writer;
+	std::mutex wakeLock, directLock;
+	std::condition_variable wake;
+	std::atomic<bool> writerIdle = false, running = false;
+	bool stopping = false;
+
+	// Writer thread state
+	size_t lastStatusLength = 0;
+	time_t stampSecond = 0;
+	char stamp[10] = "XX:XX:XX";
+
+	static std::string_view colorcode(logcolor color)
+	{
+		switch (color)
+		{
+			case logcolor::red: return "\033[91m";
+			case logcolor::green: return "\033[92m";
+			case logcolor::yellow: return "\033[93m";
+			case logcolor::white: return "\033[37m";
+			default: return std::string_view();
+		}
+	}
+
+	/// <summary> Writes one record to std::cout. Writer thread, or a caller holding directLock. </summary>
+	void emit(const slot & s)
+	{
+		const std::string_view text(s.text, s.length);
+		if (s.type == kind::raw)
+		{
+			std::cout << colorcode(s.color) << text;
+			if (s.color != logcolor::none)
+				std::cout << colorcode(logcolor::yellow);
+			return;
+		}
+
+		const time_t second = std::chrono::system_clock::to_time_t(s.when);
+		if (second != stampSecond)
+		{
+			stampSecond = second;
+			std::tm timeinfo;
+			if (localtime_r(&second, &timeinfo))
+				std::strftime(stamp, sizeof(stamp), "%T", &timeinfo);
+			else
+				strcpy(stamp, "XX:XX:XX");
+		}
+
+		// Blank out whatever is left of a longer status line underneath
+		const size_t length = sizeof(" | ") - 1 + strlen(stamp) + text.size();
+		const size_t pad = lastStatusLength > length ? lastStatusLength - length : 0;
+
+		std::cout << colorcode(s.color) << '\r' << stamp << " | " << text;
+		for (size_t i = 0; i < pad; ++i)
+			std::cout << ' ';
+
+		if (s.type == kind::status)
+		{
+			std::cout << '\r';
+			lastStatusLength = length;
+		}
+		else
+		{
+			std::cout << "\r\n" << colorcode(logcolor::yellow);
+			lastStatusLength = 0;
+		}
+	}
+
+	void writerloop()
+	{
+		size_t reportedDrops = 0;
+		while (true)
+		{
+			bool wroteAny = false;
+			for (size_t pos = head.load(std::memory_order_relaxed); ; ++pos)
+			{
+				slot & s = ring[pos & mask];
+				if (s.sequence.load(std::memory_order_acquire) != pos + 1)
+					break;
+				emit(s);
+				s.sequence.store(pos + mask + 1, std::memory_order_release);
+				head.store(pos + 1, std::memory_order_release);
+				wroteAny = true;
+			}
+
+			const size_t drops = droppedCount.load(std::memory_order_relaxed);
+			if (drops != reportedDrops)
+			{
+				slot notice;
+				notice.when = std::chrono::system_clock::now();
+				notice.type = kind::line;
+				notice.color = logcolor::red;
+				const auto res = std::to_chars(notice.text, std::end(notice.text), drops - reportedDrops);
+				const std::string_view suffix = " log record(s) dropped, log ring was full.";
+				memcpy(res.ptr, suffix.data(), suffix.size());
+				notice.length = (unsigned short)(res.ptr - notice.text + suffix.size());
+				emit(notice);
+				reportedDrops = drops;
+				wroteAny = true;
+			}
+
+			if (wroteAny)
+			{
+				std::cout.flush();
+				written.store(head.load(std::memory_order_relaxed), std::memory_order_release);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> wakeGuard(wakeLock);
+			if (stopping)
+				return;
+			writerIdle.store(true);
+			// Recheck after announcing idle, or a record published just before would wait for the timeout
+			if (ring[head.load(std::memory_order_relaxed) & mask].sequence.load(std::memory_order_acquire) ==
+				head.load(std::memory_order_relaxed) + 1)
+			{
+				writerIdle.store(false);
+				continue;
+			}
+			wake.wait_for(wakeGuard, std::chrono::milliseconds(100), [this] { return !writerIdle.load() || stopping; });
+			writerIdle.store(false);
+		}
+	}
+
+	/// <summary> Claims the next slot, or returns null if the ring is full and the policy is to drop. </summary>
+	slot * claim()
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		while (true)
+		{
+			slot & s = ring[pos & mask];
+			const size_t seq = s.sequence.load(std::memory_order_acquire);
+			if (seq == pos)
+			{
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					return &s;
+			}
+			else if (seq < pos)
+			{
+				// Full: the writer hasn't freed this slot from the last lap yet
+				if (policy == fullpolicy::drop)
+				{
+					droppedCount.fetch_add(1, std::memory_order_relaxed);
+					return nullptr;
+				}
+				wakewriter();
+				std::this_thread::yield();
+				pos = tail.load(std::memory_order_relaxed);
+			}
+			else
+				pos = tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	void wakewriter()
+	{
+		if (writerIdle.load(std::memory_order_relaxed) && writerIdle.exchange(false))
+		{
+			std::lock_guard<std::mutex> wakeGuard(wakeLock);
+			wake.notify_one();
+		}
+	}
+
+public:
+
+	/// <summary> A record being written; it's published when this goes out of scope. Integers are formatted
+	/// 		  here, everything else (timestamp, colour, padding) by the writer. Text past the slot size is cut. </summary>
+	class entry
+	{
+		friend asynclog;
+		asynclog & log;
+		slot * s;
+		slot local; // used when the writer isn't running
+		size_t pos = 0;
+		bool direct;
+
+		entry(asynclog & log, kind type, logcolor color) : log(log)
+		{
+			direct = !log.running.load(std::memory_order_acquire);
+			s = direct ? &local : log.claim();
+			if (s)
+			{
+				s->when = std::chrono::system_clock::now();
+				s->type = type;
+				s->color = color;
+			}
+		}
+
+	public:
+		entry(const entry &) = delete;
+
+		~entry()
+		{
+			if (!s)
+				return;
+			s->length = (unsigned short)pos;
+			if (direct)
+			{
+				std::lock_guard<std::mutex> directGuard(log.directLock);
+				log.emit(*s);
+				std::cout.flush();
+				return;
+			}
+			s->sequence.store(s->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			log.wakewriter();
+		}
+
+		entry & operator << (std::string_view text)
+		{
+			if (s)
+			{
+				const size_t n = std::min(text.size(), sizeof(s->text) - pos);
+				memcpy(s->text + pos, text.data(), n);
+				pos += n;
+			}
+			return *this;
+		}
+		entry & operator << (const char * text)
+		{
+			return *this << std::string_view(text);
+		}
+		entry & operator << (char c)
+		{
+			return *this << std::string_view(&c, 1);
+		}
+		template<class T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, char> && !std::is_same_v<T, bool>, int> = 0>
+		entry & operator << (T number)
+		{
+			if (s)
+			{
+				const auto res = std::to_chars(s->text + pos, std::end(s->text), number);
+				if (res.ec == std::errc())
+					pos = res.ptr - s->text;
+			}
+			return *this;
+		}
+	};
+
+	~asynclog()
+	{
+		stop();
+	}
+
+	/// <summary> Starts the writer thread, with room for capacity records (rounded up to a power of two). </summary>
+	void start(size_t capacity, fullpolicy whenFull)
+	{
+		stop();
+		size_t size = 16;
+		while (size < capacity)
+			size <<= 1;
+		ring = std::make_unique<slot[]>(size);
+		for (size_t i = 0; i < size; ++i)
+			ring[i].sequence.store(i, std::memory_order_relaxed);
+		mask = size - 1;
+		tail = head = written = 0;
+		policy = whenFull;
+		stopping = false;
+		running.store(true, std::memory_order_release);
+		writer = std::thread(&asynclog::writerloop, this);
+	}
+
+	/// <summary> Writes out everything queued, then ends the writer; later records are written directly.
+	/// 		  Callers must not be logging from other threads meanwhile. </summary>
+	void stop()
+	{
+		if (!writer.joinable())
+			return;
+		flush();
+		running.store(false, std::memory_order_release);
+		{
+			std::lock_guard<std::mutex> wakeGuard(wakeLock);
+			stopping = true;
+		}
+		wake.notify_one();
+		writer.join();
+	}
+
+	/// <summary> Waits until everything logged so far is written out. </summary>
+	void flush()
+	{
+		if (!running.load(std::memory_order_acquire))
+			return;
+		const size_t target = tail.load();
+		while (written.load(std::memory_order_acquire) < target)
+		{
+			wakewriter();
+			std::this_thread::yield();
+		}
+	}
+
+	/// <summary> Records dropped because the ring was full, under fullpolicy::drop. </summary>
+	size_t dropped() const
+	{
+		return droppedCount.load(std::memory_order_relaxed);
+	}
+
+	/// <summary> A timestamped line, e.g. log.line(logcolor::green) << "Client ID "sv << id << " connected."sv; </summary>
+	entry line(logcolor color = logcolor::yellow)
+	{
+		return entry(*this, kind::line, color);
+	}
+
+	/// <summary> A timestamped line that stays until the next record overwrites it. </summary>
+	entry status()
+	{
+		return entry(*this, kind::status, logcolor::none);
+	}
+
+	/// <summary> Text written as given, for the console title, prompts and startup banners. </summary>
+	entry raw(logcolor color = logcolor::none)
+	{
+		return entry(*this, kind::raw, color);
+	}
+};
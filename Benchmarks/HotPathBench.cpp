@@ -0,0 +1,468 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * Created by Darkwire Software.
+ *
+ * This benchmark file is available unlicensed; the MIT license of liblacewing/Lacewing Relay does not apply to this file.
+*/
+
+// hotpathbench: micro-benchmarks for the pure CPU paths a relay server runs per message, with no sockets:
+// framereader::process on single, batched and fragmented messages, framebuilder encoding for TCP and WebSocket,
+// lw_webserver_sink_websocket unmasking, codepointsallowlist::checkcodepointsallowed, lw_u8str_simplify,
+// IDPool::borrow/returnID, b64encode/b64decode, and reading and changing the server client list, as snapshotlist
+// and as the vector behind lock_clientlist it replaced; the contended list runs add background threads.
+// Each reports the median ns per op over 7 samples, the fastest sample, and heap allocations per op on the
+// measuring thread. Fixtures are built from fixed patterns, so runs are comparable across builds.
+//
+// Usage: hotpathbench [substring]
+//   only runs benchmarks whose name contains substring, e.g. "framereader"
+//
+// Allocations are counted by interposing glibc's malloc, calloc and realloc, so C allocations are included;
+// elsewhere only C++ operator new is counted.
+//
+// Build on Linux, from the repo root, as for relaybench:
+//   gcc -c -O2 -DNDEBUG -DENABLE_SSL -ILacewing -ILacewing/src Lacewing/src/*.c Lacewing/src/unix/*.c
+//     Lacewing/src/unix/eventqueue/epoll.c Lacewing/src/webserver/*.c Lacewing/src/webserver/http/*.c
+//     Lacewing/src/openssl/*.c Lacewing/deps/utf8proc.c Lacewing/deps/http-parser/http_parser.c
+//     Lacewing/deps/multipart-parser/*.c
+//   g++ -std=c++17 -O2 -DNDEBUG -DENABLE_SSL -ILacewing -ILacewing/src Benchmarks/HotPathBench.cpp Lacewing/*.cc
+//     Lacewing/*.cpp Lacewing/src/cxx/*.cc *.o -lssl -lcrypto -lpthread -o hotpathbench && ./hotpathbench
+
+// The library's internal headers define lw_import unconditionally, and Lacewing.h only if it's not defined,
+// so they go first
+extern "C" {
+#include "webserver/common.h"
+size_t lw_webserver_sink_websocket(lw_ws webserver, lwp_ws_httpclient client, const char * data, size_t size);
+}
+
+#include "Lacewing.h"
+#include "FrameBuilder.h"
+#include "IDPool.h"
+#include "SnapshotList.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+
+namespace lacewing
+{
+	// Defined in RelayServer.cc, for the WebSocket handshake
+	const std::string b64encode(const void * data, const size_t len);
+	const std::string b64decode(const void * data, const size_t & len);
+}
+
+extern "C" void always_log(const char * c, ...)
+{
+	va_list v;
+	va_start(v, c);
+	vfprintf(stderr, c, v);
+	va_end(v);
+	fputc('\n', stderr);
+}
+
+// Only the measuring thread counts, so no atomics needed
+static size_t allocations = 0;
+static thread_local bool backgroundThread = false;
+
+#ifdef __GLIBC__
+extern "C"
+{
+	void * __libc_malloc(size_t size);
+	void * __libc_calloc(size_t count, size_t size);
+	void * __libc_realloc(void * ptr, size_t size);
+
+	void * malloc(size_t size) noexcept
+	{
+		if (!backgroundThread)
+			++allocations;
+		return __libc_malloc(size);
+	}
+	void * calloc(size_t count, size_t size) noexcept
+	{
+		if (!backgroundThread)
+			++allocations;
+		return __libc_calloc(count, size);
+	}
+	void * realloc(void * ptr, size_t size) noexcept
+	{
+		if (!backgroundThread)
+			++allocations;
+		return __libc_realloc(ptr, size);
+	}
+}
+#else
+void * operator new(size_t size)
+{
+	if (!backgroundThread)
+		++allocations;
+	if (void * ptr = malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+void operator delete(void * ptr) noexcept { free(ptr); }
+void operator delete(void * ptr, size_t) noexcept { free(ptr); }
+#endif
+
+// Results go here, so the compiler can't drop the work
+static volatile size_t sink;
+static std::string_view nameFilter;
+
+/// <summary> Runs call() in samples of about 50ms, and reports per op, where each call does opsPerCall ops. </summary>
+template<class Fn>
+static void run(const char * name, size_t opsPerCall, Fn && call)
+{
+	if (!nameFilter.empty() && std::string_view(name).find(nameFilter) == std::string_view::npos)
+		return;
+
+	using benchclock = std::chrono::steady_clock;
+	const auto timecalls = [&](size_t calls) {
+		const auto start = benchclock::now();
+		for (size_t i = 0; i < calls; ++i)
+			call();
+		return std::chrono::duration<double, std::nano>(benchclock::now() - start).count();
+	};
+
+	// Warms caches and pools, then finds how many calls make up a sample
+	size_t calls = 1;
+	double ns;
+	while ((ns = timecalls(calls)) < 5e6)
+		calls *= 2;
+	calls = std::max<size_t>(1, (size_t)(calls * 50e6 / ns));
+
+	constexpr int samples = 7;
+	std::vector<double> nsPerOp;
+	const size_t allocationsBefore = allocations;
+	for (int s = 0; s < samples; ++s)
+		nsPerOp.push_back(timecalls(calls) / (double)(calls * opsPerCall));
+	const double allocationsPerOp = (double)(allocations - allocationsBefore) / (double)(calls * opsPerCall * samples);
+
+	std::sort(nsPerOp.begin(), nsPerOp.end());
+	printf("%-48s %10.1f ns/op (min %10.1f) %8.2f allocs/op\n", name, nsPerOp[samples / 2], nsPerOp[0], allocationsPerOp);
+}
+
+static std::string makepayload(size_t size)
+{
+	std::string payload(size, '\0');
+	for (size_t i = 0; i < size; ++i)
+		payload[i] = (char)('a' + i % 26);
+	return payload;
+}
+
+/// <summary> A Relay TCP frame: type byte, then an 8, 16 or 32-bit size, then the body. </summary>
+static std::string makeframe(lw_ui8 typeAndVariant, size_t size)
+{
+	std::string frame(1, (char)typeAndVariant);
+	if (size < 254)
+		frame += (char)size;
+	else if (size < 0xFFFF)
+	{
+		const lw_ui16 size16 = (lw_ui16)size;
+		frame += (char)254;
+		frame.append((const char *)&size16, sizeof(size16));
+	}
+	else
+	{
+		const lw_ui32 size32 = (lw_ui32)size;
+		frame += (char)255;
+		frame.append((const char *)&size32, sizeof(size32));
+	}
+	return frame + makepayload(size);
+}
+
+/// <summary> A masked binary WebSocket frame, as a browser sends. </summary>
+static std::string makewebsocketframe(size_t size, lw_ui32 mask)
+{
+	std::string frame(1, (char)0b10000010); // fin + binary
+	if (size <= 125)
+		frame += (char)(0b10000000 | size);
+	else
+	{
+		const lw_ui16 size16 = htons((lw_ui16)size);
+		frame += (char)(0b10000000 | 126);
+		frame.append((const char *)&size16, sizeof(size16));
+	}
+	frame.append((const char *)&mask, sizeof(mask));
+	const std::string payload = makepayload(size);
+	for (size_t i = 0; i < size; ++i)
+		frame += (char)(payload[i] ^ ((const char *)&mask)[i % 4]);
+	return frame;
+}
+
+static bool countmessage(void * tag, unsigned char type, const char * message, size_t size)
+{
+	*(size_t *)tag += type + size + (unsigned char)message[0];
+	return true;
+}
+
+static void benchframereader()
+{
+	size_t handled = 0;
+	framereader reader;
+	reader.tag = &handled;
+	reader.messagehandler = countmessage;
+
+	const auto processall = [&](std::string & data) {
+		const char * next = data.data();
+		size_t size = data.size();
+		while (reader.process(&next, &size))
+			;
+	};
+
+	std::string single = makeframe(0x12, 64);
+	run("framereader single 64B", 1, [&] { processall(single); });
+
+	// One read holding many messages of assorted sizes, as from a busy client
+	std::string batch;
+	constexpr size_t batchCount = 32;
+	for (size_t i = 0; i < batchCount; ++i)
+		batch += makeframe(0x12, 16 + (i * 37) % 200);
+	run("framereader batched 32 x 16-215B", batchCount, [&] { processall(batch); });
+
+	// A message arriving over several reads, the first of which splits the size header
+	const std::string whole = makeframe(0x12, 1500);
+	std::vector<std::string> fragments;
+	for (size_t offset = 0, length = 2; offset < whole.size(); offset += length, length = 400)
+		fragments.push_back(whole.substr(offset, length));
+	run("framereader fragmented 1500B in 5 reads", 1, [&] {
+		for (auto & fragment : fragments)
+			processall(fragment);
+	});
+
+	sink = handled;
+}
+
+static void benchframebuilder()
+{
+	framebuilder builder(false);
+	for (const size_t size : { 64, 1024 })
+	{
+		const std::string payload = makepayload(size);
+		for (const bool websocket : { false, true })
+		{
+			// As the server builds a channel message: header, subchannel, channel ID, peer ID, body
+			const std::string name = "framebuilder " + std::string(websocket ? "websocket " : "raw ") + std::to_string(size) + "B";
+			run(name.c_str(), 1, [&] {
+				builder.framereset();
+				builder.addheader(2, 2);
+				builder.add<lw_ui8>(0);
+				builder.add<lw_ui16>(1);
+				builder.add<lw_ui16>(2);
+				builder.add(payload.data(), payload.size());
+				sink = builder.encodefor(websocket).size();
+			});
+		}
+	}
+}
+
+static size_t websocketBytes = 0;
+static void lw_callback countwebsocketmessage(lw_ws, lw_ws_req, const char * buffer, size_t size)
+{
+	websocketBytes += size + (unsigned char)buffer[0];
+}
+
+static void benchwebsocket()
+{
+	struct _lw_ws webserver = { };
+	webserver.on_websocket_message = countwebsocketmessage;
+	struct _lwp_ws_httpclient client = { };
+	client.client.local_close_code = -1;
+
+	for (const size_t size : { 64, 1024 })
+	{
+		const std::string frame = makewebsocketframe(size, 0x5A3CC3A5);
+		const std::string name = "lw_webserver_sink_websocket " + std::to_string(size) + "B";
+		run(name.c_str(), 1, [&] { sink = lw_webserver_sink_websocket(&webserver, &client, frame.data(), frame.size()); });
+	}
+	sink = websocketBytes;
+}
+
+static void benchcodepoints()
+{
+	lacewing::codepointsallowlist allowlist;
+	// As bluewing-cpp-server sets for client names, channel names and messages to server
+	const std::string error = allowlist.setcodepointsallowedlist("L*,M*,N*,P*,32");
+	if (!error.empty())
+		printf("setcodepointsallowedlist failed: %s\n", error.c_str());
+
+	const std::pair<const char *, std::string> texts[] = {
+		{ "checkcodepointsallowed English chat", "anyone want to team up for the next round? Map vote: forest or caves." },
+		{ "checkcodepointsallowed mixed script chat",
+			"\xE3\x81\x93\xE3\x82\x93\xE3\x81\xAB\xE3\x81\xA1\xE3\x81\xAF\xEF\xBC\x81 hello! "
+			"\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82, caf\xC3\xA9 cr\xC3\xA8me br\xC3\xBBl\xC3\xA9" },
+		{ "checkcodepointsallowed 1KB text", makepayload(1024) },
+	};
+	for (const auto & text : texts)
+		run(text.first, 1, [&] { sink = (size_t)allowlist.checkcodepointsallowed(text.second); });
+}
+
+static void benchsimplify()
+{
+	const std::string ascii = "PlayerOne_42";
+	run("lw_u8str_simplify ASCII name", 1, [&] { sink = lw_u8str_simplify(ascii).size(); });
+
+	const std::string unicode = "J\xC3\xB6rg M\xC3\xBCller";
+	run("lw_u8str_simplify non-ASCII name, cached", 1, [&] { sink = lw_u8str_simplify(unicode).size(); });
+
+	// More distinct names than the simplify cache holds, cycled, so every call misses it
+	std::vector<std::string> names;
+	for (size_t i = 0; i < 1024; ++i)
+		names.push_back("J\xC3\xB6rg M\xC3\xBCller " + std::to_string(i));
+	size_t next = 0;
+	run("lw_u8str_simplify non-ASCII name, uncached", 1, [&] {
+		sink = lw_u8str_simplify(names[next]).size();
+		next = (next + 1) % names.size();
+	});
+}
+
+static void benchidpool()
+{
+	IDPool pool;
+	// A server with some clients connected, so returned IDs go in the released set
+	for (int i = 0; i < 200; ++i)
+		pool.borrow();
+
+	constexpr size_t churn = 64;
+	lw_ui16 ids[churn];
+	run("IDPool borrow/returnID, 64 each", churn * 2, [&] {
+		for (size_t i = 0; i < churn; ++i)
+			ids[i] = pool.borrow();
+		for (size_t i = 1; i < churn; i += 2)
+			pool.returnID(ids[i]);
+		for (size_t i = 0; i < churn; i += 2)
+			pool.returnID(ids[i]);
+	});
+}
+
+static void benchbase64()
+{
+	// A SHA-1 digest, as in the WebSocket handshake response, and a larger block
+	for (const size_t size : { 20, 1024 })
+	{
+		const std::string data = makepayload(size);
+		const std::string encoded = lacewing::b64encode(data.data(), data.size());
+		const std::string encodeName = "b64encode " + std::to_string(size) + "B";
+		run(encodeName.c_str(), 1, [&] { sink = lacewing::b64encode(data.data(), data.size()).size(); });
+		const std::string decodeName = "b64decode " + std::to_string(size) + "B";
+		run(decodeName.c_str(), 1, [&] { sink = lacewing::b64decode(encoded.data(), encoded.size()).size(); });
+	}
+}
+
+/// <summary> Background threads that keep calling read(), plus one that calls change() every 50us or so,
+/// 		  about a connect or disconnect a time on a busy server, until destroyed. </summary>
+class listload
+{
+	std::atomic<bool> stop = false;
+	std::vector<std::thread> threads;
+public:
+	template<class ReadFn, class ChangeFn>
+	listload(unsigned int readers, ReadFn read, ChangeFn change)
+	{
+		for (unsigned int i = 0; i < readers; ++i)
+		{
+			threads.emplace_back([this, read] {
+				backgroundThread = true;
+				while (!stop.load(std::memory_order_relaxed))
+					read();
+			});
+		}
+		threads.emplace_back([this, change] {
+			backgroundThread = true;
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				change();
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+			}
+		});
+	}
+	~listload()
+	{
+		stop = true;
+		for (auto & t : threads)
+			t.join();
+	}
+};
+
+struct listentry
+{
+	size_t id;
+};
+
+static void benchclientlist()
+{
+	for (const size_t clientCount : { 1000, 10000 })
+	{
+		std::vector<std::shared_ptr<listentry>> entries;
+		for (size_t i = 0; i < clientCount; ++i)
+			entries.push_back(std::make_shared<listentry>(listentry { i }));
+		const auto extra = std::make_shared<listentry>(listentry { clientCount });
+
+		// As the server did before snapshotlist: a vector behind lock_clientlist
+		lacewing::readwritelock lock;
+		std::vector<std::shared_ptr<listentry>> lockedList(entries);
+		const auto readLocked = [&] {
+			auto readLock = lock.createReadLock();
+			size_t sum = 0;
+			for (const auto & e : lockedList)
+				sum += e->id;
+			sink = sum;
+		};
+		const auto changeLocked = [&] {
+			auto writeLock = lock.createWriteLock();
+			lockedList.push_back(extra);
+			lockedList.erase(std::find(lockedList.begin(), lockedList.end(), extra));
+		};
+
+		snapshotlist<listentry> snapList;
+		for (const auto & e : entries)
+			snapList.push_back(e);
+		// lock_clientlist still serialises snapshotlist writers
+		std::mutex writers;
+		const auto readSnapshot = [&] {
+			size_t sum = 0;
+			for (const auto & e : snapList.read())
+				sum += e->id;
+			sink = sum;
+		};
+		const auto changeSnapshot = [&] {
+			std::lock_guard<std::mutex> writersGuard(writers);
+			snapList.push_back(extra);
+			snapList.erase(extra);
+		};
+
+		const std::string size = std::to_string(clientCount);
+		run(("client list read " + size + ", readwritelock").c_str(), 1, readLocked);
+		run(("client list read " + size + ", snapshotlist").c_str(), 1, readSnapshot);
+		run(("client list add+remove " + size + ", readwritelock").c_str(), 1, changeLocked);
+		run(("client list add+remove " + size + ", snapshotlist").c_str(), 1, changeSnapshot);
+		{
+			listload load(3, readLocked, changeLocked);
+			run(("client list read " + size + ", readwritelock, contended").c_str(), 1, readLocked);
+		}
+		{
+			listload load(3, readSnapshot, changeSnapshot);
+			run(("client list read " + size + ", snapshotlist, contended").c_str(), 1, readSnapshot);
+		}
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc > 1)
+		nameFilter = argv[1];
+
+	benchframereader();
+	benchframebuilder();
+	benchwebsocket();
+	benchcodepoints();
+	benchsimplify();
+	benchidpool();
+	benchbase64();
+	benchclientlist();
+	return 0;
+}
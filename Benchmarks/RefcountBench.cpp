@@ -0,0 +1,301 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * Created by Darkwire Software.
+ *
+ * This benchmark file is available unlicensed; the MIT license of liblacewing/Lacewing Relay does not apply to this file.
+*/
+
+// refcountbench: counts the atomic read-modify-write instructions relayserver runs to relay one TCP channel message,
+// on the real path. A relayserver is hosted on a pump this thread ticks by hand, and raw sockets speak the Relay
+// protocol to it, so nothing else in the process touches an atomic. The pump tick that reads a channel message and
+// relays it to the channel is single-stepped with the x86 trap flag, and each instruction is checked for a lock
+// prefix (or an xchg with memory, which is locked without one). That counts shared_ptr refcount changes alongside
+// readwritelock and mutex traffic; build it at two revisions to compare them, as it only uses public API.
+// Clients connect from distinct loopback addresses, so the server's per-IP connection limits don't apply.
+//
+// Also times client-sized make_shared against allocate_shared with slaballocator. make_shared already puts the
+// object and its refcount in one block; the slab only makes getting and freeing that block cheaper.
+//
+// x86-64 Linux only. Build from the repo root, with the C objects built as for relaybench:
+//   g++ -std=c++17 -O2 -DNDEBUG -DENABLE_SSL -ILacewing Benchmarks/RefcountBench.cpp Lacewing/*.cc Lacewing/*.cpp
+//     Lacewing/src/cxx/*.cc *.o -lssl -lcrypto -lpthread -o refcountbench && ./refcountbench [port]
+
+#include "Lacewing.h"
+#if __has_include("SlabAllocator.h")
+#include "SlabAllocator.h"
+#endif
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C" void always_log(const char *, ...) { }
+
+static size_t instructionsStepped = 0, atomicsStepped = 0;
+
+/// <summary> True if the instruction at ip is an atomic read-modify-write. </summary>
+static bool isatomic(const unsigned char * ip)
+{
+	// Legacy prefixes in any order; lock is one of them
+	for (int i = 0; i < 14; ++i, ++ip)
+	{
+		if (*ip == 0xF0)
+			return true;
+		if (*ip != 0x66 && *ip != 0x67 && *ip != 0xF2 && *ip != 0xF3 && *ip != 0x2E && *ip != 0x36 &&
+			*ip != 0x3E && *ip != 0x26 && *ip != 0x64 && *ip != 0x65)
+			break;
+	}
+	if ((*ip & 0xF0) == 0x40) // REX
+		++ip;
+	return (*ip == 0x86 || *ip == 0x87) && (ip[1] >> 6) != 3;
+}
+
+static void ontrap(int, siginfo_t *, void * context)
+{
+	++instructionsStepped;
+	if (isatomic((const unsigned char *)((ucontext_t *)context)->uc_mcontext.gregs[REG_RIP]))
+		++atomicsStepped;
+}
+
+// Not inlined, and without locals, so pushf can't land on anything the compiler keeps in the red zone
+__attribute__((noinline)) static void startstepping()
+{
+	asm volatile("pushfq; orq $0x100, (%%rsp); popfq" ::: "memory", "cc");
+}
+__attribute__((noinline)) static void stopstepping()
+{
+	asm volatile("pushfq; andq $~0x100, (%%rsp); popfq" ::: "memory", "cc");
+}
+
+/// <summary> A Relay client over a blocking TCP socket, reading whole frames. </summary>
+struct rawclient
+{
+	int fd = -1;
+	std::string received;
+
+	rawclient(int index, int port)
+	{
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(0x7F000000 | (10 + index));
+		if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+			throw std::runtime_error("bind to 127.0.0." + std::to_string(10 + index) + " failed");
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(port);
+		if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+			throw std::runtime_error("connect failed");
+		// The server leaves Nagle on, so ACK at once, or its writes wait out our delayed ACKs
+		const int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+		send(std::string(1, '\0'));
+	}
+	~rawclient() { close(fd); }
+
+	void send(const std::string & data) { ::send(fd, data.data(), data.size(), 0); }
+	void sendframe(int type, const std::string & body)
+	{
+		std::string frame(1, (char)(type << 4));
+		if (body.size() < 254)
+			frame += (char)body.size();
+		else
+		{
+			const lw_ui32 size = (lw_ui32)body.size();
+			frame += (char)255;
+			frame.append((const char *)&size, sizeof(size));
+		}
+		send(frame + body);
+	}
+
+	/// <summary> Reads what's waiting without blocking; returns the number of bytes read. </summary>
+	size_t drain()
+	{
+		char buffer[16384];
+		size_t total = 0;
+		ssize_t got;
+		while ((got = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+		{
+			received.append(buffer, got);
+			total += got;
+		}
+		// Quick ACK mode doesn't stick, so renew it
+		const int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+		return total;
+	}
+
+	/// <summary> Pops one whole frame off received, if there is one. </summary>
+	bool popframe(int & type, std::string & body)
+	{
+		if (received.size() < 2)
+			return false;
+		size_t header = 2, size = (unsigned char)received[1];
+		if (size == 254 || size == 255)
+		{
+			const size_t width = size == 254 ? 2 : 4;
+			if (received.size() < 2 + width)
+				return false;
+			size = 0;
+			memcpy(&size, received.data() + 2, width);
+			header += width;
+		}
+		if (received.size() < header + size)
+			return false;
+		type = (unsigned char)received[0] >> 4;
+		body = received.substr(header, size);
+		received.erase(0, header + size);
+		return true;
+	}
+};
+
+/// <summary> Connects count clients, names them and joins them to channelName; returns the channel ID. </summary>
+static lw_ui16 joinchannel(lacewing::eventpump pump, std::vector<std::unique_ptr<rawclient>> & clients,
+	int firstIndex, size_t count, int port, const std::string & channelName)
+{
+	lw_ui16 channelID = 0xFFFF;
+	for (size_t i = 0; i < count; ++i)
+	{
+		auto client = std::make_unique<rawclient>(firstIndex + (int)i, port);
+		client->sendframe(0, std::string(1, '\0') + "revision 3");
+		client->sendframe(0, std::string(1, '\1') + "bench" + std::to_string(firstIndex + i));
+		client->sendframe(0, std::string(1, '\2') + std::string(1, '\0') + channelName);
+
+		// Tick until the join response arrives
+		for (bool joined = false; !joined; )
+		{
+			pump->tick();
+			client->drain();
+			int type;
+			std::string body;
+			while (client->popframe(type, body))
+			{
+				if (type != 0 || body.size() < 2 || body[0] != 2)
+					continue;
+				if (body[1] != 1)
+					throw std::runtime_error("join of " + channelName + " denied");
+				const size_t nameLength = (unsigned char)body[3];
+				memcpy(&channelID, body.data() + 4 + nameLength, sizeof(channelID));
+				joined = true;
+			}
+		}
+		clients.push_back(std::move(client));
+	}
+	return channelID;
+}
+
+/// <summary> Relays one channel message from clients[0], stepping the tick that relays it. Returns the atomics
+/// 		  and instructions stepped, less the cost of starting and stopping. </summary>
+static std::pair<size_t, size_t> stepmessage(lacewing::eventpump pump,
+	std::vector<std::unique_ptr<rawclient>> & clients, lw_ui16 channelID, std::pair<size_t, size_t> overhead)
+{
+	std::string body(1, '\0');
+	body.append((const char *)&channelID, sizeof(channelID));
+	body += "sixteen byte msg";
+	clients[0]->sendframe(2, body);
+	usleep(1000); // let loopback deliver it, so the one tick sees it
+
+	instructionsStepped = atomicsStepped = 0;
+	startstepping();
+	pump->tick();
+	stopstepping();
+	const std::pair<size_t, size_t> stepped(atomicsStepped - overhead.first, instructionsStepped - overhead.second);
+
+	usleep(1000);
+	for (size_t i = 1; i < clients.size(); ++i)
+		if (clients[i]->drain() == 0)
+			throw std::runtime_error("peer " + std::to_string(i) + " didn't get the message in one tick");
+	clients[0]->drain();
+	return stepped;
+}
+
+struct clientsized { char data[512]; std::atomic<long> refs; };
+
+#ifdef LacewingSlabAllocator
+template<bool slab>
+static double timealloc(size_t count)
+{
+	std::vector<std::shared_ptr<clientsized>> objects(count);
+	const auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < 20; ++round)
+	{
+		for (auto & o : objects)
+		{
+			if constexpr (slab)
+				o = std::allocate_shared<clientsized>(slaballocator<clientsized>());
+			else
+				o = std::make_shared<clientsized>();
+		}
+		for (auto & o : objects)
+			o.reset();
+	}
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (20 * count);
+}
+#endif
+
+int main(int argc, char ** argv)
+{
+	const int port = argc > 1 ? atoi(argv[1]) : 6124;
+
+	struct sigaction trap = {};
+	trap.sa_sigaction = ontrap;
+	trap.sa_flags = SA_SIGINFO;
+	sigaction(SIGTRAP, &trap, nullptr);
+
+	lacewing::eventpump pump = lacewing::eventpump_new();
+	lacewing::relayserver * server = new lacewing::relayserver(pump);
+	server->host((lw_ui16)port);
+
+	instructionsStepped = atomicsStepped = 0;
+	startstepping();
+	stopstepping();
+	const std::pair<size_t, size_t> overhead(atomicsStepped, instructionsStepped);
+
+	try
+	{
+		int nextIndex = 0;
+		for (size_t channelSize : { 2, 8, 32 })
+		{
+			std::vector<std::unique_ptr<rawclient>> clients;
+			const std::string channelName = "refcount" + std::to_string(channelSize);
+			const lw_ui16 channelID = joinchannel(pump, clients, nextIndex, channelSize, port, channelName);
+			nextIndex += (int)channelSize;
+			for (auto & c : clients)
+				c->drain(), c->received.clear();
+
+			// Warm up pools and buffers, then take the median of the rest
+			for (int i = 0; i < 5; ++i)
+				stepmessage(pump, clients, channelID, overhead);
+			std::vector<std::pair<size_t, size_t>> samples;
+			for (int i = 0; i < 15; ++i)
+				samples.push_back(stepmessage(pump, clients, channelID, overhead));
+			std::sort(samples.begin(), samples.end());
+			const auto median = samples[samples.size() / 2];
+			std::cout << "Channel of " << channelSize << ": " << median.first << " atomic ops, "
+				<< median.second << " instructions per relayed channel message\n";
+		}
+	}
+	catch (const std::exception & e)
+	{
+		std::cerr << "Failed: " << e.what() << '\n';
+		return 1;
+	}
+
+#ifdef LacewingSlabAllocator
+	std::cout << "Client-sized alloc+free: make_shared " << timealloc<false>(10000) << " ns, slab allocate_shared "
+		<< timealloc<true>(10000) << " ns\n";
+#endif
+	return 0;
+}
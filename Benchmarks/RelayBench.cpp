@@ -0,0 +1,829 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * Created by Darkwire Software.
+ *
+ * This benchmark file is available unlicensed; the MIT license of liblacewing/Lacewing Relay does not apply to this file.
+*/
+
+// relaybench: load generator for a Relay server. Drives thousands of relayclient instances from a few threads, each
+// thread running its own eventpump, through scripted scenarios, and reports throughput, end-to-end latency percentiles
+// and server CPU. Messages carry their send time, and every client is in this process, so latency is measured from
+// send() on one client to the message handler on another, on one clock.
+//
+// Scenarios; each takes key=value settings after its name, e.g. "chat clients=2000 channelsize=50 rate=2":
+//   connect   connect storm; latency is connect() to connect approval
+//   join      join storm, after everyone has connected and set a name; latency is join() to join approval
+//   chat      TCP channel messages at rate per client per second
+//   blast     UDP channel blasts, 30 a second per client by default; also reports loss
+//   transfer  large binary channel messages between pairs
+//   slow      chat with some clients handling each message slowly, so the server queues up for them;
+//             latency is for the normal clients, with the slow ones' reported separately
+// Settings: clients, channelsize, rate (messages/s per client), size (bytes), duration (s),
+//   slow (fraction of each channel that's slow), slowdelay (ms per message).
+//
+// Usage: relaybench [--server host:port | --host port] [--server-pid pid] [--threads n] [--json] [--script file]
+//                   [scenario [key=value...]]...
+//   --host      hosts a relayserver in this process, on its own thread, and measures that thread's CPU
+//   --server-pid  with --server, reads the server process's CPU from /proc
+//   --json      one JSON object per scenario on stdout, for regression tracking; the human summary goes to stderr
+//   --script    a file of scenario lines, as on the command line; # starts a comment
+// With no scenarios, all six run with their defaults. External servers must allow this many connections from one IP;
+// for bluewing-cpp-server, set maxConnectionsPerIP and maxPendingConnectsPerIP in its config.
+//
+// Comparing readwritelock policies: LW_RWLOCK_POLICY is compile-time, and changes the layout of relay classes, so
+// build the g++ line below once per policy, e.g. with -DLW_RWLOCK_POLICY=1, and run each build with --host. The
+// in-process server then relays with that policy; results name it. Each relayclient stays on its own pump thread
+// and the hosted server runs one pump, so the none policy (0) is safe here.
+//
+// Build on Linux, from the repo root:
+//   gcc -c -O2 -DNDEBUG -DENABLE_SSL -ILacewing -ILacewing/src Lacewing/src/*.c Lacewing/src/unix/*.c
+//     Lacewing/src/unix/eventqueue/epoll.c Lacewing/src/webserver/*.c Lacewing/src/webserver/http/*.c
+//     Lacewing/src/openssl/*.c Lacewing/deps/utf8proc.c Lacewing/deps/http-parser/http_parser.c
+//     Lacewing/deps/multipart-parser/*.c
+//   g++ -std=c++17 -O2 -DNDEBUG -DENABLE_SSL -ILacewing Benchmarks/RelayBench.cpp Lacewing/*.cc Lacewing/*.cpp
+//     Lacewing/src/cxx/*.cc *.o -lssl -lcrypto -lpthread -o relaybench && ./relaybench --host 6121
+
+#include "Lacewing.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+using benchclock = std::chrono::steady_clock;
+
+// Lacewing logs pump internals through this; normally defined by POSIXMain.cpp. Thousands of sockets closing at the
+// end of a run can log a lot, so only the first few are shown.
+extern "C" void always_log(const char * c, ...)
+{
+	static std::atomic<int> shown = 0;
+	if (shown.fetch_add(1, std::memory_order_relaxed) >= 5)
+		return;
+	va_list v;
+	va_start(v, c);
+	vfprintf(stderr, c, v);
+	va_end(v);
+	fputc('\n', stderr);
+}
+
+/// <summary> Latencies in microseconds, in log-linear buckets: 16 per power of two, so within 1/16 of the true value. </summary>
+struct latencyhistogram
+{
+	static constexpr size_t subBuckets = 16;
+	std::array<std::uint64_t, 61 * subBuckets> counts = { };
+	std::uint64_t total = 0, max = 0;
+
+	static size_t bucketof(std::uint64_t us)
+	{
+		if (us < subBuckets)
+			return (size_t)us;
+		size_t msb = 63;
+		while (!(us >> msb))
+			--msb;
+		return (msb - 3) * subBuckets + (size_t)((us >> (msb - 4)) & (subBuckets - 1));
+	}
+	static std::uint64_t bucketmax(size_t bucket)
+	{
+		if (bucket < subBuckets)
+			return bucket;
+		const size_t msb = bucket / subBuckets + 3, sub = bucket % subBuckets;
+		return ((std::uint64_t)(subBuckets + sub + 1) << (msb - 4)) - 1;
+	}
+
+	void record(std::uint64_t us)
+	{
+		++counts[bucketof(us)];
+		++total;
+		max = std::max(max, us);
+	}
+	void merge(const latencyhistogram & other)
+	{
+		for (size_t i = 0; i < counts.size(); ++i)
+			counts[i] += other.counts[i];
+		total += other.total;
+		max = std::max(max, other.max);
+	}
+	std::uint64_t percentile(double p) const
+	{
+		if (total == 0)
+			return 0;
+		const std::uint64_t target = std::max<std::uint64_t>(1, (std::uint64_t)std::ceil(p * total));
+		std::uint64_t cumulative = 0;
+		for (size_t i = 0; i < counts.size(); ++i)
+		{
+			cumulative += counts[i];
+			if (cumulative >= target)
+				return std::min(bucketmax(i), max);
+		}
+		return max;
+	}
+};
+
+enum class scenariokind { connect, join, chat, blast, transfer, slow };
+
+struct scenario
+{
+	scenariokind kind;
+	std::string name;
+	size_t clients = 1000, channelSize = 20, size = 64;
+	double rate = 1, duration = 10, slowFraction = 0;
+	long slowDelayMS = 20;
+
+	bool sendstraffic() const { return kind != scenariokind::connect && kind != scenariokind::join; }
+	bool joinschannels() const { return kind != scenariokind::connect; }
+};
+
+static bool makescenario(const std::string & name, scenario & sc)
+{
+	static const std::pair<const char *, scenariokind> kinds[] = {
+		{ "connect", scenariokind::connect }, { "join", scenariokind::join }, { "chat", scenariokind::chat },
+		{ "blast", scenariokind::blast }, { "transfer", scenariokind::transfer }, { "slow", scenariokind::slow }
+	};
+	const auto kind = std::find_if(std::begin(kinds), std::end(kinds), [&](const auto & k) { return name == k.first; });
+	if (kind == std::end(kinds))
+		return false;
+
+	sc = scenario();
+	sc.kind = kind->second;
+	sc.name = name;
+	switch (sc.kind)
+	{
+		case scenariokind::connect: sc.clients = 2000; break;
+		case scenariokind::join: sc.clients = 2000; sc.channelSize = 10; break;
+		case scenariokind::chat: break;
+		case scenariokind::blast: sc.clients = 500; sc.channelSize = 16; sc.rate = 30; sc.size = 48; break;
+		case scenariokind::transfer: sc.clients = 20; sc.channelSize = 2; sc.size = 1024 * 1024; break;
+		case scenariokind::slow: sc.clients = 200; sc.rate = 10; sc.size = 256; sc.slowFraction = 0.1; break;
+	}
+	return true;
+}
+
+static bool setscenariovalue(scenario & sc, const std::string & setting)
+{
+	const size_t equals = setting.find('=');
+	if (equals == std::string::npos)
+		return false;
+	const std::string key = setting.substr(0, equals);
+	const char * value = setting.c_str() + equals + 1;
+	char * end;
+	const double number = strtod(value, &end);
+	if (end == value || *end != '\0' || number < 0)
+		return false;
+
+	if (key == "clients")
+		sc.clients = (size_t)number;
+	else if (key == "channelsize")
+		sc.channelSize = std::max<size_t>(2, (size_t)number);
+	else if (key == "rate")
+		sc.rate = number;
+	else if (key == "size")
+		sc.size = (size_t)number;
+	else if (key == "duration")
+		sc.duration = number;
+	else if (key == "slow")
+		sc.slowFraction = std::min(number, 1.0);
+	else if (key == "slowdelay")
+		sc.slowDelayMS = (long)number;
+	else
+		return false;
+	return true;
+}
+
+/// <summary> Reads a list of scenarios, each a name followed by its key=value settings. </summary>
+static bool parsescenarios(const std::vector<std::string> & words, std::vector<scenario> & out)
+{
+	for (const auto & word : words)
+	{
+		scenario sc;
+		if (makescenario(word, sc))
+			out.push_back(sc);
+		else if (out.empty() || !setscenariovalue(out.back(), word))
+		{
+			std::cerr << "relaybench: unrecognised scenario or setting \"" << word << "\".\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+enum class phase { idle, connect, join, run, drain, stop };
+
+struct benchthread;
+
+/// <summary> One scenario run: settings and the phase the client threads follow. </summary>
+struct benchrun
+{
+	const scenario & sc;
+	const std::string & host;
+	const lw_ui16 port;
+	std::atomic<phase> current = phase::idle;
+	benchclock::time_point runStart;
+	std::string payload;
+
+	benchrun(const scenario & sc, const std::string & host, lw_ui16 port) : sc(sc), host(host), port(port) { }
+};
+
+struct benchclient
+{
+	benchthread & thread;
+	lacewing::relayclient client;
+	const size_t index;
+	bool named = false;
+	// When connect() or join() was called, for the storm latencies
+	benchclock::time_point requestedAt;
+	std::shared_ptr<lacewing::relayclient::channel> channel;
+	std::uint64_t sent = 0;
+
+	benchclient(benchthread & thread, lacewing::pump pump, size_t index) : thread(thread), client(pump), index(index)
+	{
+		client.tag = this;
+	}
+};
+
+/// <summary> A thread running one eventpump and the clients on it. All the clients' handlers run on this thread. </summary>
+struct benchthread
+{
+	benchrun & run;
+	const bool slowConsumers;
+	std::vector<size_t> indexes;
+
+	lacewing::eventpump pump = nullptr;
+	lacewing::timer ticker = nullptr;
+	std::vector<std::unique_ptr<benchclient>> clients;
+	phase seen = phase::idle;
+	// This thread's copy of run.payload, stamped with each send time
+	std::string payload;
+
+	// Read by the main thread while running
+	std::atomic<size_t> connected = 0, named = 0, joined = 0, errors = 0;
+	std::atomic<std::uint64_t> messagesSent = 0, deliveriesExpected = 0, messagesReceived = 0, bytesReceived = 0;
+	// Read by the main thread once this thread ends
+	latencyhistogram latency;
+	std::string firstError;
+	std::thread worker;
+
+	benchthread(benchrun & run, bool slowConsumers) : run(run), slowConsumers(slowConsumers) { }
+
+	void error(std::string_view text)
+	{
+		if (errors.fetch_add(1, std::memory_order_relaxed) == 0)
+			firstError = text;
+	}
+};
+
+static std::uint64_t nowns()
+{
+	return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(benchclock::now().time_since_epoch()).count();
+}
+static std::uint64_t sinceus(benchclock::time_point start)
+{
+	return (std::uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(benchclock::now() - start).count();
+}
+
+static std::string channelname(const scenario & sc, size_t index)
+{
+	return "bench" + std::to_string(index / sc.channelSize);
+}
+
+static void onconnect(lacewing::relayclient & client)
+{
+	benchclient & c = *(benchclient *)client.tag;
+	if (c.thread.run.sc.kind == scenariokind::connect)
+		c.thread.latency.record(sinceus(c.requestedAt));
+	c.thread.connected.fetch_add(1, std::memory_order_relaxed);
+	client.name("b" + std::to_string(c.index));
+}
+static void onconnectiondenied(lacewing::relayclient & client, std::string_view reason)
+{
+	((benchclient *)client.tag)->thread.error("connection denied: " + std::string(reason));
+}
+static void onnameset(lacewing::relayclient & client)
+{
+	benchclient & c = *(benchclient *)client.tag;
+	if (c.named)
+		return;
+	c.named = true;
+	c.thread.named.fetch_add(1, std::memory_order_relaxed);
+
+	// The join storm waits for everyone to be named first
+	const scenario & sc = c.thread.run.sc;
+	if (sc.joinschannels() && sc.kind != scenariokind::join)
+		client.join(channelname(sc, c.index));
+}
+static void onnamedenied(lacewing::relayclient & client, std::string_view, std::string_view reason)
+{
+	((benchclient *)client.tag)->thread.error("name denied: " + std::string(reason));
+}
+static void onchanneljoin(lacewing::relayclient & client, std::shared_ptr<lacewing::relayclient::channel> channel)
+{
+	benchclient & c = *(benchclient *)client.tag;
+	if (c.thread.run.sc.kind == scenariokind::join)
+		c.thread.latency.record(sinceus(c.requestedAt));
+	c.channel = channel;
+	c.thread.joined.fetch_add(1, std::memory_order_relaxed);
+}
+static void onchanneljoindenied(lacewing::relayclient & client, std::string_view, std::string_view reason)
+{
+	((benchclient *)client.tag)->thread.error("join denied: " + std::string(reason));
+}
+static void onmessagechannel(lacewing::relayclient & client, std::shared_ptr<lacewing::relayclient::channel>,
+	std::shared_ptr<lacewing::relayclient::channel::peer>, bool, lw_ui8, std::string_view message, lw_ui8)
+{
+	benchthread & t = ((benchclient *)client.tag)->thread;
+	if (message.size() >= sizeof(std::uint64_t))
+	{
+		std::uint64_t sentAt;
+		memcpy(&sentAt, message.data(), sizeof(sentAt));
+		t.latency.record((nowns() - sentAt) / 1000);
+	}
+	t.messagesReceived.fetch_add(1, std::memory_order_relaxed);
+	t.bytesReceived.fetch_add(message.size(), std::memory_order_relaxed);
+
+	// Only while sending, so the backlog clears quickly afterwards
+	if (t.slowConsumers && t.run.current.load(std::memory_order_relaxed) == phase::run)
+		std::this_thread::sleep_for(std::chrono::milliseconds(t.run.sc.slowDelayMS));
+}
+static void onerror(lacewing::relayclient & client, lacewing::error error)
+{
+	((benchclient *)client.tag)->thread.error(error->tostring());
+}
+static void ondisconnect(lacewing::relayclient & client)
+{
+	benchclient & c = *(benchclient *)client.tag;
+	if (c.thread.run.current.load() != phase::stop)
+		c.thread.error("disconnected by server");
+}
+
+/// <summary> Sends each ready client's due messages, spreading clients' send times over the period. </summary>
+static void sendtraffic(benchthread & t)
+{
+	const scenario & sc = t.run.sc;
+	const double elapsed = std::chrono::duration<double>(benchclock::now() - t.run.runStart).count();
+	std::string & payload = t.payload;
+	for (const auto & c : t.clients)
+	{
+		if (!c->channel)
+			continue;
+		const std::uint64_t due = (std::uint64_t)(elapsed * sc.rate + (double)(c->index % 1000) / 1000.0);
+		const int peers = c->channel->peercount();
+		for (; c->sent < due; ++c->sent)
+		{
+			const std::uint64_t sentAt = nowns();
+			memcpy(payload.data(), &sentAt, std::min(sizeof(sentAt), payload.size()));
+			// Binary variant, so the server doesn't check the payload as text
+			if (sc.kind == scenariokind::blast)
+				c->channel->blast(0, payload, 2);
+			else
+				c->channel->send(0, payload, 2);
+			t.messagesSent.fetch_add(1, std::memory_order_relaxed);
+			t.deliveriesExpected.fetch_add(peers > 0 ? (std::uint64_t)peers : 0, std::memory_order_relaxed);
+		}
+	}
+}
+
+static void lw_callback threadtick(lacewing::timer timer)
+{
+	benchthread & t = *(benchthread *)timer->tag();
+	const phase now = t.run.current.load();
+	const bool entered = now != t.seen;
+	t.seen = now;
+
+	switch (now)
+	{
+		case phase::connect:
+			if (entered)
+			{
+				for (const auto & c : t.clients)
+				{
+					c->requestedAt = benchclock::now();
+					c->client.connect(t.run.host.c_str(), t.run.port);
+				}
+			}
+			break;
+		case phase::join:
+			if (entered)
+			{
+				for (const auto & c : t.clients)
+				{
+					c->requestedAt = benchclock::now();
+					if (c->named)
+						c->client.join(channelname(t.run.sc, c->index));
+				}
+			}
+			break;
+		case phase::run:
+			// Slow consumers only receive
+			if (!t.slowConsumers)
+				sendtraffic(t);
+			break;
+		case phase::stop:
+			if (entered)
+			{
+				timer->stop();
+				// Deleted here rather than after the loop, so their sockets' pump watches are removed while it runs
+				for (const auto & c : t.clients)
+					c->client.disconnect();
+				t.clients.clear();
+				t.pump->post_eventloop_exit();
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+static void threadmain(benchthread & t)
+{
+	t.pump = lacewing::eventpump_new();
+	t.payload = t.run.payload;
+	for (size_t index : t.indexes)
+	{
+		auto c = std::make_unique<benchclient>(t, t.pump, index);
+		c->client.onconnect(onconnect);
+		c->client.onconnectiondenied(onconnectiondenied);
+		c->client.ondisconnect(ondisconnect);
+		c->client.onname_set(onnameset);
+		c->client.onname_denied(onnamedenied);
+		c->client.onchannel_join(onchanneljoin);
+		c->client.onchannel_joindenied(onchanneljoindenied);
+		c->client.onmessage_channel(onmessagechannel);
+		c->client.onerror(onerror);
+		t.clients.push_back(std::move(c));
+	}
+
+	t.ticker = lacewing::timer_new(t.pump);
+	t.ticker->tag(&t);
+	t.ticker->on_tick(threadtick);
+	t.ticker->start(5);
+
+	if (lacewing::error error = t.pump->start_eventloop())
+	{
+		t.error(error->tostring());
+		lacewing::error_delete(error);
+	}
+
+	lacewing::timer_delete(t.ticker);
+	lacewing::pump_delete(t.pump);
+}
+
+/// <summary> A relayserver hosted in this process, on its own pump thread. </summary>
+struct inprocessserver
+{
+	lacewing::eventpump pump = nullptr;
+	lacewing::relayserver * server = nullptr;
+	std::thread thread;
+
+	static void lw_callback onerror(lacewing::relayserver &, lacewing::error error)
+	{
+		static std::atomic<int> shown = 0;
+		if (shown.fetch_add(1) < 5)
+			std::cerr << "server error: " << error->tostring() << '\n';
+	}
+	// Run on the server's pump thread
+	static void lw_callback unhostandexit(inprocessserver * s)
+	{
+		s->server->unhost();
+		s->pump->post_eventloop_exit();
+	}
+
+	void start(lw_ui16 port)
+	{
+		pump = lacewing::eventpump_new();
+		server = new lacewing::relayserver(pump);
+		server->onerror(onerror);
+		server->setmaxconnectionsperip(1000000, 1000000);
+		server->host(port);
+		thread = std::thread([this] { pump->start_eventloop(); });
+	}
+	void stop()
+	{
+		pump->post((void *)unhostandexit, this);
+		thread.join();
+		delete server;
+		lacewing::pump_delete(pump);
+	}
+};
+
+/// <summary> Server CPU time in seconds, from the in-process server's thread or the server process's /proc entry;
+/// 		  negative if neither is known. </summary>
+struct cpumeter
+{
+	inprocessserver * local = nullptr;
+	int pid = 0;
+
+	double seconds() const
+	{
+		if (local)
+		{
+			clockid_t clock;
+			timespec ts;
+			if (pthread_getcpuclockid(local->thread.native_handle(), &clock) == 0 && clock_gettime(clock, &ts) == 0)
+				return ts.tv_sec + ts.tv_nsec / 1e9;
+			return -1;
+		}
+		if (pid <= 0)
+			return -1;
+		std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+		std::string line;
+		if (!std::getline(stat, line))
+			return -1;
+		// Fields after the parenthesised command name; utime and stime are the 12th and 13th of those
+		const size_t close = line.rfind(')');
+		if (close == std::string::npos)
+			return -1;
+		std::istringstream fields(line.substr(close + 2));
+		std::string field;
+		unsigned long long utime = 0, stime = 0;
+		for (int i = 1; i <= 13 && fields >> field; ++i)
+		{
+			if (i == 12)
+				utime = std::stoull(field);
+			else if (i == 13)
+				stime = std::stoull(field);
+		}
+		return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+	}
+};
+
+struct benchresult
+{
+	std::string scenario, error;
+	size_t clients = 0, ready = 0, errors = 0;
+	double seconds = 0, serverCPUPercent = -1;
+	double operationsPerSecond = 0, bytesPerSecond = 0;
+	std::uint64_t sent = 0, expected = 0, received = 0;
+	latencyhistogram latency, slowLatency;
+};
+
+static benchresult runscenario(const scenario & sc, const std::string & host, lw_ui16 port, size_t threadCount, const cpumeter & cpu)
+{
+	benchrun run(sc, host, port);
+	run.payload.assign(std::max<size_t>(sc.size, sizeof(std::uint64_t)), 'x');
+
+	// Slow consumers get a thread of their own, so their stalls don't hold up the normal clients' handlers
+	const size_t slowPerChannel = sc.kind == scenariokind::slow ?
+		(size_t)std::lround(sc.slowFraction * sc.channelSize) : 0;
+	std::vector<std::unique_ptr<benchthread>> threads;
+	for (size_t i = 0; i < threadCount; ++i)
+		threads.push_back(std::make_unique<benchthread>(run, false));
+	if (slowPerChannel)
+		threads.push_back(std::make_unique<benchthread>(run, true));
+	for (size_t i = 0, normal = 0; i < sc.clients; ++i)
+	{
+		if (i % sc.channelSize < slowPerChannel)
+			threads.back()->indexes.push_back(i);
+		else
+			threads[normal++ % threadCount]->indexes.push_back(i);
+	}
+	for (auto & t : threads)
+		t->worker = std::thread(threadmain, std::ref(*t));
+
+	const auto total = [&](std::atomic<size_t> benchthread::* counter) {
+		size_t sum = 0;
+		for (const auto & t : threads)
+			sum += (*t.*counter).load(std::memory_order_relaxed);
+		return sum;
+	};
+	const auto total64 = [&](std::atomic<std::uint64_t> benchthread::* counter) {
+		std::uint64_t sum = 0;
+		for (const auto & t : threads)
+			sum += (*t.*counter).load(std::memory_order_relaxed);
+		return sum;
+	};
+	// Waits until everyone's reached a step, or has failed, or it's been quiet too long
+	const auto waitfor = [&](std::atomic<size_t> benchthread::* counter) {
+		size_t last = 0;
+		auto lastProgress = benchclock::now();
+		while (total(counter) + total(&benchthread::errors) < sc.clients)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			const size_t now = total(counter);
+			if (now != last)
+				last = now, lastProgress = benchclock::now();
+			else if (benchclock::now() - lastProgress > std::chrono::seconds(10))
+				return false;
+		}
+		return true;
+	};
+
+	benchresult result;
+	result.scenario = sc.name;
+	result.clients = sc.clients;
+
+	double cpuStart = cpu.seconds();
+	auto start = benchclock::now();
+	run.current = phase::connect;
+	bool ok = waitfor(sc.kind == scenariokind::connect ? &benchthread::connected : &benchthread::named);
+	result.ready = total(sc.kind == scenariokind::connect ? &benchthread::connected : &benchthread::named);
+	if (ok && sc.kind == scenariokind::connect)
+	{
+		result.seconds = std::chrono::duration<double>(benchclock::now() - start).count();
+		result.operationsPerSecond = result.ready / result.seconds;
+	}
+	else if (ok && sc.kind == scenariokind::join)
+	{
+		cpuStart = cpu.seconds();
+		start = benchclock::now();
+		run.current = phase::join;
+		ok = waitfor(&benchthread::joined);
+		result.ready = total(&benchthread::joined);
+		result.seconds = std::chrono::duration<double>(benchclock::now() - start).count();
+		result.operationsPerSecond = result.ready / result.seconds;
+	}
+	else if (ok)
+	{
+		ok = waitfor(&benchthread::joined);
+		result.ready = total(&benchthread::joined);
+		if (ok)
+		{
+			cpuStart = cpu.seconds();
+			run.runStart = start = benchclock::now();
+			run.current = phase::run;
+			std::this_thread::sleep_for(std::chrono::duration<double>(sc.duration));
+			result.seconds = std::chrono::duration<double>(benchclock::now() - start).count();
+			run.current = phase::drain;
+
+			// Let what's in flight arrive; anything still missing after is counted as lost
+			const auto drainStart = benchclock::now();
+			while (total64(&benchthread::messagesReceived) < total64(&benchthread::deliveriesExpected) &&
+				benchclock::now() - drainStart < std::chrono::seconds(sc.kind == scenariokind::slow ? 1 : 5))
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			result.operationsPerSecond = total64(&benchthread::messagesReceived) / result.seconds;
+			result.bytesPerSecond = total64(&benchthread::bytesReceived) / result.seconds;
+		}
+	}
+	const double cpuEnd = cpu.seconds();
+	if (cpuStart >= 0 && cpuEnd >= 0 && result.seconds > 0)
+		result.serverCPUPercent = (cpuEnd - cpuStart) / result.seconds * 100;
+	if (!ok)
+		result.error = "timed out with " + std::to_string(result.ready) + " of " + std::to_string(sc.clients) + " clients ready";
+
+	run.current = phase::stop;
+	for (auto & t : threads)
+	{
+		t->worker.join();
+		(t->slowConsumers ? result.slowLatency : result.latency).merge(t->latency);
+		if (result.error.empty() && !t->firstError.empty())
+			result.error = t->firstError;
+	}
+	result.errors = total(&benchthread::errors);
+	result.sent = total64(&benchthread::messagesSent);
+	result.expected = total64(&benchthread::deliveriesExpected);
+	result.received = total64(&benchthread::messagesReceived);
+	return result;
+}
+
+static std::string jsonescape(std::string_view text)
+{
+	std::string out;
+	for (const char c : text)
+	{
+		if (c == '"' || c == '\\')
+			out += '\\';
+		if ((unsigned char)c < 0x20)
+			out += ' ';
+		else
+			out += c;
+	}
+	return out;
+}
+
+static const char * lockpolicyname()
+{
+#if LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_NONE
+	return "none";
+#elif LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_SPIN
+	return "spin";
+#else
+	return "checked";
+#endif
+}
+
+static void report(const scenario & sc, const benchresult & r, bool json)
+{
+	const char * rateUnit = sc.sendstraffic() ? "msg/s delivered" : sc.kind == scenariokind::connect ? "connects/s" : "joins/s";
+	char line[512];
+	snprintf(line, sizeof(line), "%-8s %6zu clients: %10.0f %s, %8.2f MB/s; latency p50 %llu us, p99 %llu us, p99.9 %llu us, max %llu us",
+		sc.name.c_str(), r.clients, r.operationsPerSecond, rateUnit, r.bytesPerSecond / 1e6,
+		(unsigned long long)r.latency.percentile(0.5), (unsigned long long)r.latency.percentile(0.99),
+		(unsigned long long)r.latency.percentile(0.999), (unsigned long long)r.latency.max);
+	std::cerr << line;
+	if (r.serverCPUPercent >= 0)
+		std::cerr << "; server CPU " << (int)std::lround(r.serverCPUPercent) << "%";
+	if (sc.sendstraffic() && r.expected > r.received)
+		std::cerr << "; " << (r.expected - r.received) << " of " << r.expected << " not delivered";
+	if (r.slowLatency.total)
+		std::cerr << "; slow consumers' p99 " << r.slowLatency.percentile(0.99) << " us";
+	if (!r.error.empty())
+		std::cerr << "\n         " << r.errors << " error(s), first: " << r.error;
+	std::cerr << '\n';
+
+	if (!json)
+		return;
+	std::cout << "{\"scenario\":\"" << sc.name << "\",\"lockpolicy\":\"" << lockpolicyname() << "\",\"clients\":" << sc.clients << ",\"channelsize\":" << sc.channelSize
+		<< ",\"rate\":" << sc.rate << ",\"size\":" << sc.size << ",\"duration\":" << sc.duration
+		<< ",\"ready\":" << r.ready << ",\"seconds\":" << r.seconds << ",\"ops_per_second\":" << r.operationsPerSecond
+		<< ",\"bytes_per_second\":" << r.bytesPerSecond << ",\"sent\":" << r.sent << ",\"expected\":" << r.expected
+		<< ",\"received\":" << r.received << ",\"p50_us\":" << r.latency.percentile(0.5) << ",\"p99_us\":" << r.latency.percentile(0.99)
+		<< ",\"p999_us\":" << r.latency.percentile(0.999) << ",\"max_us\":" << r.latency.max;
+	if (r.slowLatency.total)
+		std::cout << ",\"slow_p99_us\":" << r.slowLatency.percentile(0.99);
+	if (r.serverCPUPercent >= 0)
+		std::cout << ",\"server_cpu_percent\":" << r.serverCPUPercent;
+	std::cout << ",\"errors\":" << r.errors << ",\"error\":\"" << jsonescape(r.error) << "\"}" << std::endl;
+}
+
+int main(int argc, char ** argv)
+{
+	std::string host = "127.0.0.1";
+	lw_ui16 port = 6121;
+	size_t threadCount = std::max(1u, std::thread::hardware_concurrency() / 2);
+	bool json = false, hostLocally = false;
+	cpumeter cpu;
+	std::vector<std::string> words;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "--server" && hasValue)
+		{
+			const std::string value = argv[++i];
+			const size_t colon = value.rfind(':');
+			host = value.substr(0, colon);
+			if (colon != std::string::npos)
+				port = (lw_ui16)atoi(value.c_str() + colon + 1);
+		}
+		else if (arg == "--host" && hasValue)
+			hostLocally = true, port = (lw_ui16)atoi(argv[++i]);
+		else if (arg == "--server-pid" && hasValue)
+			cpu.pid = atoi(argv[++i]);
+		else if (arg == "--threads" && hasValue)
+			threadCount = std::max(1, atoi(argv[++i]));
+		else if (arg == "--json")
+			json = true;
+		else if (arg == "--script" && hasValue)
+		{
+			std::ifstream script(argv[++i]);
+			if (!script)
+			{
+				std::cerr << "relaybench: couldn't open script \"" << argv[i] << "\".\n";
+				return EXIT_FAILURE;
+			}
+			for (std::string line; std::getline(script, line); )
+			{
+				std::istringstream lineWords(line.substr(0, line.find('#')));
+				for (std::string word; lineWords >> word; )
+					words.push_back(word);
+			}
+		}
+		else if (arg.rfind("--", 0) == 0)
+		{
+			std::cerr << "Usage: relaybench [--server host:port | --host port] [--server-pid pid] [--threads n] [--json] "
+				"[--script file] [scenario [key=value...]]...\n";
+			return EXIT_FAILURE;
+		}
+		else
+			words.push_back(arg);
+	}
+
+	if (words.empty())
+		words = { "connect", "join", "chat", "blast", "transfer", "slow" };
+	std::vector<scenario> scenarios;
+	if (!parsescenarios(words, scenarios))
+		return EXIT_FAILURE;
+
+	inprocessserver local;
+	if (hostLocally)
+	{
+		std::cerr << "Hosting with the " << lockpolicyname() << " readwritelock policy.\n";
+		local.start(port);
+		cpu.local = &local;
+	}
+
+	for (const auto & sc : scenarios)
+	{
+		report(sc, runscenario(sc, host, port, threadCount, cpu), json);
+		// Let the server finish with the last run's disconnects
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	}
+
+	if (hostLocally)
+		local.stop();
+	return 0;
+}
@@ -0,0 +1,88 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * Created by Darkwire Software.
+ *
+ * This benchmark file is available unlicensed; the MIT license of liblacewing/Lacewing Relay does not apply to this file.
+*/
+
+// Times lw_u8str_validate(), which picks AVX2, SSSE3 or scalar at runtime, against the previous approach of
+// utf8proc_iterate() + utf8proc_codepoint_valid() per code point, on typical text message payloads:
+// short English chat, chat mixing scripts and emoji, and JSON state blobs.
+//   g++ -std=c++17 -O2 -DNDEBUG -ILacewing Benchmarks/UTF8ValidateBench.cpp Lacewing/UTF8Validate.cc -x c Lacewing/deps/utf8proc.c -o utf8validatebench && ./utf8validatebench
+
+#include "Lacewing.h"
+#include "deps/utf8proc.h"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static bool validatebyiterate(std::string_view text)
+{
+	const utf8proc_uint8_t * str = (const utf8proc_uint8_t *)text.data();
+	utf8proc_int32_t thisChar;
+	utf8proc_ssize_t numBytesInCodePoint, remainder = text.size();
+	while (remainder > 0)
+	{
+		numBytesInCodePoint = utf8proc_iterate(str, remainder, &thisChar);
+		if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar))
+			return false;
+		str += numBytesInCodePoint;
+		remainder -= numBytesInCodePoint;
+	}
+	return true;
+}
+
+static std::string makejson(size_t entries)
+{
+	std::string json = "{\"players\":[";
+	for (size_t i = 0; i < entries; ++i)
+	{
+		json += "{\"id\":" + std::to_string(i) + ",\"name\":\"Player" + std::to_string(i) +
+			"\",\"x\":" + std::to_string(i * 37 % 640) + ",\"y\":" + std::to_string(i * 91 % 480) +
+			",\"hp\":100,\"team\":\"" + (i % 2 ? "red" : "blue") + "\"},";
+	}
+	json.back() = ']';
+	return json + ",\"round\":3,\"map\":\"Caf\xC3\xA9 \xE6\x9D\xB1\xE4\xBA\xAC\"}";
+}
+
+template<class Fn>
+static double time(const std::vector<std::string> & payloads, Fn && validate)
+{
+	size_t bytes = 0, good = 0;
+	const auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < 200; ++round)
+	{
+		for (const auto & p : payloads)
+		{
+			good += validate(p);
+			bytes += p.size();
+		}
+	}
+	const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	if (good != payloads.size() * 200)
+		std::cout << "(validation disagreed) ";
+	return bytes / ns; // GB/s
+}
+
+int main()
+{
+	const std::vector<std::pair<const char *, std::vector<std::string>>> sets = {
+		{ "English chat", { "gg", "anyone want to team up for the next round?", "brb 5 min", "lol that was close",
+			"Ready when you are. Map vote: forest or caves?" } },
+		{ "Mixed script chat", { "\xE3\x81\x93\xE3\x82\x93\xE3\x81\xAB\xE3\x81\xA1\xE3\x81\xAF\xEF\xBC\x81 hello!",
+			"\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82, \xD0\xBA\xD0\xB0\xD0\xBA \xD0\xB4\xD0\xB5\xD0\xBB\xD0\xB0?",
+			"nice shot \xF0\x9F\x98\x80\xF0\x9F\x91\x8D", "caf\xC3\xA9 cr\xC3\xA8me br\xC3\xBB\x6C\xC3\xA9\x65 time",
+			"\xCE\x93\xCE\xB5\xCE\xB9\xCE\xB1 \xCF\x83\xCE\xBF\xCF\x85 \xCE\xBA\xCF\x8C\xCF\x83\xCE\xBC\xCE\xB5" } },
+		{ "JSON state, 1KB", { makejson(12) } },
+		{ "JSON state, 16KB", { makejson(200) } },
+	};
+
+	for (const auto & set : sets)
+	{
+		std::cout << set.first << ": utf8proc_iterate " << time(set.second, validatebyiterate)
+			<< " GB/s, lw_u8str_validate " << time(set.second, [](std::string_view p) { return lw_u8str_validate(p); })
+			<< " GB/s\n";
+	}
+	return 0;
+}
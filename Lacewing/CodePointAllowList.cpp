@@ -9,6 +9,10 @@
 
 #include "Lacewing.h"
 #include "deps/utf8proc.h"
+#include <map>
+
+// Unicode is U+0000 to U+10FFFF; blocks of 256 code points
+static constexpr size_t CPALNumBlocks = 0x110000 >> 8;
 
 static std::string CPALMakeError(lacewing::codepointsallowlist * that, lacewing::codepointsallowlist & acTemp, const char * str, ...)
 {
@@ -35,6 +39,7 @@ std::string lacewing::codepointsallowlist::setcodepointsallowedlist(std::string
 		codePointRanges.clear();
 		allAllowed = true;
 		list = acStr;
+		compile();
 		return std::string();
 	}
 
@@ -178,49 +183,111 @@ std::string lacewing::codepointsallowlist::setcodepointsallowedlist(std::string
 		/* go to next char */;
 	}
 
+	compile();
 	return std::string();
 }
 
+bool lacewing::codepointsallowlist::matcheslists(std::int32_t codePoint) const
+{
+	if (std::find(specificCodePoints.cbegin(), specificCodePoints.cend(), codePoint) != specificCodePoints.cend())
+		return true;
+	if (std::find_if(codePointRanges.cbegin(), codePointRanges.cend(),
+		[=](const std::pair<std::int32_t, std::int32_t> & range) {
+			return codePoint >= range.first && codePoint <= range.second;
+		}) != codePointRanges.cend())
+	{
+		return true;
+	}
+	const utf8proc_category_t category = utf8proc_category(codePoint);
+	return std::find(codePointCategories.cbegin(), codePointCategories.cend(), category) != codePointCategories.cend();
+}
+
+void lacewing::codepointsallowlist::compile()
+{
+	asciiAllowed[0] = asciiAllowed[1] = 0;
+	printableASCIIAllowed = false;
+	blockBitmapIndex.clear();
+	blockBitmaps.clear();
+	if (allAllowed)
+		return;
+
+	for (std::int32_t codePoint = 0; codePoint < 0x80; ++codePoint)
+	{
+		if (matcheslists(codePoint))
+			asciiAllowed[codePoint >> 6] |= 1ULL << (codePoint & 63);
+	}
+	printableASCIIAllowed = true;
+	for (std::int32_t codePoint = 0x20; codePoint < 0x7F; ++codePoint)
+		printableASCIIAllowed &= ((asciiAllowed[codePoint >> 6] >> (codePoint & 63)) & 1) != 0;
+
+	// Most blocks come out all denied or all allowed, so there's far fewer distinct bitmaps than blocks
+	std::map<std::array<std::uint64_t, 4>, std::uint16_t> distinct;
+	blockBitmapIndex.resize(CPALNumBlocks);
+	for (size_t block = 0; block < CPALNumBlocks; ++block)
+	{
+		std::array<std::uint64_t, 4> bits = { 0, 0, 0, 0 };
+		for (std::int32_t i = 0; i < 256; ++i)
+		{
+			const std::int32_t codePoint = (std::int32_t)(block << 8) | i;
+			if (utf8proc_codepoint_valid(codePoint) && matcheslists(codePoint))
+				bits[i >> 6] |= 1ULL << (i & 63);
+		}
+		const auto found = distinct.emplace(bits, (std::uint16_t)blockBitmaps.size());
+		if (found.second)
+			blockBitmaps.push_back(bits);
+		blockBitmapIndex[block] = found.first->second;
+	}
+}
+
 int lacewing::codepointsallowlist::checkcodepointsallowed(const std::string_view toTest, int * const rejectedUTF32CodePoint /* = NULL */) const
 {
 	if (allAllowed)
 		return -1;
 
 	const utf8proc_uint8_t * str = (const utf8proc_uint8_t *)toTest.data();
+	const utf8proc_uint8_t * const end = str + toTest.size();
 	utf8proc_int32_t thisChar;
-	utf8proc_ssize_t numBytesInCodePoint, remainingBytes = toTest.size();
 	int codePointIndex = 0;
-	utf8proc_category_t category;
-	while (remainingBytes > 0)
+	while (str < end)
 	{
-		numBytesInCodePoint = utf8proc_iterate(str, remainingBytes, &thisChar);
-		if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar))
-			goto badChar;
-
-		if (std::find(specificCodePoints.cbegin(), specificCodePoints.cend(), thisChar) != specificCodePoints.cend())
-			goto goodChar;
-		if (std::find_if(codePointRanges.cbegin(), codePointRanges.cend(),
-			[=](const std::pair<std::int32_t, std::int32_t> & range) {
-				return thisChar >= range.first && thisChar <= range.second;
-			}) != codePointRanges.cend())
+		// Accept printable ASCII in bulk, where the list allows all of it
+		if (printableASCIIAllowed)
+		{
+			const size_t run = lw_u8str_printableasciirun(std::string_view((const char *)str, end - str));
+			str += run;
+			codePointIndex += (int)run;
+			if (str == end)
+				break;
+		}
+
+		if (*str < 0x80)
 		{
-			goto goodChar;
+			thisChar = *str;
+			if (!((asciiAllowed[thisChar >> 6] >> (thisChar & 63)) & 1))
+				goto badChar;
+			++str;
+			++codePointIndex;
+			continue;
+		}
+
+		{
+			const utf8proc_ssize_t numBytesInCodePoint = utf8proc_iterate(str, end - str, &thisChar);
+			if (numBytesInCodePoint <= 0 || thisChar < 0 || thisChar > 0x10FFFF)
+				goto badChar;
+
+			const std::array<std::uint64_t, 4> & bits = blockBitmaps[blockBitmapIndex[thisChar >> 8]];
+			if (!((bits[(thisChar >> 6) & 3] >> (thisChar & 63)) & 1))
+				goto badChar;
+
+			++codePointIndex;
+			str += numBytesInCodePoint;
+			continue;
 		}
-		category = utf8proc_category(thisChar);
-		if (std::find(codePointCategories.cbegin(), codePointCategories.cend(), category) != codePointCategories.cend())
-			goto goodChar;
 
-		// ... fall through from above
 	badChar:
 		if (rejectedUTF32CodePoint != NULL)
 			*rejectedUTF32CodePoint = thisChar;
 		return codePointIndex;
-
-		// Loop around
-	goodChar:
-		++codePointIndex;
-		str += numBytesInCodePoint;
-		remainingBytes -= numBytesInCodePoint;
 	}
 
 	return -1; // All good
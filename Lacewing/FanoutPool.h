@@ -0,0 +1,135 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef LacewingFanoutPool
+#define LacewingFanoutPool
+
+/// <summary> A fork-join pool for splitting one send across threads. run() hands out chunk indexes to the
+/// 		  workers and the calling thread, and returns once every chunk is done, so anything the chunks
+/// 		  reference may live on the caller's stack. With no workers, chunks run in order on the caller. </summary>
+class fanoutpool
+{
+	struct batch
+	{
+		std::function<void(size_t)> func;
+		size_t chunks = 0;
+		std::atomic<size_t> next = 0, done = 0;
+	};
+
+	std::mutex poolLock, runLock;
+	std::condition_variable batchReady, batchDone;
+	std::vector<std::thread> workers;
+	std::shared_ptr<batch> current;
+	bool stopping = false;
+
+	/// <summary> Runs chunks of b until there are none left to claim. </summary>
+	void runchunks(batch & b)
+	{
+		for (size_t i; (i = b.next++) < b.chunks; )
+		{
+			b.func(i);
+			if (++b.done == b.chunks)
+			{
+				std::lock_guard<std::mutex> poolGuard(poolLock);
+				batchDone.notify_all();
+			}
+		}
+	}
+
+	void workerloop()
+	{
+		std::shared_ptr<batch> last;
+		while (true)
+		{
+			std::shared_ptr<batch> b;
+			{
+				std::unique_lock<std::mutex> poolGuard(poolLock);
+				batchReady.wait(poolGuard, [&] { return stopping || current != last; });
+				if (stopping)
+					return;
+				b = last = current;
+			}
+			if (b)
+				runchunks(*b);
+		}
+	}
+
+	void stopworkers()
+	{
+		{
+			std::lock_guard<std::mutex> poolGuard(poolLock);
+			stopping = true;
+		}
+		batchReady.notify_all();
+		for (auto & t : workers)
+			t.join();
+		workers.clear();
+		stopping = false;
+	}
+
+public:
+
+	~fanoutpool()
+	{
+		stopworkers();
+	}
+
+	/// <summary> Replaces the worker threads, waiting for any batch in progress. 0 disables the pool;
+	/// 		  run() then works on the caller only. </summary>
+	void setworkercount(size_t count)
+	{
+		std::lock_guard<std::mutex> runGuard(runLock);
+		stopworkers();
+		for (size_t i = 0; i < count; ++i)
+			workers.emplace_back(&fanoutpool::workerloop, this);
+	}
+
+	size_t workercount() const
+	{
+		return workers.size();
+	}
+
+	/// <summary> Calls func(i) for each i in [0, chunks), spread over the workers and the calling thread,
+	/// 		  and waits for all of them. If another thread is already running a batch, runs on the caller alone. </summary>
+	template<class Func>
+	void run(size_t chunks, Func && func)
+	{
+		std::unique_lock<std::mutex> runGuard(runLock, std::try_to_lock);
+		if (!runGuard.owns_lock() || workers.empty() || chunks <= 1)
+		{
+			for (size_t i = 0; i < chunks; ++i)
+				func(i);
+			return;
+		}
+
+		auto b = std::make_shared<batch>();
+		b->func = std::ref(func);
+		b->chunks = chunks;
+		{
+			std::lock_guard<std::mutex> poolGuard(poolLock);
+			current = b;
+		}
+		batchReady.notify_all();
+
+		runchunks(*b);
+
+		std::unique_lock<std::mutex> poolGuard(poolLock);
+		batchDone.wait(poolGuard, [&] { return b->done == b->chunks; });
+		current.reset(); // func references our caller's stack
+	}
+};
+
+#endif
@@ -122,6 +122,7 @@ protected:
 	int tosendsize;
 	lw_ui32 origUDP;
 	lw_i8 wasWebLast;
+	lw_ui8 messagetype;
 
 public:
 
@@ -132,11 +133,13 @@ public:
 		tosendsize = 0;
 		origUDP = UINT32_MAX;
 		wasWebLast = -1;
+		messagetype = 0;
 	}
 
 	inline void addheader(lw_ui8 type, lw_ui8 variant, bool forudp = false, int udpclientid = -1)
 	{
 		assert(size == 0 && "lacewing framebuilder.addheader() error: adding header to message that already has one.");
+		messagetype = type;
 
 		if (!forudp)
 		{
@@ -156,6 +159,14 @@ public:
 			origUDP = ((lw_ui32*)buffer)[1];
 	}
 
+	/// <summary> True for pings and implementation requests. These are written ahead of any backlog of messages,
+	/// 		  so a client busy downloading still answers pings in time. Responses and peer notifications stay in
+	/// 		  order with messages, or a leave could overtake messages queued from that channel or peer. </summary>
+	inline bool iscontrol() const
+	{
+		return messagetype == 11 || messagetype == 12;
+	}
+
 	inline void send(lacewing::server_client client, bool clear = true)
 	{
 		if (wasWebLast == -1 || client->is_websocket() != wasWebLast)
@@ -165,10 +176,11 @@ public:
 			preparefortransmission(wasWebLast);
 		}
 
+		const int priority = iscontrol() ? 32 /* lwp_stream_write_priority */ : 0;
 		if (wasWebLast)
-			lwp_stream_write((lw_stream)client, tosend, tosendsize, 2 /* lwp_stream_write_ignore_busy */);
+			lwp_stream_write((lw_stream)client, tosend, tosendsize, 2 /* lwp_stream_write_ignore_busy */ | priority);
 		else
-			client->write(tosend, tosendsize);
+			lwp_stream_write((lw_stream)client, tosend, tosendsize, priority);
 
 		if (clear)
 			framereset();
@@ -187,6 +199,7 @@ public:
 		((lw_ui32*)buffer)[1] = origUDP;
 		tosend = nullptr;
 		tosendsize = 0;
+		wasWebLast = -1; // or the next send() thinks it's still encoded
 	}
 
 	inline void send(lacewing::udp udp, lacewing::address address, bool clear = true)
@@ -197,6 +210,34 @@ public:
 			framereset();
 	}
 
+	inline void send(lacewing::udp udp, const lacewing::udpendpoint & endpoint, bool clear = true)
+	{
+		udp->send(endpoint, &buffer[isudpclient ? 5 : 7], size - (isudpclient ? 5 : 7));
+
+		if (clear)
+			framereset();
+	}
+
+	/// <summary> Encodes the frame as send() would for a TCP or WebSocket client, so it can be written to
+	/// 		  many clients from other threads. Points into this builder, and encoding for the other client type
+	/// 		  reuses the same bytes, so copy it before doing so. </summary>
+	inline std::string_view encodefor(bool iswebsocketclient)
+	{
+		if (wasWebLast == -1 || iswebsocketclient != (wasWebLast != 0))
+		{
+			wasWebLast = iswebsocketclient;
+			tosend = nullptr; // or preparefortransmission does nothing
+			preparefortransmission(iswebsocketclient);
+		}
+		return std::string_view(tosend, tosendsize);
+	}
+
+	/// <summary> The bytes send(udp, ...) would send. Read it before encodefor(), which may overwrite the UDP header. </summary>
+	inline std::string_view udppayload() const
+	{
+		return std::string_view(&buffer[isudpclient ? 5 : 7], size - (isudpclient ? 5 : 7));
+	}
+
 	inline void framereset()
 	{
 		reset();
@@ -33,6 +33,18 @@ public:
 	framereader() {
 	}
 
+	// Releases the reassembly buffer, unless it's holding part of a message
+	inline void compact()
+	{
+		if (state == 0)
+			buffer.shrink();
+	}
+
+	inline size_t memoryused() const
+	{
+		return buffer.capacity();
+	}
+
 	// Processes a message, returns true if more messages will follow in same data packet.
 	// Sets up dataPtr and sizePtr to point to the next one, for the next process() call.
 	// If no more messages or error, returns false.
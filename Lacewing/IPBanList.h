@@ -0,0 +1,355 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifndef LacewingIPBanList
+#define LacewingIPBanList
+
+/// <summary> Banned IPs and CIDR ranges, each with a reason and an expiry time. Single IPs are found by hash,
+/// 		  ranges by walking a binary radix tree, so a lookup doesn't depend on how many bans there are.
+/// 		  Expiry times are kept in a min-heap, so expire() only looks at bans that are due.
+/// 		  Addresses are in6_addr, with IPv4 as IPv4-mapped IPv6, so an IPv4 /24 is a /120 here.
+/// 		  Not thread-safe. </summary>
+class ipbanlist
+{
+public:
+	typedef std::chrono::steady_clock::time_point time_point;
+	struct ban
+	{
+		std::string reason;
+		// time_point::max() for never
+		time_point expires;
+	};
+
+private:
+	typedef std::array<unsigned char, 16> addrkey;
+
+	struct addrhash
+	{
+		size_t operator()(const addrkey &key) const
+		{
+			// FNV-1a
+			std::uint64_t hash = 14695981039346656037ull;
+			for (const unsigned char b : key)
+				hash = (hash ^ b) * 1099511628211ull;
+			return (size_t)hash;
+		}
+	};
+
+	// Bit i of the address, most significant first
+	static unsigned int bitat(const addrkey &key, unsigned int i)
+	{
+		return (key[i / 8] >> (7 - i % 8)) & 1;
+	}
+
+	static addrkey makekey(const in6_addr &address, unsigned int prefixBits)
+	{
+		addrkey key;
+		std::memcpy(key.data(), &address, key.size());
+		// Zero the host bits, so any address in a range finds the same entry
+		for (unsigned int i = prefixBits; i < 128; ++i)
+			key[i / 8] &= (unsigned char)~(0x80 >> (i % 8));
+		return key;
+	}
+
+	struct node
+	{
+		std::unique_ptr<node> child[2];
+		std::unique_ptr<ban> entry;
+	};
+
+	struct expiry
+	{
+		time_point at;
+		addrkey key;
+		unsigned int prefixBits;
+		bool operator>(const expiry &other) const { return at > other.at; }
+	};
+
+	std::unordered_map<addrkey, ban, addrhash> singles;
+	node root;
+	size_t rangeCount = 0;
+	// May hold stale entries for bans since replaced or removed; expire() checks each against its ban
+	std::priority_queue<expiry, std::vector<expiry>, std::greater<expiry>> expiries;
+
+	ban * findentry(const addrkey &key, unsigned int prefixBits)
+	{
+		if (prefixBits == 128)
+		{
+			const auto it = singles.find(key);
+			return it == singles.end() ? nullptr : &it->second;
+		}
+		node * n = &root;
+		for (unsigned int i = 0; n && i < prefixBits; ++i)
+			n = n->child[bitat(key, i)].get();
+		return n ? n->entry.get() : nullptr;
+	}
+
+public:
+
+	/// <summary> Bans address, or the range of its first prefixBits bits, until expires. Replaces any ban on
+	/// 		  the exact same range. </summary>
+	void add(const in6_addr &address, unsigned int prefixBits, std::string_view reason, time_point expires)
+	{
+		prefixBits = std::min(prefixBits, 128u);
+		const addrkey key = makekey(address, prefixBits);
+		ban * entry;
+		if (prefixBits == 128)
+			entry = &singles[key];
+		else
+		{
+			node * n = &root;
+			for (unsigned int i = 0; i < prefixBits; ++i)
+			{
+				std::unique_ptr<node> &next = n->child[bitat(key, i)];
+				if (!next)
+					next = std::make_unique<node>();
+				n = next.get();
+			}
+			if (!n->entry)
+			{
+				n->entry = std::make_unique<ban>();
+				++rangeCount;
+			}
+			entry = n->entry.get();
+		}
+		entry->reason = reason;
+		entry->expires = expires;
+		if (expires != time_point::max())
+			expiries.push(expiry { expires, key, prefixBits });
+	}
+
+	/// <summary> Lifts the ban on exactly this address or range. Returns false if there wasn't one. </summary>
+	bool remove(const in6_addr &address, unsigned int prefixBits)
+	{
+		prefixBits = std::min(prefixBits, 128u);
+		const addrkey key = makekey(address, prefixBits);
+		if (prefixBits == 128)
+			return singles.erase(key) > 0;
+
+		// Keep the path, so nodes left with no ban and no children can be freed
+		node * path[129];
+		path[0] = &root;
+		for (unsigned int i = 0; i < prefixBits; ++i)
+		{
+			path[i + 1] = path[i]->child[bitat(key, i)].get();
+			if (!path[i + 1])
+				return false;
+		}
+		if (!path[prefixBits]->entry)
+			return false;
+		path[prefixBits]->entry.reset();
+		--rangeCount;
+		for (unsigned int i = prefixBits; i > 0; --i)
+		{
+			const node * n = path[i];
+			if (n->entry || n->child[0] || n->child[1])
+				break;
+			path[i - 1]->child[bitat(key, i - 1)].reset();
+		}
+		return true;
+	}
+
+	/// <summary> The ban covering address at now, or null. If several ranges cover it, the narrowest wins. </summary>
+	const ban * find(const in6_addr &address, time_point now) const
+	{
+		addrkey key;
+		std::memcpy(key.data(), &address, key.size());
+		if (!singles.empty())
+		{
+			const auto it = singles.find(key);
+			if (it != singles.end() && it->second.expires > now)
+				return &it->second;
+		}
+
+		const ban * found = nullptr;
+		const node * n = &root;
+		for (unsigned int i = 0; rangeCount != 0 && n; ++i)
+		{
+			if (n->entry && n->entry->expires > now)
+				found = n->entry.get();
+			if (i == 128)
+				break;
+			n = n->child[bitat(key, i)].get();
+		}
+		return found;
+	}
+
+	/// <summary> Removes bans that expired by now. Returns how many were removed. </summary>
+	size_t expire(time_point now)
+	{
+		size_t removed = 0;
+		while (!expiries.empty() && expiries.top().at <= now)
+		{
+			const expiry due = expiries.top();
+			expiries.pop();
+			in6_addr address;
+			std::memcpy(&address, due.key.data(), due.key.size());
+			// A ban replaced with a later expiry has its own heap entry, so only remove it if this one's it
+			const ban * entry = findentry(due.key, due.prefixBits);
+			if (entry && entry->expires <= now && remove(address, due.prefixBits))
+				++removed;
+		}
+		return removed;
+	}
+
+	size_t size() const
+	{
+		return singles.size() + rangeCount;
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	/// <summary> Reads "address" or "address/prefix", IPv4 or IPv6, into address and prefixBits. IPv4 is
+	/// 		  mapped, so "10.0.0.0/8" reads as ::ffff:10.0.0.0/104. Returns false if text isn't one. </summary>
+	static bool parse(std::string_view text, in6_addr &address, unsigned int &prefixBits)
+	{
+		std::string_view host = text;
+		int prefix = -1;
+		const size_t slash = text.find('/');
+		if (slash != std::string_view::npos)
+		{
+			host = text.substr(0, slash);
+			const std::string_view digits = text.substr(slash + 1);
+			if (digits.empty() || digits.size() > 3)
+				return false;
+			prefix = 0;
+			for (const char c : digits)
+			{
+				if (c < '0' || c > '9')
+					return false;
+				prefix = prefix * 10 + (c - '0');
+			}
+		}
+
+		unsigned char bytes[16] = { };
+		if (host.find(':') == std::string_view::npos)
+		{
+			if (!parseipv4(host, bytes + 12) || prefix > 32)
+				return false;
+			bytes[10] = bytes[11] = 0xFF;
+			prefixBits = prefix < 0 ? 128 : 96 + (unsigned int)prefix;
+		}
+		else
+		{
+			if (!parseipv6(host, bytes) || prefix > 128)
+				return false;
+			prefixBits = prefix < 0 ? 128 : (unsigned int)prefix;
+		}
+		std::memcpy(&address, bytes, sizeof(bytes));
+		return true;
+	}
+
+private:
+
+	static bool parseipv4(std::string_view text, unsigned char * out)
+	{
+		for (int part = 0; part < 4; ++part)
+		{
+			if (part > 0)
+			{
+				if (text.empty() || text[0] != '.')
+					return false;
+				text.remove_prefix(1);
+			}
+			unsigned int value = 0;
+			size_t digits = 0;
+			while (digits < text.size() && text[digits] >= '0' && text[digits] <= '9' && digits < 3)
+				value = value * 10 + (unsigned int)(text[digits++] - '0');
+			if (digits == 0 || value > 255)
+				return false;
+			out[part] = (unsigned char)value;
+			text.remove_prefix(digits);
+		}
+		return text.empty();
+	}
+
+	static bool parseipv6(std::string_view text, unsigned char * out)
+	{
+		// Groups before and after "::", which stands for however many zero groups fill the gap
+		unsigned char head[16], tail[16];
+		size_t headLen = 0, tailLen = 0;
+		bool gap = false;
+		if (text.substr(0, 2) == "::")
+		{
+			gap = true;
+			text.remove_prefix(2);
+		}
+		while (!text.empty())
+		{
+			unsigned char * const dest = gap ? tail : head;
+			size_t &len = gap ? tailLen : headLen;
+
+			// Trailing dotted IPv4, as in ::ffff:10.0.0.1
+			const size_t end = text.find(':');
+			if (end == std::string_view::npos && text.find('.') != std::string_view::npos)
+			{
+				if (len + 4 > 16 || !parseipv4(text, dest + len))
+					return false;
+				len += 4;
+				break;
+			}
+
+			unsigned int value = 0;
+			size_t digits = 0;
+			for (; digits < text.size() && digits < 5; ++digits)
+			{
+				const char c = text[digits];
+				const int nibble = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+					c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+				if (nibble < 0)
+					break;
+				value = (value << 4) | (unsigned int)nibble;
+			}
+			if (digits == 0 || digits > 4 || len + 2 > 16)
+				return false;
+			dest[len++] = (unsigned char)(value >> 8);
+			dest[len++] = (unsigned char)value;
+			text.remove_prefix(digits);
+
+			if (text.empty())
+				break;
+			if (text[0] != ':')
+				return false;
+			text.remove_prefix(1);
+			if (!text.empty() && text[0] == ':')
+			{
+				if (gap)
+					return false;
+				gap = true;
+				text.remove_prefix(1);
+			}
+			else if (text.empty())
+				return false;
+		}
+
+		if (gap ? headLen + tailLen > 14 : headLen != 16)
+			return false;
+		std::memset(out, 0, 16);
+		std::memcpy(out, head, headLen);
+		std::memcpy(out + 16 - tailLen, tail, tailLen);
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,149 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#ifndef LacewingInternedName
+#define LacewingInternedName
+
+// Defined in PhiAddress.cc; declared here too so this header doesn't depend on include order
+std::string lw_u8str_simplify(const std::string_view first, bool destructive, bool extralumping);
+
+/// <summary> An immutable client or channel name, refcounted and shared by everything holding the same text.
+/// 		  Interning the same text again returns the same entry, so the simplified form is worked out once
+/// 		  per distinct name, and names with the same simplified form share one simplified entry; comparing
+/// 		  them is a pointer compare. Copying a handle never allocates. </summary>
+class internedname
+{
+	struct entry
+	{
+		std::string text;
+		// Equal simplified forms share one entry; null for names that simplify to empty
+		std::shared_ptr<const entry> simplified;
+	};
+
+	/// <summary> Maps text to its live entry. Entries remove themselves when their last handle goes.
+	/// 		  Names and simplified forms have a table each, as a name's text can be another's simplified form. </summary>
+	class table
+	{
+		std::mutex tableLock;
+		std::unordered_map<std::string_view, std::weak_ptr<const entry>> entries;
+
+		table() = default;
+
+		void release(const entry * e)
+		{
+			{
+				std::lock_guard<std::mutex> tableGuard(tableLock);
+				const auto it = entries.find(e->text);
+				// A newer entry for the same text may have replaced this one already
+				if (it != entries.end() && it->second.expired())
+					entries.erase(it);
+			}
+			delete e;
+		}
+
+	public:
+
+		// Never destroyed, so names released during static destruction still have somewhere to go
+		static table & names()
+		{
+			static table * t = new table();
+			return *t;
+		}
+		static table & simplifiedforms()
+		{
+			static table * t = new table();
+			return *t;
+		}
+
+		std::shared_ptr<const entry> find(std::string_view text)
+		{
+			std::lock_guard<std::mutex> tableGuard(tableLock);
+			const auto it = entries.find(text);
+			return it == entries.end() ? nullptr : it->second.lock();
+		}
+
+		/// <summary> Adds e, unless another thread added the same text first; returns whichever is listed. </summary>
+		std::shared_ptr<const entry> add(std::unique_ptr<entry> e)
+		{
+			std::lock_guard<std::mutex> tableGuard(tableLock);
+			const auto it = entries.find(e->text);
+			if (it != entries.end())
+			{
+				if (auto existing = it->second.lock())
+					return existing;
+				entries.erase(it); // its key views the dying entry's text
+			}
+			std::shared_ptr<const entry> added(e.release(), [this](const entry * d) { release(d); });
+			entries.emplace(added->text, added);
+			return added;
+		}
+	};
+
+	std::shared_ptr<const entry> e;
+
+	explicit internedname(std::shared_ptr<const entry> && ent) : e(std::move(ent)) { }
+
+	static std::shared_ptr<const entry> lookup(std::string_view text, bool isName)
+	{
+		if (text.empty())
+			return nullptr;
+
+		table & t = isName ? table::names() : table::simplifiedforms();
+		if (auto found = t.find(text))
+			return found;
+
+		// Simplify outside the table lock; if two threads race, add() keeps the first and this one is dropped
+		auto made = std::make_unique<entry>();
+		made->text = text;
+		if (isName)
+			made->simplified = lookup(lw_u8str_simplify(text, true, true), false);
+		return t.add(std::move(made));
+	}
+
+public:
+
+	internedname() = default;
+
+	/// <summary> Returns the shared name for text, creating it if no one holds it yet. </summary>
+	static internedname intern(std::string_view text)
+	{
+		return internedname(lookup(text, true));
+	}
+
+	std::string_view view() const { return e ? std::string_view(e->text) : std::string_view(); }
+	operator std::string_view() const { return view(); }
+	const char * c_str() const { return e ? e->text.c_str() : ""; }
+	std::string str() const { return e ? e->text : std::string(); }
+	size_t size() const { return e ? e->text.size() : 0; }
+	bool empty() const { return !e; }
+
+	/// <summary> The simplified form, as from lw_u8str_simplify(). </summary>
+	std::string_view simplified() const { return e && e->simplified ? std::string_view(e->simplified->text) : std::string_view(); }
+
+	/// <summary> True if both simplify to the same text, i.e. would clash as client or channel names. Names that
+	/// 		  simplify to nothing, e.g. only stripped characters, clash with each other. </summary>
+	bool samesimplified(const internedname & other) const
+	{
+		if (!e || !other.e)
+			return false;
+		// Compare the text, not the entries; an empty form has no entry
+		return e->simplified == other.e->simplified || simplified() == other.simplified();
+	}
+
+	/// <summary> True if both are the same text. </summary>
+	bool operator == (const internedname & other) const { return e == other.e; }
+	bool operator != (const internedname & other) const { return e != other.e; }
+};
+
+#endif
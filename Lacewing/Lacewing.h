@@ -93,6 +93,7 @@
 #ifdef __cplusplus
 
 #include <atomic>
+#include <array>
 #include <vector>
 #include <memory>
 #include <string>
@@ -100,6 +101,7 @@
 #include <mutex>
 #include <shared_mutex>
 #include <thread>
+#include <unordered_map>
 #include <cctype>
 #include <cstring>
 
@@ -386,6 +388,7 @@ typedef lw_i8 lw_bool;
 	lw_import		  void  lw_fdstream_set_fd	(lw_fdstream, lw_fd fd, lw_pump_watch watch, lw_bool auto_close, lw_bool is_socket);
 	lw_import		  void  lw_fdstream_cork	(lw_fdstream);
 	lw_import		  void  lw_fdstream_uncork	(lw_fdstream);
+	lw_import		  void  lw_fdstream_read_pause (lw_fdstream, lw_bool paused);
 	lw_import		  void  lw_fdstream_nagle	(lw_fdstream, lw_bool nagle);
 	lw_import	   lw_bool  lw_fdstream_valid	(lw_fdstream);
 	lw_import		  long  lw_fdstream_get_fd_debug (lw_fdstream);
@@ -502,6 +505,8 @@ typedef lw_i8 lw_bool;
 	lw_import	lw_server_client  lw_server_client_next		(lw_server_client);
 	lw_import			  void *  lw_server_tag				(lw_server);
 	lw_import				void  lw_server_set_tag			(lw_server, void *);
+	lw_import				void  lw_server_set_accept_limit(lw_server, long per_second);
+	lw_import				long  lw_server_accept_limit	(lw_server);
 
 	typedef void (lw_callback * lw_server_hook_connect) (lw_server, lw_server_client);
 	lw_import void lw_server_on_connect (lw_server, lw_server_hook_connect);
@@ -526,6 +531,8 @@ typedef lw_i8 lw_bool;
 	lw_import		void  lw_udp_unhost		 (lw_udp);
 	lw_import	 lw_ui16  lw_udp_port		 (lw_udp);
 	lw_import		void  lw_udp_send		 (lw_udp, lw_addr, const char * buffer, size_t size);
+	lw_import		void  lw_udp_send_sockaddr (lw_udp, const struct sockaddr *, size_t addrlen,
+										const char * buffer, size_t size);
 	lw_import	  void *  lw_udp_tag		 (lw_udp);
 	lw_import		void  lw_udp_set_tag	 (lw_udp, void *);
 
@@ -706,6 +713,10 @@ bool lw_u8str_icmp(const std::string_view first, const std::string_view second);
 ///			  Does not ensure strings are normalized; empty strings return true. </summary>
 bool lw_u8str_validate(const std::string_view toValidate);
 
+/// <summary> Returns how many bytes at the start of str are printable ASCII, U+0020 to U+007E.
+///			  Text that's all printable ASCII needs no decoding for validation, normalizing or allow lists. </summary>
+size_t lw_u8str_printableasciirun(const std::string_view str);
+
 /// <summary> Normalizes the passed std::string to its least-bytes equivalent (using NFC), and returns true.
 ///			  Empty = true. Handles invalid UTF-8 strings by returning false. </summary>
 bool lw_u8str_normalize(std::string & input);
@@ -1015,6 +1026,10 @@ struct _fdstream : public _stream
 	lw_import void cork ();
 	lw_import void uncork ();
 
+	/// <summary> Stops reading from the fd until called again with false. Data keeps queueing in the
+	/// 		  OS buffer meanwhile, so a TCP sender is eventually throttled by the window. </summary>
+	lw_import void read_pause (bool paused);
+
 	lw_import void nagle (bool);
 
 };
@@ -1177,6 +1192,11 @@ struct _server
 	lw_import size_t num_clients ();
 	lw_import server_client client_first ();
 
+	/// <summary> Caps new connections accepted per second; 0 for no cap. Connections over the cap
+	/// 		  wait in the kernel backlog rather than being accepted and dropped. </summary>
+	lw_import void accept_limit (long per_second);
+	lw_import long accept_limit ();
+
 	typedef void (lw_callback * hook_connect) (server, server_client);
 	typedef void (lw_callback * hook_disconnect) (server, server_client);
 
@@ -1211,6 +1231,67 @@ struct _server_client : public _fdstream
 };
 
 
+/** udpendpoint **/
+
+/// <summary> A UDP peer address held by value in sockaddr_storage-sized space, with no heap parts, so it can
+/// 		  sit inline in the object it belongs to. Holds an IPv4 or IPv6 sockaddr, zero-padded, so it
+/// 		  compares by whole words rather than by family. </summary>
+struct udpendpoint
+{
+	alignas(8) lw_ui64 words[16] = { };
+
+	udpendpoint() = default;
+	lw_import udpendpoint(address);
+
+	/// <summary> Replaces the held address; families other than IPv4 and IPv6 leave it empty. </summary>
+	lw_import void set(const struct sockaddr *);
+	lw_import void set(address);
+
+	lw_import lw_ui16 port() const;
+	lw_import void port(lw_ui16);
+
+	inline bool ipv6() const
+	{
+		return ((const struct sockaddr *)words)->sa_family == AF_INET6;
+	}
+
+	inline const struct sockaddr * get() const
+	{
+		return (const struct sockaddr *)words;
+	}
+	lw_import size_t length() const;
+
+	/// <summary> True if both hold the same IP, ignoring port. </summary>
+	inline bool sameip(const udpendpoint & other) const
+	{
+		// Bytes 0-1 are family, 2-3 port, 4-7 the IPv4 address or IPv6 flow info, 8-23 the IPv6 address
+		// (zero for IPv4). Flow info doesn't identify the peer, so it's masked off rather than branched on.
+		lw_ui16 family, otherFamily;
+		lw_ui32 second, otherSecond;
+		std::memcpy(&family, words, sizeof(family));
+		std::memcpy(&otherFamily, other.words, sizeof(otherFamily));
+		std::memcpy(&second, (const char *)words + 4, sizeof(second));
+		std::memcpy(&otherSecond, (const char *)other.words + 4, sizeof(otherSecond));
+		const lw_ui32 secondMask = ipv6() ? 0 : 0xFFFFFFFF;
+		return ((lw_ui64)(family ^ otherFamily) | ((second ^ otherSecond) & secondMask) |
+			(words[1] ^ other.words[1]) | (words[2] ^ other.words[2])) == 0;
+	}
+
+	/// <summary> True if both hold the same IP and port. </summary>
+	inline bool operator == (const udpendpoint & other) const
+	{
+		lw_ui16 port, otherPort;
+		std::memcpy(&port, (const char *)words + 2, sizeof(port));
+		std::memcpy(&otherPort, (const char *)other.words + 2, sizeof(otherPort));
+		return port == otherPort && sameip(other);
+	}
+	inline bool operator != (const udpendpoint & other) const
+	{
+		return !(*this == other);
+	}
+};
+
+
 /** udp **/
 
 typedef struct _udp * udp;
@@ -1229,6 +1310,7 @@ struct _udp
 	lw_import lw_ui16 port ();
 
 	lw_import void send (address, const char * data, size_t size = -1);
+	lw_import void send (const udpendpoint &, const char * data, size_t size = -1);
 
 	typedef void (lw_callback * hook_data)
 		(udp, address, char * buffer, size_t size);
@@ -1537,6 +1619,50 @@ lw_import void flashpolicy_delete (flashpolicy);
 // Make sure you also add UDP keep-alive. Routers close connection otherwise.
 // Make sure you also fix the timer issue in unix.
 
+// Lock implementation used by readwritelock, chosen at compile time; must match across the whole build.
+// NONE: no synchronisation at all, only for builds where every relay call runs on the one pump thread.
+// SPIN: a compact reader-writer spinlock, for short critical sections when threads are in play.
+// CHECKED: std::shared_timed_mutex with per-thread holder tracking; the original implementation.
+#define LW_RWLOCK_POLICY_NONE 0
+#define LW_RWLOCK_POLICY_SPIN 1
+#define LW_RWLOCK_POLICY_CHECKED 2
+#ifndef LW_RWLOCK_POLICY
+	#define LW_RWLOCK_POLICY LW_RWLOCK_POLICY_CHECKED
+#endif
+
+#ifdef LW_RWLOCK_PROFILE
+// The hooks are in the non-_DEBUG lock paths of the SPIN and CHECKED policies; anywhere else every profile would be empty.
+// The Linux Release builds use NONE, so profile with e.g. LW_RWLOCK_PROFILE;LW_RWLOCK_POLICY=LW_RWLOCK_POLICY_SPIN.
+#if LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_NONE
+	#error LW_RWLOCK_PROFILE needs LW_RWLOCK_POLICY_SPIN or LW_RWLOCK_POLICY_CHECKED; the NONE policy never waits, so has nothing to sample.
+#elif defined(_DEBUG)
+	#error LW_RWLOCK_PROFILE needs a build without _DEBUG; debug builds take the lock checking paths, which are not profiled.
+#endif
+/// <summary> Samples how long readwritelock acquisitions wait, and how long they're then held, per call site.
+/// 		  Built in by defining LW_RWLOCK_PROFILE, and off until setsampling() is called. Each thread records
+/// 		  into its own histograms, so sampling takes no lock shared with other threads. </summary>
+namespace lockprofiler
+{
+	// Where a lock was created; string literals, so they outlive the lock
+	struct site
+	{
+		const char * file;
+		const char * func;
+		int line;
+	};
+	/// <summary> Samples one in everyN acquisitions on each thread; 0 stops sampling. </summary>
+	void setsampling(unsigned int everyN);
+	/// <summary> Sampled wait and hold times per site, as a table, most total waiting first. </summary>
+	std::string report();
+	/// <summary> The same as Prometheus summaries, for relayserver::metricstext(). </summary>
+	std::string prometheustext();
+
+	// Internal use only: one site's histograms on one thread
+	struct siteprofile;
+}
+#define lw_rwlock_profileSiteDefs lacewing::lockprofiler::site { __FILE__, __FUNCTION__, __LINE__ }
+#endif
+
 struct readlock;
 struct writelock;
 struct readwritelock
@@ -1575,6 +1701,12 @@ protected:
 	void downgradeWriteLock(writelock &wl, readlock &rl, lw_rwlock_debugParamNames);
 
 #else
+#ifdef LW_RWLOCK_PROFILE
+	[[nodiscard]]
+	lacewing::readlock createReadLock(const lockprofiler::site &site);
+	[[nodiscard]]
+	lacewing::writelock createWriteLock(const lockprofiler::site &site);
+#endif
 	lacewing::readlock createReadLock();
 	lacewing::writelock createWriteLock();
 #endif
@@ -1591,6 +1723,7 @@ protected:
 
 private:
 
+#if LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_CHECKED
 	// Would use std::shared_mutex, or std::shared_timed_mutex, but iOS doesn't support it until 10.0,
 	// so we'll roll our own.
 	std::shared_timed_mutex lock;
@@ -1608,6 +1741,15 @@ private:
 		std::thread::id threadID;
 	};
 	std::vector<holder> holders;
+#elif LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_SPIN
+	// 0 if free, -1 if write-locked, otherwise number of readers.
+	::std::atomic<lw_i32> state;
+	// Writers waiting; new readers hold off while this is non-zero, so writers aren't starved.
+	::std::atomic<lw_i32> write_waiters;
+#else
+	// Only used for the checkHolds sanity checks; there's no other thread to race with.
+	size_t readers, writers;
+#endif
 };
 struct readlock {
 	friend readwritelock;
@@ -1629,6 +1771,9 @@ struct readlock {
 
 #else // !_DEBUG
 	readlock(readwritelock &lock);
+#ifdef LW_RWLOCK_PROFILE
+	readlock(readwritelock &lock, const lockprofiler::site &site);
+#endif
 	void unlock();
 	void relock();
 #ifdef LW_ESCALATION
@@ -1641,8 +1786,16 @@ struct readlock {
 	readlock(readlock&) = delete;
 protected:
 	readwritelock & lock;
+#if LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_CHECKED
 	std::shared_lock<decltype(readwritelock::lock)> locker;
+#endif
 	bool locked = true;
+#ifdef LW_RWLOCK_PROFILE
+	// Where this was created, and while a sampled acquisition is held, its site's histograms and when it was acquired
+	lockprofiler::site profileSite = { "<unknown>", "<unknown>", 0 };
+	lockprofiler::siteprofile * profileEntry = nullptr;
+	lw_ui64 profileHeldSinceNS = 0;
+#endif
 };
 
 struct writelock {
@@ -1660,6 +1813,9 @@ struct writelock {
 #endif // LW_ESCALATION
 #else // !_DEBUG
 	writelock(readwritelock &lock);
+#ifdef LW_RWLOCK_PROFILE
+	writelock(readwritelock &lock, const lockprofiler::site &site);
+#endif
 	void unlock();
 	void relock();
 #if LW_ESCALATION
@@ -1671,8 +1827,15 @@ struct writelock {
 	writelock(writelock&) = delete;
 protected:
 	readwritelock & lock;
+#if LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_CHECKED
 	std::unique_lock<decltype(readwritelock::lock)> locker;
+#endif
 	bool locked = true;
+#ifdef LW_RWLOCK_PROFILE
+	lockprofiler::site profileSite = { "<unknown>", "<unknown>", 0 };
+	lockprofiler::siteprofile * profileEntry = nullptr;
+	lw_ui64 profileHeldSinceNS = 0;
+#endif
 };
 
 #ifdef _DEBUG
@@ -1685,6 +1848,10 @@ protected:
 #define lw_upgrade_to(x) upgrade(lw_rwlock_debugParamDefs, x)
 #define lw_downgrade_to(x) downgrade(lw_rwlock_debugParamDefs, x)
 #else
+#ifdef LW_RWLOCK_PROFILE
+#define createReadLock() createReadLock(lw_rwlock_profileSiteDefs)
+#define createWriteLock() createWriteLock(lw_rwlock_profileSiteDefs)
+#endif
 #define lw_unlock() unlock()
 #define lw_relock() relock()
 #define lw_upgrade() upgrade()
@@ -1904,6 +2071,9 @@ public:
 } // ~namespace lacewing
 #include "FrameReader.h"
 #include "MessageReader.h"
+#include "InternedName.h"
+#include "RelayMetrics.h"
+#include "TokenBucket.h"
 namespace lacewing {
 
 // List of code points, code point ranges, and categories, tied to utf8proc.
@@ -1916,10 +2086,25 @@ struct codepointsallowlist {
 	std::vector<std::int32_t> specificCodePoints;
 	std::vector<std::pair<std::int32_t, std::int32_t>> codePointRanges;
 
+	// The three lists above, compiled by setcodepointsallowedlist() so checking a code point is one table probe.
+	// ASCII is a 128-bit bitmap; the rest of Unicode is cut into blocks of 256 code points, each block indexing
+	// a 256-bit bitmap in blockBitmaps. Blocks with identical bitmaps, e.g. all denied, share one.
+	std::uint64_t asciiAllowed[2] = { 0, 0 };
+	// U+0020 to U+007E are all allowed, so runs of them can be accepted in bulk
+	bool printableASCIIAllowed = false;
+	std::vector<std::uint16_t> blockBitmapIndex;
+	std::vector<std::array<std::uint64_t, 4>> blockBitmaps;
+
 	// Updates the allowlisted Unicode code points in this struct, returns error or blank
 	std::string setcodepointsallowedlist(std::string codePointList);
 	// -1 if the string passed matches the allow list, otherwise index of failure.
 	int checkcodepointsallowed(const std::string_view toTest, int * const rejectedUTF32CodePoint = NULL) const;
+
+private:
+	// Rebuilds the tables from the lists
+	void compile();
+	// Checks a code point against the lists themselves; used by compile()
+	bool matcheslists(std::int32_t codePoint) const;
 };
 struct relayserverinternal;
 struct relayserver
@@ -1943,17 +2128,95 @@ struct relayserver
 	void unhost();
 	// This works with clients of regular server, so you should use this instead of websocket->unhost/unhost_secure
 	void unhost_websocket(bool insecure, bool secure);
+	/// <summary> Serves metricstext() over HTTP on the given port, at /metrics, for Prometheus to scrape.
+	/// 		  A scrape reads the metrics registry only, and never takes a relay lock.
+	/// 		  Returns false if the port couldn't be hosted; the reason goes to the error handler. </summary>
+	bool host_metrics(lw_ui16 port = 9100);
+	void unhost_metrics();
+	/// <summary> Message, byte and connection counters, gauges and latency histograms, in Prometheus text format.
+	/// 		  Builds with LW_RWLOCK_PROFILE also get the lock profiler's wait and hold times. </summary>
+	std::string metricstext() const;
 
 	bool hosting();
 	lw_ui16 port();
 
 	void setchannellisting(bool enabled);
+	/// <summary> Channel messages to channels with at least threshold clients are written by workerCount
+	/// 		  extra threads as well as the sending thread. 0 for either disables this; it's off by default.
+	/// 		  Safe with any LW_RWLOCK_POLICY; the workers share a mutex of their own for UDP sends. </summary>
+	void setparallelfanout(size_t threshold, size_t workerCount);
+
+	/// <summary> What happens when a client's outgoing queue passes the setqueuedbytelimit() cap. </summary>
+	enum class queuelimitpolicy
+	{
+		// Disconnect the slow client
+		disconnect,
+		// Drop newly relayed blasted messages to the slow client until it catches up. Those already queued
+		// still go, as the queue can't be edited once written; sent messages still queue
+		dropnewblasted,
+		// Stop reading from clients relaying to the slow client until it's down to half the cap
+		pausesender
+	};
+	/// <summary> Caps how many bytes may be queued to each client before policy applies. 0 for no cap, the default.
+	/// 		  Applies to channel and peer messages relayed between clients. </summary>
+	void setqueuedbytelimit(size_t maxBytes, queuelimitpolicy policy);
+
+	/// <summary> What happens to a message received from a client over a setratelimit() limit. In order of severity. </summary>
+	enum class ratelimitpolicy
+	{
+		// Handle the message, but stop reading from the client until it's back under the limit.
+		// UDP messages can't be held back, so are dropped instead
+		delayreads,
+		// Drop the message; the client stays connected
+		drop,
+		// Disconnect the client
+		disconnect
+	};
+	/// <summary> What a setratelimit() limit counts messages over. </summary>
+	enum class ratelimitscope
+	{
+		// Each client
+		client,
+		// All clients from one IP, together
+		ip,
+		// Each client's messages of one message type ID
+		clientmessagetype
+	};
+	struct ratelimit
+	{
+		// Sustained rates; 0 for no limit
+		double messagesPerSecond = 0, bytesPerSecond = 0;
+		// Bursts of up to this many seconds' worth of the rates pass at once
+		double burstSeconds = 1;
+		ratelimitpolicy policy = ratelimitpolicy::drop;
+	};
+	/// <summary> Token bucket limits on messages received, checked before they're handled. Client and IP limits
+	/// 		  count server, channel and peer messages; messageType is a message type ID, 0 to 15, for
+	/// 		  ratelimitscope::clientmessagetype only. A message over several limits gets the most severe policy.
+	/// 		  Ping replies and messages before connect approval are never limited. No limits by default. </summary>
+	void setratelimit(ratelimitscope scope, const ratelimit &limit, lw_ui8 messageType = 0);
+	// Internal use only: buckets for one ratelimit
+	struct ratebuckets
+	{
+		tokenbucket messages, bytes;
+		ratelimitpolicy policy = ratelimitpolicy::drop;
+	};
+	// Internal use only: ratebuckets shared by the clients from one IP
+	struct ipratebuckets;
+	/// <summary> Clients that haven't sent a channel, peer or server message for idleMS have their buffers
+	/// 		  released by the ping timer. 0 disables this; default is 60 seconds. </summary>
+	void setidlecompaction(long idleMS);
+	/// <summary> Releases buffers of clients idle for idleMS or more now, rather than waiting for the ping timer.
+	/// 		  Call from the pump thread. </summary>
+	void compactclients(long idleMS = 0);
+	/// <summary> Sum of client::memoryused() over all clients. </summary>
+	size_t clientmemoryused() const;
 	void setwelcomemessage(std::string_view message);
 	std::string getwelcomemessage();
 
 	struct client;
 
-	struct channel
+	struct channel : public std::enable_shared_from_this<channel>
 	{
 		friend relayserverinternal;
 		friend relayserver;
@@ -1963,11 +2226,14 @@ struct relayserver
 
 		lw_ui16 id();
 
+		/// <summary> Gets an owning pointer to this channel, to keep it past a borrowed-reference handler. </summary>
+		std::shared_ptr<channel> retain() { return shared_from_this(); }
+
 		std::shared_ptr<client> channelmaster() const;
 
-		/// <summary> Reads a copy of the channel name. Automatically read-locks the channel. </summary>
-		std::string name() const;
-		/// <summary> Reads a simplified copy of the channel name. Automatically read-locks the channel. </summary>
+		/// <summary> Reads the channel name; a shared handle, not a copy. Automatically read-locks the channel. </summary>
+		internedname name() const;
+		/// <summary> Reads the simplified channel name. Automatically read-locks the channel. </summary>
 		std::string nameSimplified() const;
 		/// <summary> Sets the channel name. </summary>
 		void name(std::string_view str);
@@ -2010,7 +2276,7 @@ struct relayserver
 
 		std::vector<std::shared_ptr<relayserver::client>> clients;
 
-		std::string _name, _namesimplified;
+		internedname _name;
 		lw_ui16 _id = 0xFFFF;
 		bool _hidden = true;
 		bool _autoclose = false;
@@ -2019,23 +2285,49 @@ struct relayserver
 
 		std::shared_ptr<client> readpeer(messagereader &r);
 
-		void PeerToChannel(relayserver &server_, std::shared_ptr<relayserver::client> client,
+		void PeerToChannel(relayserver &server_, relayserver::client &client,
 			bool blasted, lw_ui8 subchannel, lw_ui8 variant, std::string_view message);
 	};
 
+	/// <summary> An immutable copy of a server list, made on each call, so O(n). Iterating it needs no lock, and
+	/// 		  entries removed from the server after it was taken stay alive until it's dropped. Check readonly()
+	/// 		  if that matters. </summary>
+	template<class T>
+	using listsnapshot = std::shared_ptr<const std::vector<std::shared_ptr<T>>>;
+
 	size_t channelcount() const;
-	std::vector<std::shared_ptr<lacewing::relayserver::client>> & getclients();
-	std::vector<std::shared_ptr<lacewing::relayserver::channel>> & getchannels();
+	listsnapshot<lacewing::relayserver::client> getclients() const;
+	listsnapshot<lacewing::relayserver::channel> getchannels() const;
 	void channel_addclient(std::shared_ptr<relayserver::channel> channel, std::shared_ptr<relayserver::client> client);
 	void channel_removeclient(std::shared_ptr<relayserver::channel> channel, std::shared_ptr<relayserver::client> client);
 
+	/// <summary> A client's traffic, as message body sizes excluding frame headers. Index 0 is TCP and 1 is UDP, as the
+	/// 		  message handlers' blasted flag; blasts to or from clients without UDP go over their TCP or WebSocket
+	/// 		  connection, but count as UDP. </summary>
+	struct clientstats
+	{
+		struct counts
+		{
+			lw_ui64 messages = 0, bytes = 0;
+		};
+		// Received is every message the client sent. Sent is server, channel and peer messages written to the client,
+		// not responses, pings or other protocol messages.
+		counts received[2], sent[2];
+		// As above, for the last whole second only
+		counts receivedLastSecond[2], sentLastSecond[2];
+		// As above, for the current second so far
+		counts receivedThisSecond[2], sentThisSecond[2];
+	};
 
-	struct client
+	struct client : public std::enable_shared_from_this<client>
 	{
 		friend relayserverinternal;
 		friend relayserver;
 		friend relayserver::channel;
 
+		/// <summary> Gets an owning pointer to this client, to keep it past a borrowed-reference handler. </summary>
+		std::shared_ptr<client> retain() { return shared_from_this(); }
+
 		enum class clientimpl
 		{
 			// Can be Relay or old versions of Blue
@@ -2056,6 +2348,9 @@ struct relayserver
 		mutable lacewing::readwritelock lock;
 
 		void * tag = nullptr;
+		// Server messages the host refused, e.g. of a type it doesn't handle; kept by the host, not the server.
+		// Atomic, as TCP and UDP messages can be handled at once.
+		std::atomic<lw_ui32> wastedservermessages = 0;
 
 		lw_ui16 id();
 
@@ -2070,7 +2365,8 @@ struct relayserver
 		void send(lw_ui8 subchannel, std::string_view data, lw_ui8 variant = 0);
 		void blast(lw_ui8 subchannel, std::string_view data, lw_ui8 variant = 0);
 
-		std::string name() const;
+		/// <summary> Reads the client name; a shared handle, not a copy. Automatically read-locks the client. </summary>
+		internedname name() const;
 		std::string nameSimplified() const;
 		void name(std::string_view);
 
@@ -2080,6 +2376,13 @@ struct relayserver
 
 		bool readonly() const;
 		bool istrusted() const;
+		// Bytes waiting to be sent to this client
+		size_t queuedbytes() const;
+		// Approximate bytes held for this client: the object, its buffers and strings, and queued data
+		size_t memoryused() const;
+		/// <summary> Traffic since connecting, in the last second and in this one. O(1) and takes no lock, so counts being
+		/// 		  updated meanwhile on other threads may read a moment stale. </summary>
+		clientstats stats() const;
 
 		// Internal use only!
 		client(relayserverinternal &server, lacewing::server_client socket) noexcept;
@@ -2096,9 +2399,10 @@ struct relayserver
 		::std::chrono::steady_clock::time_point lasttcpmessagetime;
 		::std::chrono::steady_clock::time_point lastudpmessagetime; // UDP problem where unused connections are dropped by router, so must keep these separate
 		::std::chrono::steady_clock::time_point lastchannelorpeermessagetime; // For clients that go idle
+		::std::chrono::steady_clock::time_point compactedat; // lastchannelorpeermessagetime when last compacted
 		framereader reader;
 		std::vector<std::shared_ptr<channel>> channels;
-		std::string _name, _namesimplified, _prevname;
+		internedname _name, _prevname;
 		// Indicates if this socket has closed, or is expected to close.
 		std::atomic<bool> _readonly = false;
 
@@ -2107,6 +2411,9 @@ struct relayserver
 		std::string clientImplStr;
 
 		bool pseudoUDP = true; // Is UDP not supported (e.g. HTML5, UWP JS) so "faked" by receiver
+		// For pseudoUDP clients, blasted frames held back while socket is backed up, keyed by
+		// relayserverinternal::conflationkey(). A newer frame replaces an unsent older one. Guarded by lock.
+		std::unordered_map<lw_ui64, std::string> conflated;
 
 		// Got opening null byte, indicating not a HTTP client.
 		bool gotfirstbyte = false;
@@ -2118,12 +2425,42 @@ struct relayserver
 		// Has a TCP ping request been sent by server, and was replied to.
 		// If false, next ping timer tick will consider a failed ping and kick the client, so it is true by default.
 		bool pongedOnTCP = true;
+		// When the outstanding TCP ping was sent, for the ping round trip time metric
+		::std::chrono::steady_clock::time_point pingsentat;
+
+		// Traffic in one direction, counted per second as well as in total. Writers may overlap, e.g. a client's
+		// TCP and UDP messages handled at once, so counts are relaxed atomic adds; stats() reads them without a lock.
+		class trafficcounter
+		{
+			// [UDP][0 = messages, 1 = bytes]
+			std::atomic<lw_ui64> total[2][2] = { };
+			// Counts for windowSecond, and for the second before it
+			std::atomic<lw_ui64> window[2][2] = { }, previous[2][2] = { };
+			std::atomic<lw_ui64> windowSecond = 0;
+		public:
+			// Current second on the steady clock; take it once for many add() calls
+			static lw_ui64 nowsecond();
+			void add(bool udp, size_t messages, size_t bytesEach, lw_ui64 second);
+			void read(clientstats::counts (&totals)[2], clientstats::counts (&lastSecond)[2],
+				clientstats::counts (&thisSecond)[2], lw_ui64 second) const;
+		};
+		trafficcounter receivedtraffic, senttraffic;
 
-		lacewing::address udpaddress;
+		// setratelimit() buckets, set up again when the server's limits change; guarded by ratelimitlock, as a client's
+		// TCP and UDP messages may be handled at once. typeratebuckets has 16, and is only made if a type is limited.
+		mutable std::mutex ratelimitlock;
+		unsigned int ratelimitgeneration = 0;
+		ratebuckets clientratebuckets;
+		std::unique_ptr<ratebuckets[]> typeratebuckets;
+		std::shared_ptr<ipratebuckets> ipbuckets;
+
+		// Where UDP messages to this client go. The IP is the TCP connection's; the port is taken from
+		// the latest UDP message that passed validation.
+		lacewing::udpendpoint udpaddress;
 
 		lw_ui16 _id = 0xFFFF;
 
-		void PeerToPeer(relayserver &server, std::shared_ptr<relayserver::channel> viachannel, std::shared_ptr<relayserver::client> receivingclient,
+		void PeerToPeer(relayserver &server, relayserver::channel &viachannel, relayserver::client &receivingclient,
 			bool blasted, lw_ui8 subchannel, lw_ui8 variant, std::string_view message);
 
 		// Checks if name can be set to given name, by this client.
@@ -2150,9 +2487,52 @@ struct relayserver
 	// handles UDP?
 	mutable lacewing::readwritelock lock_udp;
 
+	/// <summary> Errors raised per message, which bad traffic can raise in bulk; see seterrorratelimit(). </summary>
+	enum class errorkind : lw_ui8
+	{
+		// A text message held a code point outside the allow list, and was dropped
+		ServerMessageCodePoint,
+		ChannelMessageCodePoint,
+		PeerMessageCodePoint,
+		// Client sent a peer message to itself
+		PeerToSelf,
+		// A message couldn't be read or wasn't allowed; detail says why
+		MalformedMessage,
+		// A message was over a setratelimit() limit; detail says which
+		RateLimited,
+		Count
+	};
+
+	/// <summary> One per-message error, as fields rather than text. Text is only made by tostring(), so an
+	/// 		  onerrorevent() handler that only counts or filters never formats or allocates. </summary>
+	struct errorevent
+	{
+		errorkind kind = errorkind::MalformedMessage;
+		lw_ui16 clientID = 0xFFFF;
+		// Channel or peer the message was for, if any
+		lw_ui16 targetID = 0xFFFF;
+		internedname clientName, targetName;
+		// Rejected code point, for the *CodePoint kinds
+		int codePoint = -1;
+		// Start of the dropped message, the reason for MalformedMessage, or the limit's scope for RateLimited.
+		// Only valid during the handler.
+		std::string_view detail;
+		// MalformedMessage, RateLimited: the client was booted for it
+		bool clientBooted = false;
+		// RateLimited: type ID of the message
+		int messageType = -1;
+		// Errors of this kind not raised since the last one that was, due to seterrorratelimit()
+		size_t suppressed = 0;
+
+		/// <summary> Formats the event as the matching lacewing::error would read. </summary>
+		std::string tostring() const;
+	};
+
 	typedef void(*handler_connect)		(lacewing::relayserver &server, std::shared_ptr<lacewing::relayserver::client> client);
 	typedef void(*handler_disconnect)	(lacewing::relayserver &server, std::shared_ptr<lacewing::relayserver::client> client);
 	typedef void(*handler_error)		(lacewing::relayserver &server, lacewing::error);
+	// Gets errorkind errors instead of handler_error, when set
+	typedef void(*handler_errorevent)	(lacewing::relayserver &server, const errorevent &);
 
 	typedef void(*handler_message_server)
 		(lacewing::relayserver &server, std::shared_ptr<lacewing::relayserver::client> client, bool blasted, lw_ui8 subchannel,
@@ -2167,6 +2547,21 @@ struct relayserver
 			std::shared_ptr<lacewing::relayserver::client> targetclient, bool blasted,
 			lw_ui8 subchannel, std::string_view data, lw_ui8 variant);
 
+	// Borrowed-reference message handlers. These skip the refcount traffic of the shared_ptr forms above;
+	// the client and channel are only guaranteed alive until the handler returns, so call retain() to keep them.
+	typedef void(*handler_message_server_ref)
+		(lacewing::relayserver &server, lacewing::relayserver::client &client, bool blasted, lw_ui8 subchannel,
+			std::string_view data, lw_ui8 variant);
+
+	typedef void(*handler_message_channel_ref)
+		(lacewing::relayserver &server, lacewing::relayserver::client &client, lacewing::relayserver::channel &channel,
+			bool blasted, lw_ui8 subchannel, std::string_view data, lw_ui8 variant);
+
+	typedef void(*handler_message_peer_ref)
+		(lacewing::relayserver &server, lacewing::relayserver::client &client, lacewing::relayserver::channel &channel,
+			lacewing::relayserver::client &targetclient, bool blasted,
+			lw_ui8 subchannel, std::string_view data, lw_ui8 variant);
+
 	typedef void(*handler_channel_join)
 		(lacewing::relayserver &server, std::shared_ptr<lacewing::relayserver::client> client, std::shared_ptr<lacewing::relayserver::channel> channel,
 			bool hidden, bool autoclose);
@@ -2182,6 +2577,31 @@ struct relayserver
 
 	// Plain MS value. Note that 0 or negatives are not usable values.
 	void setinactivitytimer(long milliSeconds);
+	/// <summary> Caps connections from one IP: in total, and those not yet approved. Excess are dropped without
+	/// 		  a connect handler call. Defaults are 5 and 2; raise them to load test from one machine. </summary>
+	void setmaxconnectionsperip(size_t total, size_t pending);
+	/// <summary> Caps new Relay TCP connections accepted per second, across all IPs; 0, the default, for no cap.
+	/// 		  Connections over it wait in the OS listen backlog until the next second. </summary>
+	void setacceptlimit(long perSecond);
+	/// <summary> Refuses connections from an IP, or a CIDR range such as "10.0.0.0/8" or "2001:db8::/32", as they're
+	/// 		  accepted, before a client is made for them; they're closed with nothing written, so reason is
+	/// 		  only for isipbanned(). Lasts for duration, or until unbanip() if it's 0.
+	/// 		  Banning the same IP or range again replaces its reason and duration. False if address can't be read. </summary>
+	bool banip(std::string_view address, std::string_view reason, std::chrono::seconds duration);
+	/// <summary> As above, for the range of address's first prefixBits bits; IPv4 addresses are IPv4-mapped, so
+	/// 		  use 128 for one IP. </summary>
+	void banip(const in6_addr &address, lw_ui8 prefixBits, std::string_view reason, std::chrono::seconds duration);
+	/// <summary> Lifts a banip() ban on exactly this IP or range. False if there wasn't one. </summary>
+	bool unbanip(std::string_view address);
+	/// <summary> True if address is banned, by itself or in a range; sets reason if it's not null. </summary>
+	bool isipbanned(const in6_addr &address, std::string * reason = nullptr) const;
+	size_t ipbancount() const;
+
+	/// <summary> Raises at most perSecond errors of this kind a second; the rest are counted and reported in the
+	/// 		  next raised one's errorevent::suppressed. 0 for no limit. Default is 20 a second for each kind. </summary>
+	void seterrorratelimit(errorkind kind, unsigned int perSecond);
+	/// <summary> Total errors of this kind suppressed by the rate limit so far. </summary>
+	size_t errorssuppressed(errorkind kind) const;
 
 	// Used in setcodepointsallowedlist() only.
 	enum class codepointsallowlistindex : int {
@@ -2203,9 +2623,14 @@ struct relayserver
 	void onconnect(handler_connect);
 	void ondisconnect(handler_disconnect);
 	void onerror(handler_error);
+	void onerrorevent(handler_errorevent);
 	void onmessage_server(handler_message_server);
 	void onmessage_channel(handler_message_channel);
 	void onmessage_peer(handler_message_peer);
+	// Setting the _ref form of a message handler clears the shared_ptr form, and vice versa
+	void onmessage_server_ref(handler_message_server_ref);
+	void onmessage_channel_ref(handler_message_channel_ref);
+	void onmessage_peer_ref(handler_message_peer_ref);
 	void onchannel_join(handler_channel_join);
 	void onchannel_leave(handler_channel_leave);
 	void onchannel_close(handler_channel_close);
@@ -2221,6 +2646,13 @@ struct relayserver
 	void clientmessage_permit(std::shared_ptr<lacewing::relayserver::client> sendingclient, std::shared_ptr<lacewing::relayserver::channel> channel,
 		std::shared_ptr<lacewing::relayserver::client> receivingclient,
 		bool blasted, lw_ui8 subchannel, std::string_view data, lw_ui8 variant, bool accept);
+	// Borrowed-reference permits, for the *_ref handlers. Must be called before the handler returns,
+	// unless you retain()ed the client and channel.
+	void channelmessage_permit(lacewing::relayserver::client &sendingclient, lacewing::relayserver::channel &channel,
+		bool blasted, lw_ui8 subchannel, std::string_view data, lw_ui8 variant, bool accept);
+	void clientmessage_permit(lacewing::relayserver::client &sendingclient, lacewing::relayserver::channel &channel,
+		lacewing::relayserver::client &receivingclient,
+		bool blasted, lw_ui8 subchannel, std::string_view data, lw_ui8 variant, bool accept);
 	// The ability to prevent a client from leaving a channel seems pointless; they can always pull the plug.
 	void leavechannel_response(std::shared_ptr<lacewing::relayserver::channel> channel,
 		std::shared_ptr<lacewing::relayserver::client> client, std::string_view denyReason);
@@ -118,6 +118,22 @@ public:
 		size = 0;
 	}
 
+	// Frees the buffer if it's empty, giving back what a past large message grew it to
+	void shrink()
+	{
+		if (size != 0)
+			return;
+
+		free(buffer);
+		buffer = nullptr;
+		allocated = 0;
+	}
+
+	size_t capacity() const
+	{
+		return allocated;
+	}
+
 	void send(lacewing::client socket, int offset = 0)
 	{
 		socket->write(buffer + offset, size - offset);
@@ -133,6 +149,11 @@ public:
 		udp->send(address, buffer + offset, size - offset);
 	}
 
+	void send(lacewing::udp udp, const lacewing::udpendpoint & endpoint, int offset = 0)
+	{
+		udp->send(endpoint, buffer + offset, size - offset);
+	}
+
 };
 template<> inline
 void messagebuilder::add(std::string value)
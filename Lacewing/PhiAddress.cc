@@ -8,6 +8,7 @@
 */
 
 #include "Lacewing.h"
+#include <list>
 
 // Comments for all the below functions can be found in the header file.
 // IntelliSense should display them anyway.
@@ -74,11 +75,134 @@ bool lw_u8str_icmp(const std::string_view first, const std::string_view second)
 	return lw_u8str_simplify(first, false, false) == lw_u8str_simplify(second, false, false);
 }
 
+/// <summary> True if the string is already NFC and NFKC, with nothing for the control code, newline or
+/// 		  unassigned options to change, so utf8proc_map() would return it as-is. Conservative: it may
+/// 		  say false for text that is in fact unchanged, e.g. precomposed letters like U+00E9. </summary>
+static bool lw_u8str_nfcquickcheck(const std::string_view str)
+{
+	const utf8proc_uint8_t * cur = (const utf8proc_uint8_t *)str.data();
+	utf8proc_ssize_t remainder = str.size();
+	utf8proc_int32_t thisChar;
+	while (remainder > 0)
+	{
+		if (*cur >= 0x20 && *cur <= 0x7E)
+		{
+			++cur;
+			--remainder;
+			continue;
+		}
+		const utf8proc_ssize_t numBytesInCodePoint = utf8proc_iterate(cur, remainder, &thisChar);
+		if (numBytesInCodePoint <= 0 || thisChar < 0x80)
+			return false;
+
+		const utf8proc_property_t * const prop = utf8proc_get_property(thisChar);
+		// Unassigned, control, surrogate, line and paragraph separators: for REJECTNA, STRIPCC, NLF2LS
+		if (prop->category == UTF8PROC_CATEGORY_CN || prop->category == UTF8PROC_CATEGORY_CC ||
+			prop->category == UTF8PROC_CATEGORY_CS || prop->category == UTF8PROC_CATEGORY_ZL ||
+			prop->category == UTF8PROC_CATEGORY_ZP)
+		{
+			return false;
+		}
+		// Combining marks may reorder or compose; decomposable code points may change under NFC or NFKC;
+		// code points that can be second in a composed pair may merge with the one before;
+		// Hangul jamo are composed algorithmically
+		if (prop->combining_class != 0 || prop->decomp_seqindex != UINT16_MAX ||
+			(prop->comb_index != UINT16_MAX && prop->comb_index >= 0x8000) ||
+			(thisChar >= 0x1100 && thisChar <= 0x11FF))
+		{
+			return false;
+		}
+		cur += numBytesInCodePoint;
+		remainder -= numBytesInCodePoint;
+	}
+	return true;
+}
+
+/// <summary> Recent lw_u8str_simplify() results for text that needed utf8proc, most recent first.
+/// 		  Names that miss the internedname table, such as a popular channel between its closing and
+/// 		  reopening, or clients rejoining with the same name, are then a hash lookup. </summary>
+class lw_u8str_simplifycache
+{
+	static constexpr size_t capacity = 256;
+	struct entry
+	{
+		std::string text, result;
+	};
+	std::mutex cacheLock;
+	std::list<entry> recent;
+	// Keys view the text in recent's entries, which don't move
+	std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+
+	lw_u8str_simplifycache() = default;
+
+public:
+
+	// One per destructive/extralumping combination. Never destroyed, like internedname's tables.
+	static lw_u8str_simplifycache & get(bool destructive, bool extralumping)
+	{
+		static lw_u8str_simplifycache * caches = new lw_u8str_simplifycache[3];
+		return caches[destructive ? (extralumping ? 2 : 1) : 0];
+	}
+
+	bool find(const std::string_view text, std::string & result)
+	{
+		std::lock_guard<std::mutex> cacheGuard(cacheLock);
+		const auto it = index.find(text);
+		if (it == index.end())
+			return false;
+		recent.splice(recent.begin(), recent, it->second);
+		result = it->second->result;
+		return true;
+	}
+
+	void add(const std::string_view text, const std::string & result)
+	{
+		std::lock_guard<std::mutex> cacheGuard(cacheLock);
+		if (index.find(text) != index.end())
+			return; // another thread simplified it meanwhile
+		if (recent.size() >= capacity)
+		{
+			index.erase(recent.back().text);
+			recent.pop_back();
+		}
+		recent.push_front(entry { std::string(text), result });
+		index.emplace(recent.front().text, recent.begin());
+	}
+};
+
+static void lw_u8str_extralump(std::string & u8str);
+
 std::string lw_u8str_simplify(const std::string_view first, bool destructive, bool extralumping)
 {
 	if (first.empty())
 		return std::string();
 
+	// Printable ASCII is unchanged by NFKC, lumping and mark stripping, and case folding it is plain lowercasing,
+	// so it's done here rather than by utf8proc_map() and a copy of its allocation
+	if (lw_u8str_printableasciirun(first) == first.size())
+	{
+		std::string u8str(first);
+		if (!destructive)
+			return u8str;
+		for (char & c : u8str)
+		{
+			if (c >= 'A' && c <= 'Z')
+				c += 'a' - 'A';
+		}
+		if (extralumping)
+			lw_u8str_extralump(u8str);
+		return u8str;
+	}
+
+	// Without case folding and lumping, text passing the quick check comes back as-is
+	if (!destructive && lw_u8str_nfcquickcheck(first))
+		return std::string(first);
+
+	lw_u8str_simplifycache & cache = lw_u8str_simplifycache::get(destructive, extralumping);
+	std::string u8str;
+	if (cache.find(first, u8str))
+		return u8str;
+
 	// Effectively call utf8proc_tolower(), but without null terminator, and return value is more
 	// obviously not the input value.
 
@@ -94,13 +218,17 @@ std::string lw_u8str_simplify(const std::string_view first, bool destructive, bo
 	if (resultSizeBytes <= 0)
 		return std::string();
 
-	std::string u8str((char *)retval, resultSizeBytes);
+	u8str.assign((char *)retval, resultSizeBytes);
 	free(retval);
 
-	// Skip additional lumping
-	if (!destructive || !extralumping)
-		return u8str;
+	if (destructive && extralumping)
+		lw_u8str_extralump(u8str);
+	cache.add(first, u8str);
+	return u8str;
+}
 
+static void lw_u8str_extralump(std::string & u8str)
+{
 	// Lots of the characters are lumped together by virtue of UTF8PROC_LUMP enum above.
 	// These further things are not covered by the lumping, and are manual merging of similarly-displayed characters.
 	for (size_t i = 0; i < u8str.size(); ++i)
@@ -180,38 +308,15 @@ std::string lw_u8str_simplify(const std::string_view first, bool destructive, bo
 		}
 		// Box drawing characters are dumb. Anyone allowing those have brought problems upon themselves.
 	}
-
-	return u8str;
 }
 
-extern "C" bool lw_u8str_validate(const char* toValidate, size_t size)
-{
-	return lw_u8str_validate(std::string_view(toValidate, size));
-}
-bool lw_u8str_validate(const std::string_view toValidate)
-{
-	if (toValidate.empty())
-		return true;
-
-	const utf8proc_uint8_t * str = (utf8proc_uint8_t *)toValidate.data();
-	utf8proc_int32_t thisChar;
-	utf8proc_ssize_t numBytesInCodePoint, remainder = toValidate.size();
-	while (remainder > 0)
-	{
-		numBytesInCodePoint = utf8proc_iterate(str, remainder, &thisChar);
-		if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar))
-			return false;
-
-		str += numBytesInCodePoint;
-		remainder -= numBytesInCodePoint;
-	}
-
-	return true;
-}
+// lw_u8str_validate() is in UTF8Validate.cc
 
 bool lw_u8str_normalize(std::string & input)
 {
-	if (input.empty())
+	// Printable ASCII is already NFC, and has no control codes or newlines for the options below to change;
+	// most other text that is already NFC passes the quick check. Either way, no utf8proc_map() allocation.
+	if (lw_u8str_printableasciirun(input) == input.size() || lw_u8str_nfcquickcheck(input))
 		return true;
 
 	// Effectively call utf8proc_NFC(), but without null terminator, and return value is more
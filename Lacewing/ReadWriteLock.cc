@@ -9,6 +9,279 @@
 
 #include "Lacewing.h"
 
+#if LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_CHECKED
+	#define lw_rwlock_locker_init , locker(lock.lock, std::defer_lock)
+#else
+	#define lw_rwlock_locker_init
+#endif
+
+#ifdef LW_RWLOCK_PROFILE
+#include <unordered_map>
+
+// One site's samples on one thread. Only that thread writes them, so recording is a relaxed load and store,
+// as in relaymetrics; the atomics only stop report() reading torn values.
+struct lacewing::lockprofiler::siteprofile
+{
+	// Nanoseconds; waits and holds of 2^40 ns or more, about 18 minutes, go in the last bucket
+	static constexpr size_t bucketCount = 8 + 37 * 4;
+
+	site where;
+	bool isWrite;
+	std::atomic<lw_ui64> wait[bucketCount] = { }, hold[bucketCount] = { };
+	std::atomic<lw_ui64> waitSumNS = 0, holdSumNS = 0;
+
+	static void record(std::atomic<lw_ui64> (&buckets)[bucketCount], std::atomic<lw_ui64> &sum, lw_ui64 ns)
+	{
+		const size_t bucket = std::min(relaymetrics::bucketof(ns), bucketCount - 1);
+		buckets[bucket].store(buckets[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		sum.store(sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+	}
+};
+
+namespace {
+	using lacewing::lockprofiler::siteprofile;
+
+	struct sitekey
+	{
+		const char * file;
+		int line;
+		bool isWrite;
+		bool operator==(const sitekey &other) const
+		{
+			return file == other.file && line == other.line && isWrite == other.isWrite;
+		}
+	};
+	struct sitekeyhash
+	{
+		size_t operator()(const sitekey &key) const
+		{
+			return std::hash<const void *>()(key.file) ^ ((size_t)key.line << 1 | key.isWrite);
+		}
+	};
+
+	struct threadprofile
+	{
+		// Held while sites is added to, and by report(); the owning thread doesn't take it to record
+		std::mutex sitesLock;
+		std::vector<std::unique_ptr<siteprofile>> sites;
+		// Owning thread only
+		std::unordered_map<sitekey, siteprofile *, sitekeyhash> index;
+	};
+
+	// Never freed, as threads may still be unlocking while statics are destroyed at exit
+	struct profileregistry
+	{
+		std::mutex threadsLock;
+		std::vector<std::unique_ptr<threadprofile>> threads;
+		std::atomic<unsigned int> sampleEvery = 0;
+	};
+	profileregistry &registry()
+	{
+		static profileregistry * const r = new profileregistry();
+		return *r;
+	}
+
+	thread_local threadprofile * localProfile = nullptr;
+	thread_local unsigned int sampleCountdown = 0;
+
+	lw_ui64 profilenow()
+	{
+		return (lw_ui64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Start time of this acquisition if it's to be sampled, otherwise 0
+	lw_ui64 profilebegin()
+	{
+		const unsigned int every = registry().sampleEvery.load(std::memory_order_relaxed);
+		if (every == 0 || ++sampleCountdown < every)
+			return 0;
+		sampleCountdown = 0;
+		return profilenow();
+	}
+
+	void profileacquired(const lacewing::lockprofiler::site &where, bool isWrite, bool locked, lw_ui64 startNS,
+		siteprofile *&entry, lw_ui64 &heldSinceNS)
+	{
+		// Recursive opens don't acquire anything
+		if (startNS == 0 || !locked)
+			return;
+		const lw_ui64 nowNS = profilenow();
+
+		if (!localProfile)
+		{
+			profileregistry &r = registry();
+			std::lock_guard<std::mutex> threadsGuard(r.threadsLock);
+			r.threads.push_back(std::make_unique<threadprofile>());
+			localProfile = r.threads.back().get();
+		}
+		siteprofile *&found = localProfile->index[sitekey { where.file, where.line, isWrite }];
+		if (!found)
+		{
+			auto added = std::make_unique<siteprofile>();
+			added->where = where;
+			added->isWrite = isWrite;
+			found = added.get();
+			std::lock_guard<std::mutex> sitesGuard(localProfile->sitesLock);
+			localProfile->sites.push_back(std::move(added));
+		}
+
+		siteprofile::record(found->wait, found->waitSumNS, nowNS - startNS);
+		entry = found;
+		heldSinceNS = nowNS;
+	}
+
+	void profilereleased(siteprofile *&entry, lw_ui64 heldSinceNS)
+	{
+		if (!entry)
+			return;
+		siteprofile::record(entry->hold, entry->holdSumNS, profilenow() - heldSinceNS);
+		entry = nullptr;
+	}
+
+	// All threads' samples for one site, added up
+	struct sitetotals
+	{
+		std::string name;
+		const char * func;
+		bool isWrite;
+		lw_ui64 wait[siteprofile::bucketCount] = { }, hold[siteprofile::bucketCount] = { };
+		lw_ui64 waitSumNS = 0, holdSumNS = 0, waitCount = 0, holdCount = 0;
+
+		// Upper bound of the bucket holding the q quantile, in nanoseconds
+		static lw_ui64 quantile(const lw_ui64 (&buckets)[siteprofile::bucketCount], lw_ui64 count, double q)
+		{
+			lw_ui64 cumulative = 0;
+			for (size_t b = 0; b < siteprofile::bucketCount; ++b)
+			{
+				cumulative += buckets[b];
+				if (count != 0 && (double)cumulative >= q * (double)count)
+					return relaymetrics::bucketmax(b);
+			}
+			return 0;
+		}
+	};
+
+	std::vector<sitetotals> profiletotals()
+	{
+		std::vector<sitetotals> totals;
+		std::unordered_map<std::string, size_t> byName;
+		profileregistry &r = registry();
+		std::lock_guard<std::mutex> threadsGuard(r.threadsLock);
+		for (const auto &thread : r.threads)
+		{
+			std::lock_guard<std::mutex> sitesGuard(thread->sitesLock);
+			for (const auto &s : thread->sites)
+			{
+				// Same site on another thread, or the same file compiled into two objects, adds up with it
+				const char * file = s->where.file;
+				for (const char * c = file; *c; ++c)
+				{
+					if (*c == '/' || *c == '\\')
+						file = c + 1;
+				}
+				std::string name = std::string(file) + ':' + std::to_string(s->where.line);
+				const auto it = byName.try_emplace(name + (s->isWrite ? " w" : " r"), totals.size()).first;
+				if (it->second == totals.size())
+				{
+					totals.emplace_back();
+					totals.back().name = std::move(name);
+					totals.back().func = s->where.func;
+					totals.back().isWrite = s->isWrite;
+				}
+				sitetotals &t = totals[it->second];
+				for (size_t b = 0; b < siteprofile::bucketCount; ++b)
+				{
+					const lw_ui64 waits = s->wait[b].load(std::memory_order_relaxed), holds = s->hold[b].load(std::memory_order_relaxed);
+					t.wait[b] += waits;
+					t.hold[b] += holds;
+					t.waitCount += waits;
+					t.holdCount += holds;
+				}
+				t.waitSumNS += s->waitSumNS.load(std::memory_order_relaxed);
+				t.holdSumNS += s->holdSumNS.load(std::memory_order_relaxed);
+			}
+		}
+		std::sort(totals.begin(), totals.end(),
+			[](const sitetotals &a, const sitetotals &b) { return a.waitSumNS > b.waitSumNS; });
+		return totals;
+	}
+}
+
+void lacewing::lockprofiler::setsampling(unsigned int everyN)
+{
+	registry().sampleEvery.store(everyN, std::memory_order_relaxed);
+}
+
+std::string lacewing::lockprofiler::report()
+{
+	const std::vector<sitetotals> totals = profiletotals();
+	std::string out;
+	char line[512];
+	const auto append = [&](const char * format, auto... args) {
+		const int len = snprintf(line, sizeof(line), format, args...);
+		if (len > 0)
+			out.append(line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+	};
+	append("Lock profile, sampling 1 in %u acquisitions; times in microseconds\n",
+		registry().sampleEvery.load(std::memory_order_relaxed));
+	append("%-32s %-32s %-5s %10s %9s %9s %12s %9s %9s %12s\n", "site", "function", "mode", "samples",
+		"wait p50", "wait p99", "wait total", "hold p50", "hold p99", "hold total");
+	for (const sitetotals &t : totals)
+	{
+		append("%-32s %-32s %-5s %10llu %9.1f %9.1f %12.1f %9.1f %9.1f %12.1f\n", t.name.c_str(), t.func,
+			t.isWrite ? "write" : "read", (unsigned long long)t.waitCount,
+			sitetotals::quantile(t.wait, t.waitCount, 0.5) / 1e3, sitetotals::quantile(t.wait, t.waitCount, 0.99) / 1e3,
+			t.waitSumNS / 1e3,
+			sitetotals::quantile(t.hold, t.holdCount, 0.5) / 1e3, sitetotals::quantile(t.hold, t.holdCount, 0.99) / 1e3,
+			t.holdSumNS / 1e3);
+	}
+	return out;
+}
+
+std::string lacewing::lockprofiler::prometheustext()
+{
+	const std::vector<sitetotals> totals = profiletotals();
+	std::string out;
+	char line[512];
+	const auto append = [&](const char * format, auto... args) {
+		const int len = snprintf(line, sizeof(line), format, args...);
+		if (len > 0)
+			out.append(line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+	};
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	for (const bool hold : { false, true })
+	{
+		const char * const name = hold ? "relay_lock_hold_seconds" : "relay_lock_wait_seconds";
+		append("# HELP %s %s\n# TYPE %s summary\n", name, hold ? "Sampled readwritelock hold times, by call site." :
+			"Sampled readwritelock acquisition waits, by call site.", name);
+		for (const sitetotals &t : totals)
+		{
+			const auto &buckets = hold ? t.hold : t.wait;
+			const lw_ui64 count = hold ? t.holdCount : t.waitCount;
+			const char * const mode = t.isWrite ? "write" : "read";
+			for (const double q : quantiles)
+			{
+				append("%s{site=\"%s\",func=\"%s\",mode=\"%s\",quantile=\"%g\"} %.9g\n", name, t.name.c_str(), t.func, mode,
+					q, sitetotals::quantile(buckets, count, q) * 1e-9);
+			}
+			append("%s_sum{site=\"%s\",func=\"%s\",mode=\"%s\"} %.9g\n%s_count{site=\"%s\",func=\"%s\",mode=\"%s\"} %llu\n",
+				name, t.name.c_str(), t.func, mode, (hold ? t.holdSumNS : t.waitSumNS) * 1e-9,
+				name, t.name.c_str(), t.func, mode, (unsigned long long)count);
+		}
+	}
+	return out;
+}
+
+	#define lw_rwlock_profile_begin() const lw_ui64 profileStartNS = profilebegin()
+	#define lw_rwlock_profile_acquired(isWrite) profileacquired(profileSite, isWrite, locked, profileStartNS, profileEntry, profileHeldSinceNS)
+	#define lw_rwlock_profile_released() profilereleased(profileEntry, profileHeldSinceNS)
+#else
+	#define lw_rwlock_profile_begin()
+	#define lw_rwlock_profile_acquired(isWrite)
+	#define lw_rwlock_profile_released()
+#endif
+
 bool lacewing::readlock::isEnabled() const
 {
 	return locked;
@@ -29,13 +302,14 @@ lacewing::readlock::~readlock()
 {
 	if (locked)
 	{
+		lw_rwlock_profile_released();
 #ifdef _DEBUG
 		lock.closeReadLock(*this, "<unknown>", "readlock::~readlock()", 0);
 #else
 		lock.closeReadLock(*this);
 #endif
 	}
-#ifdef _DEBUG
+#if defined(_DEBUG) && LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_CHECKED
 	if (supercededByWriter)
 	{
 		// If writelock is previously opened on this thread, make sure it's not closed when this read lock is closed.
@@ -68,6 +342,7 @@ lacewing::writelock::~writelock()
 {
 	if (locked)
 	{
+		lw_rwlock_profile_released();
 #ifdef _DEBUG
 		lock.closeWriteLock(*this, "<unknown>", "writelock::~writelock()", 0);
 #else
@@ -78,22 +353,30 @@ lacewing::writelock::~writelock()
 
 #ifdef _DEBUG
 lacewing::readlock::readlock(readwritelock &lock, lw_rwlock_debugParamNames)
-	: lock(lock), locker(lock.lock, std::defer_lock)
+	: lock(lock) lw_rwlock_locker_init
 {
+#ifdef LW_RWLOCK_PROFILE
+	profileSite = { file, func, line };
+#endif
+	lw_rwlock_profile_begin();
 	lock.openReadLock(*this, file, func, line);
+	lw_rwlock_profile_acquired(false);
 }
 
 void lacewing::readlock::relockDebug(lw_rwlock_debugParamNames)
 {
 	if (locked)
 		throw std::runtime_error("ReadLock: Locking when it's already locked");
+	lw_rwlock_profile_begin();
 	lock.openReadLock(*this, file, func, line);
+	lw_rwlock_profile_acquired(false);
 	locked = true;
 }
 void lacewing::readlock::unlockDebug(lw_rwlock_debugParamNames)
 {
 	if (!locked)
 		throw std::runtime_error("ReadLock: Unlocking when it's already unlocked");
+	lw_rwlock_profile_released();
 	lock.closeReadLock(*this, file, func, line);
 	locked = false;
 }
@@ -121,17 +404,30 @@ void lacewing::readlock::upgrade(lw_rwlock_debugParamNames, lacewing::writelock
 #endif
 #else
 lacewing::readlock::readlock(readwritelock &lock)
-	: lock(lock), locker(lock.lock, std::defer_lock) {
+	: lock(lock) lw_rwlock_locker_init {
+	lw_rwlock_profile_begin();
+	lock.openReadLock(*this);
+	lw_rwlock_profile_acquired(false);
+}
+#ifdef LW_RWLOCK_PROFILE
+lacewing::readlock::readlock(readwritelock &lock, const lockprofiler::site &site)
+	: lock(lock) lw_rwlock_locker_init, profileSite(site) {
+	lw_rwlock_profile_begin();
 	lock.openReadLock(*this);
+	lw_rwlock_profile_acquired(false);
 }
+#endif
 void lacewing::readlock::relock()
 {
 	assert(!locked && "ReadLock: Locking when it's already locked");
+	lw_rwlock_profile_begin();
 	lock.openReadLock(*this);
+	lw_rwlock_profile_acquired(false);
 }
 void lacewing::readlock::unlock()
 {
 	assert(locked && "ReadLock: Unlocking when it's already unlocked");
+	lw_rwlock_profile_released();
 	lock.closeReadLock(*this);
 }
 #endif
@@ -139,9 +435,14 @@ void lacewing::readlock::unlock()
 
 #ifdef _DEBUG
 lacewing::writelock::writelock(readwritelock &lock, const char * file, const char * func, int line)
-	: lock(lock), locker(lock.lock, std::defer_lock)
+	: lock(lock) lw_rwlock_locker_init
 {
+#ifdef LW_RWLOCK_PROFILE
+	profileSite = { file, func, line };
+#endif
+	lw_rwlock_profile_begin();
 	lock.openWriteLock(*this, file, func, line);
+	lw_rwlock_profile_acquired(true);
 }
 
 void lacewing::writelock::relockDebug(const char * file, const char * func, int line)
@@ -154,36 +455,53 @@ void lacewing::writelock::relockDebug(const char * file, const char * func, int
 		//LacewingFatalErrorMsgBox();
 	}
 	locked = true;
+	lw_rwlock_profile_begin();
 	lock.openWriteLock(*this, file, func, line);
+	lw_rwlock_profile_acquired(true);
 }
 void lacewing::writelock::unlockDebug(const char * file, const char * func, int line)
 {
 	if (!locked)
 		return;
 		// throw std::exception("WriteLock: Unlocking when it's already unlocked");
+	lw_rwlock_profile_released();
 	lock.closeWriteLock(*this, file, func, line);
 	locked = false;
 }
 #else
 lacewing::writelock::writelock(readwritelock &lock)
-	: lock(lock), locker(lock.lock, std::defer_lock) {
+	: lock(lock) lw_rwlock_locker_init {
+	lw_rwlock_profile_begin();
+	lock.openWriteLock(*this);
+	lw_rwlock_profile_acquired(true);
+}
+#ifdef LW_RWLOCK_PROFILE
+lacewing::writelock::writelock(readwritelock &lock, const lockprofiler::site &site)
+	: lock(lock) lw_rwlock_locker_init, profileSite(site) {
+	lw_rwlock_profile_begin();
 	lock.openWriteLock(*this);
+	lw_rwlock_profile_acquired(true);
 }
+#endif
 void lacewing::writelock::relock()
 {
 	assert(!locked && "WriteLock: Locking when it's already locked");
+	lw_rwlock_profile_begin();
 	lock.openWriteLock(*this);
+	lw_rwlock_profile_acquired(true);
 }
 void lacewing::writelock::unlock()
 {
 	if (!locked)
 		return;
 		// throw std::runtime_error("WriteLock: Unlocking when it's already unlocked");
+	lw_rwlock_profile_released();
 	lock.closeWriteLock(*this);
 }
 #endif
 
 
+#if LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_CHECKED
 lacewing::readwritelock::readwritelock()
 {
 	readers = writers = read_waiters = write_waiters = 0;
@@ -498,9 +816,251 @@ void lacewing::readwritelock::closeWriteLock(writelock &wl)
 	wl.locked = false;
 }
 
+#elif LW_RWLOCK_POLICY == LW_RWLOCK_POLICY_SPIN
+
+// Locks held by this thread, so recursive opens can be spotted without a shared holders list.
+// The relay never nests more than a handful of locks deep.
+namespace {
+	struct heldlock {
+		const lacewing::readwritelock * lock;
+		bool isWrite;
+	};
+	thread_local heldlock heldLocks[32];
+	thread_local int heldLockCount = 0;
+
+	const heldlock * findHeld(const lacewing::readwritelock * lock)
+	{
+		for (int i = heldLockCount - 1; i >= 0; --i)
+			if (heldLocks[i].lock == lock)
+				return &heldLocks[i];
+		return nullptr;
+	}
+	void pushHeld(const lacewing::readwritelock * lock, bool isWrite)
+	{
+		if (heldLockCount == (int)(sizeof(heldLocks) / sizeof(*heldLocks)))
+			LacewingFatalErrorMsgBox();
+		heldLocks[heldLockCount++] = { lock, isWrite };
+	}
+	void popHeld(const lacewing::readwritelock * lock)
+	{
+		for (int i = heldLockCount - 1; i >= 0; --i)
+		{
+			if (heldLocks[i].lock != lock)
+				continue;
+			for (; i < heldLockCount - 1; ++i)
+				heldLocks[i] = heldLocks[i + 1];
+			--heldLockCount;
+			return;
+		}
+		LacewingFatalErrorMsgBox(); // don't own this lock!
+	}
+	// Spin briefly, then give up the timeslice; critical sections are expected to be short.
+	inline void spinWait(int & spins)
+	{
+		if (++spins > 64)
+		{
+			spins = 0;
+			std::this_thread::yield();
+		}
+	}
+}
+
+lacewing::readwritelock::readwritelock()
+{
+	state = 0;
+	write_waiters = 0;
+}
+lacewing::readwritelock::~readwritelock() noexcept(false)
+{
+	if (state || write_waiters)
+		LacewingFatalErrorMsgBox();
+}
+bool lacewing::readwritelock::checkHoldsWrite(bool excIfNot /* = true */) const
+{
+	const heldlock * h = state == -1 ? findHeld(this) : nullptr;
+	if (h && h->isWrite)
+		return true;
+	assert(!excIfNot && "Undefined behaviour; write lock not held when expected. Please attach debugger now.");
+	return false;
+}
+bool lacewing::readwritelock::checkHoldsRead(bool excIfNot /* = true */) const
+{
+	const heldlock * h = state > 0 ? findHeld(this) : nullptr;
+	if (h && !h->isWrite)
+		return true;
+	assert(!excIfNot && "Undefined behaviour; read lock not held when expected. Please attach debugger now.");
+	return false;
+}
+
+#ifdef _DEBUG
+void lacewing::readwritelock::openReadLock(readlock &rl, lw_rwlock_debugParamNames)
+#else
+void lacewing::readwritelock::openReadLock(readlock &rl)
+#endif
+{
+	// Already held as read or write by this thread; recursive, hence locked stays false
+	if (findHeld(this))
+	{
+		rl.locked = false;
+		return;
+	}
+
+	for (int spins = 0; ; spinWait(spins))
+	{
+		lw_i32 cur = state.load(std::memory_order_relaxed);
+		if (cur >= 0 && write_waiters.load(std::memory_order_relaxed) == 0 &&
+			state.compare_exchange_weak(cur, cur + 1, std::memory_order_acquire, std::memory_order_relaxed))
+			break;
+	}
+
+	pushHeld(this, false);
+	rl.locked = true;
+}
+
+#ifdef _DEBUG
+void lacewing::readwritelock::openWriteLock(writelock &wl, lw_rwlock_debugParamNames)
+#else
+void lacewing::readwritelock::openWriteLock(writelock &wl)
+#endif
+{
+	const heldlock * h = findHeld(this);
+	if (h)
+	{
+		// Read lock held by current thread will produce a deadlock
+		if (!h->isWrite)
+			throw std::runtime_error("Deadlock");
+
+		// Recursive, hence locked stays false
+		wl.locked = false;
+		return;
+	}
+
+	++write_waiters;
+	for (int spins = 0; ; spinWait(spins))
+	{
+		lw_i32 cur = 0;
+		if (state.compare_exchange_weak(cur, -1, std::memory_order_acquire, std::memory_order_relaxed))
+			break;
+	}
+	--write_waiters;
+
+	pushHeld(this, true);
+	wl.locked = true;
+}
+
+#ifdef _DEBUG
+void lacewing::readwritelock::closeReadLock(readlock &rl, lw_rwlock_debugParamNames)
+#else
+void lacewing::readwritelock::closeReadLock(readlock &rl)
+#endif
+{
+	popHeld(this);
+	state.fetch_sub(1, std::memory_order_release);
+	rl.locked = false;
+}
+
+#ifdef _DEBUG
+void lacewing::readwritelock::closeWriteLock(writelock &wl, lw_rwlock_debugParamNames)
+#else
+void lacewing::readwritelock::closeWriteLock(writelock &wl)
+#endif
+{
+	// Recursive and not held
+	if (!wl.locked)
+		return;
+
+	popHeld(this);
+	state.store(0, std::memory_order_release);
+	wl.locked = false;
+}
+
+#else // LW_RWLOCK_POLICY_NONE
+
+lacewing::readwritelock::readwritelock()
+{
+	readers = writers = 0;
+}
+lacewing::readwritelock::~readwritelock() noexcept(false)
+{
+	if (readers || writers)
+		LacewingFatalErrorMsgBox();
+}
+// Single-threaded, so any holder is this thread.
+bool lacewing::readwritelock::checkHoldsWrite(bool excIfNot /* = true */) const
+{
+	assert((writers || !excIfNot) && "Undefined behaviour; write lock not held when expected. Please attach debugger now.");
+	return writers != 0;
+}
+bool lacewing::readwritelock::checkHoldsRead(bool excIfNot /* = true */) const
+{
+	assert((readers || !excIfNot) && "Undefined behaviour; read lock not held when expected. Please attach debugger now.");
+	return readers != 0;
+}
+
 #ifdef _DEBUG
+void lacewing::readwritelock::openReadLock(readlock &rl, lw_rwlock_debugParamNames)
+#else
+void lacewing::readwritelock::openReadLock(readlock &rl)
+#endif
+{
+	// Recursive, hence locked stays false
+	if (readers || writers)
+	{
+		rl.locked = false;
+		return;
+	}
+	++readers;
+	rl.locked = true;
+}
+
+#ifdef _DEBUG
+void lacewing::readwritelock::openWriteLock(writelock &wl, lw_rwlock_debugParamNames)
+#else
+void lacewing::readwritelock::openWriteLock(writelock &wl)
+#endif
+{
+	// With a real lock, this would deadlock
+	assert(!readers && "Deadlock - opened new write lock with read lock already held by same thread.");
+
+	// Recursive, hence locked stays false
+	if (writers)
+	{
+		wl.locked = false;
+		return;
+	}
+	++writers;
+	wl.locked = true;
+}
+
+#ifdef _DEBUG
+void lacewing::readwritelock::closeReadLock(readlock &rl, lw_rwlock_debugParamNames)
+#else
+void lacewing::readwritelock::closeReadLock(readlock &rl)
+#endif
+{
+	--readers;
+	rl.locked = false;
+}
+
+#ifdef _DEBUG
+void lacewing::readwritelock::closeWriteLock(writelock &wl, lw_rwlock_debugParamNames)
+#else
+void lacewing::readwritelock::closeWriteLock(writelock &wl)
+#endif
+{
+	// Recursive and not held
+	if (!wl.locked)
+		return;
+
+	--writers;
+	wl.locked = false;
+}
+
+#endif // LW_RWLOCK_POLICY
+
 #undef createReadLock
 #undef createWriteLock
+#ifdef _DEBUG
 [[nodiscard]]
 lacewing::readlock lacewing::readwritelock::createReadLock(const char *file, const char * func, int line) {
 	return lacewing::readlock(*this, file, func, line);
@@ -523,3 +1083,14 @@ lacewing::writelock lacewing::readwritelock::createWriteLock() {
 	return lacewing::writelock(*this);
 }
 #endif
+
+#if !defined(_DEBUG) && defined(LW_RWLOCK_PROFILE)
+[[nodiscard]]
+lacewing::readlock lacewing::readwritelock::createReadLock(const lockprofiler::site &site) {
+	return lacewing::readlock(*this, site);
+}
+[[nodiscard]]
+lacewing::writelock lacewing::readwritelock::createWriteLock(const lockprofiler::site &site) {
+	return lacewing::writelock(*this, site);
+}
+#endif
@@ -13,6 +13,9 @@
 #include "MessageReader.h"
 #include <vector>
 #include <algorithm>
+#if !defined(_WIN32) && !defined(__ANDROID__) && !defined(__APPLE__)
+	#include <sys/utsname.h>
+#endif
 
 namespace lacewing
 {
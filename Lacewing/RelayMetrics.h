@@ -0,0 +1,289 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef LacewingRelayMetrics
+#define LacewingRelayMetrics
+
+/// <summary> Counters, gauges and histograms for relayserver, read out in Prometheus text format.
+/// 		  Each thread records into its own shard, which only it writes, so recording is a plain load and
+/// 		  store with no atomic read-modify-write and no shared cache lines. Reading sums the shards
+/// 		  under the shard list lock only, never any relay lock. </summary>
+class relaymetrics
+{
+public:
+	// Relay protocol message type IDs, 0 to 15; sizes are message bodies, excluding frame headers.
+	// Client-to-server and server-to-client IDs differ, so received and sent types have their own labels.
+	static constexpr size_t messageTypes = 16;
+
+	enum class gauge : size_t
+	{
+		Clients,
+		Channels,
+		// Bytes waiting in clients' outgoing queues, in total and for the most backed-up client
+		QueuedBytes,
+		MaxClientQueuedBytes,
+		Count
+	};
+
+	enum class histogram : size_t
+	{
+		// Recipients written to per channel message
+		Fanout,
+		// Nanoseconds spent handling one received message, including server handlers and relaying it
+		HandleLatency,
+		// Microseconds between a TCP ping and its reply
+		PingRTT,
+		Count
+	};
+
+private:
+	enum counterbase : size_t
+	{
+		MessagesIn = 0,
+		BytesIn = MessagesIn + messageTypes,
+		MessagesOut = BytesIn + messageTypes,
+		BytesOut = MessagesOut + messageTypes,
+		Connects = BytesOut + messageTypes,
+		Disconnects,
+		CounterCount
+	};
+
+public:
+	// HDR-style log-linear buckets: values 0-7 get a bucket each, then each power of two is split in four,
+	// so a bucket's width is at most a quarter of its lower bound. Also used by lacewing::lockprofiler.
+	static constexpr size_t bucketCount = 8 + 61 * 4;
+
+	static size_t bucketof(std::uint64_t value)
+	{
+		if (value < 8)
+			return (size_t)value;
+		size_t msb = 63;
+		while (!(value >> msb))
+			--msb;
+		return 8 + (msb - 3) * 4 + (size_t)((value >> (msb - 2)) & 3);
+	}
+
+	// Highest value that lands in the bucket
+	static std::uint64_t bucketmax(size_t bucket)
+	{
+		if (bucket < 8)
+			return bucket;
+		const size_t msb = (bucket - 8) / 4 + 3, sub = (bucket - 8) % 4;
+		return ((std::uint64_t)(4 + sub + 1) << (msb - 2)) - 1;
+	}
+
+private:
+
+	struct shard
+	{
+		std::atomic<std::uint64_t> counters[CounterCount] = { };
+		std::atomic<std::uint64_t> buckets[(size_t)histogram::Count][bucketCount] = { };
+		std::atomic<std::uint64_t> sums[(size_t)histogram::Count] = { };
+	};
+
+	// Only the owning thread writes a shard, so this needn't be a locked add; relaxed atomics keep reads untorn
+	static void bump(std::atomic<std::uint64_t> & value, std::uint64_t by)
+	{
+		value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+	}
+
+	const std::uint64_t registryID;
+	mutable std::mutex shardsLock;
+	// Shards outlive their threads; a later thread with the same ID carries on with the same shard
+	std::vector<std::pair<std::thread::id, std::unique_ptr<shard>>> shards;
+	std::atomic<std::int64_t> gauges[(size_t)gauge::Count] = { };
+
+	static std::uint64_t nextregistryid()
+	{
+		static std::atomic<std::uint64_t> next = 1;
+		return next.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	shard & localshard()
+	{
+		// Registry IDs are never reused, so a cache entry for a deleted registry can't match a new one
+		thread_local std::uint64_t cachedRegistryID = 0;
+		thread_local shard * cached = nullptr;
+		if (cachedRegistryID == registryID)
+			return *cached;
+
+		std::lock_guard<std::mutex> shardsGuard(shardsLock);
+		const std::thread::id self = std::this_thread::get_id();
+		shard * found = nullptr;
+		for (const auto & s : shards)
+		{
+			if (s.first == self)
+				found = s.second.get();
+		}
+		if (!found)
+		{
+			shards.emplace_back(self, std::make_unique<shard>());
+			found = shards.back().second.get();
+		}
+		cachedRegistryID = registryID;
+		cached = found;
+		return *found;
+	}
+
+	std::uint64_t sumcounter(size_t index) const
+	{
+		std::uint64_t total = 0;
+		for (const auto & s : shards)
+			total += s.second->counters[index].load(std::memory_order_relaxed);
+		return total;
+	}
+
+public:
+
+	relaymetrics() : registryID(nextregistryid()) { }
+	relaymetrics(const relaymetrics &) = delete;
+
+	void received(std::uint8_t messageType, size_t bytes)
+	{
+		shard & s = localshard();
+		bump(s.counters[MessagesIn + (messageType & 15)], 1);
+		bump(s.counters[BytesIn + (messageType & 15)], bytes);
+	}
+
+	void sent(std::uint8_t messageType, size_t messages, size_t bytesEach)
+	{
+		shard & s = localshard();
+		bump(s.counters[MessagesOut + (messageType & 15)], messages);
+		bump(s.counters[BytesOut + (messageType & 15)], messages * bytesEach);
+	}
+
+	void connected() { bump(localshard().counters[Connects], 1); }
+	void disconnected() { bump(localshard().counters[Disconnects], 1); }
+
+	void record(histogram which, std::uint64_t value)
+	{
+		shard & s = localshard();
+		bump(s.buckets[(size_t)which][bucketof(value)], 1);
+		bump(s.sums[(size_t)which], value);
+	}
+
+	void set(gauge which, std::int64_t value)
+	{
+		gauges[(size_t)which].store(value, std::memory_order_relaxed);
+	}
+
+	/// <summary> Times a scope into a nanosecond histogram. </summary>
+	class timer
+	{
+		relaymetrics & metrics;
+		const histogram which;
+		const std::chrono::steady_clock::time_point start;
+	public:
+		timer(relaymetrics & metrics, histogram which) : metrics(metrics), which(which), start(std::chrono::steady_clock::now()) { }
+		~timer()
+		{
+			metrics.record(which, (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count());
+		}
+	};
+
+	/// <summary> All metrics, in Prometheus text exposition format 0.0.4. </summary>
+	std::string prometheustext() const
+	{
+		static const char * const receivedTypeNames[messageTypes] = {
+			"request", "binaryserver", "binarychannel", "binarypeer", "objectserver", "objectchannel",
+			"objectpeer", "udphello", "channelmaster", "ping", "implementation", "type11",
+			"type12", "type13", "type14", "type15"
+		};
+		static const char * const sentTypeNames[messageTypes] = {
+			"response", "binaryserver", "binarychannel", "binarypeer", "binaryserverchannel", "objectserver",
+			"objectchannel", "objectpeer", "objectserverchannel", "peer", "udpwelcome", "ping",
+			"implementationrequest", "type13", "type14", "type15"
+		};
+		struct counterfamily { size_t base; const char * name, * help; const char * const * typeNames; };
+		static const counterfamily perType[] = {
+			{ MessagesIn, "relay_messages_received_total", "Messages received from clients, by message type.", receivedTypeNames },
+			{ BytesIn, "relay_message_bytes_received_total", "Message body bytes received from clients, by message type.", receivedTypeNames },
+			{ MessagesOut, "relay_messages_sent_total", "Messages written to clients, by message type.", sentTypeNames },
+			{ BytesOut, "relay_message_bytes_sent_total", "Message body bytes written to clients, by message type.", sentTypeNames },
+		};
+		struct gaugeinfo { const char * name, * help; };
+		static const gaugeinfo gaugeInfo[(size_t)gauge::Count] = {
+			{ "relay_clients", "Connected clients." },
+			{ "relay_channels", "Open channels." },
+			{ "relay_queued_bytes", "Bytes waiting in clients' outgoing queues." },
+			{ "relay_client_queued_bytes_max", "Bytes waiting in the most backed-up client's outgoing queue." },
+		};
+		struct histograminfo { const char * name, * help; double scale; std::uint64_t exportMin, exportMax; };
+		static const histograminfo histogramInfo[(size_t)histogram::Count] = {
+			{ "relay_channel_fanout_recipients", "Recipients written to per channel message.", 1.0, 1, 1u << 20 },
+			{ "relay_message_handle_seconds", "Time to handle one received message.", 1e-9, 1u << 10, 1ull << 34 },
+			{ "relay_ping_rtt_seconds", "Time between a TCP ping and its reply.", 1e-6, 1u << 7, 1ull << 26 },
+		};
+
+		std::string out;
+		out.reserve(32 * 1024);
+		char line[256];
+		const auto append = [&](const char * format, auto... args) {
+			const int len = snprintf(line, sizeof(line), format, args...);
+			if (len > 0)
+				out.append(line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+		};
+
+		std::lock_guard<std::mutex> shardsGuard(shardsLock);
+
+		for (const auto & family : perType)
+		{
+			append("# HELP %s %s\n# TYPE %s counter\n", family.name, family.help, family.name);
+			for (size_t type = 0; type < messageTypes; ++type)
+			{
+				if (const std::uint64_t total = sumcounter(family.base + type))
+					append("%s{type=\"%s\"} %llu\n", family.name, family.typeNames[type], (unsigned long long)total);
+			}
+		}
+		append("# HELP relay_connects_total Clients connected.\n# TYPE relay_connects_total counter\nrelay_connects_total %llu\n",
+			(unsigned long long)sumcounter(Connects));
+		append("# HELP relay_disconnects_total Clients disconnected.\n# TYPE relay_disconnects_total counter\nrelay_disconnects_total %llu\n",
+			(unsigned long long)sumcounter(Disconnects));
+
+		for (size_t g = 0; g < (size_t)gauge::Count; ++g)
+		{
+			append("# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gaugeInfo[g].name, gaugeInfo[g].help, gaugeInfo[g].name,
+				gaugeInfo[g].name, (long long)gauges[g].load(std::memory_order_relaxed));
+		}
+
+		for (size_t h = 0; h < (size_t)histogram::Count; ++h)
+		{
+			const histograminfo & info = histogramInfo[h];
+			append("# HELP %s %s\n# TYPE %s histogram\n", info.name, info.help, info.name);
+
+			std::uint64_t cumulative = 0, sum = 0;
+			for (const auto & s : shards)
+				sum += s.second->sums[h].load(std::memory_order_relaxed);
+			for (size_t b = 0; b < bucketCount; ++b)
+			{
+				for (const auto & s : shards)
+					cumulative += s.second->buckets[h][b].load(std::memory_order_relaxed);
+				// A fixed range of bucket bounds, so every scrape has the same series
+				const std::uint64_t upper = bucketmax(b);
+				if (upper >= info.exportMin && upper <= info.exportMax)
+					append("%s_bucket{le=\"%.9g\"} %llu\n", info.name, (double)upper * info.scale, (unsigned long long)cumulative);
+			}
+			append("%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count %llu\n", info.name, (unsigned long long)cumulative,
+				info.name, (double)sum * info.scale, info.name, (unsigned long long)cumulative);
+		}
+		return out;
+	}
+};
+
+#endif
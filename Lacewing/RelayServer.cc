@@ -13,11 +13,17 @@
 
 #include "deps/utf8proc.h"
 #include "IDPool.h"
+#include "SnapshotList.h"
+#include "FanoutPool.h"
+#include "IPBanList.h"
+#include "SlabAllocator.h"
 #include "FrameReader.h"
 #include "FrameBuilder.h"
 #include "MessageReader.h"
 #include "MessageBuilder.h"
 #include <vector>
+#include <array>
+#include <algorithm>
 #include <sstream>
 #include <chrono>
 #include <assert.h>
@@ -31,6 +37,7 @@
 extern "C" {
 	size_t lwp_stream_write(lw_stream ctx, const char* buffer, size_t size, int flags);
 	void* lw_server_client_get_relay_tag(lw_server_client client);
+	size_t lwp_chunkpool_trim(size_t keep);
 	void lw_server_client_set_relay_tag(lw_server_client client, void* ptr);
 	void lw_server_client_set_websocket(lw_server_client client, lw_bool isWebSocket);
 }
@@ -41,6 +48,31 @@ extern "C" {
 namespace lacewing
 {
 void serverpingtimertick  (lacewing::timer timer);
+void serverqueuelimittimertick (lacewing::timer timer);
+void serverratelimittimertick (lacewing::timer timer);
+void serverconflationtimertick (lacewing::timer timer);
+void handlermetricsget (lacewing::webserver webserver, lacewing::webserver_request req);
+void handlermetricserror (lacewing::webserver webserver, lacewing::error error);
+
+/// <summary> Error text for client_messagehandler. The stream is only made once something is written,
+/// 		  so the usual, error-free message costs no stringstream construction. </summary>
+class lazyerrorstream
+{
+	std::unique_ptr<std::stringstream> stream;
+public:
+	template<class T>
+	lazyerrorstream & operator << (const T & part)
+	{
+		if (!stream)
+			stream = std::make_unique<std::stringstream>();
+		*stream << part;
+		return *this;
+	}
+	std::string str() const
+	{
+		return stream ? stream->str() : std::string();
+	}
+};
 
 struct relayserverinternal
 {
@@ -54,23 +86,33 @@ struct relayserverinternal
 	relayserver::handler_connect		  handlerconnect;
 	relayserver::handler_disconnect		  handlerdisconnect;
 	relayserver::handler_error			  handlererror;
+	relayserver::handler_errorevent		  handlererrorevent;
 	relayserver::handler_message_server   handlermessage_server;
 	relayserver::handler_message_channel  handlermessage_channel;
 	relayserver::handler_message_peer	  handlermessage_peer;
+	// Borrowed-reference versions; only one of each pair is set
+	relayserver::handler_message_server_ref   handlermessage_server_ref;
+	relayserver::handler_message_channel_ref  handlermessage_channel_ref;
+	relayserver::handler_message_peer_ref	  handlermessage_peer_ref;
 	relayserver::handler_channel_join	  handlerchannel_join;
 	relayserver::handler_channel_leave	  handlerchannel_leave;
 	relayserver::handler_channel_close	  handlerchannel_close;
 	relayserver::handler_nameset		  handlernameset;
 
 	relayserverinternal(relayserver &_server, pump pump) noexcept
-		: server(_server), pingtimer(lacewing::timer_new(pump))
+		: server(_server), pingtimer(lacewing::timer_new(pump)), queuelimittimer(lacewing::timer_new(pump)),
+		ratelimittimer(lacewing::timer_new(pump)), conflationtimer(lacewing::timer_new(pump))
 	{
 		handlerconnect			= 0;
 		handlerdisconnect		= 0;
 		handlererror			= 0;
+		handlererrorevent		= 0;
 		handlermessage_server	= 0;
 		handlermessage_channel	= 0;
 		handlermessage_peer		= 0;
+		handlermessage_server_ref	= 0;
+		handlermessage_channel_ref	= 0;
+		handlermessage_peer_ref		= 0;
 		handlerchannel_join		= 0;
 		handlerchannel_leave	= 0;
 		handlerchannel_close	= 0;
@@ -105,6 +147,18 @@ struct relayserverinternal
 		maxInactivityMS = 10 * 60 * 1000;
 
 		channellistingenabled = true;
+
+		queuelimittimer->tag(this);
+		queuelimittimer->on_tick(serverqueuelimittimertick);
+		ratelimittimer->tag(this);
+		ratelimittimer->on_tick(serverratelimittimertick);
+		conflationtimer->tag(this);
+		conflationtimer->on_tick(serverconflationtimertick);
+
+		metricsserver = lacewing::webserver_new(pump);
+		metricsserver->tag(this);
+		metricsserver->on_get(handlermetricsget);
+		metricsserver->on_error(handlermetricserror);
 	}
 	~relayserverinternal() noexcept
 	{
@@ -116,7 +170,7 @@ struct relayserverinternal
 		auto serverUDPWriteLock = server.lock_udp.createWriteLock();
 
 		// TODO: Will this ever be non-empty?
-		for (auto& c : clients)
+		for (auto& c : clients.read())
 		{
 			auto cliWriteLock = c->lock.createWriteLock();
 			c->channels.clear(); // no channel leave messages from dtor
@@ -124,7 +178,7 @@ struct relayserverinternal
 		}
 		clients.clear();
 
-		for (auto& c : channels)
+		for (auto& c : channels.read())
 		{
 			auto chWriteLock = c->lock.createWriteLock();
 			c->clients.clear(); // prevent channel dtor using already mem-free'd clients
@@ -134,6 +188,17 @@ struct relayserverinternal
 
 		lacewing::timer_delete(pingtimer);
 		pingtimer = nullptr;
+		lacewing::timer_delete(queuelimittimer);
+		queuelimittimer = nullptr;
+		lacewing::timer_delete(ratelimittimer);
+		ratelimittimer = nullptr;
+		lacewing::timer_delete(conflationtimer);
+		conflationtimer = nullptr;
+		metricsserver->on_get(nullptr);
+		metricsserver->on_error(nullptr);
+		metricsserver->unhost();
+		lacewing::webserver_delete(metricsserver);
+		metricsserver = nullptr;
 	}
 
 	IDPool clientids;
@@ -146,17 +211,107 @@ struct relayserverinternal
 	// events fired but not responded to)
 	// Excess will be disconnected without On Connect being fired for them.
 	size_t numPendingConnectsPerIP;
+	// relayserver::banip() bans; checked by generic_handlerconnect(), and expired by pingtimertick()
+	mutable std::mutex bansLock;
+	ipbanlist bans;
 
 	std::string welcomemessage;
 
-	std::vector<std::shared_ptr<relayserver::client>> clients;
-	std::vector<std::shared_ptr<relayserver::channel>> channels;
+	// Readers use read() without locking; changes need lock_clientlist/lock_channellist write-locked.
+	snapshotlist<relayserver::client> clients;
+	snapshotlist<relayserver::channel> channels;
 
 	bool channellistingenabled;
+	// Channels with this many clients or more split PeerToChannel sends over fanoutworkers; 0 for never
+	size_t fanoutthreshold = 0;
+	fanoutpool fanoutworkers;
+	// Serializes the fan-out workers' lw_udp sends. lock_udp keeps other pump threads out, but it's a no-op
+	// in LW_RWLOCK_POLICY_NONE builds, and the workers still run in parallel there.
+	std::mutex fanoutudplock;
+	// Cap on each client's queued outgoing bytes, and what to do past it; see relayserver::setqueuedbytelimit()
+	size_t maxqueuedbytes = 0;
+	relayserver::queuelimitpolicy queuepolicy = relayserver::queuelimitpolicy::disconnect;
+	// Guards pausedsenders and ratepausedclients; the pauses are applied by whichever thread relayed or received
+	// the message, and lifted by the pump's timers. Never held while resuming a read, which may pause again.
+	std::mutex pausedLock;
+	// Senders paused by queuelimitpolicy::pausesender, each with the receiver it's waiting on
+	std::vector<std::pair<std::weak_ptr<relayserver::client>, std::weak_ptr<relayserver::client>>> pausedsenders;
+	timer queuelimittimer;
+	// setratelimit() limits: [0] per client, [1] per IP, [2 + type] per client message type. Guarded by ratelimitLock;
+	// changing them bumps ratelimitgeneration, so buckets are set up again on their clients' next message.
+	std::mutex ratelimitLock;
+	relayserver::ratelimit ratelimits[2 + 16];
+	bool typeratelimiting = false;
+	std::atomic<unsigned int> ratelimitgeneration = 1;
+	std::atomic<bool> ratelimiting = false;
+	// Buckets for each IP with a connected client, keyed by its in6_addr bytes; pruned by pingtimertick
+	std::mutex ipratebucketsLock;
+	std::unordered_map<std::string, std::weak_ptr<relayserver::ipratebuckets>> ipratebuckets;
+	// Clients paused by ratelimitpolicy::delayreads until their buckets refill. Pump thread only.
+	std::vector<std::weak_ptr<relayserver::client>> ratepausedclients;
+	timer ratelimittimer;
+	// pseudoUDP clients holding conflated blasted frames, flushed by conflationtimer as their sockets drain
+	std::mutex conflatingLock;
+	std::vector<std::weak_ptr<relayserver::client>> conflatingclients;
+	timer conflationtimer;
 	long tcpPingMS;
 	long maxNoConnectApprovedMS;
 	long udpKeepAliveMS;
 	long maxInactivityMS;
+	// Clients with no channel/peer/server messages for this long are compacted by pingtimertick; 0 for never
+	long idleCompactMS = 60 * 1000;
+
+	/// <summary> Rate limit state for one relayserver::errorkind. Approximate under races, which is fine for logging. </summary>
+	struct errorlimit
+	{
+		std::atomic<unsigned int> perSecond = 20;
+		std::atomic<lw_i64> windowStartMS = 0;
+		std::atomic<unsigned int> inWindow = 0;
+		// Suppressed since the last raised, and in total
+		std::atomic<size_t> pendingSuppressed = 0, totalSuppressed = 0;
+	};
+	std::array<errorlimit, (size_t)relayserver::errorkind::Count> errorlimits;
+
+	// Recorded on whichever thread does the work; read by metricsserver's scrapes without relay locks
+	relaymetrics metrics;
+	// Serves relayserver::metricstext(); see relayserver::host_metrics()
+	lacewing::webserver metricsserver;
+
+	/// <summary> Passes ev to the errorevent handler, or formats it for the error handler, unless its kind
+	/// 		  is over its rate limit, in which case it's only counted. </summary>
+	void raiseerror(relayserver::errorevent &ev)
+	{
+		if (!handlererrorevent && !handlererror)
+			return;
+
+		errorlimit &limit = errorlimits[(size_t)ev.kind];
+		if (const unsigned int perSecond = limit.perSecond.load(std::memory_order_relaxed))
+		{
+			const lw_i64 nowMS = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+			lw_i64 windowStart = limit.windowStartMS.load(std::memory_order_relaxed);
+			if (nowMS - windowStart >= 1000 && limit.windowStartMS.compare_exchange_strong(windowStart, nowMS))
+				limit.inWindow.store(0, std::memory_order_relaxed);
+			if (limit.inWindow.fetch_add(1, std::memory_order_relaxed) >= perSecond)
+			{
+				limit.pendingSuppressed.fetch_add(1, std::memory_order_relaxed);
+				limit.totalSuppressed.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+		}
+		ev.suppressed = limit.pendingSuppressed.exchange(0, std::memory_order_relaxed);
+
+		if (handlererrorevent)
+		{
+			handlererrorevent(server, ev);
+			return;
+		}
+		const std::string text = ev.tostring();
+		lacewing::error error = lacewing::error_new();
+		error->add("%s", text.c_str());
+		handlererror(server, error);
+		lacewing::error_delete(error);
+	}
 
 	/// <summary> Lacewing timer function for pinging and inactivity tests. </summary>
 	///	<remarks> There are three things this function does:
@@ -176,19 +331,24 @@ struct relayserverinternal
 	{
 		std::vector<std::shared_ptr<relayserver::client>> pingUnresponsivesToDisconnect;
 		std::vector<std::shared_ptr<relayserver::client>> inactivesToDisconnects;
+		std::vector<std::shared_ptr<relayserver::client>> idlesToCompact;
 
 		framebuilder msgBuilderTCP(false), msgBuilderUDP(true);
 		msgBuilderTCP.addheader(11, 0);			/* ping header */
 		msgBuilderUDP.addheader(11, 0, true);	/* ping header, true for UDP */
 
 		std::chrono::steady_clock::time_point currentTime = std::chrono::steady_clock::now();
-		auto serverClientListReadLock = server.lock_clientlist.createReadLock();
+		size_t queuedBytes = 0, maxClientQueuedBytes = 0, pingsSent = 0;
 		auto serverUDPWriteLock = server.lock_udp.createWriteLock();
-		for (const auto& client : clients)
+		for (const auto& client : clients.read())
 		{
 			if (client->_readonly)
 				continue;
 
+			const size_t clientQueuedBytes = client->queuedbytes();
+			queuedBytes += clientQueuedBytes;
+			maxClientQueuedBytes = std::max(maxClientQueuedBytes, clientQueuedBytes);
+
 			auto msElapsedTCP = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - client->lasttcpmessagetime).count();
 			auto msElapsedNonPing = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - client->lastchannelorpeermessagetime).count();
 
@@ -204,6 +364,13 @@ struct relayserverinternal
 				continue;
 			}
 
+			// Gone quiet since we last looked; give back buffers grown while it was busy
+			if (idleCompactMS != 0 && msElapsedNonPing > idleCompactMS &&
+				client->compactedat != client->lastchannelorpeermessagetime)
+			{
+				idlesToCompact.push_back(client);
+			}
+
 			// Psuedo UDP is true unless a UDPHello packet is received, i.e. the client connect handshake UDP packet.
 			decltype(msElapsedTCP) msElapsedUDP = 0;
 			if (!client->pseudoUDP)
@@ -244,7 +411,9 @@ struct relayserverinternal
 			if (msElapsedTCP >= tcpPingMS)
 			{
 				client->pongedOnTCP = false;
+				client->pingsentat = currentTime;
 				msgBuilderTCP.send(client->socket, false);
+				++pingsSent;
 			}
 
 			// Keep UDP alive by sending a UDP message.
@@ -257,10 +426,38 @@ struct relayserverinternal
 				msgBuilderUDP.send(server.udp, client->udpaddress, false);
 		}
 
+		metrics.sent(11, pingsSent, 0);
+		metrics.set(relaymetrics::gauge::Clients, (lw_i64)clients.size());
+		metrics.set(relaymetrics::gauge::Channels, (lw_i64)channels.size());
+		metrics.set(relaymetrics::gauge::QueuedBytes, (lw_i64)queuedBytes);
+		metrics.set(relaymetrics::gauge::MaxClientQueuedBytes, (lw_i64)maxClientQueuedBytes);
+
+		if (!idlesToCompact.empty())
+		{
+			for (const auto& client : idlesToCompact)
+				compactclient(*client);
+			lwp_chunkpool_trim(32); // idle stream chunks kept for reuse; 512KB
+		}
+
+		{
+			std::lock_guard<std::mutex> bansGuard(bansLock);
+			bans.expire(currentTime);
+		}
+
+		// Lists replaced while a long read was running are otherwise kept until the next change
+		clients.reclaim();
+		channels.reclaim();
+
+		// Per-IP rate buckets whose clients have all gone
+		{
+			std::lock_guard<std::mutex> ipBucketsGuard(ipratebucketsLock);
+			for (auto it = ipratebuckets.begin(); it != ipratebuckets.end(); )
+				it = it->second.expired() ? ipratebuckets.erase(it) : std::next(it);
+		}
+
 		if (pingUnresponsivesToDisconnect.empty() && inactivesToDisconnects.empty())
 			return;
 
-		serverClientListReadLock.lw_unlock();
 		serverUDPWriteLock.lw_unlock();
 
 		// Loop all pending ping disconnects
@@ -270,14 +467,9 @@ struct relayserverinternal
 			if (client->_readonly)
 				continue;
 
-			// To allow client disconnect handlers to run without clashes, we keep the lock open
-			// as frequently as possible.
-			if (!serverClientListReadLock.isEnabled())
-				serverClientListReadLock.lw_relock();
-
-			if (std::find(clients.begin(), clients.end(), client) != clients.end())
+			// Earlier disconnects may have dropped this client; check the current list, not our snapshot
+			if (clients.contains(client))
 			{
-				serverClientListReadLock.lw_unlock();
 				auto clientWriteLock = client->lock.createWriteLock();
 				if (client->_readonly)
 					continue;
@@ -318,12 +510,8 @@ struct relayserverinternal
 			if (client->_readonly)
 				continue;
 
-			if (!serverClientListReadLock.isEnabled())
-				serverClientListReadLock.lw_relock();
-			if (std::find(clients.begin(), clients.end(), client) != clients.end())
+			if (clients.contains(client))
 			{
-				serverClientListReadLock.lw_unlock();
-
 				auto clientWriteLock = client->lock.createWriteLock();
 				if (client->_readonly)
 					continue;
@@ -349,6 +537,101 @@ struct relayserverinternal
 		}
 	}
 
+	/// <summary> Checks receiver's outgoing queue against maxqueuedbytes before a message is written to it.
+	/// 		  Returns false if the message should be dropped. Sets overLimit if queuelimitexceeded() must be
+	/// 		  called once the receiver's lock is released. Call with the receiver's lock held; safe from fan-out workers. </summary>
+	bool checkqueuelimit(relayserver::client &receiver, bool blasted, bool &overLimit) const
+	{
+		overLimit = false;
+		if (maxqueuedbytes == 0 || receiver.socket->queued() <= maxqueuedbytes)
+			return true;
+
+		switch (queuepolicy)
+		{
+			case relayserver::queuelimitpolicy::dropnewblasted:
+				return !blasted;
+			case relayserver::queuelimitpolicy::pausesender:
+				overLimit = true;
+				return true;
+			default: // disconnect
+				overLimit = true;
+				return false;
+		}
+	}
+
+	/// <summary> Releases what an idle client doesn't need to keep: its message reassembly buffer, spare
+	/// 		  string and vector capacity, and its hold on its previous name. Pump thread only. </summary>
+	void compactclient(relayserver::client &client)
+	{
+		auto cliWriteLock = client.lock.createWriteLock();
+		if (client._readonly)
+			return;
+
+		client.compactedat = client.lastchannelorpeermessagetime;
+		client.reader.compact();
+		client._prevname = internedname();
+		client.clientImplStr.shrink_to_fit();
+		client.channels.shrink_to_fit();
+		if (client.conflated.empty())
+			decltype(client.conflated)().swap(client.conflated); // drop the bucket array
+	}
+
+	void queuelimitexceeded(relayserver::client &sender, relayserver::client &receiver);
+	void queuelimittimertick();
+	bool stillpaused(const std::shared_ptr<relayserver::client> &client) const;
+
+	bool checkratelimit(relayserver::client &client, lw_ui8 messagetypeid, size_t bytes,
+		relayserver::ratelimitpolicy &policy, std::string_view &scope);
+	void setupratebuckets(relayserver::client &client, std::chrono::steady_clock::time_point now);
+	bool ratelimitindebt(relayserver::client &client, std::chrono::steady_clock::time_point now);
+	void ratelimitpause(relayserver::client &client);
+	void ratelimittimertick();
+
+	/// <summary> Key for client::conflated; a newer blasted message with the same key makes an unsent one stale.
+	/// 		  Use 0xFFFF for channel or sender when the message has none. </summary>
+	static lw_ui64 conflationkey(lw_ui8 typeAndVariant, lw_ui16 channelID, lw_ui16 senderID, lw_ui8 subchannel)
+	{
+		return ((lw_ui64)typeAndVariant << 40) | ((lw_ui64)channelID << 24) | ((lw_ui64)senderID << 8) | subchannel;
+	}
+
+	/// <summary> Writes an encoded blasted frame to a pseudoUDP client. If the socket already has data queued, the frame
+	/// 		  replaces any unsent one with the same key instead, so a slow client gets the latest state rather than
+	/// 		  a growing backlog. Returns true if the client then needs passing to addconflating(), once locks are released.
+	/// 		  Call with the receiver's write lock held; safe from fan-out workers. </summary>
+	static bool blastpseudoudp(relayserver::client &receiver, lw_ui64 key, std::string_view frame)
+	{
+		if (receiver.socket->queued() != 0)
+		{
+			const bool first = receiver.conflated.empty();
+			receiver.conflated[key].assign(frame.data(), frame.size());
+			return first;
+		}
+
+		// Drained since the timer last looked; older frames for other keys go first
+		receiver.conflated.erase(key);
+		flushconflated(receiver);
+		writeencoded(receiver, frame);
+		return false;
+	}
+
+	static void writeencoded(relayserver::client &receiver, std::string_view frame)
+	{
+		if (receiver.socket->is_websocket())
+			lwp_stream_write((lw_stream)receiver.socket, frame.data(), frame.size(), 2 /* lwp_stream_write_ignore_busy */);
+		else
+			receiver.socket->write(frame.data(), frame.size());
+	}
+
+	static void flushconflated(relayserver::client &receiver)
+	{
+		for (const auto &f : receiver.conflated)
+			writeencoded(receiver, f.second);
+		receiver.conflated.clear();
+	}
+
+	void addconflating(const std::shared_ptr<relayserver::client> &client);
+	void conflationtimertick();
+
 	// for debug
 	void makestrstrerror(std::stringstream &err)
 	{
@@ -360,12 +643,12 @@ struct relayserverinternal
 	}
 
 	// Called by program and by library
-	void channel_addclient(std::shared_ptr<relayserver::channel> channel, std::shared_ptr<relayserver::client> client);
-	void channel_removeclient(std::shared_ptr<relayserver::channel> channel, std::shared_ptr<relayserver::client> client);
+	void channel_addclient(const std::shared_ptr<relayserver::channel> &channel, const std::shared_ptr<relayserver::client> &client);
+	void channel_removeclient(const std::shared_ptr<relayserver::channel> &channel, const std::shared_ptr<relayserver::client> &client);
 
 	// Cleans up these
-	void close_channel(std::shared_ptr<relayserver::channel> channel);
-	void close_client(std::shared_ptr<relayserver::client> client);
+	void close_channel(const std::shared_ptr<relayserver::channel> &channel);
+	void close_client(const std::shared_ptr<relayserver::client> &client);
 
 	void generic_handlerconnect(lacewing::server server, lacewing::server_client clientsocket);
 	void generic_handlerdisconnect(lacewing::server server, lacewing::server_client clientsocket);
@@ -375,7 +658,7 @@ struct relayserverinternal
 	// Don't ask
 	static bool tcpmessagehandler(void * tag, lw_ui8 type, const char * message, size_t size);
 	// Used to be inside client, but we need the shared ptr
-	bool client_messagehandler(std::shared_ptr<relayserver::client> client, lw_ui8 type, std::string_view message, bool blasted);
+	bool client_messagehandler(const std::shared_ptr<relayserver::client> &client, lw_ui8 type, std::string_view message, bool blasted);
 
 	// Limiters applied to names and messages by relayserver
 	codepointsallowlist unicodeLimiters[4];
@@ -403,16 +686,14 @@ void relayserverinternal::generic_handlerudpreceive(lacewing::udp udp, lacewing:
 
 	data.remove_prefix(sizeof(type) + sizeof(id));
 
-	auto serverClientListReadLock = server.lock_clientlist.createReadLock();
-	for (const auto& clientsocket : clients)
+	const lacewing::udpendpoint from(address);
+
+	const auto clientList = clients.read();
+	for (const auto& clientsocket : clientList)
 	{
 		if (clientsocket->_id == id)
 		{
-			serverClientListReadLock.lw_unlock();
-			// Pay close attention to this * here. You can do
-			// lacewing::address == lacewing::_address, but
-			// not any other combo.
-			if (*clientsocket->udpaddress != address)
+			if (!clientsocket->udpaddress.sameip(from))
 			{
 				// A client ID was used by the wrong IP... hack attempt?
 				// Can occasionally occur during legitimate disconnects, but rarely (?)
@@ -425,7 +706,7 @@ void relayserverinternal::generic_handlerudpreceive(lacewing::udp udp, lacewing:
 				std::shared_ptr<relayserver::client> realSender = nullptr;
 				for (const auto& cs : clients)
 				{
-					if (*cs->udpaddress == address)
+					if (cs->udpaddress.sameip(from))
 					{
 						realSender = cs;
 						break;
@@ -459,14 +740,13 @@ void relayserverinternal::generic_handlerudpreceive(lacewing::udp udp, lacewing:
 				clientsocket->pseudoUDP = false;
 			}
 
-			clientsocket->udpaddress->port(address->port());
+			clientsocket->udpaddress.port(from.port());
 			client_messagehandler(clientsocket, type, data, true);
 
 			return;
 		}
 	}
 
-	serverClientListReadLock.lw_unlock();
 #if 0
 	// http://web.archive.org/web/20020609030916/http://www.gamehigh.net/document/netdocs/docs/ping_src.htm
 
@@ -607,7 +887,7 @@ void relayserverinternal::generic_handlerudpreceive(lacewing::udp udp, lacewing:
 	std::vector<relayserver::client *> todrop;
 	for (const auto& clientsocket : internal.clients)
 	{
-		if (*clientsocket->udpaddress == address)
+		if (clientsocket->udpaddress.sameip(address))
 			todrop.push_back(clientsocket);
 	}
 
@@ -640,9 +920,8 @@ bool relayserverinternal::tcpmessagehandler (void * tag, lw_ui8 type, const char
 {
 	auto clientPtr = ((relayserver::client *) tag);
 	auto& server = clientPtr->server;
-	auto clientIt = std::find_if(server.clients.cbegin(), server.clients.cend(),
-		[=](auto const &p) { return p.get() == clientPtr; });
-	if (clientIt == server.clients.cend())
+	const auto clientShd = server.clients.find(clientPtr);
+	if (!clientShd)
 	{
 		lacewing::error error = lacewing::error_new();
 		error->add("Dropped TCP message, shared client ptr not found");
@@ -651,13 +930,349 @@ bool relayserverinternal::tcpmessagehandler (void * tag, lw_ui8 type, const char
 		return false;
 	}
 
-	return clientPtr->server.client_messagehandler(*clientIt, type, std::string_view(message, size), false);
+	return clientPtr->server.client_messagehandler(clientShd, type, std::string_view(message, size), false);
 }
 
 void serverpingtimertick (lacewing::timer timer)
 {   ((relayserverinternal *) timer->tag())->pingtimertick();
 }
 
+/// <summary> Applies queuepolicy to receiver, which checkqueuelimit() found over maxqueuedbytes while relaying
+/// 		  a message from sender. Pump thread only, with no client locks held. </summary>
+void relayserverinternal::queuelimitexceeded(relayserver::client &sender, relayserver::client &receiver)
+{
+	if (queuepolicy == relayserver::queuelimitpolicy::disconnect)
+	{
+		auto clientWriteLock = receiver.lock.createWriteLock();
+		if (receiver._readonly)
+			return;
+		receiver._readonly = true;
+
+		auto error = lacewing::error_new();
+		error->add("Disconnecting client ID %hu as it has %zu bytes of messages queued, over the limit of %zu",
+			receiver._id, receiver.socket->queued(), maxqueuedbytes);
+		handlererror(this->server, error);
+		lacewing::error_delete(error);
+
+		clientWriteLock.lw_unlock();
+		if (receiver.socket->is_websocket())
+			receiver.disconnect(1000);
+		else // It's not reading what we've got already, so don't wait for it to
+			receiver.socket->close(lw_true);
+		return;
+	}
+
+	// pausesender
+	if (sender._readonly)
+		return;
+
+	{
+		std::lock_guard<std::mutex> pausedGuard(pausedLock);
+		for (const auto &p : pausedsenders)
+		{
+			if (p.first.lock().get() == &sender && p.second.lock().get() == &receiver)
+				return;
+		}
+
+		if (pausedsenders.empty())
+			queuelimittimer->start(100);
+		pausedsenders.push_back(std::make_pair(sender.retain(), receiver.retain()));
+	}
+	sender.socket->read_pause(true);
+}
+
+/// <summary> True if pausedsenders or ratepausedclients still hold client. Call with pausedLock held. </summary>
+bool relayserverinternal::stillpaused(const std::shared_ptr<relayserver::client> &client) const
+{
+	return std::any_of(pausedsenders.cbegin(), pausedsenders.cend(),
+		[&](const auto &p) { return p.first.lock() == client; }) ||
+		std::any_of(ratepausedclients.cbegin(), ratepausedclients.cend(),
+		[&](const auto &c) { return c.lock() == client; });
+}
+
+/// <summary> Resumes senders paused by queuelimitpolicy::pausesender once their receivers have drained
+/// 		  to half of maxqueuedbytes, disconnected, or the limit was lifted. </summary>
+void relayserverinternal::queuelimittimertick()
+{
+	// Receivers are checked without pausedLock, as queuedbytes() takes the receiver's lock, and pauses are
+	// added with client locks held
+	std::vector<std::pair<std::shared_ptr<relayserver::client>, std::shared_ptr<relayserver::client>>> drained;
+	{
+		std::lock_guard<std::mutex> pausedGuard(pausedLock);
+		for (const auto &p : pausedsenders)
+			drained.emplace_back(p.first.lock(), p.second.lock());
+	}
+	drained.erase(std::remove_if(drained.begin(), drained.end(), [&](const auto &p) {
+		return p.first && p.second && !p.second->_readonly && maxqueuedbytes != 0 &&
+			p.second->queuedbytes() > maxqueuedbytes / 2;
+	}), drained.end());
+
+	std::vector<std::shared_ptr<relayserver::client>> toResume;
+	std::unique_lock<std::mutex> pausedGuard(pausedLock);
+	for (auto it = pausedsenders.begin(); it != pausedsenders.end(); )
+	{
+		const auto sender = it->first.lock(), receiver = it->second.lock();
+		if (sender && receiver && std::none_of(drained.cbegin(), drained.cend(),
+			[&](const auto &p) { return p.first == sender && p.second == receiver; }))
+		{
+			++it;
+			continue;
+		}
+		it = pausedsenders.erase(it);
+		if (sender && !sender->_readonly)
+			toResume.push_back(sender);
+	}
+
+	if (pausedsenders.empty())
+		queuelimittimer->stop();
+
+	// Resuming reads what arrived meanwhile right away, which may pause senders again, so do it last
+	toResume.erase(std::remove_if(toResume.begin(), toResume.end(),
+		[&](const auto &sender) { return stillpaused(sender); }), toResume.end());
+	pausedGuard.unlock();
+	for (const auto &sender : toResume)
+	{
+		if (!sender->_readonly)
+			sender->socket->read_pause(false);
+	}
+}
+
+void serverqueuelimittimertick (lacewing::timer timer)
+{   ((relayserverinternal *) timer->tag())->queuelimittimertick();
+}
+
+struct relayserver::ipratebuckets
+{
+	std::mutex lock;
+	unsigned int generation = 0;
+	ratebuckets buckets;
+};
+
+static void configureratebuckets(relayserver::ratebuckets &buckets, const relayserver::ratelimit &limit,
+	std::chrono::steady_clock::time_point now)
+{
+	buckets.messages.configure(limit.messagesPerSecond, limit.messagesPerSecond * limit.burstSeconds, now);
+	buckets.bytes.configure(limit.bytesPerSecond, limit.bytesPerSecond * limit.burstSeconds, now);
+	buckets.policy = limit.policy;
+}
+
+/// <summary> Sets client's buckets up for the current ratelimits. Call with client.ratelimitlock held. </summary>
+void relayserverinternal::setupratebuckets(relayserver::client &client, std::chrono::steady_clock::time_point now)
+{
+	std::lock_guard<std::mutex> rateLimitGuard(ratelimitLock);
+	configureratebuckets(client.clientratebuckets, ratelimits[0], now);
+
+	if (!typeratelimiting)
+		client.typeratebuckets.reset();
+	else
+	{
+		if (!client.typeratebuckets)
+			client.typeratebuckets = std::make_unique<relayserver::ratebuckets[]>(16);
+		for (size_t i = 0; i < 16; ++i)
+			configureratebuckets(client.typeratebuckets[i], ratelimits[2 + i], now);
+	}
+
+	// The IP's buckets are shared, so they're set up under their own lock, by checkratelimit()
+	if (ratelimits[1].messagesPerSecond <= 0 && ratelimits[1].bytesPerSecond <= 0)
+		client.ipbuckets.reset();
+	else if (!client.ipbuckets)
+	{
+		std::lock_guard<std::mutex> ipBucketsGuard(ipratebucketsLock);
+		auto &entry = ipratebuckets[std::string((const char *)&client.addressInt, sizeof(client.addressInt))];
+		client.ipbuckets = entry.lock();
+		if (!client.ipbuckets)
+		{
+			client.ipbuckets = std::make_shared<relayserver::ipratebuckets>();
+			entry = client.ipbuckets;
+		}
+	}
+	client.ratelimitgeneration = ratelimitgeneration.load(std::memory_order_relaxed);
+}
+
+/// <summary> Checks a received message against the setratelimit() limits. Returns true if it's within them all.
+/// 		  Otherwise sets policy and scope to the most severe limit it's over. The message's cost is spent
+/// 		  from all the buckets if it'll be handled, i.e. it passed or policy is delayreads. </summary>
+bool relayserverinternal::checkratelimit(relayserver::client &client, lw_ui8 messagetypeid, size_t bytes,
+	relayserver::ratelimitpolicy &policy, std::string_view &scope)
+{
+	const auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> clientRateGuard(client.ratelimitlock);
+	if (client.ratelimitgeneration != ratelimitgeneration.load(std::memory_order_acquire))
+		setupratebuckets(client, now);
+
+	// Client and IP limits are on server, channel and peer messages; dropping requests would leave clients
+	// waiting on replies, so only a limit on their type ID applies to them
+	const bool relayed = messagetypeid >= 1 && messagetypeid <= 6;
+	std::unique_lock<std::mutex> ipRateLock;
+	relayserver::ratebuckets * const checks[] = {
+		relayed ? &client.clientratebuckets : nullptr,
+		client.typeratebuckets ? &client.typeratebuckets[messagetypeid & 15] : nullptr,
+		relayed && client.ipbuckets ? &client.ipbuckets->buckets : nullptr
+	};
+	static constexpr std::string_view scopes[] = { "client"sv, "message type"sv, "IP"sv };
+	if (checks[2])
+	{
+		ipRateLock = std::unique_lock<std::mutex>(client.ipbuckets->lock);
+		const unsigned int generation = ratelimitgeneration.load(std::memory_order_acquire);
+		if (client.ipbuckets->generation != generation)
+		{
+			std::lock_guard<std::mutex> rateLimitGuard(ratelimitLock);
+			configureratebuckets(client.ipbuckets->buckets, ratelimits[1], now);
+			client.ipbuckets->generation = generation;
+		}
+	}
+
+	bool over = false;
+	for (size_t i = 0; i < std::size(checks); ++i)
+	{
+		if (!checks[i] || (checks[i]->messages.fits(1, now) && checks[i]->bytes.fits((double)bytes, now)))
+			continue;
+		if (!over || checks[i]->policy > policy)
+		{
+			policy = checks[i]->policy;
+			scope = scopes[i];
+		}
+		over = true;
+	}
+
+	if (over && policy != relayserver::ratelimitpolicy::delayreads)
+		return false;
+	for (auto buckets : checks)
+	{
+		if (!buckets)
+			continue;
+		buckets->messages.spend(1);
+		buckets->bytes.spend((double)bytes);
+	}
+	return !over;
+}
+
+/// <summary> True if any of client's buckets are still paying off ratelimitpolicy::delayreads messages. False if
+/// 		  the limits have changed since, so it's resumed and set up for the new limits on its next message. </summary>
+bool relayserverinternal::ratelimitindebt(relayserver::client &client, std::chrono::steady_clock::time_point now)
+{
+	std::lock_guard<std::mutex> clientRateGuard(client.ratelimitlock);
+	if (client.ratelimitgeneration != ratelimitgeneration.load(std::memory_order_acquire))
+		return false;
+
+	const auto indebt = [&](relayserver::ratebuckets &buckets) {
+		return buckets.messages.indebt(now) || buckets.bytes.indebt(now);
+	};
+	if (indebt(client.clientratebuckets))
+		return true;
+	if (client.typeratebuckets)
+	{
+		for (size_t i = 0; i < 16; ++i)
+		{
+			if (indebt(client.typeratebuckets[i]))
+				return true;
+		}
+	}
+	if (client.ipbuckets)
+	{
+		std::lock_guard<std::mutex> ipRateGuard(client.ipbuckets->lock);
+		return indebt(client.ipbuckets->buckets);
+	}
+	return false;
+}
+
+/// <summary> Stops reading from client until ratelimittimertick() finds its buckets refilled. Pump thread only. </summary>
+void relayserverinternal::ratelimitpause(relayserver::client &client)
+{
+	if (client._readonly)
+		return;
+	{
+		std::lock_guard<std::mutex> pausedGuard(pausedLock);
+		for (const auto &c : ratepausedclients)
+		{
+			if (c.lock().get() == &client)
+				return;
+		}
+
+		if (ratepausedclients.empty())
+			ratelimittimer->start(50);
+		ratepausedclients.push_back(client.retain());
+	}
+	client.socket->read_pause(true);
+}
+
+/// <summary> Resumes clients paused by ratelimitpolicy::delayreads once they're out of debt, unless
+/// 		  queuelimitpolicy::pausesender is holding them too. </summary>
+void relayserverinternal::ratelimittimertick()
+{
+	const auto now = std::chrono::steady_clock::now();
+	std::vector<std::shared_ptr<relayserver::client>> toResume;
+	std::unique_lock<std::mutex> pausedGuard(pausedLock);
+	for (auto it = ratepausedclients.begin(); it != ratepausedclients.end(); )
+	{
+		const auto client = it->lock();
+		if (client && !client->_readonly && ratelimitindebt(*client, now))
+		{
+			++it;
+			continue;
+		}
+		it = ratepausedclients.erase(it);
+		if (client && !client->_readonly)
+			toResume.push_back(client);
+	}
+
+	if (ratepausedclients.empty())
+		ratelimittimer->stop();
+
+	// As in queuelimittimertick(), resuming may handle messages and pause clients again, so do it last
+	toResume.erase(std::remove_if(toResume.begin(), toResume.end(),
+		[&](const auto &client) { return stillpaused(client); }), toResume.end());
+	pausedGuard.unlock();
+	for (const auto &client : toResume)
+	{
+		if (!client->_readonly)
+			client->socket->read_pause(false);
+	}
+}
+
+void serverratelimittimertick (lacewing::timer timer)
+{   ((relayserverinternal *) timer->tag())->ratelimittimertick();
+}
+
+/// <summary> Queues a check on a client that blastpseudoudp() started holding frames for. </summary>
+void relayserverinternal::addconflating(const std::shared_ptr<relayserver::client> &client)
+{
+	std::lock_guard<std::mutex> conflatingGuard(conflatingLock);
+	if (conflatingclients.empty())
+		conflationtimer->start(20);
+	conflatingclients.push_back(client);
+}
+
+/// <summary> Writes held-back blasted frames to clients whose sockets have drained. </summary>
+void relayserverinternal::conflationtimertick()
+{
+	std::lock_guard<std::mutex> conflatingGuard(conflatingLock);
+	for (auto it = conflatingclients.begin(); it != conflatingclients.end(); )
+	{
+		const auto client = it->lock();
+		if (client)
+		{
+			auto cliWriteLock = client->lock.createWriteLock();
+			if (!client->_readonly && !client->conflated.empty() && client->socket->queued() != 0)
+			{
+				++it;
+				continue;
+			}
+			if (!client->_readonly)
+				flushconflated(*client);
+			client->conflated.clear();
+		}
+		it = conflatingclients.erase(it);
+	}
+
+	if (conflatingclients.empty())
+		conflationtimer->stop();
+}
+
+void serverconflationtimertick (lacewing::timer timer)
+{   ((relayserverinternal *) timer->tag())->conflationtimertick();
+}
+
 std::shared_ptr<relayserver::channel> relayserver::client::readchannel(messagereader &reader)
 {
 	int channelid = reader.get <lw_ui16> ();
@@ -673,39 +1288,35 @@ std::shared_ptr<relayserver::channel> relayserver::client::readchannel(messagere
 	return nullptr;
 }
 
-void relayserver::client::PeerToPeer(relayserver &server, std::shared_ptr<relayserver::channel> channel,
-	std::shared_ptr<relayserver::client> receivingClient,
+void relayserver::client::PeerToPeer(relayserver &server, relayserver::channel &channel,
+	relayserver::client &receivingClient,
 	bool blasted, lw_ui8 subchannel, lw_ui8 variant, std::string_view message)
 {
 	relayserverinternal & serverinternal = *(relayserverinternal *)server.internaltag;
 
-	if (_id == receivingClient->_id)
+	if (_id == receivingClient._id)
 	{
-		lacewing::error error = lacewing::error_new();
-		error->add("Client ID %hu attempted to send peer message to ID %hu, e.g. themselves. Message dropped", _id, receivingClient->_id);
-		serverinternal.handlererror(server, error);
-		lacewing::error_delete(error);
+		relayserver::errorevent ev;
+		ev.kind = errorkind::PeerToSelf;
+		ev.clientID = ev.targetID = _id;
+		serverinternal.raiseerror(ev);
 		return;
 	}
 
 	int rejectedCodePoint;
 	if (variant == 0 && serverinternal.checkcodepointsallowed(codepointsallowlistindex::MessagesSentToClients, message, &rejectedCodePoint) != -1)
 	{
-		utf8proc_uint8_t rejectCharAsStr[5] = u8"(?)";
-		if (utf8proc_codepoint_valid(rejectedCodePoint))
-		{
-			utf8proc_ssize_t numBytesUsed = utf8proc_encode_char(rejectedCodePoint, rejectCharAsStr);
-			rejectCharAsStr[numBytesUsed] = '\0';
-		}
-
-		// TODO: This as an error feels awkward as it's easily flooded, but we need some log of it.
-		lacewing::error error = lacewing::error_new();
-		size_t msgPartSize = message.size(); msgPartSize = lw_min_size_t(msgPartSize, 15);
-		error->add("Dropped peer text message \"%.*hs...\" from client %hs (ID %hu) -> client %hs (ID %hu), invalid char U+%0.4X '%hs' rejected.",
-			msgPartSize, message.data(), name().c_str(), id(), receivingClient->name().c_str(), receivingClient->id(),
-			rejectedCodePoint, rejectCharAsStr);
-		serverinternal.handlererror(server, error);
-		lacewing::error_delete(error);
+		// Rate limited by raiseerror(), as a client can flood these
+		relayserver::errorevent ev;
+		ev.kind = errorkind::PeerMessageCodePoint;
+		ev.clientID = _id;
+		// name() copies under each client's read lock, as a rename may be underway on another thread
+		ev.clientName = name();
+		ev.targetID = receivingClient._id;
+		ev.targetName = receivingClient.name();
+		ev.codePoint = rejectedCodePoint;
+		ev.detail = message.substr(0, 15);
+		serverinternal.raiseerror(ev);
 		return;
 	}
 
@@ -713,27 +1324,52 @@ void relayserver::client::PeerToPeer(relayserver &server, std::shared_ptr<relays
 	builder.addheader(3, variant, blasted); /* binarypeermessage */
 
 	builder.add <lw_ui8>(subchannel);
-	builder.add <lw_ui16>(channel->_id);
+	builder.add <lw_ui16>(channel._id);
 	builder.add <lw_ui16>(_id);
 	builder.add(message);
 
 
-	auto channelReadLock = channel->lock.createReadLock();
-	if (channel->_readonly)
+	auto channelReadLock = channel.lock.createReadLock();
+	if (channel._readonly)
 		return;
 
-	auto recvCliWriteLock = receivingClient->lock.createWriteLock();
+	auto recvCliWriteLock = receivingClient.lock.createWriteLock();
 
-	if (receivingClient->_readonly)
+	if (receivingClient._readonly)
 		return;
 
-	if (blasted && !receivingClient->pseudoUDP)
+	serverinternal.metrics.sent(3, 1, message.size());
+	receivingClient.senttraffic.add(blasted, 1, message.size(), trafficcounter::nowsecond());
+
+	if (blasted && !receivingClient.pseudoUDP)
 	{
 		auto serverUDPWriteLock = server.lock_udp.createWriteLock();
-		builder.send(server.udp, receivingClient->udpaddress);
+		builder.send(server.udp, receivingClient.udpaddress);
+		return;
+	}
+
+	bool overLimit, conflating = false;
+	if (serverinternal.checkqueuelimit(receivingClient, blasted, overLimit))
+	{
+		if (blasted)
+		{
+			conflating = relayserverinternal::blastpseudoudp(receivingClient,
+				relayserverinternal::conflationkey((3 << 4) | variant, channel._id, _id, subchannel),
+				builder.encodefor(receivingClient.socket->is_websocket()));
+		}
+		else
+			builder.send(receivingClient.socket);
+	}
+
+	if (overLimit || conflating)
+	{
+		recvCliWriteLock.lw_unlock();
+		channelReadLock.lw_unlock();
+		if (conflating)
+			serverinternal.addconflating(receivingClient.retain());
+		if (overLimit)
+			serverinternal.queuelimitexceeded(*this, receivingClient);
 	}
-	else
-		builder.send(receivingClient->socket);
 }
 
 
@@ -813,6 +1449,19 @@ void handlerreceive(lacewing::server server, lacewing::server_client clientsocke
 
 void relayserverinternal::generic_handlerconnect(lacewing::server server, lacewing::server_client clientsocket)
 {
+	// Banned IPs are turned away before anything is allocated for them. Nothing is written: the client hasn't
+	// said whether it speaks Lacewing or WebSocket yet, so there's no framing it would understand.
+	bool banned = false;
+	{
+		std::lock_guard<std::mutex> bansGuard(bansLock);
+		banned = !bans.empty() && bans.find(clientsocket->address()->toin6_addr(), std::chrono::steady_clock::now()) != nullptr;
+	}
+	if (banned)
+	{
+		clientsocket->close();
+		return;
+	}
+
 	// Check num of pending/active connections. Pending connections may not be in RelayServer's list.
 	size_t numMatchIPTotal = 0U, numMatchIPFullyConnected = 0U;
 	size_t numMatchIPPending = 0U;
@@ -857,12 +1506,13 @@ void relayserverinternal::generic_handlerconnect(lacewing::server server, lacewi
 	}
 
 	// Add client to server's client list
-	auto newClient = std::make_shared<relayserver::client>(*this, clientsocket);
+	auto newClient = std::allocate_shared<relayserver::client>(slaballocator<relayserver::client>(), *this, clientsocket);
 	lw_server_client_set_relay_tag((lw_server_client)clientsocket, newClient.get());
 	{
 		auto serverClientListWriteLock = this->server.lock_clientlist.createWriteLock();
 		this->clients.push_back(newClient);
 	}
+	metrics.connected();
 
 	// Do not call handlerconnect on relayserverinternal.
 	// That will be called when we get a Connect Request message, in Lacewing style.
@@ -890,18 +1540,16 @@ void relayserverinternal::generic_handlerdisconnect(lacewing::server server, lac
 	client->_readonly = true;
 
 	lacewing::writelock serverClientListWriteLock = this->server.lock_clientlist.createWriteLock();
-	auto clientIt =
-		std::find_if(clients.begin(), clients.end(),
-			[=](const auto &p) { return p.get() == client; });
-	if (clientIt == clients.end())
+	std::shared_ptr<lacewing::relayserver::client> clientShd = clients.find(client);
+	if (!clientShd)
 	{
 		// The tag is only set as the result of a make_shared stored in server's client list
 		always_log("relayserverinternal::generic_handlerdisconnect(): client not found in server's client list.");
 		return;
 	}
-	std::shared_ptr<lacewing::relayserver::client> clientShd = *clientIt;
 
 	lw_server_client_set_relay_tag((lw_server_client)clientsocket, nullptr);
+	metrics.disconnected();
 
 	cliWriteLock.lw_unlock();
 
@@ -909,7 +1557,7 @@ void relayserverinternal::generic_handlerdisconnect(lacewing::server server, lac
 	{
 		// We want count of clients to be accurate for the ondisconnect handler.
 		// Note close_client() will also remove it, if it's the else block.
-		clients.erase(clientIt);
+		clients.erase(clientShd);
 		serverClientListWriteLock.lw_unlock();
 
 		handlerdisconnect(this->server, clientShd);
@@ -1049,22 +1697,15 @@ void relayserverinternal::generic_handlerreceive(lacewing::server server, lacewi
 			// This will instantly disconnect, destroying the relay tag; which will cause the relay
 			// write lock to notice the disconnect func is still write-locking the relay tag, and abort the app.
 			// So, we grab a shared_ptr owner for ourselves
-			auto serverClientListReadLock = internal.server.lock_clientlist.createReadLock();
-			const auto csc = std::find_if(internal.clients.crbegin(), internal.clients.crend(),
-				[=](const auto& s) { return &*s == clientPtr; });
-			if (csc == internal.clients.crend())
+			const auto csc = internal.clients.find(clientPtr);
+			if (!csc)
 			{
-				serverClientListReadLock.lw_unlock();
 				// This direct close may still cause a crash, but no idea what recovery we can do at this point
 				clientsocket->tag(nullptr);
 				clientsocket->close(true);
 			}
 			else
-			{
-				const auto csc2 = *csc;
-				serverClientListReadLock.lw_unlock();
-				csc2->disconnect(1003);
-			}
+				csc->disconnect(1003);
 			return;
 		}
 	}
@@ -1113,22 +1754,15 @@ void relayserverinternal::generic_handlerreceive(lacewing::server server, lacewi
 	// This will instantly disconnect, destroying the relay tag; which will cause the relay
 	// write lock to notice the disconnect func is still write-locking the relay tag, and abort the app.
 	// So, we grab a shared_ptr owner for ourselves
-	auto serverClientListReadLock = internal.server.lock_clientlist.createReadLock();
-	const auto csc = std::find_if(internal.clients.crbegin(), internal.clients.crend(),
-		[=](const auto& s) { return &*s == clientPtr; });
-	if (csc == internal.clients.crend())
+	const auto csc = internal.clients.find(clientPtr);
+	if (!csc)
 	{
-		serverClientListReadLock.lw_unlock();
 		// This direct close may still cause a crash, but no idea what recovery we can do at this point
 		clientsocket->tag(nullptr);
 		clientsocket->close(true);
 	}
 	else
-	{
-		const auto csc2 = *csc;
-		serverClientListReadLock.lw_unlock();
-		csc2->disconnect(1008);
-	}
+		csc->disconnect(1008);
 }
 
 void handlererror(lacewing::server server, lacewing::error error)
@@ -1257,6 +1891,29 @@ void handlerwebserverget(lacewing::webserver webserver, lacewing::webserver_requ
 		req->status(422, "Unprocessable Entity");
 	req->finish();
 }
+void handlermetricsget(lacewing::webserver webserver, lacewing::webserver_request req)
+{
+	relayserverinternal& internal = *(relayserverinternal*)webserver->tag();
+	if (req->url()[0] == '\0' || !strcasecmp(req->url(), "metrics"))
+	{
+		const std::string text = internal.server.metricstext();
+		req->set_mimetype("text/plain; version=0.0.4", "utf-8");
+		req->disable_cache();
+		req->write(text.data(), text.size());
+	}
+	else
+		req->status(404, "Not Found");
+	req->finish();
+}
+void handlermetricserror(lacewing::webserver webserver, lacewing::error error)
+{
+	relayserverinternal& internal = *(relayserverinternal*)webserver->tag();
+
+	error->add("Metrics error");
+
+	if (internal.handlererror)
+		internal.handlererror(internal.server, error);
+}
 void handlerwebsocketmessage(lacewing::webserver websocket, lacewing::webserver_request req, const char* buffer, size_t size)
 {
 	relayserverinternal& internal = *(relayserverinternal*)websocket->tag();
@@ -1445,7 +2102,7 @@ void relayserver::unhost()
 	// and both of those will free the IDs
 	// We'll set the leavers all as readonly before closing channels, so peer leave messages aren't sent to them
 	// as the clients leave their channels
-	for (auto& c : serverInternal->clients)
+	for (auto& c : serverInternal->clients.read())
 	{
 		if (!c->socket->is_websocket())
 			c->_readonly = true; // unhost() has already made clients inaccessible
@@ -1521,6 +2178,25 @@ void relayserver::unhost_websocket(bool insecure, bool secure)
 	// serverInternal->handlerchannel_close = handler;
 }
 
+bool relayserver::host_metrics(lw_ui16 port)
+{
+	relayserverinternal* serverInternal = (relayserverinternal*)internaltag;
+	serverInternal->metricsserver->host(port);
+	return serverInternal->metricsserver->hosting();
+}
+void relayserver::unhost_metrics()
+{
+	((relayserverinternal*)internaltag)->metricsserver->unhost();
+}
+std::string relayserver::metricstext() const
+{
+	std::string text = ((relayserverinternal*)internaltag)->metrics.prometheustext();
+#ifdef LW_RWLOCK_PROFILE
+	text += lacewing::lockprofiler::prometheustext();
+#endif
+	return text;
+}
+
 bool relayserver::hosting()
 {
 	return socket->hosting();
@@ -1533,7 +2209,7 @@ lw_ui16 relayserver::port()
 
 /// <summary> Gracefully closes the channel, including deleting memory, removing channel
 /// 		  from server list, and messaging clients. </summary>
-void relayserverinternal::close_channel(std::shared_ptr<relayserver::channel> channel)
+void relayserverinternal::close_channel(const std::shared_ptr<relayserver::channel> &channel)
 {
 	auto channelWriteLock = channel->lock.createWriteLock();
 	channel->_readonly = true;
@@ -1548,25 +2224,20 @@ void relayserverinternal::close_channel(std::shared_ptr<relayserver::channel> ch
 		channelWriteLock.lw_relock();
 	}
 
+	// Take the peer list off the channel; we message them below without holding the channel lock
+	std::vector<std::shared_ptr<relayserver::client>> leavingClients;
 	channel->_channelmaster.reset(); // so garbage collection can happen
+	leavingClients.swap(channel->clients);
+	channelWriteLock.lw_unlock();
 
 	// Remove the channel from server's list (if it exists)
 	{
 		auto serverChannelListWriteLock = server.lock_channellist.createWriteLock();
-		for (auto e3 = channels.begin(); e3 != channels.end(); e3++)
-		{
-			if (*e3 == channel)
-			{
-				// LW_ESCALATION_NOTE
-				// auto serverChannelListWriteLock = serverChannelListReadLock.lw_upgrade();
-				channels.erase(e3);
-				break;
-			}
-		}
+		channels.erase(channel);
 	}
 
 	// Message and remove channel from all clients
-	if (!channel->clients.empty())
+	if (!leavingClients.empty())
 	{
 		framebuilder builder(true);
 		builder.addheader(0, 0);   /* response */
@@ -1574,9 +2245,8 @@ void relayserverinternal::close_channel(std::shared_ptr<relayserver::channel> ch
 		builder.add <lw_ui8>(1);   /* success */
 		builder.add <lw_ui16>(channel->_id); /* channel ID */
 
-		while (!channel->clients.empty())
+		for (const auto &cli : leavingClients)
 		{
-			auto cli = channel->clients[0];
 			auto cliWriteLock = cli->lock.createWriteLock();
 			if (!cli->_readonly)
 				builder.send(cli->socket, false);
@@ -1590,13 +2260,11 @@ void relayserverinternal::close_channel(std::shared_ptr<relayserver::channel> ch
 					break;
 				}
 			}
-
-			channel->clients.erase(channel->clients.cbegin());
 		}
 	}
 }
 
-void relayserverinternal::close_client (std::shared_ptr<lacewing::relayserver::client> client)
+void relayserverinternal::close_client (const std::shared_ptr<lacewing::relayserver::client> &client)
 {
 	auto clientWriteLock = client->lock.createWriteLock();
 	client->_readonly = true;
@@ -1604,9 +2272,13 @@ void relayserverinternal::close_client (std::shared_ptr<lacewing::relayserver::c
 	while (!client->channels.empty())
 	{
 		auto clientJoinedCh = client->channels[0];
+		// channel_removeclient() takes the channel lock, then this client's; holding ours meanwhile would
+		// invert that order against a fan-out on the channel. It takes the client lock itself.
+		clientWriteLock.lw_unlock();
 		// PHI NOTE 29TH DEC: loop server list of channels, upon match run this code
 		// Ensure channel is still open; we rarely get a race condition where it's not
 		channel_removeclient(clientJoinedCh, client);
+		clientWriteLock.lw_relock();
 		// channel may still contain us in client list if channel close was triggered and close handler was
 		// delayed, but client should no longer have it in channel list.
 		if (std::find(client->channels.cbegin(), client->channels.cend(), clientJoinedCh) != client->channels.cend())
@@ -1623,16 +2295,7 @@ void relayserverinternal::close_client (std::shared_ptr<lacewing::relayserver::c
 	auto serverClientListWriteLock = server.lock_clientlist.createWriteLock();
 
 	// Drop this client from server list (if it exists)
-	for (auto cli = clients.begin(); cli != clients.end(); cli++)
-	{
-		if (*cli == client)
-		{
-			// LW_ESCALATION_NOTE
-			// auto serverClientListWriteLock = serverClientListReadLock.lw_upgrade();
-			clients.erase(cli);
-			break;
-		}
-	}
+	clients.erase(client);
 }
 
 
@@ -1644,7 +2307,7 @@ void relayserver::channel_addclient(std::shared_ptr<relayserver::channel> channe
 
 	return ((relayserverinternal *)internaltag)->channel_addclient(channel, client);
 }
-void relayserverinternal::channel_addclient(std::shared_ptr<relayserver::channel> channel, std::shared_ptr<relayserver::client> client)
+void relayserverinternal::channel_addclient(const std::shared_ptr<relayserver::channel> &channel, const std::shared_ptr<relayserver::client> &client)
 {
 	auto channelWriteLock = channel->lock.createWriteLock();
 	if (channel->_readonly)
@@ -1666,7 +2329,7 @@ void relayserverinternal::channel_addclient(std::shared_ptr<relayserver::channel
 	builder.add <lw_ui8>(channel->_channelmaster == client);  /* whether they are the channel master */
 
 	builder.add <lw_ui8>((lw_ui8)channel->_name.size());
-	builder.add(channel->_name);
+	builder.add(channel->_name.view());
 
 	builder.add <lw_ui16>(channel->_id);
 
@@ -1676,7 +2339,7 @@ void relayserverinternal::channel_addclient(std::shared_ptr<relayserver::channel
 		builder.add <lw_ui16>(cli->_id);
 		builder.add <lw_ui8>(cli == channel->_channelmaster ? 1 : 0);
 		builder.add <lw_ui8>((lw_ui8)cli->_name.size());
-		builder.add(cli->_name);
+		builder.add(cli->_name.view());
 	}
 
 	{
@@ -1687,6 +2350,9 @@ void relayserverinternal::channel_addclient(std::shared_ptr<relayserver::channel
 		// joiningCliWriteLock.lw_downgrade_to(joiningClientReadLock);
 	}
 
+	// Don't hold one client's lock while taking the others
+	joiningCliWriteLock.lw_unlock();
+
 	if (!channel->clients.empty())
 	{
 		builder.framereset();
@@ -1697,7 +2363,7 @@ void relayserverinternal::channel_addclient(std::shared_ptr<relayserver::channel
 		builder.add <lw_ui16>(channel->_id);
 		builder.add <lw_ui16>(client->_id);
 		builder.add <lw_ui8>(0); // if there are peers, we can't be creating, so channelmaster always false
-		builder.add(client->_name);
+		builder.add(client->_name.view());
 
 		/* notify the other clients on the channel that this client has joined */
 
@@ -1725,6 +2391,7 @@ void relayserverinternal::channel_addclient(std::shared_ptr<relayserver::channel
 
 	// LW_ESCALATION_NOTE
 	// auto joiningClientWriteLock = joiningClientReadLock.lw_upgrade();
+	joiningCliWriteLock.lw_relock();
 	client->channels.push_back(channel);
 }
 
@@ -1733,7 +2400,7 @@ void relayserver::channel_removeclient(std::shared_ptr<relayserver::channel> cha
 	// readonly checks done in internal
 	return ((relayserverinternal *)internaltag)->channel_removeclient(channel, client);
 }
-void relayserverinternal::channel_removeclient(std::shared_ptr<relayserver::channel> channel, std::shared_ptr<relayserver::client> client)
+void relayserverinternal::channel_removeclient(const std::shared_ptr<relayserver::channel> &channel, const std::shared_ptr<relayserver::client> &client)
 {
 	auto channelWriteLock = channel->lock.createWriteLock();
 	auto clientWriteLock = client->lock.createWriteLock();
@@ -1780,7 +2447,7 @@ void relayserverinternal::channel_removeclient(std::shared_ptr<relayserver::chan
 				channelWriteLock.lw_relock();
 				clientWriteLock.lw_relock();
 			}
-			channel->clients.erase (e);
+			channel->clients.erase(e);
 
 			if (client->_readonly)
 				break;
@@ -1801,12 +2468,12 @@ void relayserverinternal::channel_removeclient(std::shared_ptr<relayserver::chan
 	}
 
 	// No clients left or master left and autoclose is on
+	// Peers are messaged below without the leaving client's lock
+	clientWriteLock.lw_unlock();
+
 	if (channel->clients.empty() || (channel->_channelmaster == client && channel->_autoclose))
 	{
 		close_channel(channel); // Sends Channel Leave Success to peers, and drops from server's channel list
-
-		// Should garbage collect for channel, so we want channel write lock off
-		channelWriteLock.lw_unlock();
 		return;
 	}
 
@@ -1898,11 +2565,11 @@ bool relayserver::client::checkname(std::string_view name)
 		return false;
 	}
 
-	const std::string nameSimplified = lw_u8str_simplify(name);
-	auto serverClientListReadLock = server.server.lock_clientlist.createReadLock();
+	const internedname interned = internedname::intern(name);
+	const auto clientList = server.clients.read();
 
 	// const auto breaks on Unix - the lock doesn't destruct
-	for (auto& e2 : server.clients)
+	for (auto& e2 : clientList)
 	{
 		if (e2->_readonly)
 			continue;
@@ -1919,7 +2586,7 @@ bool relayserver::client::checkname(std::string_view name)
 		// Note: case insensitive.
 		// Due to self being skipped above, a client is still allowed to rename
 		// to a different capitalisation of its current name.
-		if (lw_sv_cmp(e2->_namesimplified, nameSimplified))
+		if (e2->_name.samesimplified(interned))
 		{
 			srvCliReadLock.lw_unlock();
 			framebuilder builder(true);
@@ -1945,13 +2612,17 @@ bool relayserver::client::checkname(std::string_view name)
 }
 
 
-bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::client> client, lw_ui8 type, std::string_view messageP, bool blasted)
+bool relayserverinternal::client_messagehandler(const std::shared_ptr<relayserver::client> &client, lw_ui8 type, std::string_view messageP, bool blasted)
 {
 	auto cliReadLock = client->lock.createReadLock();
 
 	lw_ui8 messagetypeid = (lw_ui8)(type >> 4);
 	lw_ui8 variant		 = (type & 0xF);
 
+	metrics.received(messagetypeid, messageP.size());
+	client->receivedtraffic.add(blasted, 1, messageP.size(), relayserver::client::trafficcounter::nowsecond());
+	relaymetrics::timer handleTimer(metrics, relaymetrics::histogram::HandleLatency);
+
 	messagereader reader (messageP.data(), messageP.size());
 	framebuilder builder(true);
 
@@ -1993,8 +2664,41 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 	else
 		client->lasttcpmessagetime = ::std::chrono::steady_clock::now();
 
+	// setratelimit() limits. Ping replies aren't limited, so a limited client doesn't also time out.
+	if (ratelimiting.load(std::memory_order_relaxed) && messagetypeid != 9 && client->connectRequestApproved)
+	{
+		relayserver::ratelimitpolicy policy = relayserver::ratelimitpolicy::drop;
+		std::string_view scope;
+		if (!checkratelimit(*client, messagetypeid, messageP.size(), policy, scope))
+		{
+			// Already spent; it's handled below, and reading waits for the buckets to refill
+			if (policy == relayserver::ratelimitpolicy::delayreads && !blasted)
+				ratelimitpause(*client);
+			else
+			{
+				relayserver::errorevent ev;
+				ev.kind = relayserver::errorkind::RateLimited;
+				ev.clientID = client->_id;
+				ev.clientName = client->_name;
+				ev.messageType = messagetypeid;
+				ev.detail = scope;
+				ev.clientBooted = policy == relayserver::ratelimitpolicy::disconnect;
+				raiseerror(ev);
+
+				if (!ev.clientBooted)
+					return true;
+
+				client->_readonly = true;
+				cliReadLock.lw_unlock();
+				auto cliWriteLock = client->lock.createWriteLock();
+				client->socket->close(true);
+				return false;
+			}
+		}
+	}
+
 	// Psuedo-UDP -> UDP
-	std::stringstream errStr;
+	lazyerrorstream errStr;
 	bool& trustedClient = client->trustedClient;
 	if (variant & 0x8)
 	{
@@ -2153,13 +2857,13 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 					// Name too long - the protocol allows channel name to be requested >255, but server can only approve <= 255,
 					// so it's tested in joinchannel_response(), which is run here if no handler, and in handlerchannel_join() otherwise.
 
-					const std::string channelnamesimplified = lw_u8str_simplify(channelnametrimmed);
+					const internedname channelnameinterned = internedname::intern(channelnametrimmed);
 					std::shared_ptr<relayserver::channel> channel;
 
 					//auto cliReadLock = client->lock.createReadLock();
-					for (const auto& e : channels)
+					for (const auto& e : channels.read())
 					{
-						if (lw_sv_cmp (e->_namesimplified, channelnamesimplified))
+						if (e->_name.samesimplified(channelnameinterned))
 						{
 							channel = e;
 							break;
@@ -2170,7 +2874,7 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 					/* creating a new channel */
 					if (!channel)
 					{
-						channel = std::make_shared<relayserver::channel>(*this, channelnametrimmed);
+						channel = std::allocate_shared<relayserver::channel>(slaballocator<relayserver::channel>(), *this, channelnametrimmed);
 
 						channel->_channelmaster = client;
 						channel->_hidden = (flags & 1) != 0;
@@ -2272,7 +2976,7 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 					builder.add <lw_ui8> (4);  /* channellist */
 					builder.add <lw_ui8> (1);  /* success */
 
-					for (const auto& e : channels)
+					for (const auto& e : channels.read())
 					{
 						auto chLoopReadLock = e->lock.createReadLock();
 						if (e->_hidden)
@@ -2322,34 +3026,31 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 				break;
 			}
 
-			if (handlermessage_server)
+			if (handlermessage_server || handlermessage_server_ref)
 			{
 				if (variant == 0)
 				{
 					int rejectedCodePoint = -1, charIndexInStr = server.checkcodepointsallowed(relayserver::codepointsallowlistindex::MessagesSentToServer, message3, &rejectedCodePoint);
 					if (charIndexInStr > -1)
 					{
-						utf8proc_uint8_t rejectCharAsStr[5] = u8"(?)";
-						if (utf8proc_codepoint_valid(rejectedCodePoint))
-						{
-							utf8proc_ssize_t numBytesUsed = utf8proc_encode_char(rejectedCodePoint, rejectCharAsStr);
-							rejectCharAsStr[numBytesUsed] = '\0';
-						}
-
-						// TODO: This as an error feels awkward as it's easily flooded, but we need some log of it.
-						auto error = lacewing::error_new();
-						size_t msgPartSize = message3.size(); msgPartSize = lw_min_size_t(msgPartSize, 15);
-						error->add("Dropped server text message \"%.*hs...\" from client %hs (ID %hu), invalid char U+%0.4X '%hs' rejected. Client is no longer trusted.",
-							msgPartSize, message3.data(), client->name().c_str(), client->id(), rejectedCodePoint, rejectCharAsStr);
-						((relayserverinternal *)server.internaltag)->handlererror(server, error);
-						lacewing::error_delete(error);
+						// Rate limited by raiseerror(), as a client can flood these
+						relayserver::errorevent ev;
+						ev.kind = relayserver::errorkind::ServerMessageCodePoint;
+						ev.clientID = client->_id;
+						ev.clientName = client->_name;
+						ev.codePoint = rejectedCodePoint;
+						ev.detail = message3.substr(0, 15);
+						raiseerror(ev);
 						trustedClient = false;
 						reader.failed = true;
 						break;
 					}
 				}
 
-				handlermessage_server(server, client, blasted, subchannel, message3, variant);
+				if (handlermessage_server_ref)
+					handlermessage_server_ref(server, *client, blasted, subchannel, message3, variant);
+				else
+					handlermessage_server(server, client, blasted, subchannel, message3, variant);
 
 				// Since there is a server message handler, we'll assume it is activity.
 				client->lastchannelorpeermessagetime = ::std::chrono::steady_clock::now();
@@ -2377,8 +3078,8 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 #else
 				if (channel)
 				{
-					errStr << "Malformed channel message content, for client ID "sv << client->_id << ", name \""sv << client->_name << "\", channel ID "sv <<
-						channelid << ", name \""sv << channel->name() << "\", discarding"sv;
+					errStr << "Malformed channel message content, for client ID "sv << client->_id << ", name \""sv << client->_name.view() << "\", channel ID "sv <<
+						channelid << ", name \""sv << channel->name().view() << "\", discarding"sv;
 				}
 				else
 				{
@@ -2392,12 +3093,12 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 					}
 					if (channelFromServerList)
 					{
-						errStr << "Malformed channel message content, for client ID "sv << client->_id << ", name \""sv << client->_name << "\", channel ID "sv <<
-							channelid << ", name \""sv << channelFromServerList->name() << "\" was not found on client's channel list, but WAS on server channel list, discarding"sv;
+						errStr << "Malformed channel message content, for client ID "sv << client->_id << ", name \""sv << client->_name.view() << "\", channel ID "sv <<
+							channelid << ", name \""sv << channelFromServerList->name().view() << "\" was not found on client's channel list, but WAS on server channel list, discarding"sv;
 					}
 					else
 					{
-						errStr << "Malformed channel message content, for client ID "sv << client->_id << ", name \""sv << client->_name << "\", channel ID "sv <<
+						errStr << "Malformed channel message content, for client ID "sv << client->_id << ", name \""sv << client->_name.view() << "\", channel ID "sv <<
 							channelid << " was not found on client's channel list, or server channel list, discarding"sv;
 					}
 				}
@@ -2414,11 +3115,14 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 
 			// We don't verify the Unicode allowlist until channelmessage_permit()
 
-			if (handlermessage_channel)
+			if (handlermessage_channel_ref)
+				handlermessage_channel_ref(server, *client, *channel,
+					blasted, subchannel, message2, variant);
+			else if (handlermessage_channel)
 				handlermessage_channel(server, client, channel,
 					blasted, subchannel, message2, variant);
 			else
-				server.channelmessage_permit(client, channel,
+				server.channelmessage_permit(*client, *channel,
 					blasted, subchannel, message2, variant, true);
 
 			break;
@@ -2450,11 +3154,14 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 
 			client->lastchannelorpeermessagetime = ::std::chrono::steady_clock::now();
 
-			if (handlermessage_peer)
+			if (handlermessage_peer_ref)
+				handlermessage_peer_ref(server, *client, *channel,
+					*peer, blasted, subchannel, message3, variant);
+			else if (handlermessage_peer)
 				handlermessage_peer(server, client, channel,
 					peer, blasted, subchannel, message3, variant);
 			else
-				server.clientmessage_permit(client, channel, peer,
+				server.clientmessage_permit(*client, *channel, *peer,
 					blasted, subchannel, message3, variant, true);
 
 			break;
@@ -2507,7 +3214,15 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 
 		case 9: /* ping */
 			if (!blasted)
+			{
 				client->pongedOnTCP = true;
+				if (client->pingsentat != std::chrono::steady_clock::time_point())
+				{
+					metrics.record(relaymetrics::histogram::PingRTT, (lw_ui64)std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now() - client->pingsentat).count());
+					client->pingsentat = std::chrono::steady_clock::time_point();
+				}
+			}
 			break;
 
 		case 10: /* implementation response */
@@ -2571,18 +3286,15 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 	errorout:
 	if (reader.failed)
 	{
-		lacewing::error error = lacewing::error_new();
-		std::string errAsText = errStr.str();
-		error->add("Reader failed!");
-		if (!errAsText.empty())
-			error->add("%s", errAsText.c_str());
-		if (!trustedClient)
-			error->add("Booting client");
-
-		lwp_trace("%s", error->tostring());
-		handlererror(server, error);
-
-		lacewing::error_delete(error);
+		const std::string errAsText = errStr.str();
+		relayserver::errorevent ev;
+		ev.kind = relayserver::errorkind::MalformedMessage;
+		ev.clientID = client->_id;
+		ev.clientName = client->name();
+		ev.detail = errAsText;
+		ev.clientBooted = !trustedClient;
+		lwp_trace("Client ID %hu: reader failed: %s", ev.clientID, errAsText.c_str());
+		raiseerror(ev);
 
 		if (!trustedClient)
 		{
@@ -2622,7 +3334,11 @@ void relayserver::client::send(lw_ui8 subchannel, std::string_view message, lw_u
 
 	auto clientWriteLock = lock.createWriteLock();
 	if (!_readonly)
+	{
 		builder.send (socket);
+		server.metrics.sent(1, 1, message.size());
+		senttraffic.add(false, 1, message.size(), trafficcounter::nowsecond());
+	}
 }
 
 void relayserver::client::blast(lw_ui8 subchannel, std::string_view message, lw_ui8 variant)
@@ -2633,14 +3349,30 @@ void relayserver::client::blast(lw_ui8 subchannel, std::string_view message, lw_
 	builder.add<lw_ui8>(subchannel);
 	builder.add (message);
 
+	server.metrics.sent(1, 1, message.size());
+	if (pseudoUDP)
+	{
+		auto clientWriteLock = lock.createWriteLock();
+		if (_readonly)
+			return;
+		senttraffic.add(true, 1, message.size(), trafficcounter::nowsecond());
+		if (relayserverinternal::blastpseudoudp(*this,
+			relayserverinternal::conflationkey((1 << 4) | variant, 0xFFFF, 0xFFFF, subchannel),
+			builder.encodefor(socket->is_websocket())))
+		{
+			clientWriteLock.lw_unlock();
+			server.addconflating(retain());
+		}
+		return;
+	}
+
 	auto serverUDPWriteLock = server.server.lock_udp.createWriteLock();
-	auto clientReadLock = lock.createReadLock();
+	// Write lock, as senttraffic is only written with it held
+	auto clientWriteLock = lock.createWriteLock();
 	if (!_readonly)
 	{
-		if (pseudoUDP)
-			builder.send(this->socket);
-		else
-			builder.send(server.server.udp, udpaddress);
+		builder.send(server.server.udp, udpaddress);
+		senttraffic.add(true, 1, message.size(), trafficcounter::nowsecond());
 	}
 }
 
@@ -2657,12 +3389,19 @@ void relayserver::channel::send(lw_ui8 subchannel, std::string_view message, lw_
 	if (_readonly)
 		return;
 
+	size_t recipients = 0;
+	const lw_ui64 second = relayserver::client::trafficcounter::nowsecond();
 	for (const auto& e : clients)
 	{
 		auto clientReadLock = e->lock.createWriteLock();
 		if (!e->_readonly)
+		{
 			builder.send(e->socket, false);
+			e->senttraffic.add(false, 1, message.size(), second);
+			++recipients;
+		}
 	}
+	server.metrics.sent(4, recipients, message.size());
 }
 
 void relayserver::channel::blast(lw_ui8 subchannel, std::string_view message, lw_ui8 variant)
@@ -2678,41 +3417,50 @@ void relayserver::channel::blast(lw_ui8 subchannel, std::string_view message, lw
 	if (_readonly)
 		return;
 
+	std::vector<std::shared_ptr<relayserver::client>> conflatingClients;
+	const lw_ui64 conflationKey = relayserverinternal::conflationkey((4 << 4) | variant, _id, 0xFFFF, subchannel);
+
 	auto serverClientListReadLock = server.server.lock_clientlist.createReadLock();
+	const lw_ui64 second = relayserver::client::trafficcounter::nowsecond();
 	for (const auto& e : clients)
 	{
 		auto clientWriteLock = e->lock.createWriteLock();
 		if (!e->_readonly)
 		{
-			if (e->socket->is_websocket())
+			e->senttraffic.add(true, 1, message.size(), second);
+			if (e->pseudoUDP)
 			{
-				builder.send(e->socket, false);
+				if (relayserverinternal::blastpseudoudp(*e, conflationKey, builder.encodefor(e->socket->is_websocket())))
+					conflatingClients.push_back(e);
 				builder.revert();
 			}
 			else
 				builder.send(server.server.udp, e->udpaddress, false);
 		}
 	}
+	serverClientListReadLock.lw_unlock();
+	channelReadLock.lw_unlock();
+	server.metrics.sent(4, clients.size(), message.size());
+
+	for (const auto& e : conflatingClients)
+		server.addconflating(e);
 }
 
 /// <summary> Throw all clients off this channel, sending Leave Request Success. </summary>
 void relayserver::channel::close()
 {
-	auto serverChannelListReadLock = server.server.lock_channellist.createReadLock();
-	auto ch = std::find_if(server.channels.begin(), server.channels.end(),
-		[=](const auto &p) { return p.get() == this; });
+	const auto ch = server.channels.find(this);
 
 	// Assume channel is already closed, as it's not on server channel list.
-	if (ch == server.channels.end())
+	if (!ch)
 		return;
 
-	serverChannelListReadLock.lw_unlock();
-	server.close_channel(*ch);
+	server.close_channel(ch);
 }
 
 relayserver::client::client(relayserverinternal &internal, lacewing::server_client _socket) noexcept
 	: socket(_socket), server(internal),
-	udpaddress(lacewing::address_new(socket->address()))
+	udpaddress(socket->address())
 {
 	//public_.internaltag = this;
 	tag = 0;
@@ -2737,7 +3485,7 @@ relayserver::client::client(relayserverinternal &internal, lacewing::server_clie
 }
 
 ::lacewing::relayserver::channel::channel(relayserverinternal &_server, std::string_view _name) noexcept :
-	server(_server), _name(_name), _namesimplified(lw_u8str_simplify(_name))
+	server(_server), _name(internedname::intern(_name))
 {
 	_id = server.channelids.borrow();
 }
@@ -2785,7 +3533,7 @@ lw_ui16 relayserver::channel::id()
 	return _id;
 }
 
-std::string relayserver::channel::name() const
+internedname relayserver::channel::name() const
 {
 	lacewing::readlock rl = lock.createReadLock();
 	return _name;
@@ -2794,7 +3542,7 @@ std::string relayserver::channel::name() const
 std::string relayserver::channel::nameSimplified() const
 {
 	lacewing::readlock rl = lock.createReadLock();
-	return _namesimplified;
+	return std::string(_name.simplified());
 }
 
 // Renames channel.
@@ -2803,9 +3551,9 @@ void relayserver::channel::name(std::string_view name)
 {
 	if (_readonly)
 		return;
+	const internedname interned = internedname::intern(name);
 	lacewing::writelock wl = lock.createWriteLock();
-	_name = name;
-	_namesimplified = lw_u8str_simplify(name);
+	_name = interned;
 }
 
 bool relayserver::channel::hidden() const
@@ -2851,6 +3599,72 @@ void relayserver::setchannellisting (bool enabled)
 	((relayserverinternal *) internaltag)->channellistingenabled = enabled;
 }
 
+void relayserver::setparallelfanout(size_t threshold, size_t workerCount)
+{
+	lacewing::writelock serverMetaWriteLock = lock_meta.createWriteLock();
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	serverinternal.fanoutthreshold = workerCount == 0 ? 0 : threshold;
+	serverinternal.fanoutworkers.setworkercount(threshold == 0 ? 0 : workerCount);
+}
+
+void relayserver::setidlecompaction(long idleMS)
+{
+	lacewing::writelock serverMetaWriteLock = lock_meta.createWriteLock();
+	((relayserverinternal *)internaltag)->idleCompactMS = idleMS;
+}
+
+void relayserver::compactclients(long idleMS)
+{
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	const auto currentTime = std::chrono::steady_clock::now();
+	for (const auto& client : serverinternal.clients.read())
+	{
+		if (std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - client->lastchannelorpeermessagetime).count() >= idleMS)
+			serverinternal.compactclient(*client);
+	}
+	lwp_chunkpool_trim(32);
+}
+
+size_t relayserver::clientmemoryused() const
+{
+	size_t used = 0;
+	for (const auto& client : ((relayserverinternal *)internaltag)->clients.read())
+		used += client->memoryused();
+	return used;
+}
+
+void relayserver::setqueuedbytelimit(size_t maxBytes, queuelimitpolicy policy)
+{
+	lacewing::writelock serverMetaWriteLock = lock_meta.createWriteLock();
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	serverinternal.maxqueuedbytes = maxBytes;
+	serverinternal.queuepolicy = policy;
+}
+
+void relayserver::setratelimit(ratelimitscope scope, const ratelimit &limit, lw_ui8 messageType)
+{
+	if (scope == ratelimitscope::clientmessagetype && messageType > 15)
+		return;
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	std::lock_guard<std::mutex> rateLimitGuard(serverinternal.ratelimitLock);
+	const size_t index = scope == ratelimitscope::client ? 0 : scope == ratelimitscope::ip ? 1 : 2 + messageType;
+	serverinternal.ratelimits[index] = limit;
+
+	bool limiting = false;
+	serverinternal.typeratelimiting = false;
+	for (size_t i = 0; i < std::size(serverinternal.ratelimits); ++i)
+	{
+		if (serverinternal.ratelimits[i].messagesPerSecond <= 0 && serverinternal.ratelimits[i].bytesPerSecond <= 0)
+			continue;
+		limiting = true;
+		if (i >= 2)
+			serverinternal.typeratelimiting = true;
+	}
+	serverinternal.ratelimiting.store(limiting, std::memory_order_relaxed);
+	// Clients set their buckets up again on their next message
+	serverinternal.ratelimitgeneration.fetch_add(1, std::memory_order_release);
+}
+
 std::shared_ptr<relayserver::client> relayserver::channel::channelmaster() const
 {
 	lacewing::readlock rl = lock.createReadLock();
@@ -2872,7 +3686,7 @@ void relayserver::client::disconnect(int websocketReasonCode)
 		socket->close();
 }
 
-std::string relayserver::client::name() const
+internedname relayserver::client::name() const
 {
 	lacewing::readlock clientReadLock = lock.createReadLock();
 	return _name;
@@ -2881,21 +3695,109 @@ std::string relayserver::client::name() const
 std::string relayserver::client::nameSimplified() const
 {
 	lacewing::readlock clientReadLock = lock.createReadLock();
-	return _namesimplified;
+	return std::string(_name.simplified());
 }
 
 void relayserver::client::name(std::string_view name)
 {
+	// Interning may simplify, so do it before locking
+	const internedname interned = internedname::intern(name);
 	lacewing::writelock clientWriteLock = lock.createWriteLock();
-	_prevname = _name;
-	_name = name;
-	_namesimplified = lw_u8str_simplify(name);
+	_prevname = std::move(_name);
+	_name = interned;
 }
 
 bool relayserver::client::readonly() const
 {
 	return _readonly;
 }
+
+size_t relayserver::client::queuedbytes() const
+{
+	lacewing::readlock clientReadLock = lock.createReadLock();
+	return socket ? socket->queued() : 0;
+}
+
+size_t relayserver::client::memoryused() const
+{
+	// Short strings live inside the std::string itself, so only count capacity past that
+	const auto heapBytes = [](const std::string &s) {
+		return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+	};
+
+	lacewing::readlock clientReadLock = lock.createReadLock();
+	size_t used = sizeof(*this) + reader.memoryused() + channels.capacity() * sizeof(channels[0]) +
+		heapBytes(address) + heapBytes(clientImplStr);
+	// Names are shared between everyone holding the same one; count them as this client's anyway
+	used += _name.size() + _name.simplified().size() + _prevname.size();
+	for (const auto &f : conflated)
+		used += sizeof(f) + sizeof(void *) * 2 + heapBytes(f.second); // node and its links
+	{
+		std::lock_guard<std::mutex> clientRateGuard(ratelimitlock);
+		if (typeratebuckets)
+			used += 16 * sizeof(ratebuckets);
+	}
+	if (socket)
+		used += socket->queued();
+	return used;
+}
+relayserver::clientstats relayserver::client::stats() const
+{
+	clientstats stats;
+	const lw_ui64 second = trafficcounter::nowsecond();
+	receivedtraffic.read(stats.received, stats.receivedLastSecond, stats.receivedThisSecond, second);
+	senttraffic.read(stats.sent, stats.sentLastSecond, stats.sentThisSecond, second);
+	return stats;
+}
+lw_ui64 relayserver::client::trafficcounter::nowsecond()
+{
+	return (lw_ui64)std::chrono::duration_cast<std::chrono::seconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+void relayserver::client::trafficcounter::add(bool udp, size_t messages, size_t bytesEach, lw_ui64 second)
+{
+	const auto bump = [](std::atomic<lw_ui64> &value, lw_ui64 by) {
+		value.fetch_add(by, std::memory_order_relaxed);
+	};
+
+	// One writer rolls the window; a writer that read the clock just before the roll counts into the newer second.
+	// Counts added while the roll is underway may land in either second.
+	lw_ui64 current = windowSecond.load(std::memory_order_relaxed);
+	if (second > current && windowSecond.compare_exchange_strong(current, second, std::memory_order_relaxed))
+	{
+		const bool adjacent = second == current + 1;
+		for (size_t t = 0; t < 2; ++t)
+		{
+			for (size_t k = 0; k < 2; ++k)
+			{
+				previous[t][k].store(adjacent ? window[t][k].load(std::memory_order_relaxed) : 0, std::memory_order_relaxed);
+				window[t][k].store(0, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bump(total[udp][0], messages);
+	bump(total[udp][1], messages * bytesEach);
+	bump(window[udp][0], messages);
+	bump(window[udp][1], messages * bytesEach);
+}
+void relayserver::client::trafficcounter::read(clientstats::counts (&totals)[2], clientstats::counts (&lastSecond)[2],
+	clientstats::counts (&thisSecond)[2], lw_ui64 second) const
+{
+	// The window is the last whole second if it's for the one before now; if it's for now, the one before it is
+	const lw_ui64 current = windowSecond.load(std::memory_order_relaxed);
+	const std::atomic<lw_ui64> (*last)[2] = current == second ? previous : current + 1 == second ? window : nullptr;
+	const std::atomic<lw_ui64> (*now)[2] = current == second ? window : nullptr;
+	for (size_t t = 0; t < 2; ++t)
+	{
+		totals[t].messages = total[t][0].load(std::memory_order_relaxed);
+		totals[t].bytes = total[t][1].load(std::memory_order_relaxed);
+		lastSecond[t].messages = last ? last[t][0].load(std::memory_order_relaxed) : 0;
+		lastSecond[t].bytes = last ? last[t][1].load(std::memory_order_relaxed) : 0;
+		thisSecond[t].messages = now ? now[t][0].load(std::memory_order_relaxed) : 0;
+		thisSecond[t].bytes = now ? now[t][1].load(std::memory_order_relaxed) : 0;
+	}
+}
 bool relayserver::client::istrusted() const
 {
 	return trustedClient;
@@ -2909,7 +3811,6 @@ std::vector<std::shared_ptr<lacewing::relayserver::channel>> & relayserver::clie
 
 size_t relayserver::channelcount() const
 {
-	lacewing::readlock serverChannelListReadLock = lock_channellist.createReadLock();
 	return ((relayserverinternal *) internaltag)->channels.size();
 }
 
@@ -2918,6 +3819,136 @@ void relayserver::setinactivitytimer(long MS)
 	// Could grab a writelock, but thread misreading will likely not matter.
 	((relayserverinternal *)internaltag)->maxInactivityMS = MS;
 }
+void relayserver::setmaxconnectionsperip(size_t total, size_t pending)
+{
+	// As above, read unlocked by the connect handler
+	relayserverinternal * serverInternal = (relayserverinternal *)internaltag;
+	serverInternal->numTotalClientsPerIP = total;
+	serverInternal->numPendingConnectsPerIP = pending;
+}
+void relayserver::setacceptlimit(long perSecond)
+{
+	socket->accept_limit(perSecond);
+}
+
+static ipbanlist::time_point banexpiry(std::chrono::seconds duration)
+{
+	return duration.count() <= 0 ? ipbanlist::time_point::max() : std::chrono::steady_clock::now() + duration;
+}
+bool relayserver::banip(std::string_view address, std::string_view reason, std::chrono::seconds duration)
+{
+	in6_addr addressInt;
+	unsigned int prefixBits;
+	if (!ipbanlist::parse(address, addressInt, prefixBits))
+		return false;
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	std::lock_guard<std::mutex> bansGuard(serverinternal.bansLock);
+	serverinternal.bans.add(addressInt, prefixBits, reason, banexpiry(duration));
+	return true;
+}
+void relayserver::banip(const in6_addr &address, lw_ui8 prefixBits, std::string_view reason, std::chrono::seconds duration)
+{
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	std::lock_guard<std::mutex> bansGuard(serverinternal.bansLock);
+	serverinternal.bans.add(address, prefixBits, reason, banexpiry(duration));
+}
+bool relayserver::unbanip(std::string_view address)
+{
+	in6_addr addressInt;
+	unsigned int prefixBits;
+	if (!ipbanlist::parse(address, addressInt, prefixBits))
+		return false;
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	std::lock_guard<std::mutex> bansGuard(serverinternal.bansLock);
+	return serverinternal.bans.remove(addressInt, prefixBits);
+}
+bool relayserver::isipbanned(const in6_addr &address, std::string * reason) const
+{
+	const relayserverinternal &serverinternal = *(const relayserverinternal *)internaltag;
+	std::lock_guard<std::mutex> bansGuard(serverinternal.bansLock);
+	const ipbanlist::ban * ban = serverinternal.bans.find(address, std::chrono::steady_clock::now());
+	if (ban && reason)
+		*reason = ban->reason;
+	return ban != nullptr;
+}
+size_t relayserver::ipbancount() const
+{
+	const relayserverinternal &serverinternal = *(const relayserverinternal *)internaltag;
+	std::lock_guard<std::mutex> bansGuard(serverinternal.bansLock);
+	return serverinternal.bans.size();
+}
+
+void relayserver::seterrorratelimit(errorkind kind, unsigned int perSecond)
+{
+	if ((size_t)kind >= (size_t)errorkind::Count)
+		return;
+	((relayserverinternal *)internaltag)->errorlimits[(size_t)kind].perSecond.store(perSecond, std::memory_order_relaxed);
+}
+size_t relayserver::errorssuppressed(errorkind kind) const
+{
+	if ((size_t)kind >= (size_t)errorkind::Count)
+		return 0;
+	return ((relayserverinternal *)internaltag)->errorlimits[(size_t)kind].totalSuppressed.load(std::memory_order_relaxed);
+}
+
+std::string relayserver::errorevent::tostring() const
+{
+	char text[1024];
+	int len = 0;
+	switch (kind)
+	{
+		case errorkind::ServerMessageCodePoint:
+		case errorkind::ChannelMessageCodePoint:
+		case errorkind::PeerMessageCodePoint:
+		{
+			utf8proc_uint8_t rejectCharAsStr[5] = u8"(?)";
+			if (utf8proc_codepoint_valid(codePoint))
+			{
+				utf8proc_ssize_t numBytesUsed = utf8proc_encode_char(codePoint, rejectCharAsStr);
+				rejectCharAsStr[numBytesUsed] = '\0';
+			}
+
+			const char * const msgType = kind == errorkind::ServerMessageCodePoint ? "server" :
+				kind == errorkind::ChannelMessageCodePoint ? "channel" : "peer";
+			len = snprintf(text, sizeof(text), "Dropped %s text message \"%.*s...\" from client %s (ID %hu)",
+				msgType, (int)detail.size(), detail.data(), clientName.c_str(), clientID);
+			if (kind != errorkind::ServerMessageCodePoint && len > 0 && len < (int)sizeof(text))
+			{
+				len += snprintf(text + len, sizeof(text) - len, " -> %s %s (ID %hu)",
+					kind == errorkind::ChannelMessageCodePoint ? "channel" : "client", targetName.c_str(), targetID);
+			}
+			if (len > 0 && len < (int)sizeof(text))
+			{
+				len += snprintf(text + len, sizeof(text) - len, ", invalid char U+%.4X '%s' rejected.%s",
+					codePoint, (const char *)rejectCharAsStr,
+					kind == errorkind::ServerMessageCodePoint ? " Client is no longer trusted." : "");
+			}
+			break;
+		}
+		case errorkind::PeerToSelf:
+			len = snprintf(text, sizeof(text), "Client ID %hu attempted to send peer message to ID %hu, e.g. themselves. Message dropped",
+				clientID, targetID);
+			break;
+		case errorkind::MalformedMessage:
+			// Same order as the lacewing::error this used to be, which prepends each addition
+			len = snprintf(text, sizeof(text), "%s%.*s%sReader failed!", clientBooted ? "Booting client - " : "",
+				(int)detail.size(), detail.data(), detail.empty() ? "" : " - ");
+			break;
+		case errorkind::RateLimited:
+			len = snprintf(text, sizeof(text), "%s type %d message from client %s (ID %hu), over its %.*s rate limit",
+				clientBooted ? "Disconnecting client for" : "Dropped", messageType, clientName.c_str(), clientID,
+				(int)detail.size(), detail.data());
+			break;
+		default:
+			len = snprintf(text, sizeof(text), "Unknown error kind %d from client ID %hu", (int)kind, clientID);
+			break;
+	}
+
+	std::string result(text, (size_t)std::clamp(len, 0, (int)sizeof(text) - 1));
+	if (suppressed > 0)
+		result.append(" (").append(std::to_string(suppressed)).append(" more like this suppressed by rate limit)");
+	return result;
+}
 
 // Updates the allowlisted Unicode code point sused in text messages, channel names and peer names.
 std::string relayserver::setcodepointsallowedlist(codepointsallowlistindex type, std::string acStr) {
@@ -2939,15 +3970,13 @@ std::string relayserverinternal::setcodepointsallowedlist(relayserver::codepoint
 	return unicodeLimiters[(int)type].setcodepointsallowedlist(acStr);
 }
 
-std::vector<std::shared_ptr<lacewing::relayserver::client>> & relayserver::getclients()
+relayserver::listsnapshot<relayserver::client> relayserver::getclients() const
 {
-	lock_clientlist.checkHoldsRead();
-	return ((lacewing::relayserverinternal *)internaltag)->clients;
+	return ((lacewing::relayserverinternal *)internaltag)->clients.snapshot();
 }
-std::vector<std::shared_ptr<lacewing::relayserver::channel>>& relayserver::getchannels()
+relayserver::listsnapshot<relayserver::channel> relayserver::getchannels() const
 {
-	lock_channellist.checkHoldsRead();
-	return ((lacewing::relayserverinternal *)internaltag)->channels;
+	return ((lacewing::relayserverinternal *)internaltag)->channels.snapshot();
 }
 
 
@@ -2978,7 +4007,6 @@ lw_i64 relayserver::client::getconnecttime() const
 
 size_t relayserver::clientcount() const
 {
-	lacewing::readlock serverClientListReadLock = lock_clientlist.createReadLock();
 	return ((relayserverinternal *)internaltag)->clients.size();
 }
 
@@ -2992,9 +4020,6 @@ relayserver::client::~client() noexcept
 
 	server.clientids.returnID(_id);
 
-	lacewing::address_delete(udpaddress);
-	udpaddress = nullptr;
-
 	// When refcount for the stream reaches 0, the stream will be freed.
 	// Note lw_stream_delete does not free, as the IO Completion port might still have
 	// pending reads/writes that will try to access the freed memory.
@@ -3008,7 +4033,7 @@ relayserver::client::~client() noexcept
 std::shared_ptr<relayserver::channel> relayserver::createchannel(std::string_view channelName, std::shared_ptr<relayserver::client> master, bool hidden, bool autoclose)
 {
 	auto& serverinternal = *(lacewing::relayserverinternal *)internaltag;
-	auto channel = std::make_shared<relayserver::channel>(serverinternal, channelName);
+	auto channel = std::allocate_shared<relayserver::channel>(slaballocator<relayserver::channel>(), serverinternal, channelName);
 	auto channelWriteLock = channel->lock.createWriteLock();
 
 	channel->_channelmaster = master;
@@ -3046,8 +4071,7 @@ std::shared_ptr<relayserver::channel> relayserver::createchannel(std::string_vie
 	else
 	{
 		lacewing::writelock serverChannelListWriteLock = lock_channellist.createWriteLock();
-		if (std::find(serverinternal.channels.cbegin(), serverinternal.channels.cend(), channel) == serverinternal.channels.cend())
-			serverinternal.channels.push_back(channel);
+		serverinternal.channels.push_back_unique(channel);
 	}
 
 	channelWriteLock.lw_unlock();
@@ -3234,7 +4258,7 @@ void relayserver::joinchannel_response(std::shared_ptr<relayserver::channel> cha
 
 		// actual length 1-255, checked by channel ctor
 		builder.add <lw_ui8>((lw_ui8)channel->_name.size());
-		builder.add(channel->_name);
+		builder.add(channel->_name.view());
 		builder.add(denyReason);
 		builder.send(client->socket);
 
@@ -3249,12 +4273,13 @@ void relayserver::joinchannel_response(std::shared_ptr<relayserver::channel> cha
 	}
 
 	lacewing::writelock serverChannelListWriteLock = lock_channellist.createWriteLock();
-	if (std::find(serverinternal.channels.cbegin(), serverinternal.channels.cend(), channel) == serverinternal.channels.cend())
-		serverinternal.channels.push_back(channel);
+	serverinternal.channels.push_back_unique(channel);
 	serverChannelListWriteLock.lw_unlock();
 
 	// LW_ESCALATION_NOTE
 	channelReadLock.lw_unlock();
+	// channel_addclient() takes the channel lock, then this client's; holding ours would invert that order
+	clientWriteLock.lw_unlock();
 	//lacewing::writelock channelWriteLock = channel->lock.createWriteLock();
 	// writelock made by channel_addclient
 	serverinternal.channel_addclient(channel, client);
@@ -3293,7 +4318,7 @@ void relayserver::leavechannel_response(std::shared_ptr<relayserver::channel> ch
 		return;
 	}
 
-	lacewing::writelock wl = channel->lock.createWriteLock();
+	// channel_removeclient() takes the channel lock, then the client's
 	serverinternal.channel_removeclient(channel, client);
 }
 
@@ -3317,19 +4342,30 @@ void relayserver::closechannel_finish(std::shared_ptr<lacewing::relayserver::cha
 void relayserver::channelmessage_permit(std::shared_ptr<relayserver::client> sendingclient, std::shared_ptr<relayserver::channel> channel,
 	bool blasted, lw_ui8 subchannel, std::string_view data, lw_ui8 variant, bool accept)
 {
-	if (!accept || channel->_readonly || sendingclient->_readonly)
+	channelmessage_permit(*sendingclient, *channel, blasted, subchannel, data, variant, accept);
+}
+void relayserver::channelmessage_permit(relayserver::client &sendingclient, relayserver::channel &channel,
+	bool blasted, lw_ui8 subchannel, std::string_view data, lw_ui8 variant, bool accept)
+{
+	if (!accept || channel._readonly || sendingclient._readonly)
 		return;
-	channel->PeerToChannel(*this, sendingclient, blasted, subchannel, variant, data);
+	channel.PeerToChannel(*this, sendingclient, blasted, subchannel, variant, data);
 }
 
 void relayserver::clientmessage_permit(std::shared_ptr<relayserver::client> sendingclient, std::shared_ptr<relayserver::channel> channel,
 	std::shared_ptr<relayserver::client> receivingclient,
 	bool blasted, lw_ui8 subchannel, std::string_view data, lw_ui8 variant, bool accept)
 {
-	if (!accept || channel->_readonly || receivingclient->_readonly)
+	clientmessage_permit(*sendingclient, *channel, *receivingclient, blasted, subchannel, data, variant, accept);
+}
+void relayserver::clientmessage_permit(relayserver::client &sendingclient, relayserver::channel &channel,
+	relayserver::client &receivingclient,
+	bool blasted, lw_ui8 subchannel, std::string_view data, lw_ui8 variant, bool accept)
+{
+	if (!accept || channel._readonly || receivingclient._readonly)
 		return;
 
-	sendingclient->PeerToPeer(*this, channel, receivingclient, blasted, subchannel, variant, data);
+	sendingclient.PeerToPeer(*this, channel, receivingclient, blasted, subchannel, variant, data);
 }
 
 void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
@@ -3365,7 +4401,7 @@ void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
 		}
 	}
 
-	std::string_view oldClientName = client->_name;
+	const internedname oldClientName = client->name();
 
 	// If not already denying, check and potentially deny if name is invalid.
 	if (denyReason.empty())
@@ -3380,7 +4416,7 @@ void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
 		// but this could potentially be abused.
 
 		if (denyReason.empty() &&
-			!oldClientName.empty() && lw_sv_cmp(newClientName, oldClientName))
+			!oldClientName.empty() && lw_sv_cmp(newClientName, oldClientName.view()))
 		{
 			denyReason = "Name set to what it was before"sv;
 		}
@@ -3463,9 +4499,13 @@ void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
 
 	// Send Peer (Name Change) message
 
-	// Send peer name change messages
-	for (const auto& e : client->channels)
+	// Send peer name change messages. Channel locks go before client locks, so let ours go first.
+	const auto joinedChannels = client->channels;
+	clientWriteLock.lw_unlock();
+
+	for (const auto& e : joinedChannels)
 	{
+		auto channelReadLock = e->lock.createReadLock();
 		builder.addheader(9, 0); /* peer */
 
 		builder.add <lw_ui16>(e->_id);
@@ -3488,11 +4528,12 @@ void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
 	}
 }
 
-void relayserver::channel::PeerToChannel(relayserver &server, std::shared_ptr<relayserver::client> client,
+void relayserver::channel::PeerToChannel(relayserver &server, relayserver::client &client,
 	bool blasted, lw_ui8 subchannel, lw_ui8 variant, std::string_view message)
 {
-	//auto channelReadLock = lock.createReadLock();
-	auto channelWriteLock = lock.createWriteLock();
+	// Membership changes write-lock the channel, so a read lock keeps the peer list stable;
+	// fan-outs on the same channel from other threads can run alongside
+	auto channelReadLock = lock.createReadLock();
 
 	// Sending to no one or just self, no point
 	if (clients.size() <= 1)
@@ -3501,25 +4542,22 @@ void relayserver::channel::PeerToChannel(relayserver &server, std::shared_ptr<re
 	if (_readonly)
 		return;
 
-	// TODO: This as an error feels awkward as it's easily flooded, but we need some log of it.
+	// Rate limited by raiseerror(), as a client can flood these
 	if (variant == 0)
 	{
 		int rejectedCodePoint = -1, charIndexInStr = server.checkcodepointsallowed(codepointsallowlistindex::MessagesSentToClients, message, &rejectedCodePoint);
 		if (charIndexInStr > -1)
 		{
-			utf8proc_uint8_t rejectCharAsStr[5] = u8"(?)";
-			if (utf8proc_codepoint_valid(rejectedCodePoint))
-			{
-				utf8proc_ssize_t numBytesUsed = utf8proc_encode_char(rejectedCodePoint, rejectCharAsStr);
-				rejectCharAsStr[numBytesUsed] = '\0';
-			}
-
-			auto error = lacewing::error_new();
-			size_t msgPartSize = message.size(); msgPartSize = lw_min_size_t(msgPartSize, 15);
-			error->add("Dropped channel text message \"%.*hs...\" from client %hs (ID %hu) -> channel %hs (ID %hu), invalid char U+%0.4X '%hs' rejected.",
-				msgPartSize, message.data(), client->name().c_str(), client->id(), name().c_str(), rejectedCodePoint, rejectCharAsStr);
-			((relayserverinternal *)server.internaltag)->handlererror(server, error);
-			lacewing::error_delete(error);
+			relayserver::errorevent ev;
+			ev.kind = errorkind::ChannelMessageCodePoint;
+			ev.clientID = client._id;
+			// name() copies under the client's read lock; the channel's is already held
+			ev.clientName = client.name();
+			ev.targetID = _id;
+			ev.targetName = name();
+			ev.codePoint = rejectedCodePoint;
+			ev.detail = message.substr(0, 15);
+			((relayserverinternal *)server.internaltag)->raiseerror(ev);
 			return;
 		}
 	}
@@ -3529,34 +4567,140 @@ void relayserver::channel::PeerToChannel(relayserver &server, std::shared_ptr<re
 
 	builder.add <lw_ui8>(subchannel);
 	builder.add <lw_ui16>(this->_id);
-	builder.add <lw_ui16>(client->_id);
+	builder.add <lw_ui16>(client._id);
 	builder.add (message);
 
-	// Loop through and send message to all clients that aren't this one
+	// Receivers found over the queued bytes limit, and pseudoUDP receivers that started holding back blasts
+	std::vector<std::shared_ptr<relayserver::client>> overLimitClients, conflatingClients;
+	const lw_ui64 conflationKey = relayserverinternal::conflationkey((2 << 4) | variant, _id, client._id, subchannel);
 
-	// Only need server write lock for shared lw_udp socket
-	auto serverUDPWriteLock = server.lock_udp.createWriteLock();
-	if (!blasted)
-		serverUDPWriteLock.lw_unlock();
+	// Big channel; split the recipients over the fan-out workers
+	relayserverinternal &serverinternal = *(relayserverinternal *)server.internaltag;
+	std::atomic<size_t> recipients = 0;
+	const lw_ui64 second = relayserver::client::trafficcounter::nowsecond();
+	if (serverinternal.fanoutthreshold != 0 && clients.size() >= serverinternal.fanoutthreshold &&
+		serverinternal.fanoutworkers.workercount() > 0)
+	{
+		// Encode once for every client type up front; the workers only read these.
+		// UDP payload first, then WebSocket, as the encodings write over the UDP header in that order.
+		const std::string udpFrame(blasted ? builder.udppayload() : std::string_view());
+		const std::string webFrame(builder.encodefor(true));
+		const std::string tcpFrame(builder.encodefor(false));
+
+		const size_t chunkCount = lw_min_size_t((serverinternal.fanoutworkers.workercount() + 1) * 4, clients.size() / 64 + 1);
+		const size_t chunkSize = (clients.size() + chunkCount - 1) / chunkCount;
+		std::mutex collectLock;
+
+		// Each client's stream is written by one thread only, and we're blocked here until all are done,
+		// so the pump won't touch them meanwhile; that holds even where the client locks are no-ops.
+		// Writes never close a stream directly, so no handlers run on workers.
+		serverinternal.fanoutworkers.run(chunkCount, [&](size_t chunk) {
+			size_t chunkRecipients = 0;
+			const auto end = clients.cbegin() + lw_min_size_t(clients.size(), (chunk + 1) * chunkSize);
+			for (auto it = clients.cbegin() + lw_min_size_t(clients.size(), chunk * chunkSize); it != end; ++it)
+			{
+				const auto &e = *it;
+				if (e.get() == &client)
+					continue;
 
-	for (const auto& e : clients)
+				auto cliWriteLock = e->lock.createWriteLock();
+				if (e->_readonly)
+					continue;
+				++chunkRecipients;
+				e->senttraffic.add(blasted, 1, message.size(), second);
+
+				if (blasted && !e->pseudoUDP)
+				{
+					// lw_udp isn't thread-safe
+					std::lock_guard<std::mutex> fanoutUDPGuard(serverinternal.fanoutudplock);
+					auto serverUDPWriteLock = server.lock_udp.createWriteLock();
+					server.udp->send(e->udpaddress, udpFrame.data(), udpFrame.size());
+					continue;
+				}
+
+				bool overLimit, conflating = false;
+				if (serverinternal.checkqueuelimit(*e, blasted, overLimit))
+				{
+					const std::string_view frame = e->socket->is_websocket() ? webFrame : tcpFrame;
+					if (blasted)
+						conflating = relayserverinternal::blastpseudoudp(*e, conflationKey, frame);
+					else
+						relayserverinternal::writeencoded(*e, frame);
+				}
+
+				if (overLimit || conflating)
+				{
+					// Can be both: a pausesender receiver over its limit still has its blasts conflated
+					std::lock_guard<std::mutex> collectGuard(collectLock);
+					if (overLimit)
+						overLimitClients.push_back(e);
+					if (conflating)
+						conflatingClients.push_back(e);
+				}
+			}
+			recipients.fetch_add(chunkRecipients, std::memory_order_relaxed);
+		});
+	}
+	else
 	{
-		if (e == client)
-			continue;
+		// Loop through and send message to all clients that aren't this one
 
-		auto cliWriteLock = e->lock.createWriteLock();
-		if (e->_readonly)
-			continue;
+		// Only need server write lock for shared lw_udp socket
+		auto serverUDPWriteLock = server.lock_udp.createWriteLock();
+		if (!blasted)
+			serverUDPWriteLock.lw_unlock();
 
-		if (blasted && !e->pseudoUDP)
-			builder.send(server.udp, e->udpaddress, false);
-		else
-			builder.send(e->socket, false);
+		for (const auto& e : clients)
+		{
+			if (e.get() == &client)
+				continue;
+
+			auto cliWriteLock = e->lock.createWriteLock();
+			if (e->_readonly)
+				continue;
+			recipients.fetch_add(1, std::memory_order_relaxed);
+			e->senttraffic.add(blasted, 1, message.size(), second);
+
+			if (blasted && !e->pseudoUDP)
+			{
+				builder.send(server.udp, e->udpaddress, false);
+				continue;
+			}
+
+			bool overLimit;
+			if (serverinternal.checkqueuelimit(*e, blasted, overLimit))
+			{
+				if (!blasted)
+					builder.send(e->socket, false);
+				else
+				{
+					if (relayserverinternal::blastpseudoudp(*e, conflationKey, builder.encodefor(e->socket->is_websocket())))
+						conflatingClients.push_back(e);
+					builder.revert(); // restore the UDP header for UDP clients later in the list
+				}
+			}
+			if (overLimit)
+				overLimitClients.push_back(e);
+		}
+
+		builder.framereset();
 	}
 
-	builder.framereset();
+	// Conflation and the queue limit policy may disconnect, which write-locks the channel
+	channelReadLock.lw_unlock();
+
+	serverinternal.metrics.record(relaymetrics::histogram::Fanout, recipients.load(std::memory_order_relaxed));
+	serverinternal.metrics.sent(2, recipients.load(std::memory_order_relaxed), message.size());
+
+	for (const auto& e : conflatingClients)
+		serverinternal.addconflating(e);
+
+	// Policy may disconnect or run handlers, so apply it on this thread, with no client locks held
+	for (const auto& e : overLimitClients)
+		serverinternal.queuelimitexceeded(client, *e);
 }
 
+
 #define autohandlerfunctions(pub, intern, handlername)			  \
 	void pub::on##handlername(pub::handler_##handlername handler) {  \
 			lacewing::writelock serverMetaWriteLock = lock_meta.createWriteLock(); \
@@ -3565,12 +4709,26 @@ void relayserver::channel::PeerToChannel(relayserver &server, std::shared_ptr<re
 autohandlerfunctions(relayserver, relayserverinternal, connect)
 autohandlerfunctions(relayserver, relayserverinternal, disconnect)
 autohandlerfunctions(relayserver, relayserverinternal, error)
-autohandlerfunctions(relayserver, relayserverinternal, message_server)
-autohandlerfunctions(relayserver, relayserverinternal, message_channel)
-autohandlerfunctions(relayserver, relayserverinternal, message_peer)
+autohandlerfunctions(relayserver, relayserverinternal, errorevent)
 autohandlerfunctions(relayserver, relayserverinternal, channel_join)
 autohandlerfunctions(relayserver, relayserverinternal, channel_leave)
 autohandlerfunctions(relayserver, relayserverinternal, channel_close)
 autohandlerfunctions(relayserver, relayserverinternal, nameset)
 
+// Message handlers come in owning and borrowed-reference forms; setting one form clears the other
+#define autohandlerpairfunctions(pub, intern, handlername)			  \
+	void pub::on##handlername(pub::handler_##handlername handler) {  \
+			lacewing::writelock serverMetaWriteLock = lock_meta.createWriteLock(); \
+			((intern *) internaltag)->handler##handlername = handler;	  \
+			((intern *) internaltag)->handler##handlername##_ref = nullptr;	  \
+		}	\
+	void pub::on##handlername##_ref(pub::handler_##handlername##_ref handler) {  \
+			lacewing::writelock serverMetaWriteLock = lock_meta.createWriteLock(); \
+			((intern *) internaltag)->handler##handlername##_ref = handler;	  \
+			((intern *) internaltag)->handler##handlername = nullptr;	  \
+		}
+autohandlerpairfunctions(relayserver, relayserverinternal, message_server)
+autohandlerpairfunctions(relayserver, relayserverinternal, message_channel)
+autohandlerpairfunctions(relayserver, relayserverinternal, message_peer)
+
 }
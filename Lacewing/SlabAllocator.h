@@ -0,0 +1,103 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+#ifndef LacewingSlabAllocator
+#define LacewingSlabAllocator
+
+/// <summary> Hands out fixed-size blocks carved from large slabs, reusing freed blocks. Slabs are never
+/// 		  freed, so a server that once held N clients keeps room for N clients. </summary>
+template<size_t blockSize, size_t blockAlign>
+class slabpool
+{
+	union block
+	{
+		block * nextFree;
+		alignas(blockAlign) unsigned char storage[blockSize];
+	};
+	static constexpr size_t blocksPerSlab = 64;
+
+	std::mutex poolLock;
+	block * freeList = nullptr;
+
+	slabpool() = default;
+
+public:
+
+	static slabpool & get()
+	{
+		// Never destroyed, so objects freed during static destruction still have somewhere to go
+		static slabpool * pool = new slabpool();
+		return *pool;
+	}
+
+	void * allocate()
+	{
+		std::lock_guard<std::mutex> poolGuard(poolLock);
+		if (!freeList)
+		{
+			block * slab = (block *)::operator new(sizeof(block) * blocksPerSlab, std::align_val_t(alignof(block)));
+			for (size_t i = 0; i < blocksPerSlab; ++i)
+			{
+				slab[i].nextFree = freeList;
+				freeList = &slab[i];
+			}
+		}
+		block * b = freeList;
+		freeList = b->nextFree;
+		return b;
+	}
+
+	void deallocate(void * ptr)
+	{
+		std::lock_guard<std::mutex> poolGuard(poolLock);
+		block * b = (block *)ptr;
+		b->nextFree = freeList;
+		freeList = b;
+	}
+};
+
+/// <summary> Standard allocator over slabpool, for std::allocate_shared. make_shared already puts the object
+/// 		  and its control block in one allocation; this only makes that allocation a pop off a free list,
+/// 		  reusing blocks freed by earlier clients instead of going back to malloc. </summary>
+template<class T>
+class slaballocator
+{
+public:
+	typedef T value_type;
+
+	slaballocator() noexcept = default;
+	template<class U>
+	slaballocator(const slaballocator<U> &) noexcept { }
+
+	T * allocate(size_t count)
+	{
+		if (count != 1)
+			return (T *)::operator new(sizeof(T) * count);
+		return (T *)slabpool<sizeof(T), alignof(T)>::get().allocate();
+	}
+
+	void deallocate(T * ptr, size_t count) noexcept
+	{
+		if (count != 1)
+			::operator delete(ptr);
+		else
+			slabpool<sizeof(T), alignof(T)>::get().deallocate(ptr);
+	}
+
+	template<class U>
+	bool operator == (const slaballocator<U> &) const noexcept { return true; }
+	template<class U>
+	bool operator != (const slaballocator<U> &) const noexcept { return false; }
+};
+
+#endif
@@ -0,0 +1,385 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+
+#ifndef LacewingSnapshotList
+#define LacewingSnapshotList
+
+/// <summary> Epoch-based reclamation for snapshotlist. A reader announces the epoch it started in; a writer
+/// 		  retires what it replaced with the epoch it was replaced in, and frees it once no reader that
+/// 		  started at or before then is still reading. Entering and leaving a read are a store each, to
+/// 		  a slot only this thread writes, so readers don't contend with each other or with writers. </summary>
+class snapshotepoch
+{
+	struct record
+	{
+		// Epoch this thread's outermost read started in, or 0 when it's not reading
+		std::atomic<std::uint64_t> active = 0;
+		std::atomic<bool> inuse = true;
+		record * next = nullptr;
+	};
+	// Records are reused by later threads, and never freed
+	static inline std::atomic<record *> records = nullptr;
+	static inline std::atomic<std::uint64_t> global = 1;
+
+	struct threadslot
+	{
+		record * rec = nullptr;
+		unsigned int depth = 0;
+
+		threadslot()
+		{
+			for (record * r = records.load(std::memory_order_acquire); r; r = r->next)
+			{
+				bool expected = false;
+				if (r->inuse.compare_exchange_strong(expected, true))
+				{
+					rec = r;
+					return;
+				}
+			}
+			rec = new record();
+			rec->next = records.load(std::memory_order_relaxed);
+			while (!records.compare_exchange_weak(rec->next, rec, std::memory_order_release, std::memory_order_relaxed))
+				/* retry */;
+		}
+		~threadslot()
+		{
+			rec->active.store(0, std::memory_order_release);
+			rec->inuse.store(false, std::memory_order_release);
+		}
+	};
+	static threadslot & slot()
+	{
+		thread_local threadslot s;
+		return s;
+	}
+
+public:
+	/// <summary> Keeps anything retired from now on allocated until destroyed. Nests. </summary>
+	class guard
+	{
+		threadslot & s;
+	public:
+		guard() : s(slot())
+		{
+			if (s.depth++ != 0)
+				return;
+			s.rec->active.store(global.load(std::memory_order_acquire), std::memory_order_relaxed);
+			// The announcement must be visible before this thread reads any list pointer; pairs with the
+			// fence in oldestactive()
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+		~guard()
+		{
+			if (--s.depth == 0)
+				s.rec->active.store(0, std::memory_order_release);
+		}
+		guard(const guard &) = delete;
+		guard & operator=(const guard &) = delete;
+	};
+
+	/// <summary> Call after publishing a replacement; returns the epoch to retire the replaced object with. </summary>
+	static std::uint64_t retire()
+	{
+		return global.fetch_add(1, std::memory_order_seq_cst);
+	}
+
+	/// <summary> The earliest epoch a current reader started in, or UINT64_MAX if none is reading. Anything
+	/// 		  retired with an epoch before this can be freed. </summary>
+	static std::uint64_t oldestactive()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::uint64_t oldest = UINT64_MAX;
+		for (const record * r = records.load(std::memory_order_acquire); r; r = r->next)
+		{
+			const std::uint64_t active = r->active.load(std::memory_order_acquire);
+			if (active != 0 && active < oldest)
+				oldest = active;
+		}
+		return oldest;
+	}
+};
+
+/// <summary> A copy-on-write list of shared pointers. read() iterates it without locking, or touching any
+/// 		  reference count; a reader sees the list as it was when read() was called, and entries removed
+/// 		  since stay allocated until it's done. Entries are held in chunks of up to chunkSize, and a change
+/// 		  copies only the chunk it touches, plus the index of chunk pointers, so it's O(n / chunkSize +
+/// 		  chunkSize) rather than O(n). Replaced chunks and indexes are freed by snapshotepoch. </summary>
+template<class T>
+class snapshotlist
+{
+public:
+	typedef std::shared_ptr<const std::vector<std::shared_ptr<T>>> snapshot_t;
+	static constexpr size_t chunkSize = 64;
+
+private:
+	typedef std::vector<std::shared_ptr<T>> chunk;
+	struct version
+	{
+		// No chunk is empty, and no two neighbouring chunks would fit in one. Chunks are shared with the versions
+		// before and after this one; each is freed with the version it was last in.
+		std::vector<const chunk *> chunks;
+		size_t count = 0;
+	};
+	struct retiree
+	{
+		const version * v;
+		// Chunks of v that the version replacing it didn't keep
+		std::vector<const chunk *> chunks;
+		std::uint64_t epoch;
+	};
+
+	std::atomic<const version *> current = new version();
+	// Replaced versions, oldest first; writers are serialised by the caller, but reclaim() needn't be
+	std::mutex retiredLock;
+	std::vector<retiree> retired;
+
+	void publish(version * next, std::vector<const chunk *> replacedChunks)
+	{
+		const version * old = current.exchange(next, std::memory_order_acq_rel);
+		const std::uint64_t epoch = snapshotepoch::retire();
+		{
+			std::lock_guard<std::mutex> retiredGuard(retiredLock);
+			retired.push_back(retiree { old, std::move(replacedChunks), epoch });
+		}
+		reclaim();
+	}
+
+	static chunk * newchunk()
+	{
+		chunk * c = new chunk();
+		c->reserve(chunkSize);
+		return c;
+	}
+
+public:
+
+	class const_iterator
+	{
+		const chunk * const * chunkAt, * const * chunksEnd;
+		// Null at the end
+		const std::shared_ptr<T> * at, * chunkEnd;
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef std::shared_ptr<T> value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const std::shared_ptr<T> * pointer;
+		typedef const std::shared_ptr<T> & reference;
+
+		const_iterator(const chunk * const * chunkAt, const chunk * const * chunksEnd)
+			: chunkAt(chunkAt), chunksEnd(chunksEnd), at(nullptr), chunkEnd(nullptr)
+		{
+			if (chunkAt != chunksEnd)
+			{
+				at = (*chunkAt)->data();
+				chunkEnd = at + (*chunkAt)->size();
+			}
+		}
+
+		const std::shared_ptr<T> & operator*() const { return *at; }
+		const std::shared_ptr<T> * operator->() const { return at; }
+		const_iterator & operator++()
+		{
+			if (++at != chunkEnd)
+				return *this;
+			if (++chunkAt != chunksEnd)
+			{
+				at = (*chunkAt)->data();
+				chunkEnd = at + (*chunkAt)->size();
+			}
+			else
+				at = chunkEnd = nullptr;
+			return *this;
+		}
+		bool operator==(const const_iterator & other) const { return at == other.at; }
+		bool operator!=(const const_iterator & other) const { return at != other.at; }
+	};
+
+	/// <summary> The list as it was when this was made. Iterating it needs no lock, and it won't change under
+	/// 		  you; don't keep it for longer than you need, as it holds up freeing everything replaced meanwhile. </summary>
+	class reader
+	{
+		snapshotepoch::guard guard;
+		const version * v;
+	public:
+		explicit reader(const snapshotlist & list) : v(list.current.load(std::memory_order_acquire)) { }
+
+		const_iterator begin() const { return const_iterator(v->chunks.data(), v->chunks.data() + v->chunks.size()); }
+		const_iterator end() const { return const_iterator(nullptr, nullptr); }
+		size_t size() const { return v->count; }
+		bool empty() const { return v->count == 0; }
+	};
+
+	snapshotlist() = default;
+	snapshotlist(const snapshotlist &) = delete;
+	snapshotlist & operator=(const snapshotlist &) = delete;
+	~snapshotlist()
+	{
+		// By now nothing should be reading
+		const version * cur = current.load();
+		for (const chunk * c : cur->chunks)
+			delete c;
+		delete cur;
+		for (const retiree & r : retired)
+		{
+			for (const chunk * c : r.chunks)
+				delete c;
+			delete r.v;
+		}
+	}
+
+	reader read() const
+	{
+		return reader(*this);
+	}
+
+	/// <summary> Copies the list into a vector that can be kept. O(n); use read() unless you need to keep it. </summary>
+	snapshot_t snapshot() const
+	{
+		const reader list = read();
+		auto copy = std::make_shared<std::vector<std::shared_ptr<T>>>();
+		copy->reserve(list.size());
+		copy->insert(copy->end(), list.begin(), list.end());
+		return copy;
+	}
+
+	/// <summary> Adds item at the end. Writers must be serialised by the caller (i.e. hold the matching server
+	/// 		  list write lock), or changes will be lost; this goes for erase() and clear() too. </summary>
+	void push_back(const std::shared_ptr<T> & item)
+	{
+		const version * cur = current.load(std::memory_order_acquire);
+		version * next = new version { cur->chunks, cur->count + 1 };
+		std::vector<const chunk *> replaced;
+		chunk * last = newchunk();
+		if (!next->chunks.empty() && next->chunks.back()->size() < chunkSize)
+		{
+			replaced.push_back(next->chunks.back());
+			*last = *next->chunks.back();
+			last->push_back(item);
+			next->chunks.back() = last;
+		}
+		else
+		{
+			last->push_back(item);
+			next->chunks.push_back(last);
+		}
+		publish(next, std::move(replaced));
+	}
+
+	/// <summary> Adds item if it's not already in the list. </summary>
+	void push_back_unique(const std::shared_ptr<T> & item)
+	{
+		if (!contains(item))
+			push_back(item);
+	}
+
+	/// <summary> Removes item. Returns false if it wasn't in the list, and leaves the list as is. </summary>
+	bool erase(const std::shared_ptr<T> & item)
+	{
+		const version * cur = current.load(std::memory_order_acquire);
+		size_t chunkIndex = 0;
+		typename chunk::const_iterator found;
+		for (; chunkIndex < cur->chunks.size(); ++chunkIndex)
+		{
+			const chunk & c = *cur->chunks[chunkIndex];
+			if ((found = std::find(c.cbegin(), c.cend(), item)) != c.cend())
+				break;
+		}
+		if (chunkIndex == cur->chunks.size())
+			return false;
+
+		const chunk & oldChunk = *cur->chunks[chunkIndex];
+		version * next = new version { cur->chunks, cur->count - 1 };
+		std::vector<const chunk *> replaced { &oldChunk };
+		chunk * replacement = newchunk();
+		replacement->insert(replacement->end(), oldChunk.cbegin(), found);
+		replacement->insert(replacement->end(), found + 1, oldChunk.cend());
+
+		// Merge with a neighbour if they'd fit in one chunk, so erases can't leave the index full of tiny chunks
+		if (chunkIndex + 1 < next->chunks.size() && replacement->size() + next->chunks[chunkIndex + 1]->size() <= chunkSize)
+		{
+			const chunk * after = next->chunks[chunkIndex + 1];
+			replacement->insert(replacement->end(), after->cbegin(), after->cend());
+			replaced.push_back(after);
+			next->chunks.erase(next->chunks.begin() + chunkIndex + 1);
+		}
+		else if (chunkIndex > 0 && replacement->size() + next->chunks[chunkIndex - 1]->size() <= chunkSize)
+		{
+			const chunk * before = next->chunks[chunkIndex - 1];
+			replacement->insert(replacement->begin(), before->cbegin(), before->cend());
+			replaced.push_back(before);
+			next->chunks.erase(next->chunks.begin() + --chunkIndex);
+		}
+
+		if (replacement->empty())
+		{
+			delete replacement;
+			next->chunks.erase(next->chunks.begin() + chunkIndex);
+		}
+		else
+			next->chunks[chunkIndex] = replacement;
+		publish(next, std::move(replaced));
+		return true;
+	}
+
+	void clear()
+	{
+		const version * cur = current.load(std::memory_order_acquire);
+		publish(new version(), cur->chunks);
+	}
+
+	/// <summary> Frees replaced versions no reader can still see. Changes call this themselves; call it
+	/// 		  now and then too, so what a long read held up isn't kept until the next change. </summary>
+	void reclaim()
+	{
+		std::lock_guard<std::mutex> retiredGuard(retiredLock);
+		if (retired.empty())
+			return;
+		const std::uint64_t oldest = snapshotepoch::oldestactive();
+		size_t freed = 0;
+		for (; freed < retired.size() && retired[freed].epoch < oldest; ++freed)
+		{
+			for (const chunk * c : retired[freed].chunks)
+				delete c;
+			delete retired[freed].v;
+		}
+		retired.erase(retired.begin(), retired.begin() + freed);
+	}
+
+	bool contains(const std::shared_ptr<T> & item) const
+	{
+		for (const auto & e : read())
+			if (e == item)
+				return true;
+		return false;
+	}
+
+	/// <summary> Finds the shared pointer owning the raw pointer, or null. </summary>
+	std::shared_ptr<T> find(const T * item) const
+	{
+		for (const auto & e : read())
+			if (e.get() == item)
+				return e;
+		return nullptr;
+	}
+
+	size_t size() const
+	{
+		return read().size();
+	}
+};
+
+#endif
@@ -0,0 +1,73 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+#include <algorithm>
+#include <chrono>
+
+#ifndef LacewingTokenBucket
+#define LacewingTokenBucket
+
+/// <summary> A token bucket: refills at a steady rate up to a cap, and spend() takes from it. Spending more than it
+/// 		  holds leaves it in debt, up to one cap's worth, which has to refill before anything else fits.
+/// 		  Not thread-safe. </summary>
+class tokenbucket
+{
+	double tokens = 0, rate = 0, capacity = 0;
+	std::chrono::steady_clock::time_point refilledAt;
+
+	void refill(std::chrono::steady_clock::time_point now)
+	{
+		const double seconds = std::chrono::duration<double>(now - refilledAt).count();
+		if (seconds <= 0)
+			return;
+		refilledAt = now;
+		tokens = std::min(capacity, tokens + seconds * rate);
+	}
+
+public:
+
+	/// <summary> Sets the refill rate per second, and the most it holds; starts full. A rate of 0 is no limit. </summary>
+	void configure(double perSecond, double cap, std::chrono::steady_clock::time_point now)
+	{
+		rate = std::max(perSecond, 0.0);
+		capacity = std::max(cap, 1.0);
+		tokens = capacity;
+		refilledAt = now;
+	}
+
+	bool limited() const
+	{
+		return rate > 0;
+	}
+
+	/// <summary> True if count tokens are there to spend. A full bucket fits anything, so a count over its
+	/// 		  capacity still passes now and then, rather than never. </summary>
+	bool fits(double count, std::chrono::steady_clock::time_point now)
+	{
+		if (rate <= 0)
+			return true;
+		refill(now);
+		return tokens >= count || tokens >= capacity;
+	}
+
+	void spend(double count)
+	{
+		if (rate > 0)
+			tokens = std::max(tokens - count, -capacity);
+	}
+
+	bool indebt(std::chrono::steady_clock::time_point now)
+	{
+		if (rate <= 0)
+			return false;
+		refill(now);
+		return tokens < 0;
+	}
+};
+
+#endif
@@ -0,0 +1,328 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+
+#include "Lacewing.h"
+
+// UTF-8 validation, vectorised with the lookup algorithm from Keiser and Lemire, "Validating UTF-8 In Less
+// Than One Instruction Per Byte" (2021). Each byte pair is classified by three 16-entry table lookups
+// (high nibble of the first byte, low nibble of the first byte, high nibble of the second byte); the
+// lookups are ANDed, and any bit left set is an error. Continuation byte counts for 3 and 4 byte
+// sequences are checked separately. The result matches utf8proc_iterate() + utf8proc_codepoint_valid():
+// overlongs, surrogates, code points past U+10FFFF and truncated sequences are all rejected.
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+	#include <immintrin.h>
+	#define LW_UTF8_X86
+	#define LW_UTF8_TARGET(x) __attribute__((target(x)))
+#elif defined(_M_X64) || defined(_M_IX86)
+	#include <immintrin.h>
+	#include <intrin.h>
+	#define LW_UTF8_X86
+	#define LW_UTF8_TARGET(x)
+#elif defined(__aarch64__) || defined(_M_ARM64)
+	#include <arm_neon.h>
+#endif
+
+// Scalar validator, used when there's no SSSE3, and for non-x86.
+static bool lw_u8str_validate_scalar(const unsigned char * str, size_t size)
+{
+	const unsigned char * const end = str + size;
+	while (str < end)
+	{
+		// Skip ASCII 8 bytes at a time
+		if (end - str >= 8)
+		{
+			lw_ui64 word;
+			memcpy(&word, str, sizeof(word));
+			if ((word & 0x8080808080808080ULL) == 0)
+			{
+				str += 8;
+				continue;
+			}
+		}
+
+		const unsigned char c = *str;
+		if (c < 0x80)
+		{
+			++str;
+			continue;
+		}
+
+		size_t length;
+		lw_ui32 codePoint, minimum;
+		if ((c & 0xE0) == 0xC0)
+			length = 2, codePoint = c & 0x1F, minimum = 0x80;
+		else if ((c & 0xF0) == 0xE0)
+			length = 3, codePoint = c & 0x0F, minimum = 0x800;
+		else if ((c & 0xF8) == 0xF0)
+			length = 4, codePoint = c & 0x07, minimum = 0x10000;
+		else
+			return false; // stray continuation, or 0xF8+
+
+		if ((size_t)(end - str) < length)
+			return false;
+		for (size_t i = 1; i < length; ++i)
+		{
+			if ((str[i] & 0xC0) != 0x80)
+				return false;
+			codePoint = (codePoint << 6) | (str[i] & 0x3F);
+		}
+		if (codePoint < minimum || codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint <= 0xDFFF))
+			return false;
+		str += length;
+	}
+	return true;
+}
+
+#ifdef LW_UTF8_X86
+
+// Error bits, as in the paper. Each is set by all three lookups only for the byte pair it names.
+enum : lw_ui8
+{
+	TOO_SHORT = 1 << 0,		// 11______ 0_______, or 11______ 11______
+	TOO_LONG = 1 << 1,		// 0_______ 10______
+	OVERLONG_3 = 1 << 2,	// 11100000 100_____
+	TOO_LARGE = 1 << 3,		// 11110100 1001____ and up
+	SURROGATE = 1 << 4,		// 11101101 101_____
+	OVERLONG_2 = 1 << 5,	// 1100000_ 10______
+	TOO_LARGE_1000 = 1 << 6,// 11110101 1000____ and up
+	OVERLONG_4 = 1 << 6,	// 11110000 1000____
+	TWO_CONTS = 1 << 7,		// 10______ 10______
+	CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS
+};
+
+#define LW_UTF8_TABLES \
+	static const lw_ui8 byte1High[16] = { \
+		/* 0_______ ________: ASCII */ \
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+		/* 10______ ________: continuation */ \
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+		/* 1100____, 1101____: 2 byte lead */ \
+		TOO_SHORT | OVERLONG_2, TOO_SHORT, \
+		/* 1110____: 3 byte lead */ \
+		TOO_SHORT | OVERLONG_3 | SURROGATE, \
+		/* 1111____: 4+ byte lead */ \
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4 }; \
+	static const lw_ui8 byte1Low[16] = { \
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, /* ____0000 */ \
+		CARRY | OVERLONG_2, /* ____0001 */ \
+		CARRY, CARRY, /* ____001_ */ \
+		CARRY | TOO_LARGE, /* ____0100 */ \
+		CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+		CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+		CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, /* ____1101 */ \
+		CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000 }; \
+	static const lw_ui8 byte2High[16] = { \
+		/* ________ 0_______: ASCII */ \
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+		/* ________ 1000____ */ \
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+		/* ________ 1001____ */ \
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+		/* ________ 101_____ */ \
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+		/* ________ 11______ */ \
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT }; \
+	/* A chunk ending partway into a sequence must be followed by its continuations */ \
+	static const lw_ui8 incompleteMax[32] = { \
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, \
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1 };
+
+LW_UTF8_TARGET("ssse3")
+static bool lw_u8str_validate_ssse3(const unsigned char * str, size_t size)
+{
+	LW_UTF8_TABLES
+	const __m128i tableByte1High = _mm_loadu_si128((const __m128i *)byte1High);
+	const __m128i tableByte1Low = _mm_loadu_si128((const __m128i *)byte1Low);
+	const __m128i tableByte2High = _mm_loadu_si128((const __m128i *)byte2High);
+	const __m128i maxForComplete = _mm_loadu_si128((const __m128i *)(incompleteMax + 16));
+	const __m128i lowNibble = _mm_set1_epi8(0x0F);
+
+	__m128i prevInput = _mm_setzero_si128(), prevIncomplete = _mm_setzero_si128(), error = _mm_setzero_si128();
+	unsigned char tail[16];
+	for (size_t i = 0; i < size; i += 16)
+	{
+		__m128i input;
+		if (size - i >= 16)
+			input = _mm_loadu_si128((const __m128i *)(str + i));
+		else
+		{
+			// Zero padding is ASCII, so a truncated sequence at the very end is still caught
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, str + i, size - i);
+			input = _mm_loadu_si128((const __m128i *)tail);
+		}
+
+		if (_mm_movemask_epi8(input) == 0)
+		{
+			error = _mm_or_si128(error, prevIncomplete);
+			prevIncomplete = _mm_setzero_si128();
+			prevInput = input;
+			continue;
+		}
+
+		const __m128i prev1 = _mm_alignr_epi8(input, prevInput, 16 - 1);
+		const __m128i special = _mm_and_si128(_mm_and_si128(
+			_mm_shuffle_epi8(tableByte1High, _mm_and_si128(_mm_srli_epi16(prev1, 4), lowNibble)),
+			_mm_shuffle_epi8(tableByte1Low, _mm_and_si128(prev1, lowNibble))),
+			_mm_shuffle_epi8(tableByte2High, _mm_and_si128(_mm_srli_epi16(input, 4), lowNibble)));
+
+		// 3rd and 4th bytes of sequences must be continuations; special has TWO_CONTS (0x80) set exactly there if so
+		const __m128i prev2 = _mm_alignr_epi8(input, prevInput, 16 - 2);
+		const __m128i prev3 = _mm_alignr_epi8(input, prevInput, 16 - 3);
+		const __m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80))),
+			_mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80))));
+		error = _mm_or_si128(error, _mm_xor_si128(_mm_and_si128(must23, _mm_set1_epi8((char)0x80)), special));
+
+		prevIncomplete = _mm_subs_epu8(input, maxForComplete);
+		prevInput = input;
+	}
+	error = _mm_or_si128(error, prevIncomplete);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+LW_UTF8_TARGET("avx2")
+static bool lw_u8str_validate_avx2(const unsigned char * str, size_t size)
+{
+	LW_UTF8_TABLES
+	// vpshufb looks up within each 128-bit lane, so the tables are repeated in both
+	const __m256i tableByte1High = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte1High));
+	const __m256i tableByte1Low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte1Low));
+	const __m256i tableByte2High = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte2High));
+	const __m256i maxForComplete = _mm256_loadu_si256((const __m256i *)incompleteMax);
+	const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+
+	__m256i prevInput = _mm256_setzero_si256(), prevIncomplete = _mm256_setzero_si256(), error = _mm256_setzero_si256();
+	unsigned char tail[32];
+	for (size_t i = 0; i < size; i += 32)
+	{
+		__m256i input;
+		if (size - i >= 32)
+			input = _mm256_loadu_si256((const __m256i *)(str + i));
+		else
+		{
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, str + i, size - i);
+			input = _mm256_loadu_si256((const __m256i *)tail);
+		}
+
+		if (_mm256_movemask_epi8(input) == 0)
+		{
+			error = _mm256_or_si256(error, prevIncomplete);
+			prevIncomplete = _mm256_setzero_si256();
+			prevInput = input;
+			continue;
+		}
+
+		// Previous bytes across the lane boundary: high lane of prevInput + low lane of input
+		const __m256i straddle = _mm256_permute2x128_si256(prevInput, input, 0x21);
+		const __m256i prev1 = _mm256_alignr_epi8(input, straddle, 16 - 1);
+		const __m256i special = _mm256_and_si256(_mm256_and_si256(
+			_mm256_shuffle_epi8(tableByte1High, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble)),
+			_mm256_shuffle_epi8(tableByte1Low, _mm256_and_si256(prev1, lowNibble))),
+			_mm256_shuffle_epi8(tableByte2High, _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble)));
+
+		const __m256i prev2 = _mm256_alignr_epi8(input, straddle, 16 - 2);
+		const __m256i prev3 = _mm256_alignr_epi8(input, straddle, 16 - 3);
+		const __m256i must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))),
+			_mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80))));
+		error = _mm256_or_si256(error, _mm256_xor_si256(_mm256_and_si256(must23, _mm256_set1_epi8((char)0x80)), special));
+
+		prevIncomplete = _mm256_subs_epu8(input, maxForComplete);
+		prevInput = input;
+	}
+	error = _mm256_or_si256(error, prevIncomplete);
+	return _mm256_testz_si256(error, error) != 0;
+}
+
+#undef LW_UTF8_TABLES
+
+typedef bool (*lw_u8str_validator)(const unsigned char * str, size_t size);
+
+static lw_u8str_validator lw_u8str_pickvalidator()
+{
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return lw_u8str_validate_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return lw_u8str_validate_ssse3;
+#else
+	int info[4];
+	__cpuid(info, 0);
+	const int maxLeaf = info[0];
+	__cpuid(info, 1);
+	const bool ssse3 = (info[2] & (1 << 9)) != 0;
+	// AVX2 also needs the OS to save YMM registers, per OSXSAVE and XCR0
+	const bool osYMM = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+	if (osYMM && maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5))
+			return lw_u8str_validate_avx2;
+	}
+	if (ssse3)
+		return lw_u8str_validate_ssse3;
+#endif
+	return lw_u8str_validate_scalar;
+}
+
+#endif // LW_UTF8_X86
+
+extern "C" bool lw_u8str_validate(const char* toValidate, size_t size)
+{
+	return lw_u8str_validate(std::string_view(toValidate, size));
+}
+bool lw_u8str_validate(const std::string_view toValidate)
+{
+	// Short strings aren't worth a vector pass
+	if (toValidate.size() < 16)
+		return lw_u8str_validate_scalar((const unsigned char *)toValidate.data(), toValidate.size());
+
+#ifdef LW_UTF8_X86
+	static const lw_u8str_validator validator = lw_u8str_pickvalidator();
+	return validator((const unsigned char *)toValidate.data(), toValidate.size());
+#else
+	return lw_u8str_validate_scalar((const unsigned char *)toValidate.data(), toValidate.size());
+#endif
+}
+
+size_t lw_u8str_printableasciirun(const std::string_view str)
+{
+	const unsigned char * const data = (const unsigned char *)str.data();
+	const size_t size = str.size();
+	size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	// Signed compare, so bytes 0x80+ are negative and fail the > 0x1F test
+	const __m128i belowSpace = _mm_set1_epi8(0x1F), del = _mm_set1_epi8(0x7F);
+	for (; i + 16 <= size; i += 16)
+	{
+		const __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+		const __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(chunk, belowSpace), _mm_cmplt_epi8(chunk, del));
+		if (_mm_movemask_epi8(printable) != 0xFFFF)
+			break; // scalar loop finds the byte
+	}
+#elif defined(__aarch64__) || defined(_M_ARM64)
+	const uint8x16_t space = vdupq_n_u8(0x20), tilde = vdupq_n_u8(0x7E);
+	for (; i + 16 <= size; i += 16)
+	{
+		const uint8x16_t chunk = vld1q_u8(data + i);
+		if (vminvq_u8(vandq_u8(vcgeq_u8(chunk, space), vcleq_u8(chunk, tilde))) != 0xFF)
+			break;
+	}
+#endif
+	for (; i < size; ++i)
+	{
+		if (data[i] < 0x20 || data[i] > 0x7E)
+			break;
+	}
+	return i;
+}
@@ -0,0 +1,212 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=c:
+ *
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * https://opensource.org/licenses/mit-license.php
+*/
+
+#include "common.h"
+
+/* The pool is shared by every stream, and streams may be written from relay fan-out threads,
+ * so it's guarded by a spinlock; it's only held for a couple of pointer swaps.
+ */
+#ifdef msvc_windows_atomic_workaround
+	static volatile LONG pool_lock = 0;
+	#define lwp_chunkpool_lock()	while (InterlockedExchange (&pool_lock, 1)) { }
+	#define lwp_chunkpool_unlock()  InterlockedExchange (&pool_lock, 0)
+#else
+	static atomic_flag pool_lock = ATOMIC_FLAG_INIT;
+	#define lwp_chunkpool_lock()	while (atomic_flag_test_and_set_explicit (&pool_lock, memory_order_acquire)) { }
+	#define lwp_chunkpool_unlock()  atomic_flag_clear_explicit (&pool_lock, memory_order_release)
+#endif
+
+static lwp_chunk pool_idle = 0;
+static size_t pool_idle_count = 0, pool_allocated = 0;
+
+static lwp_chunk lwp_chunkpool_get ()
+{
+	lwp_chunkpool_lock ();
+
+	lwp_chunk chunk = pool_idle;
+
+	if (chunk)
+	{
+		pool_idle = chunk->next;
+		-- pool_idle_count;
+	}
+	else
+		++ pool_allocated;
+
+	lwp_chunkpool_unlock ();
+
+	if (!chunk && ! (chunk = (lwp_chunk) malloc (sizeof (*chunk))))
+	{
+		lwp_chunkpool_lock ();
+		-- pool_allocated;
+		lwp_chunkpool_unlock ();
+
+		return 0;
+	}
+
+	chunk->next = 0;
+	chunk->start = chunk->end = 0;
+
+	return chunk;
+}
+
+static void lwp_chunkpool_put (lwp_chunk chunk)
+{
+	lwp_chunkpool_lock ();
+
+	if (pool_idle_count < lwp_chunkpool_max_idle)
+	{
+		chunk->next = pool_idle;
+		pool_idle = chunk;
+		++ pool_idle_count;
+
+		chunk = 0;
+	}
+	else
+		-- pool_allocated;
+
+	lwp_chunkpool_unlock ();
+
+	free (chunk);
+}
+
+size_t lwp_chunkpool_allocated ()
+{
+	lwp_chunkpool_lock ();
+	const size_t allocated = pool_allocated;
+	lwp_chunkpool_unlock ();
+
+	return allocated;
+}
+
+size_t lwp_chunkpool_trim (size_t keep)
+{
+	lwp_chunk to_free = 0;
+	size_t freed = 0;
+
+	lwp_chunkpool_lock ();
+
+	while (pool_idle_count > keep)
+	{
+		lwp_chunk chunk = pool_idle;
+		pool_idle = chunk->next;
+		-- pool_idle_count;
+		-- pool_allocated;
+
+		chunk->next = to_free;
+		to_free = chunk;
+		++ freed;
+	}
+
+	lwp_chunkpool_unlock ();
+
+	while (to_free)
+	{
+		lwp_chunk next = to_free->next;
+		free (to_free);
+		to_free = next;
+	}
+
+	return freed;
+}
+
+lw_bool lwp_chunkbuffer_add (lwp_chunkbuffer * ctx, const char * buffer, size_t length)
+{
+	if (length == SIZE_MAX)
+		length = strlen (buffer);
+
+	while (length > 0)
+	{
+		if (!ctx->tail || ctx->tail->end == lwp_chunk_size)
+		{
+			lwp_chunk chunk = lwp_chunkpool_get ();
+
+			if (!chunk)
+				return lw_false;
+
+			if (ctx->tail)
+				ctx->tail->next = chunk;
+			else
+				ctx->head = chunk;
+
+			ctx->tail = chunk;
+		}
+
+		size_t to_copy = lwp_chunk_size - ctx->tail->end;
+
+		if (to_copy > length)
+			to_copy = length;
+
+		memcpy (ctx->tail->data + ctx->tail->end, buffer, to_copy);
+
+		ctx->tail->end += to_copy;
+		ctx->length += to_copy;
+
+		buffer += to_copy;
+		length -= to_copy;
+	}
+
+	return lw_true;
+}
+
+const char * lwp_chunkbuffer_front (lwp_chunkbuffer * ctx, size_t * length)
+{
+	if (!ctx->head)
+	{
+		*length = 0;
+		return 0;
+	}
+
+	*length = ctx->head->end - ctx->head->start;
+	return ctx->head->data + ctx->head->start;
+}
+
+void lwp_chunkbuffer_trim_left (lwp_chunkbuffer * ctx, size_t length)
+{
+	while (length > 0 && ctx->head)
+	{
+		lwp_chunk chunk = ctx->head;
+		size_t in_chunk = chunk->end - chunk->start;
+
+		if (length < in_chunk)
+		{
+			chunk->start += length;
+			ctx->length -= length;
+
+			return;
+		}
+
+		length -= in_chunk;
+		ctx->length -= in_chunk;
+
+		if (! (ctx->head = chunk->next))
+			ctx->tail = 0;
+
+		lwp_chunkpool_put (chunk);
+	}
+}
+
+size_t lwp_chunkbuffer_length (lwp_chunkbuffer * ctx)
+{
+	return ctx->length;
+}
+
+void lwp_chunkbuffer_free (lwp_chunkbuffer * ctx)
+{
+	while (ctx->head)
+	{
+		lwp_chunk chunk = ctx->head;
+		ctx->head = chunk->next;
+
+		lwp_chunkpool_put (chunk);
+	}
+
+	ctx->tail = 0;
+	ctx->length = 0;
+}
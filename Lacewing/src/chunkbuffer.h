@@ -0,0 +1,56 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=c:
+ *
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * https://opensource.org/licenses/mit-license.php
+*/
+
+#ifndef _lw_chunk_buffer_h
+#define _lw_chunk_buffer_h
+
+/* Size of each chunk; data bigger than this is spread over several chunks */
+#define lwp_chunk_size  (16 * 1024)
+
+/* Drained chunks are kept for reuse up to this many (4 MB); beyond that they're freed */
+#define lwp_chunkpool_max_idle  256
+
+typedef struct _lwp_chunk
+{
+	struct _lwp_chunk * next;
+	size_t start, end;
+	char data [lwp_chunk_size];
+
+} * lwp_chunk;
+
+/* A FIFO byte queue made of fixed-size chunks from a global pool, used for stream write queues.
+ * Unlike lwp_heapbuffer, it never moves or regrows queued data, and chunks are returned to the
+ * pool as soon as they're written. Zero-initialise before use.
+ */
+typedef struct _lwp_chunkbuffer
+{
+	lwp_chunk head, tail;
+	size_t length;
+
+} lwp_chunkbuffer;
+
+lw_bool lwp_chunkbuffer_add (lwp_chunkbuffer *, const char * buffer, size_t length);
+
+/* Contiguous data at the front of the queue; *length is set to its size, which may be less than
+ * lwp_chunkbuffer_length if the data spans chunks.
+ */
+const char * lwp_chunkbuffer_front (lwp_chunkbuffer *, size_t * length);
+
+void lwp_chunkbuffer_trim_left (lwp_chunkbuffer *, size_t);
+size_t lwp_chunkbuffer_length (lwp_chunkbuffer *);
+
+void lwp_chunkbuffer_free (lwp_chunkbuffer *);
+
+/* Number of chunks currently allocated, in use or idle in the pool */
+size_t lwp_chunkpool_allocated ();
+
+/* Frees idle chunks beyond keep, returning how many were freed */
+size_t lwp_chunkpool_trim (size_t keep);
+
+#endif
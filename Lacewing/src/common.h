@@ -141,6 +141,7 @@ void lwp_deinit ();
 #endif
 
 #include "heapbuffer.h"
+#include "chunkbuffer.h"
 
 #include "../deps/uthash/uthash.h"
 #include "nvhash.h"
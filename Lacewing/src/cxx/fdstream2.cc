@@ -35,6 +35,11 @@ void _fdstream::uncork ()
 	lw_fdstream_uncork ((lw_fdstream) this);
 }
 
+void _fdstream::read_pause (bool paused)
+{
+	lw_fdstream_read_pause ((lw_fdstream) this, paused);
+}
+
 void _fdstream::nagle (bool enabled)
 {
 	lw_fdstream_nagle ((lw_fdstream) this, enabled);
@@ -82,6 +82,16 @@ server_client _server::client_first ()
 	return (server_client) lw_server_client_first ((lw_server) this);
 }
 
+void _server::accept_limit (long per_second)
+{
+	lw_server_set_accept_limit ((lw_server) this, per_second);
+}
+
+long _server::accept_limit ()
+{
+	return lw_server_accept_limit ((lw_server) this);
+}
+
 void _server::on_connect (_server::hook_connect hook)
 {
 	lw_server_on_connect ((lw_server) this, (lw_server_hook_connect) hook);
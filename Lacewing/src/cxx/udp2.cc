@@ -9,6 +9,7 @@
 */
 
 #include "../common.h"
+#include "../address.h"
 
 udp lacewing::udp_new (lacewing::pump pump)
 {
@@ -55,6 +56,12 @@ void _udp::send (lacewing::address address, const char * data, size_t size)
 	lw_udp_send ((lw_udp) this, (lw_addr) address, data, size);
 }
 
+void _udp::send (const lacewing::udpendpoint & endpoint, const char * data, size_t size)
+{
+	if (endpoint.length ())
+		lw_udp_send_sockaddr ((lw_udp) this, endpoint.get (), endpoint.length (), data, size);
+}
+
 void _udp::on_data (_udp::hook_data hook)
 {
 	lw_udp_on_data ((lw_udp) this, (lw_udp_hook_data) hook);
@@ -75,3 +82,57 @@ void _udp::tag (void * tag)
 	lw_udp_set_tag ((lw_udp) this, tag);
 }
 
+static_assert (sizeof (udpendpoint::words) == sizeof (struct sockaddr_storage),
+	"udpendpoint must hold any sockaddr");
+
+udpendpoint::udpendpoint (lacewing::address address)
+{
+	set (address);
+}
+
+void udpendpoint::set (const struct sockaddr * addr)
+{
+	memset (words, 0, sizeof (words));
+
+	// IPv4 copies up to sin_zero, so the padding the IPv6 address would use stays zero
+	if (addr->sa_family == AF_INET)
+		memcpy (words, addr, offsetof (struct sockaddr_in, sin_zero));
+	else if (addr->sa_family == AF_INET6)
+		memcpy (words, addr, sizeof (struct sockaddr_in6));
+}
+
+void udpendpoint::set (lacewing::address address)
+{
+	lw_addr addr = (lw_addr) address;
+
+	if (addr && lw_addr_ready (addr) && addr->info && addr->info->ai_addr)
+		set (addr->info->ai_addr);
+	else
+		memset (words, 0, sizeof (words));
+}
+
+lw_ui16 udpendpoint::port () const
+{
+	// sin_port and sin6_port share an offset
+	return ntohs (((const struct sockaddr_in *) words)->sin_port);
+}
+
+void udpendpoint::port (lw_ui16 port)
+{
+	((struct sockaddr_in *) words)->sin_port = htons (port);
+}
+
+size_t udpendpoint::length () const
+{
+	switch (get ()->sa_family)
+	{
+		case AF_INET:
+			return sizeof (struct sockaddr_in);
+
+		case AF_INET6:
+			return sizeof (struct sockaddr_in6);
+
+		default:
+			return 0;
+	};
+}
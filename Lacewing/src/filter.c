@@ -262,7 +262,11 @@ lwp_socket lwp_create_server_socket (lw_filter filter, int type,
 	if (ipv6)
 	  lwp_disable_ipv6_only (s);
 
-	reuse = lw_filter_reuse (filter) ? 1 : 0;
+	/* Reuse only matters for a fixed port. For an ephemeral one, Linux may hand a UDP
+	 * socket with SO_REUSEADDR a port another such socket already has, and datagrams
+	 * then go to either of them.
+	 */
+	reuse = (lw_filter_reuse (filter) && lw_filter_local_port (filter)) ? 1 : 0;
 	lwp_setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *)&reuse, sizeof(reuse));
 
 	memset (&addr, 0, sizeof (addr));
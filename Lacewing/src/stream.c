@@ -152,13 +152,19 @@ void lw_stream_delete (lw_stream ctx)
 	// Clear queues
 
 	list_each (struct _lwp_stream_queued, ctx->front_queue, queued)
-		lwp_heapbuffer_free (&queued.buffer);
+		lwp_chunkbuffer_free (&queued.buffer);
 
 	list_each (struct _lwp_stream_queued, ctx->back_queue, queued)
-		lwp_heapbuffer_free (&queued.buffer);
+		lwp_chunkbuffer_free (&queued.buffer);
+
+	list_each (struct _lwp_stream_queued, ctx->priority_queue, queued)
+		lwp_chunkbuffer_free (&queued.buffer);
 
 	list_clear (ctx->front_queue);
 	list_clear (ctx->back_queue);
+	list_clear (ctx->priority_queue);
+
+	lwp_chunkbuffer_free (&ctx->back_frames);
 
 	if (ctx->watch)
 	{
@@ -214,7 +220,65 @@ static void queue_back (lw_stream ctx, const char * buffer, size_t size)
 		list_push (struct _lwp_stream_queued, ctx->back_queue, queued);
 	}
 
-	lwp_heapbuffer_add (&list_elem_back (struct _lwp_stream_queued, ctx->back_queue)->buffer, buffer, size);
+	lwp_chunkbuffer_add (&list_elem_back (struct _lwp_stream_queued, ctx->back_queue)->buffer, buffer, size);
+
+	if (ctx->flags & lwp_stream_flag_framed)
+		lwp_chunkbuffer_add (&ctx->back_frames, (const char *) &size, sizeof (size));
+}
+
+static void queue_priority (lw_stream ctx, const char * buffer, size_t size)
+{
+	if (! (ctx->flags & lwp_stream_flag_framed))
+	{
+		/* Nothing in the back queue was tracked so far, so treat all of it
+		 * as one write that has to finish first.
+		 */
+		ctx->flags |= lwp_stream_flag_framed;
+		ctx->back_frame_left = 0;
+
+		list_each (struct _lwp_stream_queued, ctx->back_queue, queued)
+		{
+			if (queued.type == lwp_stream_queued_data)
+				ctx->back_frame_left += lwp_chunkbuffer_length (&queued.buffer);
+		}
+	}
+
+	if ( (!list_length (ctx->priority_queue)) ||
+		 list_back (struct _lwp_stream_queued, ctx->priority_queue).type != lwp_stream_queued_data)
+	{
+		struct _lwp_stream_queued queued = {0};
+
+		queued.type = lwp_stream_queued_data;
+
+		list_push (struct _lwp_stream_queued, ctx->priority_queue, queued);
+	}
+
+	lwp_chunkbuffer_add (&list_elem_back (struct _lwp_stream_queued, ctx->priority_queue)->buffer, buffer, size);
+}
+
+/* Accounts for bytes written from the back queue, moving through back_frames */
+
+static void consume_back_frames (lw_stream ctx, size_t written)
+{
+	while (written > 0)
+	{
+		if (ctx->back_frame_left == 0)
+		{
+			size_t length;
+			const char * front = lwp_chunkbuffer_front (&ctx->back_frames, &length);
+
+			if (!front)
+				break;
+
+			memcpy (&ctx->back_frame_left, front, sizeof (size_t));
+			lwp_chunkbuffer_trim_left (&ctx->back_frames, sizeof (size_t));
+		}
+
+		size_t consumed = written < ctx->back_frame_left ? written : ctx->back_frame_left;
+
+		ctx->back_frame_left -= consumed;
+		written -= consumed;
+	}
 }
 
 static void queue_front (lw_stream ctx, const char * buffer, size_t size)
@@ -229,7 +293,7 @@ static void queue_front (lw_stream ctx, const char * buffer, size_t size)
 		list_push (struct _lwp_stream_queued, ctx->front_queue, queued);
 	}
 
-	lwp_heapbuffer_add (&list_elem_back (struct _lwp_stream_queued, ctx->front_queue)->buffer, buffer, size);
+	lwp_chunkbuffer_add (&list_elem_back (struct _lwp_stream_queued, ctx->front_queue)->buffer, buffer, size);
 }
 
 size_t lwp_stream_write (lw_stream ctx, const char * buffer, size_t size, int flags)
@@ -324,7 +388,8 @@ size_t lwp_stream_write (lw_stream ctx, const char * buffer, size_t size, int fl
 	}
 
 	if ( (! (flags & lwp_stream_write_ignore_queue)) &&
-			( (ctx->flags & lwp_stream_flag_queuing) || list_length (ctx->back_queue) > 0))
+			( (ctx->flags & lwp_stream_flag_queuing) || list_length (ctx->back_queue) > 0
+				|| list_length (ctx->priority_queue) > 0))
 	{
 		lwp_trace ("%p : Adding to back queue (queueing = %d, front queue length = %zu)",
 			ctx, (int) ( (ctx->flags & lwp_stream_flag_queuing) != 0),
@@ -333,7 +398,10 @@ size_t lwp_stream_write (lw_stream ctx, const char * buffer, size_t size, int fl
 		if (flags & lwp_stream_write_partial)
 			return 0;
 
-		queue_back (ctx, buffer, size);
+		if ((flags & lwp_stream_write_priority) && ! (ctx->flags & lwp_stream_flag_queuing))
+			queue_priority (ctx, buffer, size);
+		else
+			queue_back (ctx, buffer, size);
 
 		if (ctx->retry == lw_stream_retry_more_data)
 			lw_stream_retry (ctx, lw_stream_retry_now);
@@ -360,9 +428,13 @@ size_t lwp_stream_write (lw_stream ctx, const char * buffer, size_t size, int fl
 	{
 		if (flags & lwp_stream_write_ignore_queue)
 		{
-			if (lwp_heapbuffer_length (&list_front (struct _lwp_stream_queued, ctx->back_queue).buffer) == 0)
+			/* Goes ahead of the back queue's current write, so becomes part of it */
+			if (ctx->flags & lwp_stream_flag_framed)
+				ctx->back_frame_left += size - written;
+
+			if (lwp_chunkbuffer_length (&list_elem_front (struct _lwp_stream_queued, ctx->back_queue)->buffer) == 0)
 			{
-				lwp_heapbuffer_add (&list_elem_front (struct _lwp_stream_queued, ctx->back_queue)->buffer,
+				lwp_chunkbuffer_add (&list_elem_front (struct _lwp_stream_queued, ctx->back_queue)->buffer,
 									buffer + written, size - written);
 			}
 			else
@@ -373,7 +445,7 @@ size_t lwp_stream_write (lw_stream ctx, const char * buffer, size_t size, int fl
 
 				queued.type = lwp_stream_queued_data;
 
-				lwp_heapbuffer_add (&queued.buffer, buffer + written, size - written);
+				lwp_chunkbuffer_add (&queued.buffer, buffer + written, size - written);
 
 				list_push_front (struct _lwp_stream_queued, ctx->back_queue, queued);
 			}
@@ -775,9 +847,16 @@ void lwp_stream_push (lw_stream ctx, const char * buffer, size_t size)
 	}
 }
 
+/* Writes queue until it's empty or the stream is blocked.  For the back queue
+ * of a framed stream, also stops between two writes if priority data is
+ * waiting.
+ */
+
 list_type (struct _lwp_stream_queued) lwp_stream_write_queue(lw_stream ctx,
-	lw_list (struct _lwp_stream_queued, queue))
+	lw_list (struct _lwp_stream_queued, queue), lw_bool is_back_queue)
 {
+	lw_bool framed = is_back_queue && (ctx->flags & lwp_stream_flag_framed);
+
 	lwp_trace ("%p : WriteQueued : %zu to write", ctx, list_length (queue));
 
 	while (list_length (queue) > 0)
@@ -794,30 +873,56 @@ list_type (struct _lwp_stream_queued) lwp_stream_write_queue(lw_stream ctx,
 
 		if (queued->type == lwp_stream_queued_data)
 		{
-			if (lwp_heapbuffer_length (&queued->buffer) > 0)
+			/* Write chunk by chunk; each drained chunk goes back to the pool */
+
+			size_t front_length;
+			const char * front;
+			lw_bool blocked = lw_false;
+
+			while ((front = lwp_chunkbuffer_front (&queued->buffer, &front_length)) != 0)
 			{
-				/* There's still something in the buffer that needs to be written */
+				if (framed && list_length (ctx->priority_queue) > 0)
+				{
+					if (ctx->back_frame_left == 0)
+					{
+						blocked = lw_true; /* at a boundary; let the priority data go */
+						break;
+					}
+
+					if (front_length > ctx->back_frame_left)
+						front_length = ctx->back_frame_left;
+				}
 
 				size_t written = lwp_stream_write
-					( ctx,
-						lwp_heapbuffer_buffer (&queued->buffer),
-						lwp_heapbuffer_length (&queued->buffer),
+					( ctx, front, front_length,
 						lwp_stream_write_ignore_queue | lwp_stream_write_partial
 							| lwp_stream_write_ignore_busy
 					);
 
 				// Writing can cause the stream to putter out, in which case queued is now free'd and unsafe
 				if (ctx->flags & lwp_stream_flag_dead)
-					break; // abort
+				{
+					blocked = lw_true; // abort
+					break;
+				}
 
-				lwp_heapbuffer_trim_left(&queued->buffer, written);
+				lwp_chunkbuffer_trim_left (&queued->buffer, written);
 
-				if (lwp_heapbuffer_length(&queued->buffer) > 0)
-					break; /* couldn't write everything */
+				if (framed)
+					consume_back_frames (ctx, written);
 
-				lwp_heapbuffer_free(&queued->buffer);
+				if (written < front_length)
+				{
+					blocked = lw_true; /* couldn't write everything */
+					break;
+				}
 			}
 
+			if (blocked)
+				break;
+
+			lwp_chunkbuffer_free (&queued->buffer);
+
 			list_elem_remove (queued);
 			continue;
 		}
@@ -858,7 +963,7 @@ void lwp_stream_write_queued (lw_stream ctx)
 
 	lwp_retain (ctx, "write front queue");
 
-	ctx->front_queue = lwp_stream_write_queue (ctx, ctx->front_queue);
+	ctx->front_queue = lwp_stream_write_queue (ctx, ctx->front_queue, lw_false);
 
 	if (lwp_release(ctx, "write front queue") || ctx->flags & lwp_stream_flag_dead)
 		return;
@@ -867,15 +972,46 @@ void lwp_stream_write_queued (lw_stream ctx)
 			ctx, list_length (ctx->front_queue), list_length (ctx->prev),
 				list_length (ctx->back_queue));
 
-	if (list_length (ctx->front_queue) == 0
-			&& list_length (ctx->prev) == 0)
+	/* Alternate between the priority and back queues, writing priority data
+	 * whenever the back queue is between two writes.
+	 */
+	while (list_length (ctx->front_queue) == 0
+			&& list_length (ctx->prev) == 0
+			&& ! (ctx->flags & lwp_stream_flag_queuing))
 	{
+		if (list_length (ctx->priority_queue) > 0 && ctx->back_frame_left == 0)
+		{
+			lwp_retain (ctx, "write priority queue");
+
+			ctx->priority_queue = lwp_stream_write_queue (ctx, ctx->priority_queue, lw_false);
+
+			if (lwp_release (ctx, "write priority queue") || ctx->flags & lwp_stream_flag_dead)
+				return;
+
+			if (list_length (ctx->priority_queue) > 0)
+				break; /* blocked */
+		}
+
+		if (list_length (ctx->back_queue) == 0)
+			break;
+
 		lwp_retain (ctx, "write back queue");
 
-		ctx->back_queue = lwp_stream_write_queue (ctx, ctx->back_queue);
+		ctx->back_queue = lwp_stream_write_queue (ctx, ctx->back_queue, lw_true);
 
 		if (lwp_release (ctx, "write back queue") || ctx->flags & lwp_stream_flag_dead)
 			return;
+
+		/* Carry on only if we stopped to let priority data through */
+		if (list_length (ctx->priority_queue) == 0 || ctx->back_frame_left != 0)
+			break;
+	}
+
+	if (list_length (ctx->back_queue) == 0 && list_length (ctx->priority_queue) == 0)
+	{
+		ctx->flags &= ~ lwp_stream_flag_framed;
+		ctx->back_frame_left = 0;
+		lwp_chunkbuffer_free (&ctx->back_frames);
 	}
 
 	if (ctx->flags & lwp_stream_flag_closeASAP
@@ -937,7 +1073,8 @@ lw_bool lwp_stream_may_close (lw_stream ctx)
 {
 	return list_length (ctx->prev) == 0 &&
 			list_length (ctx->back_queue) == 0 &&
-			list_length (ctx->front_queue) == 0;
+			list_length (ctx->front_queue) == 0 &&
+			list_length (ctx->priority_queue) == 0;
 }
 
 lw_bool lw_stream_close (lw_stream ctx, lw_bool immediate)
@@ -1080,7 +1217,8 @@ lw_bool lw_stream_close (lw_stream ctx, lw_bool immediate)
 void lw_stream_begin_queue (lw_stream stream)
 {
 	if (list_length (stream->front_queue)
-			|| list_length (stream->back_queue))
+			|| list_length (stream->back_queue)
+			|| list_length (stream->priority_queue))
 	{
 		/*	Although we're going to start queueing any new data, whatever is
 			currently in the queue still needs to be written.
@@ -1103,11 +1241,14 @@ size_t lw_stream_queued (lw_stream stream)
 {
 	size_t size = 0, bytes_left;
 
+	list_each (struct _lwp_stream_queued, stream->priority_queue, queued)
+		size += lwp_chunkbuffer_length (&queued.buffer);
+
 	list_each (struct _lwp_stream_queued, stream->back_queue, queued)
 	{
 		if (queued.type == lwp_stream_queued_data)
 		{
-			size += lwp_heapbuffer_length (&queued.buffer);
+			size += lwp_chunkbuffer_length (&queued.buffer);
 			continue;
 		}
 
@@ -1167,7 +1308,8 @@ lw_bool lwp_stream_is_transparent (lw_stream ctx)
 		return lw_false;
 
 	if (list_length (ctx->back_queue) > 0 ||
-		list_length (ctx->front_queue) > 0)
+		list_length (ctx->front_queue) > 0 ||
+		list_length (ctx->priority_queue) > 0)
 	{
 		return lw_false;
 	}
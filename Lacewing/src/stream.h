@@ -33,6 +33,11 @@
  */
  #define lwp_stream_flag_draining_queues ((lw_i8)16)
 
+/* A priority write has been queued, so back_frames is tracking where each
+ * write in the back queue ends.
+ */
+ #define lwp_stream_flag_framed ((lw_i8)32)
+
 typedef struct _lwp_stream_data_hook
 {
 	lw_stream_hook_data proc;
@@ -58,7 +63,7 @@ typedef struct _lwp_stream_queued
 {
 	char type;
 
-	lwp_heapbuffer buffer;
+	lwp_chunkbuffer buffer;
 
 	lw_stream stream;
 	size_t stream_bytes_left;
@@ -131,6 +136,19 @@ struct _lw_stream
 	lw_list (struct _lwp_stream_queued, back_queue);
 
 
+	/* Priority writes that couldn't be written straight away.  These go ahead
+	 * of the back queue, but only between two writes, never inside one: with
+	 * lwp_stream_flag_framed set, back_frames holds the length (size_t) of each
+	 * write in the back queue, and back_frame_left is what's left of the one
+	 * being written.
+	 */
+
+	lw_list (struct _lwp_stream_queued, priority_queue);
+
+	lwp_chunkbuffer back_frames;
+	size_t back_frame_left;
+
+
 	int retry;
 
 	lwp_streamgraph graph;
@@ -172,6 +190,7 @@ void lwp_stream_init (lw_stream, const lw_streamdef *, lw_pump);
 #define lwp_stream_write_ignore_queue  4
 #define lwp_stream_write_partial  8
 #define lwp_stream_write_delete_stream  16
+#define lwp_stream_write_priority  32
 
  void lwp_stream_write_stream
 	(lw_stream, lw_stream source, size_t size, int flags);
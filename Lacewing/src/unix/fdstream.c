@@ -74,7 +74,7 @@ static void read_ready (void * tag)
 {
 	lw_fdstream ctx = (lw_fdstream)tag;
 
-	if (ctx->flags & lwp_fdstream_flag_reading)
+	if (ctx->flags & (lwp_fdstream_flag_reading | lwp_fdstream_flag_read_paused))
 		return;
 
 	ctx->flags |= lwp_fdstream_flag_reading;
@@ -130,6 +130,10 @@ static void read_ready (void * tag)
 
 		if (! (ctx->flags & lwp_fdstream_flag_reading))
 		 break;
+
+		/* Paused by a data handler; the rest stays in the socket buffer */
+		if (ctx->flags & lwp_fdstream_flag_read_paused)
+		 break;
 	}
 
 	ctx->flags &= ~ lwp_fdstream_flag_reading;
@@ -174,18 +178,21 @@ void lw_fdstream_set_fd (lw_fdstream ctx, lw_fd fd, lw_pump_watch watch,
 	}
 	#endif
 
-	struct stat stat;
-	fstat (fd, &stat);
-
 	if (is_socket /* S_ISSOCK(stat.st_mode) */)
 	{
 		ctx->flags |= lwp_fdstream_flag_is_socket;
 
-		lwp_make_nonblocking(fd);
+		if (ctx->flags & lwp_fdstream_flag_nonblocking)
+			ctx->flags &= ~ lwp_fdstream_flag_nonblocking;
+		else
+			lwp_make_nonblocking(fd);
 	}
 	else
 	{
-		ctx->flags &= ~ lwp_fdstream_flag_is_socket;
+		ctx->flags &= ~ (lwp_fdstream_flag_is_socket | lwp_fdstream_flag_nonblocking);
+
+		struct stat stat;
+		fstat (fd, &stat);
 
 		if ((ctx->size = (size_t)stat.st_size) > 0)
 			return;
@@ -241,6 +248,26 @@ void lw_fdstream_uncork (lw_fdstream ctx)
 	#endif
 }
 
+void lw_fdstream_read_pause (lw_fdstream ctx, lw_bool paused)
+{
+	if (paused)
+	{
+		ctx->flags |= lwp_fdstream_flag_read_paused;
+		return;
+	}
+
+	if (! (ctx->flags & lwp_fdstream_flag_read_paused))
+		return;
+
+	ctx->flags &= ~ lwp_fdstream_flag_read_paused;
+
+	/* The watch is edge triggered, so data that arrived while paused won't
+	 * signal again; read it now.
+	 */
+	if (ctx->fd != -1)
+		read_ready (ctx);
+}
+
 void lw_fdstream_nagle (lw_fdstream ctx, lw_bool enabled)
 {
 	if (enabled)
@@ -31,6 +31,9 @@ struct _lw_fdstream
 #define lwp_fdstream_flag_is_socket	((lw_i8)2)
 #define lwp_fdstream_flag_autoclose	((lw_i8)4)
 #define lwp_fdstream_flag_reading	 ((lw_i8)8)
+#define lwp_fdstream_flag_read_paused ((lw_i8)16)
+/* The next fd given to lw_fdstream_set_fd is already O_NONBLOCK, e.g. from accept4 */
+#define lwp_fdstream_flag_nonblocking ((lw_i8)32)
 
 void lwp_fdstream_init (lw_fdstream, lw_pump);
 
@@ -18,6 +18,15 @@
 
 #include "fdstream.h"
 
+/* Most connections accepted per listen_socket_read_ready call. The rest are
+ * picked up by a posted continuation, so an accept storm can't starve the
+ * rest of the pump.
+ */
+#define lwp_server_accept_batch 64
+
+/* Most freed lw_server_client allocations kept around for reuse. */
+#define lwp_server_client_pool_max 256
+
 static void on_client_close (lw_stream, void * tag);
 
 static void on_client_data (lw_stream, void * tag, const char * buffer,
@@ -52,6 +61,29 @@ struct _lw_server
 	#endif
 
 	lw_list (lw_server_client, clients);
+
+	/* Recycled client allocations, see lwp_server_client_dealloc */
+	lw_list (lw_server_client, client_pool);
+
+	/* Client allocations not yet deallocated, pooled ones aside. A server
+	 * deleted while this isn't 0 is freed by the last client dealloc.
+	 */
+	size_t clients_allocated;
+
+	/* Accept rate cap; 0 for unlimited. Connections over the cap are left in
+	 * the kernel backlog, and accept_timer resumes accepting next window.
+	 */
+	long accept_limit;
+	long accept_count;
+	lw_i64 accept_window_start;
+	lw_timer accept_timer;
+
+	/* A listen_socket_read_ready continuation is queued on the pump */
+	lw_bool accept_posted;
+	/* lw_server_delete was called; freed once accept_posted is clear and
+	 * clients_allocated is 0
+	 */
+	lw_bool delete_pending;
 };
 
 struct _lw_server_client
@@ -85,17 +117,63 @@ void on_ssl_error(lw_server_client client, lw_error error)
 	lw_stream_close((lw_stream)client, lw_true);
 }
 
+// Called by refcounter when it reaches zero
+static void lwp_server_client_dealloc (lw_server_client client)
+{
+	lw_server ctx = client->server;
+
+	lw_addr_delete (client->address);
+	client->address = NULL;
+
+	-- ctx->clients_allocated;
+
+	/* The server was deleted while this client was still referenced */
+	if (ctx->delete_pending)
+	{
+		free (client);
+
+		if (ctx->clients_allocated == 0 && !ctx->accept_posted)
+			free (ctx);
+
+		return;
+	}
+
+	if (list_length (ctx->client_pool) < lwp_server_client_pool_max)
+	{
+		list_push (lw_server_client, ctx->client_pool, client);
+		return;
+	}
+
+	free (client);
+}
+
 static lw_server_client lwp_server_client_new (lw_server ctx, lw_pump pump, int fd)
 {
-	lw_server_client client = (lw_server_client)calloc (sizeof (*client), 1);
+	lw_server_client client;
+
+	if (list_length (ctx->client_pool) > 0)
+	{
+		client = list_front (lw_server_client, ctx->client_pool);
+		list_pop_front (lw_server_client, ctx->client_pool);
 
-	if (!client)
+		memset (client, 0, sizeof (*client));
+	}
+	else if (!(client = (lw_server_client)calloc (sizeof (*client), 1)))
 		return 0;
 
 	client->server = ctx;
+	++ ctx->clients_allocated;
 
 	lwp_fdstream_init (&client->fdstream, pump);
 
+	#ifdef HAVE_ACCEPT4
+		/* accept4 already made it non-blocking; saves set_fd a fcntl pair */
+		client->fdstream.flags |= lwp_fdstream_flag_nonblocking;
+	#endif
+
+	/* Must be set after init, as lwp_stream_init wipes the refcount */
+	lwp_set_dealloc_proc (client, lwp_server_client_dealloc);
+
 	/* We keep this reference right up until the client disconnects from
 	* the server
 	*/
@@ -183,11 +261,31 @@ void lw_server_delete (lw_server ctx)
 
 	lw_server_unhost (ctx);
 
+	if (ctx->accept_timer)
+	{
+		lw_timer_delete (ctx->accept_timer);
+		ctx->accept_timer = NULL;
+	}
+
+	list_each (lw_server_client, ctx->client_pool, client)
+		free (client);
+
+	list_clear (ctx->client_pool);
+
 #ifdef ENABLE_SSL
 	if (ctx->ssl_context)
 		SSL_CTX_free(ctx->ssl_context);
 #endif
 
+	/* The posted accept continuation, or clients still referenced elsewhere,
+	 * hold ctx; whichever finishes last frees it instead
+	 */
+	if (ctx->accept_posted || ctx->clients_allocated > 0)
+	{
+		ctx->delete_pending = lw_true;
+		return;
+	}
+
 	free (ctx);
 }
 
@@ -201,33 +299,135 @@ void * lw_server_tag (lw_server ctx)
 	return ctx->tag;
 }
 
+static lw_i64 lwp_server_time_ms (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ((lw_i64) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void listen_socket_read_ready (void * tag);
+
+static void listen_socket_read_ready_posted (void * tag)
+{
+	lw_server ctx = (lw_server)tag;
+
+	ctx->accept_posted = lw_false;
+
+	if (ctx->delete_pending)
+	{
+		if (ctx->clients_allocated == 0)
+			free (ctx);
+		return;
+	}
+
+	listen_socket_read_ready (ctx);
+}
+
+static void accept_timer_tick (lw_timer timer)
+{
+	lw_server ctx = (lw_server)lw_timer_tag (timer);
+
+	lw_timer_stop (timer);
+	listen_socket_read_ready (ctx);
+}
+
+/* Returns how many more connections may be accepted before the rate cap is
+ * hit. If none, arms accept_timer to resume at the start of the next window.
+ */
+static long accept_allowance (lw_server ctx)
+{
+	if (ctx->accept_limit <= 0)
+		return LONG_MAX;
+
+	lw_i64 now = lwp_server_time_ms ();
+
+	if (now - ctx->accept_window_start >= 1000)
+	{
+		ctx->accept_window_start = now;
+		ctx->accept_count = 0;
+	}
+
+	if (ctx->accept_count < ctx->accept_limit)
+		return ctx->accept_limit - ctx->accept_count;
+
+	if (!lw_timer_started (ctx->accept_timer))
+	{
+		lwp_trace ("Accept cap of %ld/sec hit, leaving the rest in the backlog", ctx->accept_limit);
+		lw_timer_start (ctx->accept_timer, (long) (1000 - (now - ctx->accept_window_start)) + 1);
+	}
+
+	return 0;
+}
+
 static void listen_socket_read_ready (void * tag)
 {
 	lw_server ctx = (lw_server)tag;
 
-	struct sockaddr_storage address;
-	socklen_t address_length = sizeof (address);
+	if (ctx->socket == -1)
+		return;
+
+	long allowance = accept_allowance (ctx);
 
-	for (;;)
+	for (int i = 0; ; ++ i)
 	{
 	  int fd;
 
+	  if (allowance <= 0)
+		 return;
+
+	  /* The listen watch is edge-triggered, so if we stop early we have to
+	   * come back for the rest ourselves.
+	   */
+	  if (i == lwp_server_accept_batch)
+	  {
+		 if (!ctx->accept_posted)
+		 {
+			ctx->accept_posted = lw_true;
+			lw_pump_post (ctx->pump, (void *) listen_socket_read_ready_posted, ctx);
+		 }
+
+		 return;
+	  }
+
+	  struct sockaddr_storage address;
+	  socklen_t address_length = sizeof (address);
+
 	  lwp_trace ("Trying to accept...");
 
-	  if ((fd = accept (ctx->socket, (struct sockaddr *) &address,
-						&address_length)) == -1)
+	  #ifdef HAVE_ACCEPT4
+		 fd = accept4 (ctx->socket, (struct sockaddr *) &address,
+						&address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	  #else
+		 fd = accept (ctx->socket, (struct sockaddr *) &address,
+						&address_length);
+	  #endif
+
+	  if (fd == -1)
 	  {
 		 lwp_trace ("Failed to accept: %s", strerror (errno));
 		 break;
 	  }
 
+	  #ifndef HAVE_ACCEPT4
+		 fcntl (fd, F_SETFD, FD_CLOEXEC);
+	  #endif
+
 	  lwp_trace ("Accepted FD %d", fd);
 
+	  if (ctx->accept_limit > 0)
+	  {
+		 ++ ctx->accept_count;
+		 -- allowance;
+	  }
+
 	  lw_server_client client = lwp_server_client_new (ctx, ctx->pump, fd);
 
 	  if (!client)
 	  {
 		 lwp_trace ("Failed allocating client");
+		 close (fd);
 		 break;
 	  }
 
@@ -258,9 +458,10 @@ static void listen_socket_read_ready (void * tag)
 		 {
 			 if (ctx->on_disconnect)
 				 ctx->on_disconnect(ctx, client);
-			/* Client was deleted by connect hook
+			/* Client was deleted by connect hook; carry on with the rest
+			 * of the backlog, as the edge won't fire again for them.
 			 */
-			return;
+			continue;
 		 }
 
 		 list_push (lw_server_client, ctx->clients, client);
@@ -285,12 +486,40 @@ static void listen_socket_read_ready (void * tag)
 		 {
 			/* Client was deleted when performing initial read
 			 */
-			return;
+			continue;
 		 }
 	  }
 	}
 }
 
+void lw_server_set_accept_limit (lw_server ctx, long per_second)
+{
+	ctx->accept_limit = per_second > 0 ? per_second : 0;
+	ctx->accept_count = 0;
+	ctx->accept_window_start = lwp_server_time_ms ();
+
+	if (ctx->accept_limit && !ctx->accept_timer)
+	{
+		ctx->accept_timer = lw_timer_new (ctx->pump);
+		lw_timer_set_tag (ctx->accept_timer, ctx);
+		lw_timer_on_tick (ctx->accept_timer, accept_timer_tick);
+	}
+
+	/* Lifting or raising the cap; drain whatever is waiting in the backlog */
+	if (ctx->accept_timer && lw_timer_started (ctx->accept_timer))
+	{
+		lw_timer_stop (ctx->accept_timer);
+
+		if (lw_server_hosting (ctx))
+			listen_socket_read_ready (ctx);
+	}
+}
+
+long lw_server_accept_limit (lw_server ctx)
+{
+	return ctx->accept_limit;
+}
+
 void lw_server_host (lw_server ctx, long port)
 {
 	lw_filter filter = lw_filter_new ();
@@ -346,6 +575,9 @@ void lw_server_unhost (lw_server ctx)
 	close (ctx->socket);
 	ctx->socket = -1;
 
+	if (ctx->accept_timer)
+		lw_timer_stop (ctx->accept_timer);
+
 	lw_pump_remove(ctx->pump, ctx->pump_watch);
 	ctx->pump_watch = NULL;
 
@@ -86,8 +86,9 @@ void lw_timer_delete (lw_timer ctx)
 	lw_event_delete (ctx->stop_event);
 
 	#ifdef _lacewing_use_timerfd
-		close (ctx->fd);
+		/* Remove the watch first; epoll_ctl on a closed fd fails with EBADF */
 		lw_pump_remove(ctx->pump, ctx->pump_watch);
+		close (ctx->fd);
 	#endif
 
 	lw_thread_delete(ctx->timer_thread);
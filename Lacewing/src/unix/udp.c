@@ -203,20 +203,25 @@ void lw_udp_send (lw_udp ctx, lw_addr addr, const char * data, size_t size)
 		return;
 	}
 
+	if (!addr->info)
+		return;
+
+	lw_udp_send_sockaddr (ctx, addr->info->ai_addr, addr->info->ai_addrlen, data, size);
+}
+
+void lw_udp_send_sockaddr (lw_udp ctx, const struct sockaddr * addr, size_t addrlen,
+						   const char * data, size_t size)
+{
 	if (size == SIZE_MAX)
 		size = strlen (data);
 
 	if (sizeof(size) > 4)
 		assert(size < 0xFFFFFFFF);
 
-	if (!addr->info)
-		return;
-
 	lwp_retain(ctx, "udp write");
 	++ctx->writes_posted;
 
-	if (sendto (ctx->fd, data, size, 0, (struct sockaddr *) addr->info->ai_addr,
-				addr->info->ai_addrlen) == -1)
+	if (sendto (ctx->fd, data, size, 0, addr, (socklen_t) addrlen) == -1)
 	{
 		lw_error error = lw_error_new ();
 
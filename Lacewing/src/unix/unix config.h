@@ -18,3 +18,4 @@
 //#define HAVE_DECL_SO_NOSIGPIPE
 
 #define HAVE_TIMEGM
+#define HAVE_ACCEPT4
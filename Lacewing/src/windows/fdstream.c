@@ -228,6 +228,9 @@ void issue_read (lw_fdstream ctx)
 	if (ctx->fd == INVALID_HANDLE_VALUE)
 		return;
 
+	if ((ctx->flags & lwp_fdstream_flag_read_paused) != 0)
+		return; // lw_fdstream_read_pause() issues it on resume
+
 	if ((ctx->flags & lwp_fdstream_flag_read_pending) != 0)
 	//if ((ctx->flags & (lwp_fdstream_flag_read_pending | lwp_fdstream_flag_close_asap)) != 0 || (ctx->stream.flags & lwp_stream_flag_closeASAP) != 0)
 		return; // Only one read pending on a stream at once
@@ -653,6 +656,21 @@ void lw_fdstream_uncork (lw_fdstream ctx)
 {
 }
 
+void lw_fdstream_read_pause (lw_fdstream ctx, lw_bool paused)
+{
+	if (paused)
+	{
+		ctx->flags |= lwp_fdstream_flag_read_paused;
+		return;
+	}
+
+	if (! (ctx->flags & lwp_fdstream_flag_read_paused))
+		return;
+
+	ctx->flags &= ~ lwp_fdstream_flag_read_paused;
+	issue_read (ctx);
+}
+
 const lw_streamdef def_fdstream =
 {
 	def_sink_data,
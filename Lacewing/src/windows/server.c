@@ -50,6 +50,8 @@ struct _lw_server
 
 	lw_list (lw_server_client, clients);
 
+	long accept_limit;
+
 	void * tag;
 };
 
@@ -122,6 +124,17 @@ void * lw_server_tag (lw_server ctx)
 {
 	return ctx->tag;
 }
+
+void lw_server_set_accept_limit (lw_server ctx, long per_second)
+{
+	// AcceptEx keeps a fixed number of accepts posted, so there's no storm to cap here
+	ctx->accept_limit = per_second > 0 ? per_second : 0;
+}
+
+long lw_server_accept_limit (lw_server ctx)
+{
+	return ctx->accept_limit;
+}
 void on_ssl_error (lw_server_client client, lw_error error)
 {
 	lw_error_addf(error, "SSL error");
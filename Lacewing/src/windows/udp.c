@@ -332,6 +332,12 @@ void lw_udp_send (lw_udp ctx, lw_addr addr, const char * buffer, size_t size)
 	  return;
 	}
 
+	lw_udp_send_sockaddr (ctx, addr->info->ai_addr, addr->info->ai_addrlen, buffer, size);
+}
+
+void lw_udp_send_sockaddr (lw_udp ctx, const struct sockaddr * addr, size_t addrlen,
+						   const char * buffer, size_t size)
+{
 	if (size == -1)
 	  size = strlen (buffer);
 
@@ -352,14 +358,11 @@ void lw_udp_send (lw_udp ctx, lw_addr addr, const char * buffer, size_t size)
 	overlapped->type = overlapped_type_send;
 	overlapped->tag = 0;
 
-	if (!addr->info)
-	  return;
-
 	++ctx->writes_posted;
 	lwp_retain(ctx, "udp write");
 
-	if (WSASendTo (ctx->socket, &winsock_buf, 1, 0, /* MSG_XX flags */ 0, addr->info->ai_addr,
-				  (int)addr->info->ai_addrlen, (OVERLAPPED *) overlapped, 0) == SOCKET_ERROR)
+	if (WSASendTo (ctx->socket, &winsock_buf, 1, 0, /* MSG_XX flags */ 0, addr,
+				  (int)addrlen, (OVERLAPPED *) overlapped, 0) == SOCKET_ERROR)
 	{
 		int code = WSAGetLastError();
 
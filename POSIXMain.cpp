@@ -9,7 +9,9 @@
 #include <sstream>
 #include <algorithm>
 #include <vector>
+#include <unordered_map>
 #include "ConsoleColors.hpp"
+#include "AsyncLog.hpp"
 #include "Lacewing/Lacewing.h"
 #include <signal.h>
 #include <termios.h>
@@ -86,6 +88,9 @@ void GenerateFlashPolicy(int port);
 void Shutdown();
 void UpdateTitle(size_t clientCount);
 void CloseHandler(int sig);
+#ifdef LW_RWLOCK_PROFILE
+void LockProfileHandler(int sig);
+#endif
 
 // Global variables
 lacewing::eventpump globalpump;
@@ -93,49 +98,37 @@ lacewing::timer globalmsgrecvcounttimer;
 lacewing::relayserver* globalserver;
 std::string flashpolicypath;
 bool deleteFlashPolicyAtEndOfApp;
-static char timeBuffer[10];
+// All console output once the server starts goes through here, so a slow terminal or log pipe can't stall the pump
+static asynclog logger;
+// Set by SIGINT/SIGTERM to the signal number; the next timer tick logs it and shuts down, as a signal
+// handler can't safely touch the logger or the pump
+static volatile sig_atomic_t closeRequested = 0;
+static bool shutdowned = false;
 
-// In case of idiocy
+// In case of idiocy. Strikes against an IP, keyed by its in6_addr bytes; past 3, the relay core bans it.
+// Banned IPs are refused at TCP accept by the relay core, so they never reach the handlers here.
 struct BanEntry
 {
-	std::string ip;
 	int disconnects;
 	std::string reason;
 	time_t resetAt;
-	BanEntry(std::string ip, int disconnects, std::string reason, time_t resetAt) :
-		ip(ip), disconnects(disconnects), reason(reason), resetAt(resetAt)
+	BanEntry(int disconnects, std::string reason, time_t resetAt) :
+		disconnects(disconnects), reason(reason), resetAt(resetAt)
 	{
 		// yay
 	}
 };
-static std::vector<BanEntry> banIPList;
+static std::unordered_map<std::string, BanEntry> banIPList;
 
 static std::uint64_t totalNumMessagesIn = 0, totalNumMessagesOut = 0;
 static std::uint64_t totalBytesIn = 0, totalBytesOut = 0;
 static size_t maxClients = 0, maxChannels = 0;
 static size_t maxNumMessagesIn = 0, maxNumMessagesOut = 0;
 static size_t maxBytesInInOneSec = 0, maxBytesOutInOneSec = 0;
+static size_t maxClientMemory = 0, maxClientMemoryClients = 0;
 
 static size_t numMessagesIn = 0, numMessagesOut = 0;
 static size_t bytesIn = 0, bytesOut = 0;
-struct clientstats
-{
-	std::shared_ptr<lacewing::relayserver::client> c;
-	size_t totalBytesIn;
-	size_t totalNumMessagesIn;
-	size_t wastedServerMessages;
-#ifdef TCP_CLIENT_UPLOAD_CAP
-	size_t bytesIn;
-	size_t numMessagesIn;
-	bool exceeded;
-	clientstats(std::shared_ptr<lacewing::relayserver::client> _c) : c(_c), totalBytesIn(0), totalNumMessagesIn(0),
-		wastedServerMessages(0), bytesIn(0), numMessagesIn(0), exceeded(false) {}
-#else
-	clientstats(std::shared_ptr<lacewing::relayserver::client> _c) : c(_c), totalBytesIn(0), totalNumMessagesIn(0),
-		wastedServerMessages(0) {}
-#endif
-};
-static std::vector<std::shared_ptr<clientstats>> clientdata;
 
 static termios oldt;
 
@@ -169,6 +162,30 @@ int main()
 		std::cerr << "No 'port' setting in configuration file." << std::endl;
 	}
 
+	// Log ring size in records, and whether to "drop" records or "block" the server when it's full
+	{
+		int logRingSize = 4096;
+		std::string logWhenFull = "drop";
+		cfg.lookupValue("logRingSize", logRingSize);
+		cfg.lookupValue("logWhenFull", logWhenFull);
+		logger.start((size_t)std::max(logRingSize, 16),
+			logWhenFull == "block" ? asynclog::fullpolicy::block : asynclog::fullpolicy::drop);
+	}
+
+	// Port to serve Prometheus metrics on, at /metrics; 0 to not serve them
+	int metricsPort = 0;
+	cfg.lookupValue("metricsPort", metricsPort);
+
+#ifdef LW_RWLOCK_PROFILE
+	// Needs a release build with the SPIN or CHECKED readwritelock policy; Lacewing.h refuses the others.
+	// Time 1 in this many lock acquisitions per thread; 1 times all of them. Results go to /metrics, and to the log on SIGUSR1.
+	{
+		int lockProfileSampling = 16;
+		cfg.lookupValue("lockProfileSampling", lockProfileSampling);
+		lacewing::lockprofiler::setsampling((unsigned int)std::max(lockProfileSampling, 1));
+	}
+#endif
+
 	//mongocxx::instance instance{}; // This should be done only once.
 	mongocxx::uri uri("mongodb://10.0.0.30:27017");
 	mongocxx::client client(uri);
@@ -182,14 +199,13 @@ int main()
 	// Disable console input
 	if (tcgetattr(STDIN_FILENO, &oldt) == -1)
 	{
-		std::cout << "Couldn't read console mode (error "sv << errno << ")."sv;
-
 		if (errno != ENOTTY)
 		{
-			std::cout << " Aborting server startup.\r\n"sv;
+			logger.raw() << "Couldn't read console mode (error "sv << errno << "). Aborting server startup.\r\n"sv;
 			return errno;
 		}
-		std::cout << " 25 = not terminal; probably run in simulated terminal. Server startup continues.\r\n"sv;
+		logger.raw() << "Couldn't read console mode (error "sv << errno << ")."sv
+			<< " 25 = not terminal; probably run in simulated terminal. Server startup continues.\r\n"sv;
 	}
 	termios newt = oldt;
 	newt.c_lflag &= ~ECHO;
@@ -202,15 +218,14 @@ int main()
 	signal(SIGINT, CloseHandler);
 	signal(SIGSEGV, CloseHandler);
 	signal(SIGTERM, CloseHandler);
+#ifdef LW_RWLOCK_PROFILE
+	signal(SIGUSR1, LockProfileHandler);
+#endif
 
 	// We don't use C-style printf(), so desync.
 	// It's unclear whether cout or printf is faster; and some say cout is faster only with a fast locale.
 	std::ios_base::sync_with_stdio(false);
 
-	// Block some IPs by default
-	//banIPList.push_back(BanEntry("75.128.140.10"sv, 4, "IP banned. Contact Phi on Clickteam Discord."sv, (time(NULL) + 24 * 60 * 60)));
-	//banIPList.push_back(BanEntry("127.0.0.1"sv, 4, "IP banned. Contact Phi on Clickteam Discord."sv, (time(NULL) + 24 * 60 * 60)));
-
 	globalpump = lacewing::eventpump_new();
 	globalserver = new lacewing::relayserver(globalpump);
 	globalmsgrecvcounttimer = lacewing::timer_new(globalpump);
@@ -246,13 +261,65 @@ int main()
 	// globalserver->setcodepointsallowedlist(lacewing::relayserver::codepointsallowlistindex::MessagesSentToClients, "L*,M*,N*,P*,32");
 	globalserver->setcodepointsallowedlist(lacewing::relayserver::codepointsallowlistindex::MessagesSentToServer, "L*,M*,N*,P*,32");
 
+	// Channels with 1000+ clients write channel messages using one extra thread per spare core
+	globalserver->setparallelfanout(1000, std::max(1u, std::thread::hardware_concurrency()) - 1);
+	// Clients that fall 8MB behind on relayed messages are kicked, so one stalled client can't grow the server's memory
+	globalserver->setqueuedbytelimit(8 * 1024 * 1024, lacewing::relayserver::queuelimitpolicy::disconnect);
+	// Per-IP connection caps; raise them to load test from one machine, e.g. with Benchmarks/RelayBench.cpp
+	{
+		int maxConnectionsPerIP = 5, maxPendingConnectsPerIP = 2;
+		cfg.lookupValue("maxConnectionsPerIP", maxConnectionsPerIP);
+		cfg.lookupValue("maxPendingConnectsPerIP", maxPendingConnectsPerIP);
+		globalserver->setmaxconnectionsperip((size_t)std::max(maxConnectionsPerIP, 1), (size_t)std::max(maxPendingConnectsPerIP, 1));
+
+		// New connections accepted per second across all IPs, to ride out connect floods; 0 for no cap
+		int acceptsPerSecond = 0;
+		cfg.lookupValue("acceptsPerSecond", acceptsPerSecond);
+		globalserver->setacceptlimit(acceptsPerSecond);
+	}
+	// Received message rate limits per client and per IP, with what to do past them: "delay" reading from the client,
+	// "drop" the message, or "disconnect"; 0 for no limit, the default
+	{
+		int clientMessagesPerSecond = 0, clientBytesPerSecond = 0, ipMessagesPerSecond = 0, ipBytesPerSecond = 0;
+		std::string rateLimitPolicy = "drop";
+		cfg.lookupValue("clientMessagesPerSecond", clientMessagesPerSecond);
+		cfg.lookupValue("clientBytesPerSecond", clientBytesPerSecond);
+		cfg.lookupValue("ipMessagesPerSecond", ipMessagesPerSecond);
+		cfg.lookupValue("ipBytesPerSecond", ipBytesPerSecond);
+		cfg.lookupValue("rateLimitPolicy", rateLimitPolicy);
+
+		lacewing::relayserver::ratelimit clientLimit, ipLimit;
+		clientLimit.messagesPerSecond = clientMessagesPerSecond;
+		clientLimit.bytesPerSecond = clientBytesPerSecond;
+		ipLimit.messagesPerSecond = ipMessagesPerSecond;
+		ipLimit.bytesPerSecond = ipBytesPerSecond;
+		clientLimit.policy = ipLimit.policy = rateLimitPolicy == "delay" ? lacewing::relayserver::ratelimitpolicy::delayreads :
+			rateLimitPolicy == "disconnect" ? lacewing::relayserver::ratelimitpolicy::disconnect : lacewing::relayserver::ratelimitpolicy::drop;
+		globalserver->setratelimit(lacewing::relayserver::ratelimitscope::client, clientLimit);
+		globalserver->setratelimit(lacewing::relayserver::ratelimitscope::ip, ipLimit);
+	}
+	// Block some IPs by default; bannedIPs in the config is a list of IPs and CIDR ranges, e.g. [ "10.0.0.0/8", "::1" ]
+	//globalserver->banip("75.128.140.10"sv, "IP banned. Contact Phi on Clickteam Discord."sv, std::chrono::hours(24));
+	//globalserver->banip("127.0.0.1"sv, "IP banned. Contact Phi on Clickteam Discord."sv, std::chrono::hours(24));
+	if (cfg.exists("bannedIPs"))
+	{
+		const Setting& bannedIPs = cfg.lookup("bannedIPs");
+		for (int i = 0; i < bannedIPs.getLength(); ++i)
+		{
+			const char* bannedIP = bannedIPs[i];
+			if (!globalserver->banip(bannedIP, "IP banned. Contact Phi on Clickteam Discord."sv, std::chrono::seconds::zero()))
+				logger.line(logcolor::red) << "Couldn't read bannedIPs entry \""sv << bannedIP << "\"; it's not an IP or CIDR range."sv;
+		}
+	}
+
 	UpdateTitle(0); // Update console title with 0 clients
 
 	// Check port settings
 	int port = FIXEDPORT;
 	if constexpr (FIXEDPORT == 0)
 	{
-		std::cout << "Enter port number to begin (default 6121):"sv;
+		logger.raw() << "Enter port number to begin (default 6121):"sv;
+		logger.flush();
 
 		{
 			std::string portStr;
@@ -265,41 +332,37 @@ int main()
 	GenerateFlashPolicy(port);
 #endif
 
-	// Update the current time in case host() errors, or try to connect before first tick
-	OnTimerTick(globalmsgrecvcounttimer);
-
 	// Host the thing
-	std::cout << green << "Host started. Port "sv << port << ", build "sv << globalserver->buildnum << ". "sv <<
-		(flashpolicypath.empty() ? "Flash not hosting"sv : "Flash policy hosting on TCP port 843"sv) << '.' <<
-		std::string(flashpolicypath.empty() ? 30 : 5, ' ') << "\r\n"sv << yellow;
+	logger.raw(logcolor::green) << "Host started. Port "sv << port << ", build "sv << globalserver->buildnum << ". "sv <<
+		(flashpolicypath.empty() ? "Flash not hosting"sv : "Flash policy hosting on TCP port 843"sv) << ".\r\n"sv;
 
 	if (websocketSecure)
 	{
 		if (!lw_file_exists(sslPathCertChain))
 		{
-			std::cout << yellow << "Couldn't find TLS certficate files - expecting \"fullchain.pem\" and \"privkey.pem\" in app folder.\r\n"
+			logger.raw(logcolor::yellow) << "Couldn't find TLS certficate files - expecting \"fullchain.pem\" and \"privkey.pem\" in app folder.\r\n"
 				"Will continue webserver with just insecure websocket.\r\n"sv;
 			websocketSecure = 0;
 		}
 		else if (!globalserver->websocket->load_cert_file(sslPathCertChain, sslPathPrivKey, ""))
 		{
-			std::cout << red << "Found but couldn't load TLS certificate files \"fullchain.pem\" and \"privkey.pem\". Aborting server.\r\n"sv;
+			logger.raw(logcolor::red) << "Found but couldn't load TLS certificate files \"fullchain.pem\" and \"privkey.pem\". Aborting server.\r\n"sv;
 			goto cleanup;
 		}
 	}
 
 	if (websocketNonSecure || websocketSecure)
 	{
-		std::cout << green << "WebSocket hosting. Port "sv;
+		auto wsLine = logger.raw(logcolor::green);
+		wsLine << "WebSocket hosting. Port "sv;
 		if (websocketNonSecure)
-			std::cout << websocketNonSecure << " (non-secure, ws://xx)"sv;
+			wsLine << websocketNonSecure << " (non-secure, ws://xx)"sv;
 		if (websocketNonSecure && websocketSecure)
-			std::cout << " and port "sv;
+			wsLine << " and port "sv;
 		if (websocketSecure)
-			std::cout << websocketSecure << " (secure, wss://xx)"sv;
-		std::cout << ".\r\n"sv << yellow;
+			wsLine << websocketSecure << " (secure, wss://xx)"sv;
+		wsLine << ".\r\n"sv;
 	}
-	std::cout.flush();
 
 	globalserver->host((lw_ui16)port);
 
@@ -309,6 +372,14 @@ int main()
 	if (websocketNonSecure || websocketSecure)
 		globalserver->host_websocket((lw_ui16)websocketNonSecure, (lw_ui16)websocketSecure);
 
+	if (metricsPort > 0 && metricsPort <= 0xFFFF)
+	{
+		if (globalserver->host_metrics((lw_ui16)metricsPort))
+			logger.raw(logcolor::green) << "Metrics hosting. Port "sv << metricsPort << " (http://xx/metrics).\r\n"sv;
+		else
+			logger.raw(logcolor::red) << "Couldn't host metrics on port "sv << metricsPort << ". Continuing without them.\r\n"sv;
+	}
+
 	// Update messages received/sent line every 1 sec
 	globalmsgrecvcounttimer->start(1000L);
 
@@ -327,16 +398,16 @@ int main()
 #endif
 
 	if (error)
-		std::cout << red << "\r\n"sv << timeBuffer << " | Error occurred in pump: "sv << error->tostring() << "\r\n"sv;
+		logger.line(logcolor::red) << "Error occurred in pump: "sv << error->tostring();
 
 cleanup:
 	// Cleanup time
-	clientdata.clear();
 	lacewing::timer_delete(globalmsgrecvcounttimer);
 	globalserver->unhost();
 	globalserver->flash->unhost();
 	globalserver->websocket->unhost();
 	globalserver->websocket->unhost_secure();
+	globalserver->unhost_metrics();
 	delete globalserver;
 	lacewing::pump_delete(globalpump);
 
@@ -351,19 +422,27 @@ cleanup:
 	lw_sync_delete(lw_trace_sync);
 #endif
 
-	std::cout << green << timeBuffer << " | Program completed.\r\n"sv;
-	std::cout << timeBuffer << " | Total bytes: "sv << totalBytesIn << " in, "sv << totalBytesOut << " out.\r\n"sv;
-	std::cout << timeBuffer << " | Total msgs: "sv << totalNumMessagesIn << " in, "sv << totalNumMessagesOut << " out.\r\n"sv;
-	std::cout << timeBuffer << " | Max msgs in 1 sec: "sv << maxNumMessagesIn << " in, "sv << maxNumMessagesOut << " out.\r\n"sv;
-	std::cout << timeBuffer << " | Max bytes in 1 sec: "sv << maxBytesInInOneSec << " in, "sv << maxBytesOutInOneSec << " out.\r\n"sv;
-	std::cout << timeBuffer << " | Press any key to exit.\r\n"sv;
-
-	// Clear any keypress the user did before we waited
-	std::cin.clear();
-	std::cin.ignore();
-	std::cin.get(); // wait for user keypress
+	logger.line(logcolor::green) << "Program completed."sv;
+	logger.line(logcolor::green) << "Total bytes: "sv << totalBytesIn << " in, "sv << totalBytesOut << " out."sv;
+	logger.line(logcolor::green) << "Total msgs: "sv << totalNumMessagesIn << " in, "sv << totalNumMessagesOut << " out."sv;
+	logger.line(logcolor::green) << "Max msgs in 1 sec: "sv << maxNumMessagesIn << " in, "sv << maxNumMessagesOut << " out."sv;
+	logger.line(logcolor::green) << "Max bytes in 1 sec: "sv << maxBytesInInOneSec << " in, "sv << maxBytesOutInOneSec << " out."sv;
+	logger.line(logcolor::green) << "Max client memory: "sv << maxClientMemory << " bytes, over "sv << maxClientMemoryClients << " clients."sv;
+	logger.line(logcolor::green) << "Log records dropped: "sv << logger.dropped() << '.';
+	// A termination request has no one at the console to press a key
+	if (closeRequested != SIGTERM)
+		logger.line(logcolor::green) << "Press any key to exit."sv;
+	logger.stop();
+
+	if (closeRequested != SIGTERM)
+	{
+		// Clear any keypress the user did before we waited
+		std::cin.clear();
+		std::cin.ignore();
+		std::cin.get(); // wait for user keypress
+	}
 
-	std::cout << "\x1B[0m"; // reset console color
+	std::cout << "\x1B[0m"; // reset console color; logger is stopped, so cout is ours again
 	tcsetattr(STDIN_FILENO, TCSANOW, &oldt); // restore console input mode
 	return 0;
 }
@@ -380,7 +459,7 @@ void UpdateTitle(size_t clientCount)
 	// cygwin: "\x1B];%p1%s\x07";
 	// konsole: "\x1B]30;%p1%s\x07";
 	// screen: "\x1Bk%p1%s\x1B";
-	std::cout << "\033]0;"sv << name << '\007';
+	logger.raw() << "\033]0;"sv << name << '\007';
 
 	if (maxClients < clientCount)
 		maxClients = clientCount;
@@ -388,82 +467,74 @@ void UpdateTitle(size_t clientCount)
 		maxChannels = channelCount;
 }
 
-void OnConnectRequest(lacewing::relayserver& server, std::shared_ptr<lacewing::relayserver::client> client)
+// Adds a strike against the client's IP, forgotten after forgetAfter seconds without another. From the 4th, the IP is
+// banned for 4 hours per strike. Returns the IP's strike count.
+int AddStrike(const std::shared_ptr<lacewing::relayserver::client>& client, const char* addr, std::string_view reason, time_t forgetAfter)
 {
-	char addr[64];
-	lw_addr_prettystring(client->getaddress().data(), addr, sizeof(addr));
-
-	auto banEntry = std::find_if(banIPList.begin(), banIPList.end(), [&](const BanEntry& b) { return b.ip == addr; });
-	if (banEntry != banIPList.end())
+	const in6_addr addrInt = client->getaddressasint();
+	const time_t now = time(NULL);
+	auto [banEntry, added] = banIPList.try_emplace(std::string((const char*)&addrInt, sizeof(addrInt)), 1, std::string(reason), now + forgetAfter);
+	if (!added)
 	{
-		if (banEntry->resetAt < time(NULL))
-			banIPList.erase(banEntry);
-		else if (banEntry->disconnects > 3)
-		{
-			banEntry->resetAt = time(NULL) + (time_t)(((long long)(banEntry->disconnects++ << 2)) * 60 * 60);
+		if (banEntry->second.resetAt < now)
+			banEntry->second = BanEntry(1, std::string(reason), now + forgetAfter);
+		else
+			++banEntry->second.disconnects;
+	}
 
-			std::cout << green << '\r' << timeBuffer << " | Blocked connection attempt from IP "sv << addr << ", banned due to "sv
-				<< banEntry->reason << '.'
-				<< std::string(45, ' ') << "\r\n"sv << yellow;
-			return server.connect_response(client, banEntry->reason.c_str());
-		}
+	if (banEntry->second.disconnects > 3)
+	{
+		const std::chrono::hours banFor((long long)banEntry->second.disconnects << 2);
+		banEntry->second.resetAt = std::max(banEntry->second.resetAt, now + (time_t)std::chrono::seconds(banFor).count());
+		globalserver->banip(addrInt, 128, banEntry->second.reason, banFor);
+		logger.line(logcolor::red) << "Banned IP "sv << addr << " for "sv << banFor.count() << " hours, due to "sv
+			<< banEntry->second.reason << '.';
 	}
+	return banEntry->second.disconnects;
+}
+
+void OnConnectRequest(lacewing::relayserver& server, std::shared_ptr<lacewing::relayserver::client> client)
+{
+	char addr[64];
+	lw_addr_prettystring(client->getaddress().data(), addr, sizeof(addr));
 
 	server.connect_response(client, std::string_view());
 	UpdateTitle(server.clientcount());
 
-	std::cout << green << '\r' << timeBuffer << " | New client ID "sv << client->id() << ", IP "sv << addr << " connected."sv
-		<< std::string(45, ' ') << "\r\n"sv << yellow;
-	clientdata.push_back(std::make_unique<clientstats>(client));
+	logger.line(logcolor::green) << "New client ID "sv << client->id() << ", IP "sv << addr << " connected."sv;
 }
 void OnDisconnect(lacewing::relayserver& server, std::shared_ptr<lacewing::relayserver::client> client)
 {
 	UpdateTitle(server.clientcount());
-	std::string name = client->name();
-	name = !name.empty() ? name : "[unset]"sv;
+	const internedname clientName = client->name();
+	const std::string_view name = !clientName.empty() ? clientName.view() : "[unset]"sv;
 	char addr[64];
 	lw_addr_prettystring(client->getaddress().data(), addr, sizeof(addr));
-	const auto a = std::find_if(clientdata.cbegin(), clientdata.cend(), [&](const auto& c) {
-		return c->c == client; }
-	);
-
-	std::cout << green << '\r' << timeBuffer << " | Client ID "sv << client->id() << ", name "sv << name << ", IP "sv << addr << " disconnected."sv;
-	if (a != clientdata.cend())
-		std::cout << " Uploaded "sv << (**a).totalBytesIn << " bytes in "sv << (**a).totalNumMessagesIn << " msgs total."sv;
-	else
-		std::cout << std::string(25, ' ');
-	std::cout << "\r\n"sv << yellow;
-
-	if (a != clientdata.cend())
-		clientdata.erase(a);
+	const lacewing::relayserver::clientstats stats = client->stats();
+
+	logger.line(logcolor::green) << "Client ID "sv << client->id() << ", name "sv << name << ", IP "sv << addr << " disconnected."sv
+		<< " Uploaded "sv << (stats.received[0].bytes + stats.received[1].bytes) << " bytes in "sv
+		<< (stats.received[0].messages + stats.received[1].messages) << " msgs total."sv;
 	if (!client->istrusted())
 	{
-		auto banEntry = std::find_if(banIPList.begin(), banIPList.end(), [&](const BanEntry& b) { return b.ip == addr; });
-		if (banEntry == banIPList.end())
-		{
-			std::cout << yellow << '\r' << timeBuffer << " | Due to malformed protocol usage, created a IP ban entry."sv << std::string(25, ' ')
-				<< "\r\n"sv << yellow;
-			banIPList.push_back(BanEntry(addr, 1, "Broken Lacewing protocol", (time(NULL) + 30 * 60)));
-		}
+		if (AddStrike(client, addr, "Broken Lacewing protocol"sv, 30 * 60) == 1)
+			logger.line() << "Due to malformed protocol usage, created a IP ban entry."sv;
 		else
-		{
-			std::cout << yellow << '\r' << timeBuffer << " | Due to malformed protocol usage, increased their ban likelihood."sv << std::string(25, ' ')
-				<< "\r\n"sv << yellow;
-			banEntry->disconnects++;
-		}
+			logger.line() << "Due to malformed protocol usage, increased their ban likelihood."sv;
 	}
 }
 
-void OnTimerTick(lacewing::timer timer)
+#ifdef LW_RWLOCK_PROFILE
+// Set by SIGUSR1; the report is written on the next timer tick, as a signal handler can't safely build it
+static volatile sig_atomic_t lockProfileRequested = 0;
+void LockProfileHandler(int sig)
 {
-	std::time_t rawtime = std::time(NULL);
-	std::time(&rawtime);
-	std::tm* timeinfo = localtime(&rawtime);
-	if (timeinfo)
-		std::strftime(timeBuffer, sizeof(timeBuffer), "%T", timeinfo);
-	else
-		strcpy(timeBuffer, "XX:XX:XX");
+	lockProfileRequested = 1;
+}
+#endif
 
+void OnTimerTick(lacewing::timer timer)
+{
 	totalNumMessagesIn += numMessagesIn;
 	totalNumMessagesOut += numMessagesOut;
 	totalBytesIn += bytesIn;
@@ -477,58 +548,48 @@ void OnTimerTick(lacewing::timer timer)
 	if (maxBytesOutInOneSec < bytesOut)
 		maxBytesOutInOneSec = bytesOut;
 
-	std::cout << timeBuffer << " | Last sec received "sv << numMessagesIn << " messages ("sv << bytesIn << " bytes), forwarded "sv
-		<< numMessagesOut << " ("sv << bytesOut << " bytes)."sv << std::string(15, ' ') << '\r';
-	std::cout.flush();
-	numMessagesOut = numMessagesIn = 0U;
-	bytesIn = bytesOut = 0U;
-
-#ifdef TCP_CLIENT_UPLOAD_CAP
-	for (auto& c : clientdata)
+	// Sample client memory once a minute, for sizing hosts
+	static int ticksSinceMemorySample = 0;
+	if (++ticksSinceMemorySample >= 60)
 	{
-		if (!c->exceeded)
+		ticksSinceMemorySample = 0;
+		// Strikes that have run out; bans themselves are expired by the relay core
+		const time_t now = time(NULL);
+		for (auto it = banIPList.begin(); it != banIPList.end(); )
+			it = it->second.resetAt < now ? banIPList.erase(it) : std::next(it);
+
+		const size_t clientMemory = globalserver->clientmemoryused();
+		if (maxClientMemory < clientMemory)
 		{
-			c->bytesIn = 0;
-			c->numMessagesIn = 0;
+			maxClientMemory = clientMemory;
+			maxClientMemoryClients = globalserver->clientcount();
 		}
 	}
-	// open clientdata as shared owner, or disconnect handler's erase may invalidate it while TimerTick is still using it
-	for (auto c : clientdata)
-	{
-		if (!c->exceeded)
-			continue;
-		char addr[64];
-		const char* ipAddress = c->c->getaddress().data();
-		lw_addr_prettystring(ipAddress, addr, sizeof(addr));
 
-		auto banEntry = std::find_if(banIPList.begin(), banIPList.end(), [&](const BanEntry& b) { return b.ip == addr; });
-		if (banEntry == banIPList.end())
-			banIPList.push_back(BanEntry(ipAddress, 1, "You have been banned for heavy TCP usage. Contact Phi on Clickteam Discord.", time(NULL) + 60));
+	if (closeRequested && !shutdowned)
+	{
+		if (closeRequested == SIGINT)
+			logger.line(logcolor::red) << "Caught SIGINT: interactive attention signal, probably a ctrl+c"sv;
 		else
-			++banEntry->disconnects;
-
-		std::cout << red << '\r' << timeBuffer << " | Client ID "sv << c->c->id() << ", IP "sv << addr <<
-			" dropped for heavy TCP upload ("sv << c->bytesIn << " bytes in "sv << c->numMessagesIn << " msgs)"sv << yellow << "\r\n"sv;
-		c->c->send(1, "You have exceeded the TCP upload limit. Contact Phi on Clickteam Discord."sv, 0);
-		c->c->send(0, "You have exceeded the TCP upload limit. Contact Phi on Clickteam Discord."sv, 0);
-		c->c->disconnect();
-
-		// disconnect() will usually call disconnect handler, but rarely won't.
-		// If it does call the handler, the handler will delete the clientdata "c", so this for loop running through clientdata
-		// is now invalid, so we have to break or we get exception from invalid iterator.
-		// If it doesn't call the handler, we need to erase "c" or we'll get a disconnect re-attempted every timer tick.
-		const auto a = std::find_if(clientdata.cbegin(), clientdata.cend(), [&](const auto& cd) {
-			return cd->c == c->c; }
-		);
-		if (a != clientdata.cend())
-			clientdata.erase(a);
+			logger.line(logcolor::red) << "Caught SIGTERM: a termination request was sent to the program"sv;
+		logger.line(logcolor::red) << "Got Ctrl-C or Close, ending the app."sv;
+		Shutdown();
+	}
 
-		break;
+#ifdef LW_RWLOCK_PROFILE
+	if (lockProfileRequested)
+	{
+		lockProfileRequested = 0;
+		logger.raw() << lacewing::lockprofiler::report();
 	}
 #endif
+
+	logger.status() << "Last sec received "sv << numMessagesIn << " messages ("sv << bytesIn << " bytes), forwarded "sv
+		<< numMessagesOut << " ("sv << bytesOut << " bytes)."sv;
+	numMessagesOut = numMessagesIn = 0U;
+	bytesIn = bytesOut = 0U;
 }
 
-static bool shutdowned = false;
 void Shutdown()
 {
 	if (shutdowned)
@@ -542,8 +603,7 @@ void OnError(lacewing::relayserver& server, lacewing::error error)
 	std::string_view err = error->tostring();
 	if (err.back() == '.')
 		err.remove_suffix(1);
-	std::cout << red << '\r' << timeBuffer << " | Error occured: "sv << err << ". Execution continues."sv
-		<< std::string(25, ' ') << "\r\n"sv << yellow;
+	logger.line(logcolor::red) << "Error occured: "sv << err << ". Execution continues."sv;
 }
 
 void OnServerMessage(lacewing::relayserver& server, std::shared_ptr<lacewing::relayserver::client> senderclient,
@@ -556,33 +616,20 @@ void OnServerMessage(lacewing::relayserver& server, std::shared_ptr<lacewing::re
 	{
 		char addr[64];
 		lw_addr_prettystring(senderclient->getaddress().data(), addr, sizeof(addr));
-		std::cout << red << '\r' << timeBuffer << " | Dropped server message from IP "sv << addr << ", invalid type."sv
-			<< std::string(35, ' ') << "\r\n"sv << yellow;
-		const auto cd = std::find_if(clientdata.cbegin(), clientdata.cend(), [&](const auto& b) { return b->c == senderclient; });
-		if (cd != clientdata.end())
-		{
-			(**cd).totalBytesIn += data.size();
-			++(**cd).totalNumMessagesIn;
-
-			if ((**cd).wastedServerMessages++ > 5) {
-				auto banEntry = std::find_if(banIPList.begin(), banIPList.end(), [&](const BanEntry& b) { return b.ip == addr; });
-				if (banEntry == banIPList.end())
-					banIPList.push_back(BanEntry(addr, 1, "Sending too many messages the server is not meant to handle.",
-						time(NULL) + 60 * 60));
-				else
-					++banEntry->disconnects;
-				senderclient->send(1, "You have been banned for sending too many server messages that the server is not designed to receive.\r\nContact Phi on Clickteam Discord."sv);
-				senderclient->disconnect();
-			}
+		logger.line(logcolor::red) << "Dropped server message from IP "sv << addr << ", invalid type."sv;
+
+		if (senderclient->wastedservermessages++ > 5) {
+			AddStrike(senderclient, addr, "Sending too many messages the server is not meant to handle."sv, 60 * 60);
+			senderclient->send(1, "You have been banned for sending too many server messages that the server is not designed to receive.\r\nContact Phi on Clickteam Discord."sv);
+			senderclient->disconnect();
 		}
 		return;
 	}
-	std::string name = senderclient->name();
-	name = !name.empty() ? name : "[unset]"sv;
+	const internedname clientName = senderclient->name();
+	const std::string_view name = !clientName.empty() ? clientName.view() : "[unset]"sv;
 
-	std::cout << white << '\r' << timeBuffer << " | Message from client ID "sv << senderclient->id() << ", name "sv << name
-		<< ":"sv << std::string(35, ' ') << "\r\n"sv
-		<< data << "\r\n"sv << yellow;
+	logger.line(logcolor::white) << "Message from client ID "sv << senderclient->id() << ", name "sv << name << ":"sv;
+	logger.raw(logcolor::white) << data << "\r\n"sv;
 	if (subchannel == 5)
 	{
 		//std::string cars[4] = { "Volvo", "BMW", "Ford", "Mazda" };
@@ -600,32 +647,43 @@ void OnServerMessage(lacewing::relayserver& server, std::shared_ptr<lacewing::re
 				child.append(element);
 			}
 			}));
-		std::cout << bsoncxx::to_json(doc) << std::endl;
+		logger.raw() << bsoncxx::to_json(doc) << "\r\n"sv;
 
 	}
 	if (data == "HI")
 	{
-		std::cout << "LOL IT WORKED\n";
+		logger.raw() << "LOL IT WORKED\n"sv;
 	}
 }
-bool IncrementClient(std::shared_ptr<lacewing::relayserver::client> client, size_t size, bool blasted)
+// False if the client is over the TCP upload cap, and is being dropped for it. Always true if the cap is off.
+bool CheckClientUploadCap([[maybe_unused]] const std::shared_ptr<lacewing::relayserver::client>& client, [[maybe_unused]] bool blasted)
 {
-	const auto cd = std::find_if(clientdata.cbegin(), clientdata.cend(), [&](const auto& b) { return b->c == client; });
-	if (cd != clientdata.cend())
-	{
-		(**cd).totalBytesIn += size;
-		++(**cd).totalNumMessagesIn;
-
 #ifdef TCP_CLIENT_UPLOAD_CAP
-		if (!blasted)
-		{
-			(**cd).bytesIn += size;
-			(**cd).exceeded = (**cd).exceeded || (**cd).bytesIn > TCP_CLIENT_UPLOAD_CAP;
-			return !(**cd).exceeded;
-		}
-#endif
-	}
+	if (blasted)
+		return true;
+	if (client->readonly())
+		return false; // already being dropped
+
+	// The relay core keeps the per-second counts; this second's includes the message being handled, so a burst
+	// is caught as it happens, even if the client goes quiet after
+	const lacewing::relayserver::clientstats::counts tcpIn = client->stats().receivedThisSecond[0];
+	if (tcpIn.bytes <= TCP_CLIENT_UPLOAD_CAP)
+		return true;
+
+	char addr[64];
+	lw_addr_prettystring(client->getaddress().data(), addr, sizeof(addr));
+
+	AddStrike(client, addr, "You have been banned for heavy TCP usage. Contact Phi on Clickteam Discord."sv, 60);
+
+	logger.line(logcolor::red) << "Client ID "sv << client->id() << ", IP "sv << addr <<
+		" dropped for heavy TCP upload ("sv << tcpIn.bytes << " bytes in "sv << tcpIn.messages << " msgs)"sv;
+	client->send(1, "You have exceeded the TCP upload limit. Contact Phi on Clickteam Discord."sv, 0);
+	client->send(0, "You have exceeded the TCP upload limit. Contact Phi on Clickteam Discord."sv, 0);
+	client->disconnect();
+	return false;
+#else
 	return true;
+#endif
 }
 void OnPeerMessage(lacewing::relayserver& server, std::shared_ptr<lacewing::relayserver::client> senderclient,
 	std::shared_ptr<lacewing::relayserver::channel> viachannel, std::shared_ptr<lacewing::relayserver::client> receiverclient,
@@ -642,7 +700,7 @@ void OnPeerMessage(lacewing::relayserver& server, std::shared_ptr<lacewing::rela
 #endif
 
 	// False means it's exceeded TCP limits (if TCP limit is off, this'll always return true)
-	if (!IncrementClient(senderclient, data.size(), blasted))
+	if (!CheckClientUploadCap(senderclient, blasted))
 	{
 		server.clientmessage_permit(senderclient, viachannel, receiverclient, blasted, subchannel, data, variant, false);
 		return;
@@ -671,7 +729,7 @@ void OnChannelMessage(lacewing::relayserver& server, std::shared_ptr<lacewing::r
 #endif
 
 	// False means it's exceeded TCP limits (if TCP limit is off, this'll always return true)
-	if (!IncrementClient(senderclient, data.size(), blasted))
+	if (!CheckClientUploadCap(senderclient, blasted))
 	{
 		server.channelmessage_permit(senderclient, channel, blasted, subchannel, data, variant, false);
 		return;
@@ -689,10 +747,10 @@ extern "C" void always_log(const char* c, ...)
 	char output[1024];
 	va_list v;
 	va_start(v, c);
-	int numChars = vsprintf(output, c, v);
+	int numChars = vsnprintf(output, sizeof(output), c, v);
 	if (numChars <= 0)
 		std::abort();
-	std::cout << yellow << '\r' << timeBuffer << " | "sv << output << std::string(35, ' ') << "\r\n"sv;
+	logger.line() << output;
 	va_end(v);
 }
 
@@ -707,7 +765,7 @@ void GenerateFlashPolicy(int port)
 	// Get full path of EXE, including EXE filename + ext
 	ssize_t len = ::readlink("/proc/self/exe", filenameBuf, sizeof(filenameBuf) - 1);
 	if (len == -1) {
-		std::cout << "Flash policy couldn't be created. Looking up current app folder failed.\r\n"sv;
+		logger.raw() << "Flash policy couldn't be created. Looking up current app folder failed.\r\n"sv;
 		return;
 	}
 	filenameBuf[len] = '\0';
@@ -719,7 +777,7 @@ void GenerateFlashPolicy(int port)
 		lastSlash = filename.rfind('\\');
 	if (lastSlash == std::string::npos)
 	{
-		std::cout << "Flash policy couldn't be created. Current app folder made no sense.\r\n"sv;
+		logger.raw() << "Flash policy couldn't be created. Current app folder made no sense.\r\n"sv;
 		return;
 	}
 
@@ -736,7 +794,7 @@ void GenerateFlashPolicy(int port)
 	FILE* forWriting = fopen(filename.c_str(), "wb");
 	if (forWriting == NULL)
 	{
-		std::cout << "Flash policy couldn't be created. Opening file "sv << filename << " for writing in current app folder failed.\r\n"sv;
+		logger.raw() << "Flash policy couldn't be created. Opening file "sv << filename << " for writing in current app folder failed.\r\n"sv;
 		return;
 	}
 
@@ -752,7 +810,7 @@ void GenerateFlashPolicy(int port)
 	const std::string policyStr = flashPolicy.str();
 	if (fwrite(policyStr.c_str(), 1, policyStr.size(), forWriting) != policyStr.size())
 	{
-		std::cout << "Flash policy couldn't be created. Writing to file "sv << filename << " failed.\r\n"sv;
+		logger.raw() << "Flash policy couldn't be created. Writing to file "sv << filename << " failed.\r\n"sv;
 		fclose(forWriting);
 		remove(filename.c_str());
 		return;
@@ -762,62 +820,49 @@ void GenerateFlashPolicy(int port)
 	flashpolicypath = filename;
 }
 
+// Writes a literal with write(2), which unlike the logger is async-signal-safe
+template<size_t N>
+static void WriteFromSignal(const char(&text)[N])
+{
+	if (write(STDOUT_FILENO, text, N - 1) < 0)
+		return; // nothing else we can do from here
+}
+
 void CloseHandler(int sig)
 {
-	std::cout << red << '\r' << timeBuffer << " | "sv;
+	if (sig == SIGINT || sig == SIGTERM)
+	{
+		closeRequested = sig;
+		return;
+	}
 
-	// Catch exceptions
+	// Every other signal is a crash; returning would re-run the faulting instruction, so exit now.
+	// Queued log records are lost; stopping the logger means locking and joining its writer thread.
+	WriteFromSignal("\x1B[0m\r\n"); // reset console color, step past the status line
 	switch (sig)
 	{
 	case SIGABRT:
-		std::cout << "Caught SIGABRT: usually caused by an abort() or assert()                   \r\n"sv;
+		WriteFromSignal("Caught SIGABRT: usually caused by an abort() or assert()\r\n");
 		break;
 	case SIGFPE:
-		std::cout << "Caught SIGFPE: arithmetic exception, such as divide by zero                \r\n"sv;
+		WriteFromSignal("Caught SIGFPE: arithmetic exception, such as divide by zero\r\n");
 		break;
 	case SIGILL:
-		std::cout << "Caught SIGILL: illegal instruction                                         \r\n"sv;
-		break;
-	case SIGINT:
-		std::cout << "Caught SIGINT: interactive attention signal, probably a ctrl+c             \r\n"sv;
+		WriteFromSignal("Caught SIGILL: illegal instruction\r\n");
 		break;
 	case SIGSEGV:
-		std::cout << "Caught SIGSEGV: segfault                                                   \r\n"sv;
+		WriteFromSignal("Caught SIGSEGV: segfault\r\n");
 		break;
-	case SIGTERM:
 	default:
-		std::cout << "Caught SIGTERM: a termination request was sent to the program              \r\n"sv;
+		WriteFromSignal("Caught unexpected signal\r\n");
 		break;
 	}
+	WriteFromSignal("Aborting instantly.\r\n");
 
+	tcsetattr(STDIN_FILENO, TCSANOW, &oldt); // restore console input mode
 
-	if (!shutdowned)
-	{
-		std::cout << red << '\r' << timeBuffer << " | Got Ctrl-C or Close, ending the app."sv << std::string(30, ' ') << "\r\n"sv << yellow;
-		Shutdown();
-	}
-
-	// Every other command will likely kill the program after end of this handler
-	if (sig != SIGINT)
-	{
-		std::cout << red << '\r' << timeBuffer << " | Aborting instantly from signal "sv << sig << '.' << std::string(40, ' ') << "\r\n"sv;
-		std::cout << "\x1B[0m"; // reset console color
-
-		tcsetattr(STDIN_FILENO, TCSANOW, &oldt); // restore console input mode
-
-		if (!flashpolicypath.empty() && deleteFlashPolicyAtEndOfApp)
-			remove(flashpolicypath.c_str());
-
-		// Cleanup time
-		clientdata.clear();
-		lacewing::timer_delete(globalmsgrecvcounttimer);
-		globalserver->unhost();
-		globalserver->flash->unhost();
-		globalserver->websocket->unhost();
-		globalserver->websocket->unhost_secure();
-		delete globalserver;
-		lacewing::pump_delete(globalpump);
+	if (!flashpolicypath.empty() && deleteFlashPolicyAtEndOfApp)
+		unlink(flashpolicypath.c_str());
 
-		exit(EXIT_FAILURE);
-	}
+	_exit(EXIT_FAILURE);
 }
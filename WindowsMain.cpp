@@ -440,8 +440,8 @@ void OnConnectRequest(lacewing::relayserver &server, std::shared_ptr<lacewing::r
 void OnDisconnect(lacewing::relayserver &server, std::shared_ptr<lacewing::relayserver::client> client)
 {
 	UpdateTitle(server.clientcount());
-	std::string name = client->name();
-	name = !name.empty() ? name : "[unset]"sv;
+	const internedname clientName = client->name();
+	const std::string_view name = !clientName.empty() ? clientName.view() : "[unset]"sv;
 	char addr[64];
 	lw_addr_prettystring(client->getaddress().data(), addr, sizeof(addr));
 	const auto a = std::find_if(clientdata.cbegin(), clientdata.cend(), [&](const auto &c) {
@@ -573,8 +573,8 @@ void OnServerMessage(lacewing::relayserver &server, std::shared_ptr<lacewing::re
 	bytesIn += data.size();
 	if constexpr (false)
 	{
-		std::string name = senderclient->name();
-		name = !name.empty() ? name : "[unset]"sv;
+		const internedname clientName = senderclient->name();
+		const std::string_view name = !clientName.empty() ? clientName.view() : "[unset]"sv;
 
 		std::wcout << white << L'\r' << timeBuffer << L" | Message from client ID "sv << senderclient->id() << L", name "sv << UTF8ToWide(name)
 			<< L":"sv << std::wstring(35, L' ') << L"\r\n"sv
@@ -610,8 +610,8 @@ void OnServerMessage(lacewing::relayserver &server, std::shared_ptr<lacewing::re
 		}
 		return;
 	}
-	std::string name = senderclient->name();
-	name = !name.empty() ? name : "[unset]"sv;
+	const internedname clientName = senderclient->name();
+	const std::string_view name = !clientName.empty() ? clientName.view() : "[unset]"sv;
 
 	std::wcout << white << L'\r' << timeBuffer << L" | Message from client ID "sv << senderclient->id() << L", name "sv << UTF8ToWide(name)
 		<< L":"sv << std::wstring(35, L' ') << L"\r\n"sv